@@ -0,0 +1,52 @@
+#version 460
+
+layout (local_size_x = 8, local_size_y = 8) in;
+
+layout (r32f, binding = 1) uniform readonly image2D previousDistance;
+layout (r32ui, binding = 2) uniform uimage2D reprojectedDistance;
+
+uniform uvec2 screenSize;
+uniform vec3 camPos;
+uniform mat4 viewMat;
+uniform mat4 projMat;
+uniform vec3 previousCamPos;
+uniform mat4 previousViewMat;
+uniform mat4 previousProjMat;
+
+// same as svo_tracer.glsl, but with last frame's matrices
+vec3 getPreviousRayDir(ivec2 screenPos)
+{
+    vec2 screenSpace = (screenPos + vec2(0.5)) / vec2(screenSize);
+    vec4 clipSpace = vec4(screenSpace * 2.0f - 1.0f, -1.0, 1.0);
+    vec4 eyeSpace = vec4(vec2(inverse(previousProjMat) * clipSpace), -1.0, 0.0);
+    return normalize(vec3(inverse(previousViewMat) * eyeSpace));
+}
+
+/**
+ * Forward splat of last frame's hits into the current frame.
+ * Every previous hit is moved back to world space then projected with the current camera, and we keep the closest one
+ * per pixel with an atomic min. This is not a lower bound of what the tracer will find there: geometry that was hidden
+ * or off screen last frame can now be in front. svo_tracer.glsl does a full trace wherever holes or depth
+ * discontinuities show that something may have been uncovered, and the distance is pulled back by how far the camera
+ * moved to leave room for the parallax of what remains, such as geometry uncovered at the edges of the screen.
+ * Positive floats keep their order when compared as uints, which is what makes imageAtomicMin usable here.
+ */
+void main()
+{
+    if (any(greaterThanEqual(gl_GlobalInvocationID.xy, screenSize)))
+    return;
+
+    // negative distance means the ray hit the sky last frame, nothing to splat
+    float d = imageLoad(previousDistance, ivec2(gl_GlobalInvocationID.xy)).r;
+    if (d <= 0) return;
+
+    vec3 hit = previousCamPos + getPreviousRayDir(ivec2(gl_GlobalInvocationID.xy)) * d;
+    vec4 clip = projMat * viewMat * vec4(hit, 1);
+    if (clip.w <= 0) return;
+
+    ivec2 pixel = ivec2(floor((clip.xy / clip.w * 0.5 + 0.5) * vec2(screenSize)));
+    if (any(lessThan(pixel, ivec2(0))) || any(greaterThanEqual(pixel, ivec2(screenSize)))) return;
+
+    float pulled = max(0., distance(camPos, hit) - distance(camPos, previousCamPos));
+    imageAtomicMin(reprojectedDistance, pixel, floatBitsToUint(pulled));
+}
@@ -3,24 +3,45 @@
 layout (local_size_x = 8, local_size_y = 8) in;
 
 layout (rgba8, binding = 0) uniform writeonly image2D outImage;
+layout (r32f, binding = 1) uniform writeonly image2D outDistance;
+layout (r32ui, binding = 2) uniform readonly uimage2D reprojectedDistance;
 
 uniform uvec2 screenSize;
 uniform uvec3 terrainSize;
 uniform uint treeDepth;
+uniform uint rootNode;
 uniform vec3 camPos;
 uniform mat4 viewMat;
 uniform mat4 projMat;
+uniform bool useReprojection;
+uniform bool collectStats;
+uniform bool usePyramid;
+uniform uint pyramidOffsets[16];
+uniform uint frameIndex;
+uniform uint recencyCellWidth;
+uniform uint recencyWidth; // 0 when recency isn't tracked
+uniform uint boundsCount; // nodes past the first boundsCount ones aren't clipped to their bounds, 0 disables it
 
 #define NODE_WIDTH 2
 #define CHUNK_WIDTH 8
 #define CHUNK_SIZE 8*8*8
 #define MAX_DDA_STEPS 256
+#define MAX_PYRAMID_STEPS 128
 #define MINI_STEP_SIZE 4e-2
 #define LOD_BIAS 0 // 0 is the default. negative value means more distant details, positive value means less details
 #define NODE_SIZE NODE_WIDTH * NODE_WIDTH * NODE_WIDTH
+#define MAX_DEPTH 15 // must mirror TERRAIN_MAX_DEPTH
+#define BOUNDS_STEPS 16 // must mirror TERRAIN_BOUNDS_STEPS
+#define BOUNDS_EMPTY 0x01000000u // must mirror TERRAIN_BOUNDS_EMPTY
+#define NO_REPROJECTION 0xffffffffu // must mirror render.c
+#define REPROJECTION_MARGIN 2. // in voxels, how far before the reprojected distance a ray restarts
+#define REPROJECTION_RELATIVE_MARGIN 0.02 // same, but as a fraction of the reprojected distance
+#define REPROJECTION_DISCONTINUITY 1.25 // farthest to nearest ratio in a neighbourhood above which we do a full trace
 
 #undef  USE_DEBUG_COLORS
 #define USE_FAKE_LIGHT
+#define USE_SKYLIGHT
+#define SKY_SHADOW_FACTOR 0.6 // how dark faces that don't see the sky are
 #undef USE_LOD
 
 layout (std430, binding = 0) readonly buffer node_pool
@@ -33,13 +54,56 @@ layout (std430, binding = 1) readonly buffer chunk_pool
     uint chunkPool[];
 };
 
+layout (std430, binding = 2) buffer traversal_stats
+{
+    uint totalSteps;
+    uint totalRays;
+};
+
+// addresses of far subnodes, at the slot of their entry. It mirrors terrain->farPool, see TERRAIN_ENTRY_FAR.
+layout (std430, binding = 5) readonly buffer far_pool
+{
+    uint farPool[];
+};
+
+// the last frame each cell of recencyCellWidth x recencyCellWidth columns was hit in, read back by render.c
+layout (std430, binding = 6) buffer region_recency
+{
+    uint regionFrames[];
+};
+
+// bounds of what isn't air in each node, in sixteenths of it. It mirrors terrain->boundsPool, see TERRAIN_BOUNDS_STEPS.
+layout (std430, binding = 7) readonly buffer bounds_pool
+{
+    uint nodeBounds[];
+};
+
+// all levels of terrain->approx_heightmaps one after the other, level n starting at pyramidOffsets[n]. x is min, y is max.
+layout (std430, binding = 4) readonly buffer height_pyramid
+{
+    uvec2 heightPyramid[];
+};
+
+// for each column, the height right above its top-most opaque voxel. It mirrors terrain->skylight.
+layout (std430, binding = 3) readonly buffer skylight_map
+{
+    uint skylight[];
+};
+
 // voxel palette. it mirrors materials.h
 vec3 colors[] = {
 vec3(1.00, 0.40, 0.40), // UNDEFINED
 vec3(0.69, 0.88, 0.90), // AIR
 vec3(0.55, 0.55, 0.55), // STONE
 vec3(0.42, 0.32, 0.25), // DIRT
-vec3(0.30, 0.59, 0.31)  // GRASS
+vec3(0.30, 0.59, 0.31), // GRASS
+vec3(0.40, 0.29, 0.17), // LOG
+vec3(0.22, 0.47, 0.20), // LEAVES
+vec3(0.45, 0.70, 0.33), // SHORT_GRASS
+vec3(0.93, 0.82, 0.25), // FLOWER
+vec3(1.00, 0.85, 0.55), // LAMP
+vec3(0.86, 0.80, 0.58), // SAND
+vec3(0.20, 0.40, 0.75)  // WATER
 };
 vec3 debug_colors[] = {
 vec3(1.0, 0.5, 0.5),
@@ -76,6 +140,75 @@ float AABBIntersect(vec3 bmin, vec3 bmax, vec3 orig, vec3 invdir)
     return -1;
 }
 
+/**
+ * Start distance for this pixel, from the hit distances of the previous frame splatted by reproject.glsl.
+ * A splatted distance only says that some surface seen last frame lands there now, not that nothing is in front of it:
+ * holes are where nothing landed, and depth discontinuities are where parallax uncovers what was hidden behind an edge.
+ * So if any pixel of the 3x3 neighbourhood is a hole, or if its distances disagree by more than
+ * REPROJECTION_DISCONTINUITY, we do a full trace. Otherwise we start a margin before the nearest one.
+ */
+float reprojected_start_distance(ivec2 pixel)
+{
+    uint nearest = NO_REPROJECTION, farthest = 0;
+    for (int dx = -1; dx <= 1; dx++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            ivec2 p = pixel + ivec2(dx, dy);
+            if (any(lessThan(p, ivec2(0))) || any(greaterThanEqual(p, ivec2(screenSize)))) continue;
+            uint splat = imageLoad(reprojectedDistance, p).r;
+            if (splat == NO_REPROJECTION) return 0.;
+            nearest = min(nearest, splat);
+            farthest = max(farthest, splat);
+        }
+    }
+    float d = uintBitsToFloat(nearest);
+    if (uintBitsToFloat(farthest) > d * REPROJECTION_DISCONTINUITY) return 0.;
+    return max(0., d * (1. - REPROJECTION_RELATIVE_MARGIN) - REPROJECTION_MARGIN);
+}
+
+/**
+ * Maximum mipmap relief tracing through the heightmap pyramid.
+ * Cells the ray passes entirely above are skipped, going up a level after each skip, and cells the ray goes below are
+ * refined down to chunk columns. Returns the distance at which the ray first goes below a chunk column's max, which is
+ * where the SVO traversal has to start, or -1 if it never does.
+ */
+float pyramid_march(vec3 origin, vec3 dir, float t, inout uint steps)
+{
+    vec3 invDir = 1. / dir;
+    vec2 sign01 = vec2(greaterThanEqual(dir.xz, vec2(0)));
+    uint widthChunks = terrainSize.x / CHUNK_WIDTH;
+    int level = int(treeDepth);
+
+    for (int i = 0; i < MAX_PYRAMID_STEPS; i++) {
+        steps++;
+        float cellSize = float(CHUNK_WIDTH << level);
+        uint levelWidth = widthChunks >> level;
+        vec3 p = origin + dir * t;
+        vec2 cell = floor(p.xz / cellSize);
+        if (any(lessThan(cell, vec2(0))) || any(greaterThanEqual(cell, vec2(levelWidth)))) return -1.;
+
+        // max is computed from one sample per chunk, so voxels can go up to the top of the chunk that contains it
+        uint maxHeight = heightPyramid[pyramidOffsets[level] + uint(cell.x) + uint(cell.y) * levelWidth].y;
+        float top = float((maxHeight / CHUNK_WIDTH + 1) * CHUNK_WIDTH);
+
+        vec2 tCell = ((cell + sign01) * cellSize - origin.xz) * invDir.xz;
+        float tExit = min(tCell.x, tCell.y);
+        if (min(p.y, origin.y + dir.y * tExit) >= top) {
+            // the ray stays above the whole cell, skip it and try a coarser level for the next one
+            t = tExit + MINI_STEP_SIZE;
+            level = min(level + 1, int(treeDepth));
+            continue;
+        }
+
+        // the ray goes below the max of the cell, so we move to where it does and refine
+        if (p.y > top) t = (top - origin.y) * invDir.y;
+        if (level == 0) return t;
+        level--;
+    }
+
+    // out of steps, but starting the SVO traversal from here is still safe
+    return t;
+}
+
 float max_depth(float distance){
     return ceil(treeDepth-sqrt(distance)/(60-LOD_BIAS*10));
 }
@@ -94,18 +227,42 @@ void main()
     // calc ray direction for current pixel
     vec3 rayDir = getRayDir(ivec2(gl_GlobalInvocationID.xy));
     vec3 previousRayPos, rayPos = camPos;
+    float rayT = 0.; // rayPos is camPos + rayT * rayDir, give or take the mini-steps that pick the next cell
+    uint steps = 0;
 
     // check if the camera is outside the voxel volume
     float intersect = AABBIntersect(vec3(0), vec3(terrainSize - 1), camPos, 1.0f / rayDir);
 
     // if it is outside the terrain, offset the ray so its starting position is (slightly) in the voxel volume
     if (intersect > 0) {
-        rayPos += rayDir * (intersect + MINI_STEP_SIZE);
+        rayT = intersect + MINI_STEP_SIZE;
+        rayPos = camPos + rayDir * rayT;
+    }
+
+    // skip the part of the ray that was known to be empty last frame. The traversal restarts from the root at any
+    // position so there is nothing else to set up.
+    if (useReprojection && intersect >= 0) {
+        float start = reprojected_start_distance(ivec2(gl_GlobalInvocationID.xy));
+        if (start > intersect + MINI_STEP_SIZE) {
+            rayT = start;
+            rayPos = camPos + rayDir * start;
+        }
+    }
+
+    // march the heightmap pyramid first, and only start the SVO traversal at the first candidate chunk column
+    if (usePyramid && intersect >= 0) {
+        float start = pyramid_march(camPos, rayDir, rayT, steps);
+        if (start < 0) intersect = -1; // the ray never goes below the terrain surface, it's sky
+        else if (start > rayT) {
+            rayT = start;
+            rayPos = camPos + rayDir * start;
+        }
     }
 
     // if the ray intersect the terrain, raytrace
     vec3 color = vec3(0.69, 0.88, 0.90); // this is the sky color
     vec3 mask = vec3(1, 0, 0);
+    float hitDistance = -1.; // negative means no hit, it's what reproject.glsl expects for the sky
 
     if (intersect >= 0) {
         uint depth = 0;
@@ -113,107 +270,152 @@ void main()
         // at any time, node_width = terrain_width / NODE_WIDTH**depth
         uint node_width = terrainSize.x;
 
-        // at any time, the top-most stack address is stack[depth]
-        uint stack[12];
+        // at any time, the top-most stack address is stack[depth], a node is pushed for every level of the deepest tree
+        uint stack[MAX_DEPTH + 1];
 
         // index of the current node in the pool
-        uint current_node = 0;
-        uint previous_node = 0;
+        uint current_node = rootNode;
+        uint previous_node = rootNode;
 
         // color code of the last valid node
-        uint color_code;
+        uint color_code = 1;
 
         // Compute once and for all a few variables
         vec3 invertedRayDir = 1. / rayDir;
         vec3 raySign = vec3(sign11(rayDir.x), sign11(rayDir.y), sign11(rayDir.z));
         vec3 raySign01 = max(raySign, 0.);
 
-        int i = 0;
-        do {
-            for (; i < MAX_DDA_STEPS; i++) {
-                // setting the stack to the starting pos of the ray
+        for (int i = 0; i < MAX_DDA_STEPS; i++) {
+            steps++;
+            // setting the stack to the starting pos of the ray
+            do {
+                stack[depth] = current_node;
+                depth += 1;
+                node_width /= NODE_WIDTH;
+                uvec3 r = uvec3(mod(rayPos, node_width * NODE_WIDTH) / node_width);
+                uint slot = current_node * NODE_SIZE + r.x + r.z * NODE_WIDTH + r.y * NODE_WIDTH * NODE_WIDTH;
+                uint node_data = nodePool[slot];
+                previous_node = current_node;
+                // near entries hold a signed offset to the subnode that skips 0, far ones have it in the far pool
+                uint value = node_data & 0x00ffffffu;
+                if (value == 0u) {
+                    current_node = 0u;
+                } else if ((value & 0x00800000u) != 0u) {
+                    current_node = farPool[slot];
+                } else {
+                    int offset = int(value << 9) >> 9;
+                    current_node += uint(offset - int(offset > 0));
+                }
+                color_code = (node_data >> 24);
+
+                // the ray goes straight to the bounds of a subnode, or past it if it misses them, like for air
+                if (current_node != 0 && depth < treeDepth && current_node < boundsCount) {
+                    uint bounds = nodeBounds[current_node];
+                    if (bounds == BOUNDS_EMPTY) {
+                        current_node = 0u;
+                        color_code = 1;
+                    } else if (bounds != 0u) {
+                        // terrain axes are x, y and z up, the tracer's y is up
+                        uvec3 low = uvec3(bounds, bounds >> 16, bounds >> 8) & 15u;
+                        uvec3 high = BOUNDS_STEPS - (uvec3(bounds >> 4, bounds >> 20, bounds >> 12) & 15u);
+                        vec3 origin = rayPos - mod(rayPos, node_width), step = vec3(node_width / BOUNDS_STEPS);
+                        vec3 t0 = (origin + low * step - camPos) * invertedRayDir;
+                        vec3 t1 = (origin + high * step - camPos) * invertedRayDir;
+                        vec3 tEnter = min(t0, t1);
+                        float tNear = max(tEnter.x, max(tEnter.y, tEnter.z));
+                        float tFar = min(max(t0.x, t1.x), min(max(t0.y, t1.y), max(t0.z, t1.z)));
+                        if (tFar < max(tNear, rayT)) {
+                            current_node = 0u;
+                            color_code = 1;
+                        } else if (tNear > rayT) {
+                            // onto the bounds, then a mini-step across the face it enters through, like the DDA
+                            rayT = tNear;
+                            mask = vec3(equal(tEnter, vec3(tNear)));
+                            vec3 nextPos = camPos + rayT * rayDir + MINI_STEP_SIZE * raySign * mask;
+                            rayPos = raySign * max(raySign * nextPos, raySign * rayPos);
+                        }
+                    }
+                }
+            } while (current_node != 0 && depth < treeDepth); // && depth < max_depth(distance(rayPos, camPos)));
+
+            if (current_node != 0) {
+                // We reached a chunk, so we DDA through its voxels until we hit one or leave the chunk
+                vec3 chunkOrigin = rayPos - mod(rayPos, CHUNK_WIDTH);
                 do {
-                    stack[depth] = current_node;
-                    depth += 1;
-                    node_width /= NODE_WIDTH;
-                    uvec3 r = uvec3(mod(rayPos, node_width * NODE_WIDTH) / node_width);
-                    uint node_data = nodePool[current_node * NODE_SIZE + r.x + r.z * NODE_WIDTH + r.y * NODE_WIDTH * NODE_WIDTH];
-                    previous_node = current_node;
-                    current_node = (node_data & 0x00ffffffu);
-                    color_code = (node_data >> 24);
-                } while (current_node != 0 && depth < treeDepth); // && depth < max_depth(distance(rayPos, camPos)));
+                    uvec3 r = uvec3(rayPos - chunkOrigin);
+                    uint addr = current_node * CHUNK_SIZE + r.x + r.z * CHUNK_WIDTH + r.y * CHUNK_WIDTH * CHUNK_WIDTH;
+                    color_code = (chunkPool[addr / 4] >> (8 * (addr % 4))) & 0xffu;
+
+                    // quick exit #1: ray hit
+                    if (color_code != 1) break;
+
+                    // Compute step, one voxel at a time
+                    vec3 tMax = invertedRayDir * (rayPos - mod(rayPos, 1.) + raySign01 - camPos);
+                    float rayStep = min(tMax.x, min(tMax.y, tMax.z));
+
+                    // Compute new rayPos, and mini-step like for nodes
+                    previousRayPos = rayPos;
+                    rayT = max(rayT, rayStep);
+                    mask = vec3(equal(tMax, vec3(rayStep)));
+                    vec3 nextPos = camPos + rayT * rayDir + MINI_STEP_SIZE * raySign * mask;
+                    rayPos = raySign * max(raySign * nextPos, raySign * rayPos);
+                    steps++;
+                } while (all(greaterThanEqual(rayPos, chunkOrigin)) && all(lessThan(rayPos, chunkOrigin + CHUNK_WIDTH)));
 
                 // quick exit #1: ray hit
                 if (color_code != 1) break;
+            } else {
+                // quick exit #1: ray hit
+                if (color_code != 1) break;
 
                 // Compute step
-                vec3 tMax = invertedRayDir * (node_width * raySign01 - mod(rayPos, node_width));
+                vec3 tMax = invertedRayDir * (rayPos - mod(rayPos, node_width) + node_width * raySign01 - camPos);
                 float rayStep = min(tMax.x, min(tMax.y, tMax.z));
 
-                // Compute new rayPos
+                // Compute new rayPos. It's taken back from the ray, so that mini-steps don't add up, and never goes
+                // back along any axis, so that a ray through an edge can't bounce between the cells on both sides.
                 previousRayPos = rayPos;
-                rayPos += rayStep * rayDir;
+                rayT = max(rayT, rayStep);
 
                 // And a mini-step in the ray step direction, to ensure we are not stuck at the frontier of the same node
                 // We'll need to do better - to only mini-step in the direction of the wall we went through
                 // vec3 mask = vec3(greaterThan(raySign*(floor((rayPos+MINI_STEP_SIZE*raySign)/node_width)-floor(previousRayPos/node_width)), vec3(0))); // nope, le mini step step 2...
                 // Et si on s'en servait pour l'occlusion ambiante?
                 mask = vec3(equal(tMax, vec3(rayStep)));
-                rayPos += MINI_STEP_SIZE * raySign * mask;
-
-                // Quick exit #2: ray exiting the volume
-                if (any(greaterThanEqual(rayPos, terrainSize)) || any(lessThan(rayPos, vec3(0)))) break;
-
-                // While pos+step is not in current_node, step up
-                do {
-                    node_width *= NODE_WIDTH;
-                    depth -= 1;
-                    current_node = stack[depth];
-                } while (depth > 0 && any(lessThan(rayPos, previousRayPos - mod(previousRayPos, node_width))) || any(greaterThanEqual(rayPos, previousRayPos + node_width - mod(previousRayPos, node_width))));
+                vec3 nextPos = camPos + rayT * rayDir + MINI_STEP_SIZE * raySign * mask;
+                rayPos = raySign * max(raySign * nextPos, raySign * rayPos);
             }
-            // TODO support chunk leafs (I'm scared)
-            // Do
-            // get voxel info
-            // if it's a hit, return
-            // get dda step
-            // step
-            // while we are in the leaf
-            // setting the stack to the starting pos of the ray
-            do{
-                uvec3 r = uvec3(mod(rayPos, CHUNK_WIDTH));
-                uint addr = current_node * CHUNK_SIZE + r.x + r.z * CHUNK_WIDTH + r.y * CHUNK_WIDTH * CHUNK_WIDTH;
-                color_code = chunkPool[uint(addr/2)]>>8*addr%2;
-
-                // quick exit #1: ray hit
-                if (color_code != 1) break;
-
-                // Compute step
-                vec3 tMax = invertedRayDir * (CHUNK_WIDTH * raySign01 - mod(rayPos, CHUNK_WIDTH));
-                float rayStep = min(tMax.x, min(tMax.y, tMax.z));
-
-                // Compute new rayPos
-                previousRayPos = rayPos;
-                rayPos += rayStep * rayDir;
-
-                // And a mini-step in the ray step direction, to ensure we are not stuck at the frontier of the same node
-                mask = vec3(equal(tMax, vec3(rayStep)));
-                rayPos += MINI_STEP_SIZE * raySign * mask;
-            }while(all(greaterThanEqual(rayPos, vec3(0))) && all(lessThan(rayPos, vec3(CHUNK_WIDTH))));
-
-            // Quick exit #1: ray hit
-            if (color_code != 1) break;
 
             // Quick exit #2: ray exiting the volume
             if (any(greaterThanEqual(rayPos, terrainSize)) || any(lessThan(rayPos, vec3(0)))) break;
 
-            // While pos+step is not in current_node, step up
+            // While pos+step is not in current_node, step up. previousRayPos is always the last position in the node
+            // or chunk we just left, so it tells us the bounds of its parents.
             do {
+                node_width *= NODE_WIDTH;
                 depth -= 1;
                 current_node = stack[depth];
-            } while (depth > 0 && any(lessThan(rayPos, previousRayPos - mod(previousRayPos, node_width))) || any(greaterThanEqual(rayPos, previousRayPos + node_width - mod(previousRayPos, node_width))));
+            } while (depth > 0 && (any(lessThan(rayPos, previousRayPos - mod(previousRayPos, node_width))) || any(greaterThanEqual(rayPos, previousRayPos + node_width - mod(previousRayPos, node_width)))));
+        }
+
+        if (color_code != 1) hitDistance = distance(camPos, rayPos);
+
+        // checking first means a cell is stored to once per frame rather than once per ray that hits it
+        if (color_code != 1 && recencyWidth != 0u) {
+            uvec2 cell = uvec2(clamp(rayPos.xz, vec2(0), vec2(terrainSize.xz - 1))) / recencyCellWidth;
+            uint index = cell.x + cell.y * recencyWidth;
+            if (regionFrames[index] != frameIndex) regionFrames[index] = frameIndex;
+        }
 
-        }while(color_code != 1);
-        // encase this with the above with a do - while not hit
+        // the voxel right in front of the face we hit, used to know if that face sees the sky. The flood-filled light
+        // levels of terrain_light.h aren't uploaded, faces are only shaded from the skylight map
+        vec3 frontPos = clamp(rayPos - 2 * MINI_STEP_SIZE * raySign * mask, vec3(0), vec3(terrainSize - 1));
+        float skyFactor = 1.;
+        #ifdef USE_SKYLIGHT
+        if (color_code != 1 && frontPos.y + 1 < skylight[uint(frontPos.x) + uint(frontPos.z) * terrainSize.x]) {
+            skyFactor = SKY_SHADOW_FACTOR;
+        }
+        #endif
 
         // ensuring the color code is valid
         if (color_code >= colors.length()) {
@@ -226,7 +428,7 @@ void main()
         #elif defined(USE_FAKE_LIGHT)
         } else if (color_code > 1){
             // setting the pixel color using the color table
-            color.xyz = colors[color_code].xyz*dot(mask*vec3(0.9, 0.7, 0.4), vec3(1));
+            color.xyz = colors[color_code].xyz*dot(mask*vec3(0.9, 0.7, 0.4), vec3(1))*skyFactor;
         #endif
         } else {
             // setting the pixel color using the color table
@@ -234,6 +436,13 @@ void main()
         }
     }
 
-    // output color to texture
+    // output color to texture, and hit distance for next frame's reprojection
     imageStore(outImage, ivec2(gl_GlobalInvocationID.xy), vec4(color, 1));
+    imageStore(outDistance, ivec2(gl_GlobalInvocationID.xy), vec4(hitDistance));
+
+    // steps per ray stats, read back by render.c once in a while
+    if (collectStats) {
+        atomicAdd(totalSteps, steps);
+        atomicAdd(totalRays, 1);
+    }
 }
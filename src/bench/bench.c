@@ -0,0 +1,64 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "cpmath.h"
+#include "bench.h"
+#include "common/log.h"
+
+typedef struct Benchmark {
+    const char *name;
+    void (*run)(void);
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+        {"ring", bench_ring},
+        {"epoch", bench_epoch},
+        {"snapshot", bench_snapshot},
+        {"sync", bench_sync},
+        {"pipeline", bench_pipeline},
+        {"structures", bench_structures},
+        {"noise", bench_noise},
+        {"gc", bench_gc},
+        {"pool", bench_pool},
+        {"residency", bench_residency},
+        {"bounds", bench_bounds},
+        {"query", bench_query},
+        {"path", bench_path},
+        {"light", bench_light},
+        {"automaton", bench_automaton},
+        {"builder", bench_builder},
+        {"out-of-core", bench_out_of_core},
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+u64 bench_clock(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (u64) time.tv_sec * 1000000000ull + (u64) time.tv_nsec;
+}
+
+u32 bench_random(u32 *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+int bench_run(const char *name) {
+    bool found = false;
+    for (u32 i = 0; i < BENCHMARK_COUNT; i++) {
+        if (strcmp(name, "all") && strcmp(name, benchmarks[i].name)) continue;
+        INFO("Running benchmark '%s'.", benchmarks[i].name);
+        benchmarks[i].run();
+        found = true;
+    }
+    if (!found) {
+        ERROR("Unknown benchmark '%s'. Available benchmarks are:", name);
+        for (u32 i = 0; i < BENCHMARK_COUNT; i++) ERROR("  %s", benchmarks[i].name);
+        return 1;
+    }
+    return 0;
+}
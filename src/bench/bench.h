@@ -0,0 +1,66 @@
+#pragma once
+
+#include "cpmath.h"
+
+/**
+ * CPU microbenchmarks, run with `iVy --bench <name>` instead of starting the server and the client.
+ * Results are logged, `--bench all` runs every one of them.
+ */
+int bench_run(const char *name);
+
+// monotonic time in nanoseconds
+u64 bench_clock(void);
+
+// xorshift32, the state must not be 0
+u32 bench_random(u32 *state);
+
+void bench_ring(void);
+
+// concurrent terrain reads while the server edits it, checking that epoch reclamation never frees too early
+void bench_epoch(void);
+
+// copy-on-write snapshot of a generated world, edits on top of it, restore and release
+void bench_snapshot(void);
+
+// Merkle-hash replication of an edited world over a Unix socket pair, incrementally and from scratch
+void bench_sync(void);
+
+// staged region generation, one region and its neighbourhood first, then the whole world
+void bench_pipeline(void);
+
+// trees and plants stamped on a generated world, what they cost in memory and whether their order matters
+void bench_structures(void);
+
+// multi-resolution height noise, how fast and how far from fnlGetNoise2D it is for each number of coarse octaves
+void bench_noise(void);
+
+// garbage left by pruning and released snapshots, collected with and without compaction while a snapshot is held
+void bench_gc(void);
+
+// free list and bitmap pool allocators, filled, freed in random order and refilled
+void bench_pool(void);
+
+// a generated world trimmed to a memory budget, far and least recently seen regions first, then generated again
+void bench_residency(void);
+
+// grazing views of a generated world traced on the CPU with and without clipping rays to node bounds, and the height
+// pyramid checked against the height of every column
+void bench_bounds(void);
+
+// raycasts, points, boxes and batched lines of sight in a generated world, checked against voxel by voxel answers
+void bench_query(void);
+
+// hierarchical paths over a generated world compared to flat A*, before and after edits on the way
+void bench_path(void);
+
+// sky and block light of a generated world, built and relit after edits, checked against a flood from scratch
+void bench_light(void);
+
+// sand and water dropped on a generated world and ticked until they settle, with the throughput of the ticks
+void bench_automaton(void);
+
+// a generated world shuffled into a voxel stream and built back bottom-up, checked against the original
+void bench_builder(void);
+
+// a world generated out-of-core under a small memory budget, checked against the same world generated in memory
+void bench_out_of_core(void);
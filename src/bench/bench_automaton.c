@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include "bench.h"
+#include "common/log.h"
+#include "common/materials.h"
+#include "common/terrain.h"
+#include "common/terrain_automaton.h"
+
+#define AUTOMATON_BENCH_DEPTH (5)
+#define AUTOMATON_BENCH_BLOBS (48)
+#define AUTOMATON_BENCH_BLOB_WIDTH (12)
+#define AUTOMATON_BENCH_BLOB_HEIGHT (16)
+#define AUTOMATON_BENCH_MAX_TICKS (2000)
+
+/**
+ * Counts the sand and water of the whole world, and the loose voxels that could still move: sand over something it
+ * falls or sinks through, water over air. Every chunk holding some of them is activated.
+ */
+static void bench_count(const Terrain *terrain, TerrainAutomaton *automaton, u64 *sand, u64 *water, u64 *unsettled) {
+    u32 width = terrain->width;
+    *sand = *water = *unsettled = 0;
+    for (u32 z = 0; z < width; z++) {
+        for (u32 y = 0; y < width; y++) {
+            for (u32 x = 0; x < width; x++) {
+                Voxel voxel = terrain_get_voxel(terrain, x, y, z);
+                if (!MATERIAL_IS_LOOSE(voxel)) continue;
+                Voxel below = z ? terrain_get_voxel(terrain, x, y, z - 1) : UNKNOWN;
+                *sand += voxel == SAND;
+                *water += voxel == WATER;
+                *unsettled += below == AIR || (voxel == SAND && below == WATER);
+                terrain_automaton_activate(automaton, x, y, z);
+            }
+        }
+    }
+}
+
+/**
+ * Blobs of sand and water dropped above a generated world, ticked until every chunk settled. Nothing may be lost or
+ * created on the way, nothing may be left hanging, and ticking every chunk holding sand or water again must not move
+ * anything. Throughput counts the loose voxels evaluated, then the voxels written, per second of ticking.
+ */
+void bench_automaton(void) {
+    Terrain terrain;
+    terrain_init(&terrain, AUTOMATON_BENCH_DEPTH);
+    TerrainAutomaton automaton;
+    terrain_automaton_init(&automaton, &terrain);
+
+    u32 random = 0x9e3779b9u, width = terrain.width, blob = AUTOMATON_BENCH_BLOB_WIDTH;
+    for (u32 i = 0; i < AUTOMATON_BENCH_BLOBS; i++) {
+        u32 min_x = bench_random(&random) % (width - blob), min_y = bench_random(&random) % (width - blob), top = 0;
+        for (u32 y = min_y; y < min_y + blob; y++) {
+            for (u32 x = min_x; x < min_x + blob; x++) top = max(top, terrain.skylight[x + y * width]);
+        }
+        Voxel material = i % 2 ? WATER : SAND;
+        for (u32 z = top + 4; z < min(top + 4 + AUTOMATON_BENCH_BLOB_HEIGHT, width); z++) {
+            for (u32 y = min_y; y < min_y + blob; y++) {
+                for (u32 x = min_x; x < min_x + blob; x++) {
+                    terrain_set_voxel(&terrain, x, y, z, material);
+                    terrain_automaton_activate(&automaton, x, y, z);
+                }
+            }
+        }
+    }
+    terrain_clear_deltas(&terrain, terrain.delta_count);
+    u64 sand, water, unsettled;
+    bench_count(&terrain, &automaton, &sand, &water, &unsettled);
+
+    u32 ticks = 0, folded = 0;
+    u64 time = 0, chunks = 0, voxels_ticked = 0, voxels_changed = 0, deltas = 0, slowest = 0;
+    for (; automaton.active_count && ticks < AUTOMATON_BENCH_MAX_TICKS; ticks++) {
+        u64 start = bench_clock();
+        terrain_automaton_tick(&automaton);
+        u64 tick_time = bench_clock() - start;
+        time += tick_time;
+        if (tick_time > slowest) slowest = tick_time;
+        chunks += automaton.chunks_ticked;
+        voxels_ticked += automaton.voxels_ticked;
+        voxels_changed += automaton.voxels_changed;
+        deltas += terrain.delta_count;
+        folded += terrain.delta_count && terrain.deltas[0].kind == TERRAIN_DELTA_ALL;
+        terrain_clear_deltas(&terrain, terrain.delta_count);
+    }
+    bool settled = !automaton.active_count;
+
+    u64 settled_sand, settled_water, left_unsettled;
+    bench_count(&terrain, &automaton, &settled_sand, &settled_water, &left_unsettled);
+    u64 moved_again = terrain_automaton_tick(&automaton);
+
+    INFO("%lu sand and %lu water voxels dropped, %s after %u ticks of %.1f chunks on average, %.2fms per tick on "
+         "average, %.2fms at most", sand, water, settled ? "settled" : "still moving", ticks,
+         (double) chunks / max(ticks, 1), time / 1e6 / max(ticks, 1), slowest / 1e6);
+    INFO("%.2fM loose voxel updates per second, %.2fM voxels written per second, %lu deltas recorded, folded into a "
+         "whole upload in %u ticks", voxels_ticked / (time / 1e3), voxels_changed / (time / 1e3), deltas, folded);
+    INFO("%lu sand and %lu water voxels once settled, %lu hanging, %lu voxels moved again by ticking the %u chunks "
+         "holding them%s", settled_sand, settled_water, left_unsettled, moved_again, automaton.chunks_ticked,
+         !settled || settled_sand != sand || settled_water != water || left_unsettled || moved_again ? ", BROKEN" : "");
+
+    terrain_automaton_destroy(&automaton);
+    terrain_destroy(&terrain);
+}
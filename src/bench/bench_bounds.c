@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdlib.h>
+#include "bench.h"
+#include "common/log.h"
+#include "common/materials.h"
+#include "common/terrain.h"
+
+#define BOUNDS_BENCH_DEPTH (6)
+#define BOUNDS_BENCH_VIEWS (64)
+#define BOUNDS_BENCH_RAYS_PER_VIEW (4096)
+#define BOUNDS_BENCH_EYE_HEIGHT (2)
+#define BOUNDS_BENCH_MIN_PITCH (-0.15f) // radians, grazing views only look a little below and above the horizon
+#define BOUNDS_BENCH_MAX_PITCH (0.05f)
+#define BOUNDS_BENCH_PYRAMID_DEPTH (9)
+#define BOUNDS_BENCH_PYRAMID_SLAB_DEPTH (4)
+
+// must mirror svo_tracer.glsl
+#define BOUNDS_BENCH_MAX_STEPS (256)
+#define BOUNDS_BENCH_MINI_STEP (4e-2f)
+
+typedef struct BoundsTrace {
+    u32 steps;
+    bool hit, finished;
+    u32 voxel[3];
+    Voxel material;
+} BoundsTrace;
+
+static bool bench_outside(const float pos[3], const float origin[3], float width) {
+    for (u32 axis = 0; axis < 3; axis++) {
+        if (pos[axis] < origin[axis] || pos[axis] >= origin[axis] + width) return true;
+    }
+    return false;
+}
+
+/**
+ * Subnodes the ray misses the bounds of are skipped like air, and the ray is moved to the bounds of the others, as in
+ * svo_tracer.glsl: onto them, then a mini-step across the face it enters through, like any other DDA step. Returns
+ * false if the subnode was skipped.
+ */
+static bool bench_clip(const Terrain *terrain, u32 node_address, u32 node_width, const float origin[3],
+                       const float dir[3], const float inverse[3], const float sign[3], float *t, float pos[3],
+                       float mask[3]) {
+    u32 bounds = terrain_node_bounds(terrain, node_address);
+    if (bounds == TERRAIN_BOUNDS_EMPTY) return false;
+    if (!bounds) return true;
+    float enter[3], near = -INFINITY, far = INFINITY;
+    float step = (float) (node_width / TERRAIN_BOUNDS_STEPS);
+    for (u32 axis = 0; axis < 3; axis++) {
+        float node_origin = pos[axis] - fmodf(pos[axis], (float) node_width);
+        float low = node_origin + (float) (bounds >> axis * 8 & 15) * step;
+        float high = node_origin + (float) (TERRAIN_BOUNDS_STEPS - (bounds >> (axis * 8 + 4) & 15)) * step;
+        float t0 = (low - origin[axis]) * inverse[axis], t1 = (high - origin[axis]) * inverse[axis];
+        enter[axis] = fminf(t0, t1);
+        near = fmaxf(near, enter[axis]);
+        far = fminf(far, fmaxf(t0, t1));
+    }
+    if (far < fmaxf(near, *t)) return false;
+    if (near <= *t) return true;
+    *t = near;
+    for (u32 axis = 0; axis < 3; axis++) {
+        mask[axis] = enter[axis] == near;
+        float next = origin[axis] + near * dir[axis] + BOUNDS_BENCH_MINI_STEP * sign[axis] * mask[axis];
+        pos[axis] = sign[axis] * fmaxf(sign[axis] * next, sign[axis] * pos[axis]);
+    }
+    return true;
+}
+
+/**
+ * Steps to the nearest face of the cell of the given width around pos, as in svo_tracer.glsl. The position is taken
+ * back from the ray at every step, so that mini-steps only pick the next cell and never add up, and never goes back
+ * along any axis, so that a ray through an edge can't bounce between the cells on both sides of it.
+ */
+static void bench_step(float width, const float origin[3], const float dir[3], const float inverse[3],
+                       const float sign[3], const float sign01[3], float *t, float pos[3], float previous[3],
+                       float mask[3]) {
+    float t_max[3], step = INFINITY;
+    for (u32 axis = 0; axis < 3; axis++) {
+        t_max[axis] = (pos[axis] - fmodf(pos[axis], width) + width * sign01[axis] - origin[axis]) * inverse[axis];
+        step = fminf(step, t_max[axis]);
+    }
+    *t = fmaxf(*t, step);
+    for (u32 axis = 0; axis < 3; axis++) {
+        previous[axis] = pos[axis];
+        mask[axis] = t_max[axis] == step;
+        float next = origin[axis] + *t * dir[axis] + BOUNDS_BENCH_MINI_STEP * sign[axis] * mask[axis];
+        pos[axis] = sign[axis] * fmaxf(sign[axis] * next, sign[axis] * pos[axis]);
+    }
+}
+
+/**
+ * The SVO traversal of svo_tracer.glsl, without the pyramid and reprojection, in the terrain's axes. Steps are counted
+ * the same way, one per descent and one per voxel of a chunk.
+ */
+static void bench_trace(const Terrain *terrain, const float origin[3], const float dir[3], bool clip,
+                        BoundsTrace *trace) {
+    float pos[3], previous[3], inverse[3], sign[3], sign01[3], mask[3] = {1, 0, 0}, t = 0;
+    for (u32 axis = 0; axis < 3; axis++) {
+        pos[axis] = origin[axis];
+        inverse[axis] = 1.f / dir[axis];
+        sign[axis] = dir[axis] < 0 ? -1.f : 1.f;
+        sign01[axis] = fmaxf(sign[axis], 0);
+    }
+    u32 stack[TERRAIN_MAX_DEPTH + 1], depth = 0, node_width = terrain->width, current = terrain->root_node_address;
+    Voxel material = AIR;
+    *trace = (BoundsTrace) {0};
+
+    for (u32 i = 0; i < BOUNDS_BENCH_MAX_STEPS; i++) {
+        trace->steps++;
+        do {
+            stack[depth++] = current;
+            node_width /= NODE_WIDTH;
+            u32 slot = NODE_SLOT((u32) (fmodf(pos[0], node_width * NODE_WIDTH) / node_width),
+                                 (u32) (fmodf(pos[1], node_width * NODE_WIDTH) / node_width),
+                                 (u32) (fmodf(pos[2], node_width * NODE_WIDTH) / node_width));
+            u32 entry = terrain_node_entry(terrain, current, slot);
+            u32 child = terrain_entry_child(terrain, current, slot, entry);
+            current = child;
+            material = terrain_entry_material(entry);
+            if (clip && current && depth < terrain->depth &&
+                !bench_clip(terrain, current, node_width, origin, dir, inverse, sign, &t, pos, mask)) {
+                current = 0;
+                material = AIR;
+            }
+        } while (current && depth < terrain->depth);
+
+        if (current) {
+            const Voxel *chunk = *(const Chunk *) poolAllocatorGet(&terrain->chunkPool, current);
+            float chunk_origin[3];
+            for (u32 axis = 0; axis < 3; axis++) chunk_origin[axis] = pos[axis] - fmodf(pos[axis], CHUNK_WIDTH);
+            do {
+                material = chunk[CHUNK_SLOT((u32) (pos[0] - chunk_origin[0]), (u32) (pos[1] - chunk_origin[1]),
+                                            (u32) (pos[2] - chunk_origin[2]))];
+                if (material != AIR) break;
+                bench_step(1.f, origin, dir, inverse, sign, sign01, &t, pos, previous, mask);
+                trace->steps++;
+            } while (!bench_outside(pos, chunk_origin, CHUNK_WIDTH));
+            if (material != AIR) break;
+        } else {
+            if (material != AIR) break;
+            bench_step((float) node_width, origin, dir, inverse, sign, sign01, &t, pos, previous, mask);
+        }
+
+        if (bench_outside(pos, (float[3]) {0, 0, 0}, (float) terrain->width)) {
+            trace->finished = true;
+            return;
+        }
+        float previous_origin[3];
+        do {
+            node_width *= NODE_WIDTH;
+            current = stack[--depth];
+            for (u32 axis = 0; axis < 3; axis++) {
+                previous_origin[axis] = previous[axis] - fmodf(previous[axis], (float) node_width);
+            }
+        } while (depth > 0 && bench_outside(pos, previous_origin, (float) node_width));
+    }
+    if (material == AIR) return; // out of steps
+    trace->hit = trace->finished = true;
+    trace->material = material;
+    for (u32 axis = 0; axis < 3; axis++) trace->voxel[axis] = (u32) pos[axis];
+}
+
+// voxel by voxel, in double precision and without mini-steps, what both traversals approximate
+static void bench_trace_exact(const Terrain *terrain, const float origin[3], const float dir[3], BoundsTrace *trace) {
+    i32 voxel[3], step[3];
+    double t_max[3], t_delta[3];
+    for (u32 axis = 0; axis < 3; axis++) {
+        voxel[axis] = (i32) floorf(origin[axis]);
+        step[axis] = dir[axis] < 0 ? -1 : 1;
+        t_delta[axis] = fabs(1. / dir[axis]);
+        double border = dir[axis] < 0 ? voxel[axis] : voxel[axis] + 1;
+        t_max[axis] = (border - origin[axis]) / dir[axis];
+    }
+    *trace = (BoundsTrace) {.finished=true};
+    while (voxel[0] >= 0 && voxel[1] >= 0 && voxel[2] >= 0 && (u32) voxel[0] < terrain->width &&
+           (u32) voxel[1] < terrain->width && (u32) voxel[2] < terrain->width) {
+        Voxel material = terrain_get_voxel(terrain, voxel[0], voxel[1], voxel[2]);
+        if (material != AIR) {
+            *trace = (BoundsTrace) {.hit=true, .finished=true, .material=material,
+                    .voxel={(u32) voxel[0], (u32) voxel[1], (u32) voxel[2]}};
+            return;
+        }
+        u32 axis = t_max[0] < t_max[1] ? (t_max[0] < t_max[2] ? 0 : 2) : (t_max[1] < t_max[2] ? 1 : 2);
+        voxel[axis] += step[axis];
+        t_max[axis] += t_delta[axis];
+    }
+}
+
+static bool bench_same_hit(const BoundsTrace *a, const BoundsTrace *b) {
+    return a->hit == b->hit && (!a->hit || (a->voxel[0] == b->voxel[0] && a->voxel[1] == b->voxel[1] &&
+                                            a->voxel[2] == b->voxel[2]));
+}
+
+// what isn't air in a subtree, voxel by voxel and from its origin, without looking at any bounds
+static bool bench_extent(const Terrain *terrain, u32 address, u32 level, u32 low[3], u32 high[3]) {
+    bool found = false;
+    if (!level) {
+        const Voxel *chunk = *(const Chunk *) poolAllocatorGet(&terrain->chunkPool, address);
+        for (u32 i = 0; i < sizeof(Chunk); i++) {
+            if (chunk[i] == AIR) continue;
+            u32 voxel[3] = {i % CHUNK_WIDTH, i / CHUNK_WIDTH % CHUNK_WIDTH, i / (CHUNK_WIDTH * CHUNK_WIDTH)};
+            for (u32 axis = 0; axis < 3; axis++) {
+                low[axis] = found ? min(low[axis], voxel[axis]) : voxel[axis];
+                high[axis] = found ? max(high[axis], voxel[axis] + 1) : voxel[axis] + 1;
+            }
+            found = true;
+        }
+        return found;
+    }
+    u32 subnode_width = CHUNK_WIDTH << (level - 1);
+    for (u32 slot = 0; slot < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; slot++) {
+        u32 child = terrain_node_child(terrain, address, slot);
+        u32 child_low[3] = {0}, child_high[3] = {subnode_width, subnode_width, subnode_width};
+        if (child ? !bench_extent(terrain, child, level - 1, child_low, child_high)
+                  : terrain_node_material(terrain, address, slot) == AIR) {
+            continue;
+        }
+        u32 offset[3] = {slot % NODE_WIDTH, slot / NODE_WIDTH % NODE_WIDTH, slot / (NODE_WIDTH * NODE_WIDTH)};
+        for (u32 axis = 0; axis < 3; axis++) {
+            u32 child_min = offset[axis] * subnode_width + child_low[axis];
+            u32 child_max = offset[axis] * subnode_width + child_high[axis];
+            low[axis] = found ? min(low[axis], child_min) : child_min;
+            high[axis] = found ? max(high[axis], child_max) : child_max;
+        }
+        found = true;
+    }
+    return found;
+}
+
+// nodes of the live tree with non-air voxels out of their bounds, which rays clipped to them would go through
+static u32 bench_uncovered(const Terrain *terrain, u32 address, u32 level) {
+    u32 uncovered = 0, low[3], high[3], bounds = terrain_node_bounds(terrain, address);
+    if (bench_extent(terrain, address, level, low, high) && bounds) {
+        u32 step = (CHUNK_WIDTH << level) / TERRAIN_BOUNDS_STEPS;
+        for (u32 axis = 0; axis < 3 && !uncovered; axis++) {
+            uncovered = bounds == TERRAIN_BOUNDS_EMPTY || low[axis] < (bounds >> axis * 8 & 15) * step ||
+                        high[axis] > (TERRAIN_BOUNDS_STEPS - (bounds >> (axis * 8 + 4) & 15)) * step;
+        }
+    }
+    if (level == 1) return uncovered;
+    for (u32 slot = 0; slot < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; slot++) {
+        u32 child = terrain_node_child(terrain, address, slot);
+        if (child) uncovered += bench_uncovered(terrain, child, level - 1);
+    }
+    return uncovered;
+}
+
+// cells of the height pyramid whose min, or max less TERRAIN_OVERHANG, doesn't contain the heights of all their columns
+static u64 bench_uncontained(const Terrain *terrain, u64 *cells) {
+    u64 uncontained = 0;
+    for (u32 level = 0; level <= terrain->depth; level++) {
+        u32 level_width = terrain->width_chunks >> level, cell_width = CHUNK_WIDTH << level;
+        for (u32 cy = 0; cy < level_width; cy++) {
+            for (u32 cx = 0; cx < level_width; cx++) {
+                HeightApprox cell = terrain->approx_heightmaps[level][cx + cy * level_width];
+                bool contained = true;
+                for (u32 y = cy * cell_width; y < (cy + 1) * cell_width && contained; y++) {
+                    for (u32 x = cx * cell_width; x < (cx + 1) * cell_width; x++) {
+                        u32 height = terrain->heightmap[x + (size_t) y * terrain->width];
+                        contained &= cell.min <= height && height + TERRAIN_OVERHANG <= cell.max;
+                    }
+                }
+                uncontained += !contained;
+            }
+        }
+        *cells += (u64) level_width * level_width;
+    }
+    return uncontained;
+}
+
+/**
+ * The height pyramid of a world wide enough for its height scale to be steep, bounded lazily as the pipeline does: its
+ * top levels at init, then each slab footprint refined once its heightmap is sampled. Every cell must contain the
+ * heights of all of its columns, which only holds if TERRAIN_HEIGHT_NOISE_LIPSCHITZ really bounds the noise's slope.
+ */
+static u64 bench_pyramid(u64 *cells) {
+    Terrain terrain;
+    TerrainSlab *slabs;
+    terrain_init_progressive(&terrain, BOUNDS_BENCH_PYRAMID_DEPTH, BOUNDS_BENCH_PYRAMID_SLAB_DEPTH, &slabs);
+    free(slabs);
+    terrain_generate_heightmap_columns(&terrain, 0, 0, terrain.width);
+    u32 footprint = CHUNK_WIDTH << BOUNDS_BENCH_PYRAMID_SLAB_DEPTH, footprints = terrain.width / footprint;
+    for (u32 i = 0; i < footprints * footprints; i++) {
+        terrain_refine_pyramid(&terrain, i % footprints * footprint, i / footprints * footprint, footprint);
+    }
+    u64 uncontained = bench_uncontained(&terrain, cells);
+    terrain_destroy(&terrain);
+    return uncontained;
+}
+
+/**
+ * Eyes a little above the surface of random columns of the default terrain, looking around close to the horizon, are
+ * traced with and without clipping rays to node bounds. Both are compared to an exact trace, and clipping must not
+ * hit another voxel than it more often than the plain traversal. Bounds are checked to cover every voxel that isn't
+ * air, and the ones kept up to date through decoration to be those a full rebuild finds. The height pyramid of this
+ * world and of a wider one must contain the height of every column.
+ */
+void bench_bounds(void) {
+    Terrain terrain;
+    terrain_init(&terrain, BOUNDS_BENCH_DEPTH);
+    u32 nodes = poolAllocatorUsed(&terrain.nodePool), stale = 0, empty = 0, clipped = 0;
+    u32 *maintained = (u32 *) malloc(nodes * sizeof(u32));
+    if (!maintained) FATAL("Out of memory.");
+    for (u32 i = 0; i < nodes; i++) maintained[i] = terrain_node_bounds(&terrain, i);
+    terrain_build_bounds(&terrain);
+    for (u32 i = 0; i < nodes; i++) {
+        u32 bounds = terrain_node_bounds(&terrain, i);
+        stale += bounds != maintained[i];
+        empty += bounds == TERRAIN_BOUNDS_EMPTY;
+        clipped += bounds && bounds != TERRAIN_BOUNDS_EMPTY;
+    }
+    free(maintained);
+    u32 uncovered = bench_uncovered(&terrain, terrain.root_node_address, terrain.depth);
+    u64 cells = 0, uncontained = bench_uncontained(&terrain, &cells);
+    uncontained += bench_pyramid(&cells);
+
+    u32 random = 0x9e3779b9u, rays = 0, unfinished[2] = {0}, inexact[2] = {0}, hits = 0;
+    u64 steps[2] = {0}, times[2] = {0};
+    for (u32 view = 0; view < BOUNDS_BENCH_VIEWS; view++) {
+        u32 x = bench_random(&random) % terrain.width, y = bench_random(&random) % terrain.width;
+        u32 height = terrain.heightmap[x + (size_t) y * terrain.width];
+        float eye[3] = {x + .5f, y + .5f, (float) (height + BOUNDS_BENCH_EYE_HEIGHT)};
+        if (eye[2] >= terrain.width) continue;
+        for (u32 i = 0; i < BOUNDS_BENCH_RAYS_PER_VIEW; i++) {
+            float yaw = bench_random(&random) / (float) UINT32_MAX * 2 * (float) M_PI;
+            float pitch = bench_random(&random) / (float) UINT32_MAX;
+            pitch = BOUNDS_BENCH_MIN_PITCH + pitch * (BOUNDS_BENCH_MAX_PITCH - BOUNDS_BENCH_MIN_PITCH);
+            float dir[3] = {cosf(yaw) * cosf(pitch), sinf(yaw) * cosf(pitch), sinf(pitch)};
+            BoundsTrace traces[2], exact;
+            bench_trace_exact(&terrain, eye, dir, &exact);
+            hits += exact.hit;
+            rays++;
+            for (u32 mode = 0; mode < 2; mode++) {
+                u64 start = bench_clock();
+                bench_trace(&terrain, eye, dir, mode == 1, &traces[mode]);
+                times[mode] += bench_clock() - start;
+                steps[mode] += traces[mode].steps;
+                unfinished[mode] += !traces[mode].finished;
+                inexact[mode] += traces[mode].finished && !bench_same_hit(&traces[mode], &exact);
+            }
+        }
+    }
+
+    INFO("%u nodes, %u of them bounded tighter than themselves and %u empty. %u out of date after decoration, %u not "
+         "covering what they hold", nodes, clipped, empty, stale, uncovered);
+    for (u32 mode = 0; mode < 2; mode++) {
+        INFO("%s: %.1f steps per ray, %.0fns per ray, %u/%u rays out of steps, %u hitting another voxel than an exact "
+             "trace (%u hits)", mode ? "Node bounds" : "Plain SVO", (double) steps[mode] / rays,
+             (double) times[mode] / rays, unfinished[mode], rays, inexact[mode], hits);
+    }
+    INFO("%lu/%lu height pyramid cells don't contain the heights of their columns", uncontained, cells);
+    INFO("Node bounds take %.1f%% fewer steps on grazing views%s", 100. * (1. - (double) steps[1] / (double) steps[0]),
+         stale || uncovered || uncontained || inexact[1] > inexact[0] ? ", BROKEN" : "");
+    terrain_destroy(&terrain);
+}
@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include "bench.h"
+#include "common/log.h"
+#include "common/materials.h"
+#include "common/terrain.h"
+#include "common/terrain_builder.h"
+
+#define BUILDER_BENCH_DEPTH (5)
+#define BUILDER_BENCH_DUPLICATES (1 << 16)
+
+/**
+ * Every non-air voxel of the world, then pairs of entries at random positions: one with the material the position
+ * really has, air included, and one with some other material. All of it is shuffled, and the entry of a pair that
+ * ends up last gets the real material, since the last one wins.
+ */
+static VoxelStreamEntry *bench_stream(const Terrain *terrain, size_t *count, u32 *random) {
+    u32 width = terrain->width;
+    size_t solid = 0;
+    for (u32 z = 0; z < width; z++) {
+        for (u32 y = 0; y < width; y++) {
+            for (u32 x = 0; x < width; x++) solid += terrain_get_voxel(terrain, x, y, z) != AIR;
+        }
+    }
+    *count = solid + 2 * BUILDER_BENCH_DUPLICATES;
+    VoxelStreamEntry *entries = (VoxelStreamEntry *) malloc(*count * sizeof(VoxelStreamEntry));
+    VoxelStreamEntry *stream = (VoxelStreamEntry *) malloc(*count * sizeof(VoxelStreamEntry));
+    u32 *order = (u32 *) malloc(*count * sizeof(u32)), *position = (u32 *) malloc(*count * sizeof(u32));
+    if (!entries || !stream || !order || !position) FATAL("Out of memory.");
+
+    size_t next = 0;
+    for (u32 z = 0; z < width; z++) {
+        for (u32 y = 0; y < width; y++) {
+            for (u32 x = 0; x < width; x++) {
+                Voxel voxel = terrain_get_voxel(terrain, x, y, z);
+                if (voxel != AIR) entries[next++] = (VoxelStreamEntry) {.x=x, .y=y, .z=z, .material=voxel};
+            }
+        }
+    }
+    for (u32 i = 0; i < BUILDER_BENCH_DUPLICATES; i++) {
+        u32 x = bench_random(random) % width, y = bench_random(random) % width, z = bench_random(random) % width;
+        Voxel voxel = terrain_get_voxel(terrain, x, y, z);
+        entries[next++] = (VoxelStreamEntry) {.x=x, .y=y, .z=z, .material=voxel};
+        entries[next++] = (VoxelStreamEntry) {.x=x, .y=y, .z=z, .material=voxel == STONE ? AIR : STONE};
+    }
+
+    for (size_t i = 0; i < *count; i++) order[i] = (u32) i;
+    for (size_t i = *count - 1; i > 0; i--) {
+        size_t j = bench_random(random) % (i + 1);
+        u32 swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    for (size_t i = 0; i < *count; i++) {
+        stream[i] = entries[order[i]];
+        position[order[i]] = (u32) i;
+    }
+    for (size_t pair = solid; pair < *count; pair += 2) {
+        u32 real = position[pair], other = position[pair + 1];
+        if (real < other) {
+            Voxel swap = stream[real].material;
+            stream[real].material = stream[other].material;
+            stream[other].material = swap;
+        }
+    }
+    free(position);
+    free(order);
+    free(entries);
+    return stream;
+}
+
+/**
+ * The top of every column of the world, exact, and the min/max of every cell of the pyramid over it. The builder
+ * must come up with exactly these, and the generated world, whose pyramid is only a bound, with a max at least as high.
+ */
+static HeightApprox **bench_pyramid(const Terrain *terrain) {
+    HeightApprox **pyramid = (HeightApprox **) malloc((terrain->depth + 1) * sizeof(HeightApprox *));
+    if (!pyramid) FATAL("Out of memory.");
+    for (u32 level = 0; level <= terrain->depth; level++) {
+        u32 level_width = terrain->width_chunks >> level;
+        pyramid[level] = (HeightApprox *) malloc((size_t) level_width * level_width * sizeof(HeightApprox));
+        if (!pyramid[level]) FATAL("Out of memory.");
+        for (u32 i = 0; i < level_width * level_width; i++) pyramid[level][i] = (HeightApprox) {UINT32_MAX, 0};
+    }
+    for (u32 y = 0; y < terrain->width; y++) {
+        for (u32 x = 0; x < terrain->width; x++) {
+            u32 top = terrain->width;
+            while (top && terrain_get_voxel(terrain, x, y, top - 1) == AIR) top--;
+            for (u32 level = 0; level <= terrain->depth; level++) {
+                u32 shift = 3 + level; // CHUNK_WIDTH wide at level 0, twice as wide for every level above
+                HeightApprox *cell = &pyramid[level][(x >> shift) + (y >> shift) * (terrain->width_chunks >> level)];
+                cell->min = min(cell->min, top);
+                cell->max = max(cell->max, top);
+            }
+        }
+    }
+    return pyramid;
+}
+
+/**
+ * A generated world turned into a shuffled voxel stream with duplicated positions, then built back with
+ * terrain_build_from_voxels. Voxels and skylight must match the generated world, the height pyramid must be exact.
+ */
+void bench_builder(void) {
+    Terrain original;
+    terrain_init(&original, BUILDER_BENCH_DEPTH);
+    u32 random = 0x9e3779b9u;
+    size_t count;
+    VoxelStreamEntry *stream = bench_stream(&original, &count, &random);
+
+    Terrain built;
+    u64 start = bench_clock();
+    terrain_build_from_voxels(&built, BUILDER_BENCH_DEPTH, stream, count);
+    u64 time = bench_clock() - start;
+
+    u32 width = original.width;
+    u64 voxel_mismatches = 0, skylight_mismatches = 0, pyramid_mismatches = 0, unbounded = 0;
+    for (u32 z = 0; z < width; z++) {
+        for (u32 y = 0; y < width; y++) {
+            for (u32 x = 0; x < width; x++) {
+                voxel_mismatches += terrain_get_voxel(&built, x, y, z) != terrain_get_voxel(&original, x, y, z);
+            }
+        }
+    }
+    for (u32 y = 0; y < width; y++) {
+        for (u32 x = 0; x < width; x++) {
+            skylight_mismatches += terrain_get_skylight(&built, x, y) != terrain_get_skylight(&original, x, y);
+        }
+    }
+    HeightApprox **pyramid = bench_pyramid(&original);
+    for (u32 level = 0; level <= original.depth; level++) {
+        u32 level_width = original.width_chunks >> level;
+        for (u32 i = 0; i < level_width * level_width; i++) {
+            HeightApprox cell = built.approx_heightmaps[level][i];
+            pyramid_mismatches += cell.min != pyramid[level][i].min || cell.max != pyramid[level][i].max;
+            unbounded += original.approx_heightmaps[level][i].max < pyramid[level][i].max;
+        }
+        free(pyramid[level]);
+    }
+    free(pyramid);
+
+    INFO("%zu stream entries, %u of them duplicated positions, built in %.2fms, %.0f MB/s of voxel stream", count,
+         2 * BUILDER_BENCH_DUPLICATES, time / 1e6, count * sizeof(VoxelStreamEntry) / (time / 1e9) / 1e6);
+    INFO("%u nodes and %u chunks, %u nodes and %u chunks when generated. %lu voxels, %lu skylight columns and %lu "
+         "pyramid cells differ, %lu cells of the generated pyramid are below the surface%s", built.nodePool.size,
+         built.chunkPool.size, original.nodePool.size, original.chunkPool.size, voxel_mismatches, skylight_mismatches,
+         pyramid_mismatches, unbounded,
+         voxel_mismatches || skylight_mismatches || pyramid_mismatches || unbounded ? ", BROKEN" : "");
+
+    free(stream);
+    terrain_destroy(&built);
+    terrain_destroy(&original);
+}
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "bench.h"
+#include "common/epoch.h"
+#include "common/log.h"
+#include "common/materials.h"
+#include "server/server.h"
+#include "server/jobs.h"
+
+#define EPOCH_BENCH_READERS (2)
+#define EPOCH_BENCH_RAYS_PER_PIN (64)
+#define EPOCH_BENCH_RAY_STEPS (256)
+#define EPOCH_BENCH_TOGGLE_ROUNDS (4)
+#define EPOCH_BENCH_TOGGLE_STRIDE (8)
+
+typedef struct BenchReader {
+    pthread_t thread;
+    u32 random;
+    u64 reads, rays, invalid;
+} BenchReader;
+
+static atomic_bool editing;
+
+static float bench_random_float(u32 *state) {
+    return (bench_random(state) & 0xffffff) / (float) 0x1000000;
+}
+
+/**
+ * Marches random rays through the terrain while it's being edited, pinning an epoch every few rays like the client
+ * does every frame. A read from a slot or a pool buffer that was reclaimed too early shows up as garbage, that isn't
+ * any material.
+ */
+static void *bench_epoch_reader(void *arg) {
+    BenchReader *reader = arg;
+    while (atomic_load(&editing)) {
+        Terrain *terrain = server_acquire_terrain();
+        float width = (float) terrain->width;
+        for (u32 ray = 0; ray < EPOCH_BENCH_RAYS_PER_PIN; ray++) {
+            float x = bench_random_float(&reader->random) * width, y = bench_random_float(&reader->random) * width;
+            float z = bench_random_float(&reader->random) * width;
+            float dx = bench_random_float(&reader->random) - 0.5f, dy = bench_random_float(&reader->random) - 0.5f;
+            float dz = bench_random_float(&reader->random) - 0.5f;
+            float length = sqrtf(dx * dx + dy * dy + dz * dz) + 1e-6f;
+            dx /= length, dy /= length, dz /= length;
+            for (u32 step = 0; step < EPOCH_BENCH_RAY_STEPS; step++) {
+                if (x < 0 || y < 0 || z < 0 || x >= width || y >= width || z >= width) break;
+                Voxel voxel = terrain_get_voxel(terrain, (u32) x, (u32) y, (u32) z);
+                reader->reads++;
+                if (voxel == UNKNOWN || voxel > WATER) reader->invalid++;
+                if (MATERIAL_IS_OPAQUE(voxel)) break;
+                x += dx, y += dy, z += dz;
+            }
+        }
+        reader->rays += EPOCH_BENCH_RAYS_PER_PIN;
+        server_release_terrain();
+    }
+    return NULL;
+}
+
+static void bench_epoch_submit(const EditCommand *edits, u32 count) {
+    u32 submitted = 0;
+    while (submitted < count) {
+        u32 pushed = server_submit_edits(edits + submitted, count - submitted);
+        if (!pushed) sched_yield(); // edits wait for the generation to end, and then for the edit job to drain them
+        submitted += pushed;
+    }
+}
+
+/**
+ * One log voxel in every chunk of the upper half of the world. No subnode is uniformly made of logs, so each of them
+ * splits a chunk: that's enough to make the pools grow, and their old buffers be retired. Some of them are then dug
+ * out and put back, which collapses the chunks that were otherwise air and retires their slot.
+ */
+static u64 bench_epoch_edit(u32 width) {
+    u32 width_chunks = width / CHUNK_WIDTH;
+    EditCommand edits[256];
+    u32 count = 0;
+    u64 total = 0;
+    for (u32 round = 0; round <= EPOCH_BENCH_TOGGLE_ROUNDS * 2; round++) {
+        Voxel material = round % 2 ? AIR : LOG;
+        u32 stride = round ? EPOCH_BENCH_TOGGLE_STRIDE : 1;
+        for (u32 chunk = 0; chunk < width_chunks * width_chunks * width_chunks / 2; chunk += stride) {
+            u32 cx = chunk % width_chunks, cy = chunk / width_chunks % width_chunks;
+            u32 cz = width_chunks / 2 + chunk / width_chunks / width_chunks;
+            edits[count++] = (EditCommand) {.x=cx * CHUNK_WIDTH + 3, .y=cy * CHUNK_WIDTH + 3, .z=cz * CHUNK_WIDTH + 3,
+                    .material=material};
+            if (count == 256) {
+                bench_epoch_submit(edits, count);
+                total += count;
+                count = 0;
+            }
+        }
+    }
+    bench_epoch_submit(edits, count);
+    return total + count;
+}
+
+void bench_epoch(void) {
+    server_start();
+    Terrain *terrain = server_acquire_terrain();
+    u32 width = terrain->width;
+    server_release_terrain();
+
+    atomic_store(&editing, true);
+    BenchReader readers[EPOCH_BENCH_READERS];
+    for (u32 i = 0; i < EPOCH_BENCH_READERS; i++) {
+        readers[i] = (BenchReader) {.random=0x9e3779b9u * (i + 1)};
+        if (pthread_create(&readers[i].thread, NULL, bench_epoch_reader, &readers[i])) FATAL("Could not create thread.");
+    }
+
+    u64 start = jobs_clock();
+    u64 edits = bench_epoch_edit(width);
+
+    // the last edits are still being applied, readers keep going until the queue is drained
+    TerrainDelta deltas[256];
+    EditCommand probe = {.x=0, .y=0, .z=width - 1, .material=STONE};
+    bench_epoch_submit(&probe, 1);
+    for (;;) {
+        while (server_poll_deltas(deltas, 256));
+        terrain = server_acquire_terrain();
+        Voxel voxel = terrain_get_voxel(terrain, probe.x, probe.y, probe.z);
+        server_release_terrain();
+        if (voxel == STONE) break;
+        sched_yield();
+    }
+    u64 elapsed = jobs_clock() - start;
+    atomic_store(&editing, false);
+
+    u64 reads = 0, rays = 0, invalid = 0;
+    for (u32 i = 0; i < EPOCH_BENCH_READERS; i++) {
+        pthread_join(readers[i].thread, NULL);
+        reads += readers[i].reads;
+        rays += readers[i].rays;
+        invalid += readers[i].invalid;
+    }
+
+    terrain = server_acquire_terrain();
+    INFO("%u readers, %lu edits in %.2fms: %.2f M reads/s, %.1f K rays/s, %lu invalid reads%s",
+         EPOCH_BENCH_READERS, edits + 1, elapsed / 1e3, reads / (double) elapsed, rays * 1e3 / (double) elapsed, invalid,
+         invalid ? ", RECLAIMED TOO EARLY" : "");
+    INFO("Pools: %u/%u nodes and %u/%u chunks used", poolAllocatorUsed(&terrain->nodePool),
+         __atomic_load_n(&terrain->nodePool.maxSize, __ATOMIC_ACQUIRE), poolAllocatorUsed(&terrain->chunkPool),
+         __atomic_load_n(&terrain->chunkPool.maxSize, __ATOMIC_ACQUIRE));
+    server_release_terrain();
+
+    EpochStats stats;
+    epoch_get_stats(&stats);
+    INFO("Epoch %lu: %lu retired, %lu reclaimed, %u pending", stats.epoch, stats.retired, stats.reclaimed, stats.pending);
+
+    server_stop();
+    server_join();
+}
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+
+#include "bench.h"
+#include "common/log.h"
+#include "common/materials.h"
+#include "common/terrain.h"
+#include "common/terrain_gc.h"
+
+#define GC_BENCH_DEPTH (6)
+#define GC_BENCH_PRUNES (64)
+#define GC_BENCH_PRUNE_LEVEL (2)
+#define GC_BENCH_EDITS (16384)
+#define GC_BENCH_SAMPLES (16384)
+
+typedef struct BenchSample {
+    u32 x, y, z;
+    Voxel live, snapshot;
+} BenchSample;
+
+// what the pools hold in memory, used or not
+static size_t bench_pool_bytes(const Terrain *terrain) {
+    return (size_t) terrain->nodePool.maxSize * sizeof(Node) + (size_t) terrain->chunkPool.maxSize * sizeof(Chunk);
+}
+
+static void bench_count_subtree(const Terrain *terrain, u32 address, u32 level, u32 *nodes, u32 *chunks) {
+    if (!level) {
+        (*chunks)++;
+        return;
+    }
+    (*nodes)++;
+    for (u32 i = 0; i < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; i++) {
+        u32 child = terrain_node_child(terrain, address, i);
+        if (child) bench_count_subtree(terrain, child, level - 1, nodes, chunks);
+    }
+}
+
+/**
+ * Replaces the subnode of the given level around a voxel by its LOD color, without releasing it, like a careless
+ * pruning pass would. Nothing is shared yet, so it's done in place. Returns false if it was uniform already.
+ */
+static bool bench_gc_prune(Terrain *terrain, u32 x, u32 y, u32 z, u32 *nodes, u32 *chunks) {
+    u32 node_address = terrain->root_node_address, subnode_width = terrain->width;
+    for (u32 depth = terrain->depth; depth > 0; depth--) {
+        subnode_width /= NODE_WIDTH;
+        u32 slot = NODE_SLOT(x / subnode_width % NODE_WIDTH, y / subnode_width % NODE_WIDTH, z / subnode_width % NODE_WIDTH);
+        u32 child = terrain_node_child(terrain, node_address, slot);
+        if (!child) return false;
+        if (depth - 1 == GC_BENCH_PRUNE_LEVEL) {
+            bench_count_subtree(terrain, child, depth - 1, nodes, chunks);
+            terrain_node_set(terrain, node_address, slot, terrain_node_material(terrain, node_address, slot), 0);
+            return true;
+        }
+        node_address = child;
+    }
+    return false;
+}
+
+static u32 bench_gc_check(const Terrain *terrain, u32 snapshot, const BenchSample *samples) {
+    u32 mismatches = 0;
+    for (u32 i = 0; i < GC_BENCH_SAMPLES; i++) {
+        const BenchSample *sample = &samples[i];
+        mismatches += terrain_get_voxel(terrain, sample->x, sample->y, sample->z) != sample->live;
+        mismatches += terrain_get_snapshot_voxel(terrain, snapshot, sample->x, sample->y, sample->z) != sample->snapshot;
+    }
+    return mismatches;
+}
+
+/**
+ * Leaves garbage in a generated world the two ways it happens: subtrees dropped without being released, which only a
+ * collection can reclaim, and slots freed by a released snapshot, which scatter later allocations. The world is then
+ * collected without and with compaction while a second snapshot is held, and both trees are checked voxel by voxel and
+ * against their Merkle hash.
+ */
+void bench_gc(void) {
+    Terrain terrain;
+    terrain_init(&terrain, GC_BENCH_DEPTH);
+    terrain_build_hashes(&terrain);
+    u32 random = 0x2545f491u;
+
+    u32 orphan_nodes = 0, orphan_chunks = 0, prunes = 0;
+    for (u32 i = 0; i < GC_BENCH_PRUNES; i++) {
+        u32 x = bench_random(&random) % terrain.width, y = bench_random(&random) % terrain.width;
+        u32 z = terrain.heightmap[x + (size_t) y * terrain.width];
+        prunes += bench_gc_prune(&terrain, x, y, min(z, terrain.width - 1), &orphan_nodes, &orphan_chunks);
+    }
+    // the pruned subtrees' hashes are still in their parents
+    terrain_build_hashes(&terrain);
+
+    static BenchSample samples[GC_BENCH_SAMPLES];
+    for (u32 i = 0; i < GC_BENCH_SAMPLES; i++) {
+        BenchSample *sample = &samples[i];
+        sample->x = bench_random(&random) % terrain.width;
+        sample->y = bench_random(&random) % terrain.width;
+        u32 z = terrain.heightmap[sample->x + (size_t) sample->y * terrain.width] + bench_random(&random) % 16;
+        sample->z = min(z < 8 ? 0 : z - 8, terrain.width - 1);
+    }
+    u32 released = terrain_snapshot(&terrain);
+    for (u32 i = 0; i < GC_BENCH_EDITS / 2; i++) {
+        const BenchSample *sample = &samples[i % GC_BENCH_SAMPLES];
+        terrain_set_voxel(&terrain, sample->x, sample->y, sample->z, LOG);
+    }
+    terrain_release_snapshot(&terrain, released);
+    u32 kept = terrain_snapshot(&terrain);
+    for (u32 i = GC_BENCH_EDITS / 2; i < GC_BENCH_EDITS; i++) {
+        const BenchSample *sample = &samples[i % GC_BENCH_SAMPLES];
+        terrain_set_voxel(&terrain, sample->x, sample->y, sample->z, AIR);
+    }
+    for (u32 i = 0; i < GC_BENCH_SAMPLES; i++) {
+        BenchSample *sample = &samples[i];
+        sample->live = terrain_get_voxel(&terrain, sample->x, sample->y, sample->z);
+        sample->snapshot = terrain_get_snapshot_voxel(&terrain, kept, sample->x, sample->y, sample->z);
+    }
+    u64 live_hash = terrain_root_hash(&terrain), snapshot_hash = terrain_get_hash(&terrain, kept, terrain.depth);
+    size_t bytes = bench_pool_bytes(&terrain);
+    u32 nodes_used = poolAllocatorUsed(&terrain.nodePool), chunks_used = poolAllocatorUsed(&terrain.chunkPool);
+
+    TerrainGcStats sweep, compaction, after;
+    u64 start = bench_clock();
+    terrain_collect_garbage(&terrain, &kept, 1, false, &sweep);
+    u64 sweep_time = bench_clock() - start;
+    u32 sweep_mismatches = bench_gc_check(&terrain, kept, samples);
+    start = bench_clock();
+    terrain_collect_garbage(&terrain, &kept, 1, true, &compaction);
+    u64 compaction_time = bench_clock() - start;
+    size_t compacted_bytes = bench_pool_bytes(&terrain);
+    u32 nodes_compacted = poolAllocatorUsed(&terrain.nodePool), chunks_compacted = poolAllocatorUsed(&terrain.chunkPool);
+    u32 compaction_mismatches = bench_gc_check(&terrain, kept, samples);
+    // hashes move along with their slots, and the live tree still hashes the same from scratch
+    bool hashes_match = terrain_root_hash(&terrain) == live_hash &&
+                        terrain_get_hash(&terrain, kept, terrain.depth) == snapshot_hash;
+    hashes_match &= terrain_build_hashes(&terrain) == live_hash;
+
+    // share counts were rebuilt, releasing the snapshot must free exactly what only it used
+    terrain_release_snapshot(&terrain, kept);
+    terrain_collect_garbage(&terrain, NULL, 0, false, &after);
+
+    INFO("%u subtrees of level %u pruned without being released, leaving %u nodes and %u chunks unreachable", prunes,
+         GC_BENCH_PRUNE_LEVEL, orphan_nodes, orphan_chunks);
+    INFO("Sweep in %.2fms: %u nodes and %u chunks freed, %u and %u reachable", sweep_time / 1e6, sweep.freed_nodes,
+         sweep.freed_chunks, sweep.live_nodes, sweep.live_chunks);
+    INFO("Compaction in %.2fms: %u nodes and %u chunks moved, %u/%u node and %u/%u chunk slots used, pools went from "
+         "%.1f MB to %.1f MB", compaction_time / 1e6, compaction.moved_nodes, compaction.moved_chunks,
+         nodes_compacted, nodes_used, chunks_compacted, chunks_used, bytes / 1e6, compacted_bytes / 1e6);
+    bool broken = sweep.freed_nodes != orphan_nodes || sweep.freed_chunks != orphan_chunks || sweep_mismatches ||
+                  compaction_mismatches || !hashes_match || compaction.freed_nodes || compaction.freed_chunks ||
+                  after.freed_nodes || after.freed_chunks;
+    INFO("%u/%u samples wrong after the sweep, %u/%u after compaction, hashes %s, %u nodes and %u chunks leaked by the "
+         "last release%s", sweep_mismatches, 2 * GC_BENCH_SAMPLES, compaction_mismatches, 2 * GC_BENCH_SAMPLES,
+         hashes_match ? "match" : "differ", after.freed_nodes, after.freed_chunks, broken ? ", BROKEN" : "");
+    terrain_destroy(&terrain);
+}
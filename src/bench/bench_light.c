@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include "bench.h"
+#include "common/log.h"
+#include "common/materials.h"
+#include "common/terrain.h"
+#include "common/terrain_light.h"
+
+#define LIGHT_BENCH_DEPTH (5)
+#define LIGHT_BENCH_SINGLE_EDITS (256)
+#define LIGHT_BENCH_BATCHES (16)
+#define LIGHT_BENCH_BATCH_SIZE (64)
+
+/**
+ * One channel of every voxel flooded from scratch over dense arrays, written again from the documentation of
+ * terrain_light.h. Every source is at the max level, so a plain breadth-first flood sets each voxel once.
+ */
+static void bench_flood(const Terrain *terrain, const u8 *opaque, u8 *levels, u32 *queue, bool sky) {
+    u32 width = terrain->width, count = 0;
+    const u32 *skylight = terrain->skylight;
+    for (u32 z = 0; z < width; z++) {
+        for (u32 y = 0; y < width; y++) {
+            for (u32 x = 0; x < width; x++) {
+                u32 index = x + y * width + z * width * width, column = x + y * width;
+                bool source = sky ? z >= skylight[column] : opaque[index] == 2;
+                levels[index] = source ? TERRAIN_LIGHT_MAX : 0;
+                if (source) queue[count++] = index;
+            }
+        }
+    }
+    for (u32 head = 0; head < count; head++) {
+        u32 index = queue[head], level = levels[index];
+        u32 position[3] = {index % width, index / width % width, index / width / width};
+        if (level <= 1) continue;
+        for (u32 axis = 0; axis < 3; axis++) {
+            for (i32 side = -1; side <= 1; side += 2) {
+                u32 neighbour[3] = {position[0], position[1], position[2]};
+                neighbour[axis] += (u32) side;
+                if (neighbour[axis] >= width) continue;
+                u32 next = neighbour[0] + neighbour[1] * width + neighbour[2] * width * width;
+                if (opaque[next] || (u32) levels[next] + 1 >= level) continue;
+                if (sky && neighbour[2] >= skylight[neighbour[0] + neighbour[1] * width]) continue;
+                levels[next] = (u8) (level - 1);
+                queue[count++] = next;
+            }
+        }
+    }
+}
+
+// voxels whose light differs from a flood from scratch
+static u64 bench_compare(const Terrain *terrain, const TerrainLight *light, u8 *opaque, u8 *sky, u8 *block,
+                         u32 *queue) {
+    u32 width = terrain->width;
+    for (u32 z = 0; z < width; z++) {
+        for (u32 y = 0; y < width; y++) {
+            for (u32 x = 0; x < width; x++) {
+                Voxel voxel = terrain_get_voxel(terrain, x, y, z);
+                opaque[x + y * width + z * width * width] = MATERIAL_LIGHT(voxel) ? 2 : MATERIAL_IS_OPAQUE(voxel);
+            }
+        }
+    }
+    bench_flood(terrain, opaque, sky, queue, true);
+    bench_flood(terrain, opaque, block, queue, false);
+    u64 mismatches = 0;
+    for (u32 z = 0; z < width; z++) {
+        for (u32 y = 0; y < width; y++) {
+            for (u32 x = 0; x < width; x++) {
+                u32 index = x + y * width + z * width * width;
+                mismatches += terrain_light_at(light, x, y, z) != (sky[index] << 4 | block[index]);
+            }
+        }
+    }
+    return mismatches;
+}
+
+// one random edit near the surface: a lamp put down or taken away, a hole dug or a pillar raised
+static uvec3 bench_edit(Terrain *terrain, u32 *random) {
+    u32 width = terrain->width, column = bench_random(random) % (width * width);
+    u32 x = column % width, y = column / width, top = terrain->skylight[column], kind = bench_random(random) % 4;
+    u32 depth = bench_random(random) % 12, z;
+    Voxel material;
+    if (kind == 0) {
+        z = top > depth ? top - 1 - depth : 0;
+        material = LAMP;
+    } else if (kind == 1) {
+        z = min(top + depth / 4, width - 1);
+        material = LAMP;
+    } else if (kind == 2) {
+        z = top > depth ? top - 1 - depth : 0;
+        material = AIR;
+    } else {
+        z = min(top + depth / 2, width - 1);
+        material = STONE;
+    }
+    terrain_set_voxel(terrain, x, y, z, material);
+    return (uvec3) {{x, y, z}};
+}
+
+/**
+ * Lights a generated world and checks it against a flood from scratch over dense arrays. Then random edits near the
+ * surface are relit one at a time, then in batches spread over regions, and the result must still match a flood from
+ * scratch, and take as many chunks as lighting the edited world anew.
+ */
+void bench_light(void) {
+    Terrain terrain;
+    terrain_init(&terrain, LIGHT_BENCH_DEPTH);
+    size_t voxels = (size_t) terrain.width * terrain.width * terrain.width;
+    u8 *opaque = (u8 *) malloc(voxels), *sky = (u8 *) malloc(voxels), *block = (u8 *) malloc(voxels);
+    u32 *queue = (u32 *) malloc(voxels * sizeof(u32));
+    uvec3 *edits = (uvec3 *) malloc(LIGHT_BENCH_BATCH_SIZE * sizeof(uvec3));
+    if (!opaque || !sky || !block || !queue || !edits) FATAL("Out of memory.");
+
+    TerrainLight light;
+    u64 start = bench_clock();
+    terrain_light_init(&light, &terrain);
+    u64 build_time = bench_clock() - start, build_steps = light.steps;
+    u32 built_chunks = light.chunk_count;
+    u64 build_mismatches = bench_compare(&terrain, &light, opaque, sky, block, queue);
+
+    u32 random = 0x9e3779b9u;
+    u64 single_time = 0, single_steps = 0, most_steps = 0;
+    for (u32 i = 0; i < LIGHT_BENCH_SINGLE_EDITS; i++) {
+        uvec3 edit = bench_edit(&terrain, &random);
+        start = bench_clock();
+        terrain_light_update(&light, &edit, 1);
+        single_time += bench_clock() - start;
+        single_steps += light.steps;
+        if (light.steps > most_steps) most_steps = light.steps;
+    }
+    u64 batch_time = 0;
+    for (u32 batch = 0; batch < LIGHT_BENCH_BATCHES; batch++) {
+        for (u32 i = 0; i < LIGHT_BENCH_BATCH_SIZE; i++) edits[i] = bench_edit(&terrain, &random);
+        start = bench_clock();
+        terrain_light_update(&light, edits, LIGHT_BENCH_BATCH_SIZE);
+        batch_time += bench_clock() - start;
+    }
+    u64 edit_mismatches = bench_compare(&terrain, &light, opaque, sky, block, queue);
+    TerrainLight rebuilt;
+    terrain_light_init(&rebuilt, &terrain);
+
+    INFO("Built in %.2fms, %lu voxels relit, %u chunks lit out of %u, %lu voxels off", build_time / 1e6,
+         build_steps, built_chunks, terrain.width_chunks * terrain.width_chunks * terrain.width_chunks,
+         build_mismatches);
+    INFO("%.1fus and %.1f voxels relit per edit on its own, %lu at most, %.1fus per edit in batches of %u",
+         single_time / 1e3 / LIGHT_BENCH_SINGLE_EDITS, (double) single_steps / LIGHT_BENCH_SINGLE_EDITS, most_steps,
+         batch_time / 1e3 / (LIGHT_BENCH_BATCHES * LIGHT_BENCH_BATCH_SIZE), LIGHT_BENCH_BATCH_SIZE);
+    INFO("%lu voxels off after edits, %u chunks lit against %u for lighting the edited world anew%s", edit_mismatches,
+         light.chunk_count, rebuilt.chunk_count,
+         build_mismatches || edit_mismatches || light.chunk_count != rebuilt.chunk_count ? ", BROKEN" : "");
+
+    terrain_light_destroy(&rebuilt);
+    terrain_light_destroy(&light);
+    free(edits);
+    free(queue);
+    free(block);
+    free(sky);
+    free(opaque);
+    terrain_destroy(&terrain);
+}
@@ -0,0 +1,61 @@
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdlib.h>
+#include "bench.h"
+#include "common/log.h"
+#include "common/terrain.h"
+
+#define NOISE_BENCH_DEPTH (6)
+#define NOISE_BENCH_TILE_WIDTH (128)
+#define NOISE_BENCH_TILES (256)
+
+/**
+ * Samples the height noise over tiles scattered across a million columns, aligned on nothing, with every number of
+ * coarse octaves, and compares it to fnlGetNoise2D. Errors are also given in voxels for worlds whose height scale is
+ * the widest there is.
+ */
+void bench_noise(void) {
+    Terrain terrain;
+    TerrainSlab *slabs;
+    terrain_init_progressive(&terrain, NOISE_BENCH_DEPTH, NOISE_BENCH_DEPTH - 1, &slabs); // only to set the noise up
+    free(slabs);
+
+    size_t tile_size = (size_t) NOISE_BENCH_TILE_WIDTH * NOISE_BENCH_TILE_WIDTH;
+    float *exact = (float *) malloc(NOISE_BENCH_TILES * tile_size * sizeof(float));
+    float *approx = (float *) malloc(tile_size * sizeof(float));
+    u32 *tiles = (u32 *) malloc(NOISE_BENCH_TILES * 2 * sizeof(u32));
+    if (!exact || !approx || !tiles) FATAL("Out of memory.");
+    srand(1);
+    for (u32 i = 0; i < NOISE_BENCH_TILES * 2; i++) tiles[i] = (u32) rand() % (1u << 20);
+
+    u64 exact_time = 0;
+    for (u32 coarse = 0; coarse <= 3; coarse++) {
+        double max_error = 0, total_error = 0;
+        u64 time = 0;
+        for (u32 i = 0; i < NOISE_BENCH_TILES; i++) {
+            float *noise = coarse ? approx : exact + i * tile_size;
+            u64 start = bench_clock();
+            terrain_sample_height_noise(tiles[2 * i], tiles[2 * i + 1], NOISE_BENCH_TILE_WIDTH, coarse, noise);
+            time += bench_clock() - start;
+            if (!coarse) continue;
+            for (size_t j = 0; j < tile_size; j++) {
+                double error = fabs((double) noise[j] - exact[i * tile_size + j]);
+                total_error += error;
+                if (error > max_error) max_error = error;
+            }
+        }
+        if (!coarse) exact_time = time;
+        u64 columns = NOISE_BENCH_TILES * tile_size;
+        double voxels = 0.25 * 8192; // heights are 0.25 * scale * noise away from the middle
+        bool broken = coarse == TERRAIN_COARSE_OCTAVES && max_error * voxels >= 1;
+        INFO("%u coarse octaves: %.1fns per column (%.2fx), error %.2e on average, %.2e at most, %.3f voxels at most%s",
+             coarse, (double) time / columns, (double) exact_time / time, total_error / columns, max_error,
+             max_error * voxels, broken ? ", BROKEN" : "");
+    }
+
+    free(tiles);
+    free(approx);
+    free(exact);
+    terrain_destroy(&terrain);
+}
@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "bench.h"
+#include "common/log.h"
+#include "common/terrain.h"
+
+#define OUT_OF_CORE_BENCH_DEPTH (5)
+#define OUT_OF_CORE_BENCH_BUDGET (2 * 1000 * 1000)
+#define OUT_OF_CORE_BENCH_WARMUP_DEPTH (2)
+
+// what the build measured, written by the child process that ran it
+typedef struct OutOfCoreBenchResult {
+    bool finished;
+    u64 time, reference_time;
+    size_t peak_growth;
+    u32 nodes, chunks, reference_nodes, reference_chunks;
+    u64 voxel_mismatches, skylight_mismatches, pyramid_mismatches;
+} OutOfCoreBenchResult;
+
+// resident memory of the process, in bytes: right now, or at its peak so far
+static size_t bench_resident_memory(bool peak) {
+    if (peak) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return (size_t) usage.ru_maxrss * 1024;
+    }
+    unsigned long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm || fscanf(statm, "%*u %lu", &pages) != 1) FATAL("Could not read /proc/self/statm");
+    fclose(statm);
+    return (size_t) pages * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * A tiny world is built out-of-core first, so that the code it runs is paged in and isn't counted against the budget,
+ * then the measured one.
+ */
+static void bench_build(OutOfCoreBenchResult *result) {
+    Terrain terrain, reference;
+    terrain_init_out_of_core(&terrain, OUT_OF_CORE_BENCH_WARMUP_DEPTH, OUT_OF_CORE_BENCH_BUDGET);
+    terrain_destroy(&terrain);
+    size_t resident = bench_resident_memory(false);
+    u64 start = bench_clock();
+    terrain_init_out_of_core(&terrain, OUT_OF_CORE_BENCH_DEPTH, OUT_OF_CORE_BENCH_BUDGET);
+    result->time = bench_clock() - start;
+    result->peak_growth = bench_resident_memory(true) - resident;
+    start = bench_clock();
+    terrain_init(&reference, OUT_OF_CORE_BENCH_DEPTH);
+    result->reference_time = bench_clock() - start;
+
+    u32 width = terrain.width;
+    for (u32 z = 0; z < width; z++) {
+        for (u32 y = 0; y < width; y++) {
+            for (u32 x = 0; x < width; x++) {
+                result->voxel_mismatches += terrain_get_voxel(&terrain, x, y, z) !=
+                                            terrain_get_voxel(&reference, x, y, z);
+            }
+        }
+    }
+    for (u32 y = 0; y < width; y++) {
+        for (u32 x = 0; x < width; x++) {
+            result->skylight_mismatches += terrain_get_skylight(&terrain, x, y) !=
+                                           terrain_get_skylight(&reference, x, y);
+        }
+    }
+    for (u32 level = 0; level <= terrain.depth; level++) {
+        u32 level_width = terrain.width_chunks >> level;
+        for (u32 i = 0; i < level_width * level_width; i++) {
+            HeightApprox cell = terrain.approx_heightmaps[level][i], expected = reference.approx_heightmaps[level][i];
+            result->pyramid_mismatches += cell.min != expected.min || cell.max != expected.max;
+        }
+    }
+    result->nodes = terrain.nodePool.size;
+    result->chunks = terrain.chunkPool.size;
+    result->reference_nodes = reference.nodePool.size;
+    result->reference_chunks = reference.chunkPool.size;
+    result->finished = true;
+
+    terrain_destroy(&reference);
+    terrain_destroy(&terrain);
+}
+
+/**
+ * A world generated out-of-core under a small memory budget, then in memory with terrain_init. Both must be the same,
+ * voxel for voxel, column for column of the skylight map and cell for cell of the height pyramid, and the peak resident
+ * memory must not have grown by more than the budget during the out-of-core build. It runs in a child process, so that
+ * its peak isn't the one of whatever ran before it.
+ */
+void bench_out_of_core(void) {
+    OutOfCoreBenchResult *result = (OutOfCoreBenchResult *) mmap(NULL, sizeof(OutOfCoreBenchResult),
+                                                                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                                                                 -1, 0);
+    if (result == MAP_FAILED) FATAL("Could not map the out-of-core benchmark results");
+    *result = (OutOfCoreBenchResult) {0};
+    fflush(stdout);
+    fflush(stderr);
+    pid_t child = fork();
+    if (child < 0) FATAL("Could not fork the out-of-core benchmark");
+    if (!child) {
+        bench_build(result);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(0);
+    }
+    int status;
+    waitpid(child, &status, 0);
+
+    if (!result->finished) {
+        ERROR("The out-of-core build died before it finished, with status %d, BROKEN", status);
+    } else {
+        INFO("Generated in %.2fms out-of-core with a %.0f MB budget, %.2fms in memory. Peak resident memory grew by "
+             "%.2f MB%s", result->time / 1e6, OUT_OF_CORE_BENCH_BUDGET / 1e6, result->reference_time / 1e6,
+             result->peak_growth / 1e6, result->peak_growth > OUT_OF_CORE_BENCH_BUDGET ? ", BROKEN" : "");
+        INFO("%u nodes and %u chunks, %u nodes and %u chunks in memory. %lu voxels, %lu skylight columns and %lu "
+             "pyramid cells differ%s", result->nodes, result->chunks, result->reference_nodes, result->reference_chunks,
+             result->voxel_mismatches, result->skylight_mismatches, result->pyramid_mismatches,
+             result->voxel_mismatches || result->skylight_mismatches || result->pyramid_mismatches ? ", BROKEN" : "");
+    }
+    munmap(result, sizeof(OutOfCoreBenchResult));
+}
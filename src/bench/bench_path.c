@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "common/log.h"
+#include "common/materials.h"
+#include "common/terrain.h"
+#include "common/terrain_path.h"
+
+#define PATH_BENCH_DEPTH (6)
+#define PATH_BENCH_QUERIES (64)
+#define PATH_BENCH_PILLAR_HEIGHT (3)
+#define PATH_BENCH_PILLARS (4)
+
+static bool bench_can_climb(const Terrain *terrain, u32 from, u32 to) {
+    u32 a = terrain->skylight[from], b = terrain->skylight[to];
+    return a && b && (a > b ? a - b : b - a) <= TERRAIN_PATH_MAX_CLIMB;
+}
+
+// the same rules as the planner, written again from its documentation
+static u32 bench_step_cost(const Terrain *terrain, u32 from, u32 to) {
+    u32 width = terrain->width;
+    i32 dx = (i32) (to % width) - (i32) (from % width), dy = (i32) (to / width) - (i32) (from / width);
+    if (abs(dx) > 1 || abs(dy) > 1 || (!dx && !dy) || !bench_can_climb(terrain, from, to)) return UINT32_MAX;
+    u32 cost = TERRAIN_PATH_STEP_COST;
+    if (dx && dy) {
+        u32 side_x = from + dx, side_y = from + dy * (i32) width;
+        if (!bench_can_climb(terrain, from, side_x) || !bench_can_climb(terrain, side_x, to) ||
+            !bench_can_climb(terrain, from, side_y) || !bench_can_climb(terrain, side_y, to)) {
+            return UINT32_MAX;
+        }
+        cost = TERRAIN_PATH_DIAGONAL_COST;
+    }
+    u32 a = terrain->skylight[from], b = terrain->skylight[to];
+    return cost + TERRAIN_PATH_CLIMB_COST * (a > b ? a - b : b - a);
+}
+
+// cost of a planned path, UINT32_MAX if one of its steps can't be walked or it doesn't go where it should
+static u32 bench_path_cost(const Terrain *terrain, const uvec3 *path, u32 count, u32 from, u32 to) {
+    if (!count || path[0].x + path[0].y * terrain->width != from) return UINT32_MAX;
+    if (path[count - 1].x + path[count - 1].y * terrain->width != to) return UINT32_MAX;
+    u32 cost = 0;
+    for (u32 i = 0; i < count; i++) {
+        u32 column = path[i].x + path[i].y * terrain->width;
+        if (path[i].z != terrain->skylight[column]) return UINT32_MAX;
+        if (!i) continue;
+        u32 step = bench_step_cost(terrain, path[i - 1].x + path[i - 1].y * terrain->width, column);
+        if (step == UINT32_MAX) return UINT32_MAX;
+        cost += step;
+    }
+    return cost;
+}
+
+static u32 bench_estimate(const Terrain *terrain, u32 from, u32 to) {
+    u32 dx = abs((i32) (from % terrain->width) - (i32) (to % terrain->width));
+    u32 dy = abs((i32) (from / terrain->width) - (i32) (to / terrain->width));
+    return TERRAIN_PATH_STEP_COST * max(dx, dy) + (TERRAIN_PATH_DIAGONAL_COST - TERRAIN_PATH_STEP_COST) * min(dx, dy);
+}
+
+/**
+ * Flat A* over every column of the world, the optimal cost the planner is compared to. costs, stamps and heap are
+ * scratch of width**2, width**2 and 8 * width**2 + 1 entries.
+ */
+static u32 bench_flat_search(const Terrain *terrain, u32 from, u32 to, u32 *costs, u32 *stamps, u32 stamp, u64 *heap) {
+    u32 width = terrain->width, size = 0;
+    costs[from] = 0;
+    stamps[from] = stamp;
+    heap[size++] = (u64) bench_estimate(terrain, from, to) << 32 | from;
+    while (size) {
+        u64 top = heap[0], last = heap[--size];
+        u32 i = 0;
+        for (u32 child; (child = 2 * i + 1) < size; i = child) {
+            if (child + 1 < size && heap[child + 1] < heap[child]) child++;
+            if (heap[child] >= last) break;
+            heap[i] = heap[child];
+        }
+        if (size) heap[i] = last;
+        u32 column = (u32) top;
+        if ((u32) (top >> 32) != costs[column] + bench_estimate(terrain, column, to)) continue;
+        if (column == to) return costs[column];
+        for (i32 ny = (i32) (column / width) - 1; ny <= (i32) (column / width) + 1; ny++) {
+            for (i32 nx = (i32) (column % width) - 1; nx <= (i32) (column % width) + 1; nx++) {
+                if (nx < 0 || ny < 0 || nx >= (i32) width || ny >= (i32) width) continue;
+                u32 next = (u32) nx + (u32) ny * width, step = bench_step_cost(terrain, column, next);
+                if (step == UINT32_MAX) continue;
+                u32 cost = costs[column] + step;
+                if (stamps[next] == stamp && costs[next] <= cost) continue;
+                costs[next] = cost;
+                stamps[next] = stamp;
+                u64 item = (u64) (cost + bench_estimate(terrain, next, to)) << 32 | next;
+                for (i = size++; i && heap[(i - 1) / 2] > item; i = (i - 1) / 2) heap[i] = heap[(i - 1) / 2];
+                heap[i] = item;
+            }
+        }
+    }
+    return UINT32_MAX;
+}
+
+/**
+ * Plans paths between random columns of a generated world, first with no cluster built, then again with all of them
+ * cached, and compares them to flat A* over every column: they must be walkable, found whenever there is a way, and
+ * not much longer than the shortest one. Then pillars are raised on the first path, and only the clusters around them
+ * may be rebuilt for the paths to go around them.
+ */
+void bench_path(void) {
+    Terrain terrain;
+    terrain_init(&terrain, PATH_BENCH_DEPTH);
+    TerrainPlanner planner;
+    terrain_planner_init(&planner, &terrain, TERRAIN_PATH_CLUSTER_LEVEL);
+    size_t columns = (size_t) terrain.width * terrain.width;
+    u32 *costs = (u32 *) malloc(columns * sizeof(u32)), *stamps = (u32 *) calloc(columns, sizeof(u32));
+    u64 *heap = (u64 *) malloc((8 * columns + 1) * sizeof(u64));
+    u32 *from = (u32 *) malloc(PATH_BENCH_QUERIES * sizeof(u32));
+    u32 *to = (u32 *) malloc(PATH_BENCH_QUERIES * sizeof(u32));
+    if (!costs || !stamps || !heap || !from || !to) FATAL("Out of memory.");
+    u32 random = 0x9e3779b9u, stamp = 0;
+    for (u32 i = 0; i < PATH_BENCH_QUERIES; i++) {
+        from[i] = bench_random(&random) % columns;
+        to[i] = bench_random(&random) % columns;
+    }
+
+    u64 times[2] = {0}, flat_time = 0, planned_cost = 0, optimal_cost = 0;
+    u32 invalid = 0, missed = 0, found = 0, steps = 0;
+    for (u32 pass = 0; pass < 2; pass++) {
+        for (u32 i = 0; i < PATH_BENCH_QUERIES; i++) {
+            uvec3 *path;
+            u64 start = bench_clock();
+            u32 count = terrain_find_path(&planner, from[i] % terrain.width, from[i] / terrain.width,
+                                          to[i] % terrain.width, to[i] / terrain.width, &path);
+            times[pass] += bench_clock() - start;
+            if (pass) {
+                free(path);
+                continue;
+            }
+            start = bench_clock();
+            u32 optimal = bench_flat_search(&terrain, from[i], to[i], costs, stamps, ++stamp, heap);
+            flat_time += bench_clock() - start;
+            u32 cost = count ? bench_path_cost(&terrain, path, count, from[i], to[i]) : UINT32_MAX;
+            invalid += count && cost == UINT32_MAX;
+            missed += !count != (optimal == UINT32_MAX);
+            if (count && cost != UINT32_MAX && optimal != UINT32_MAX) {
+                found++;
+                steps += count;
+                planned_cost += cost;
+                optimal_cost += optimal;
+            }
+            free(path);
+        }
+    }
+    u32 built = planner.clusters_built;
+
+    // pillars on the first path found, each one throwing away the clusters around it. What generation recorded is
+    // left out.
+    terrain_clear_deltas(&terrain, terrain.delta_count);
+    u32 query = 0, pillars = 0, replanned_invalid = 0, replanned_missed = 0;
+    uvec3 *path = NULL;
+    u32 count = 0;
+    for (; query < PATH_BENCH_QUERIES && !count; query++) {
+        count = terrain_find_path(&planner, from[query] % terrain.width, from[query] / terrain.width,
+                                  to[query] % terrain.width, to[query] / terrain.width, &path);
+    }
+    for (u32 p = 1; p <= PATH_BENCH_PILLARS && count > 2; p++) {
+        uvec3 column = path[p * (count - 1) / (PATH_BENCH_PILLARS + 1)];
+        for (u32 z = column.z; z < min(column.z + PATH_BENCH_PILLAR_HEIGHT, terrain.width); z++) {
+            terrain_set_voxel(&terrain, column.x, column.y, z, STONE);
+            terrain_planner_apply_deltas(&planner, terrain.deltas, terrain.delta_count);
+            terrain_clear_deltas(&terrain, terrain.delta_count);
+        }
+        pillars++;
+    }
+    free(path);
+    u32 rebuilt = planner.clusters_built;
+    for (u32 i = 0; i < PATH_BENCH_QUERIES; i++) {
+        u32 planned = terrain_find_path(&planner, from[i] % terrain.width, from[i] / terrain.width,
+                                        to[i] % terrain.width, to[i] / terrain.width, &path);
+        u32 optimal = bench_flat_search(&terrain, from[i], to[i], costs, stamps, ++stamp, heap);
+        replanned_invalid += planned && bench_path_cost(&terrain, path, planned, from[i], to[i]) == UINT32_MAX;
+        replanned_missed += !planned != (optimal == UINT32_MAX);
+        free(path);
+    }
+    rebuilt = planner.clusters_built - rebuilt;
+
+    INFO("%u paths found out of %u, %.1f steps long on average, %.2f%% costlier than the shortest ones, %u not "
+         "walkable, %u missed", found, PATH_BENCH_QUERIES, (double) steps / max(found, 1),
+         100. * ((double) planned_cost / (double) optimal_cost - 1), invalid, missed);
+    INFO("%.2fms per path with no cluster built, %.2fms with all %u of them cached, %.2fms for flat A* over every "
+         "column",
+         times[0] / 1e6 / PATH_BENCH_QUERIES, times[1] / 1e6 / PATH_BENCH_QUERIES, built,
+         flat_time / 1e6 / PATH_BENCH_QUERIES);
+    INFO("%u pillars raised, %u clusters rebuilt out of %u, %u replanned paths not walkable, %u missed%s", pillars,
+         rebuilt, planner.width_clusters * planner.width_clusters, replanned_invalid, replanned_missed,
+         invalid || missed || replanned_invalid || replanned_missed || rebuilt > 4 * pillars ? ", BROKEN" : "");
+
+    free(to);
+    free(from);
+    free(heap);
+    free(stamps);
+    free(costs);
+    terrain_planner_destroy(&planner);
+    terrain_destroy(&terrain);
+}
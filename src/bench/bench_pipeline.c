@@ -0,0 +1,76 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "bench.h"
+#include "common/log.h"
+#include "common/materials.h"
+#include "common/terrain.h"
+#include "server/jobs.h"
+#include "server/pipeline.h"
+
+#define PIPELINE_BENCH_DEPTH (6)
+#define PIPELINE_BENCH_SLAB_DEPTH (3)
+#define PIPELINE_BENCH_SAMPLES (65536)
+
+static Terrain terrain;
+static pthread_mutex_t terrain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// nobody reads the deltas here
+static void bench_pipeline_publish(void) {
+    terrain_clear_deltas(&terrain, terrain.delta_count);
+}
+
+static void bench_pipeline_wait(void) {
+    while (!pipeline_is_idle()) sched_yield();
+}
+
+static void bench_pipeline_report(const char *name, u64 time) {
+    PipelineStats stats;
+    pipeline_get_stats(&stats);
+    INFO("%s in %.2fms: %u/%u regions have their heightmap, %u their terrain, %u are decorated and %u lit", name,
+         time / 1e3, stats.stages[REGION_HEIGHTMAP].regions, stats.regions, stats.stages[REGION_TERRAIN].regions,
+         stats.stages[REGION_DECORATION].regions, stats.stages[REGION_LIGHT].regions);
+}
+
+/**
+ * Requests a single region, which only generates its neighbourhood as far as it needs, then the whole world. The
+ * result is compared to the same world generated in one go, skylight included.
+ */
+void bench_pipeline(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    jobs_start(cores > 1 ? (u32) cores - 1 : 1);
+    PipelineHooks hooks = {.lock=&terrain_lock, .publish=bench_pipeline_publish};
+    pipeline_start(&terrain, PIPELINE_BENCH_DEPTH, PIPELINE_BENCH_SLAB_DEPTH, &hooks);
+
+    u64 start = jobs_clock();
+    pipeline_request(terrain.width / 2, terrain.width / 2, 1, REGION_LIGHT);
+    bench_pipeline_wait();
+    bench_pipeline_report("One region requested", jobs_clock() - start);
+
+    start = jobs_clock();
+    pipeline_request(0, 0, terrain.width, REGION_LIGHT);
+    bench_pipeline_wait();
+    bench_pipeline_report("Whole world requested", jobs_clock() - start);
+    jobs_stop();
+    jobs_join();
+
+    Terrain reference;
+    terrain_init(&reference, PIPELINE_BENCH_DEPTH);
+    u32 random = 0x9e3779b9u, voxel_mismatches = 0, skylight_mismatches = 0;
+    for (u32 i = 0; i < PIPELINE_BENCH_SAMPLES; i++) {
+        u32 x = bench_random(&random) % terrain.width, y = bench_random(&random) % terrain.width;
+        u32 z = bench_random(&random) % terrain.width;
+        if (terrain_get_voxel(&terrain, x, y, z) != terrain_get_voxel(&reference, x, y, z)) voxel_mismatches++;
+        if (terrain_get_skylight(&terrain, x, y) != terrain_get_skylight(&reference, x, y)) skylight_mismatches++;
+    }
+    INFO("%u nodes and %u chunks, %u nodes and %u chunks when generated in one go. %u/%u voxels and %u/%u skylight "
+         "columns differ%s", terrain.nodePool.size, terrain.chunkPool.size, reference.nodePool.size,
+         reference.chunkPool.size, voxel_mismatches, PIPELINE_BENCH_SAMPLES, skylight_mismatches,
+         PIPELINE_BENCH_SAMPLES, voxel_mismatches || skylight_mismatches ? ", BROKEN" : "");
+
+    terrain_destroy(&reference);
+    terrain_destroy(&terrain);
+    pipeline_destroy();
+}
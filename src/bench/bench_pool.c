@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include "bench.h"
+#include "common/log.h"
+#include "common/terrain.h"
+
+#define POOL_BENCH_SLOTS (1u << 20)
+#define POOL_BENCH_REFILL (POOL_BENCH_SLOTS / 8)
+
+/**
+ * Fills a pool of nodes, frees half of it in random order, then hands slots out again. Reports the time of each
+ * operation, how far apart consecutive allocations land once the pool has holes, and for bitmap pools how long it
+ * takes to iterate over the live slots. It's broken if a slot was handed out twice or the counts don't add up.
+ */
+static void bench_pool_run(bool bitmap, const u32 *order) {
+    PoolAllocator pool;
+    if (bitmap) poolAllocatorCreateBitmap(&pool, 1024, sizeof(Node), NULL);
+    else poolAllocatorCreate(&pool, 1024, sizeof(Node), NULL);
+    u32 *slots = (u32 *) malloc(POOL_BENCH_SLOTS * sizeof(u32));
+    u32 *refill = (u32 *) malloc(POOL_BENCH_REFILL * sizeof(u32));
+    u8 *taken = (u8 *) calloc(POOL_BENCH_SLOTS, 1);
+    if (!slots || !refill || !taken) FATAL("Out of memory.");
+
+    u64 start = bench_clock();
+    for (u32 i = 0; i < POOL_BENCH_SLOTS; i++) slots[i] = poolAllocatorAlloc(&pool);
+    u64 fill_time = bench_clock() - start;
+
+    start = bench_clock();
+    for (u32 i = 0; i < POOL_BENCH_SLOTS / 2; i++) poolAllocatorDealloc(&pool, slots[order[i]]);
+    u64 free_time = bench_clock() - start;
+    for (u32 i = 0; i < POOL_BENCH_SLOTS / 2; i++) slots[order[i]] = UINT32_MAX;
+
+    start = bench_clock();
+    for (u32 i = 0; i < POOL_BENCH_REFILL; i++) refill[i] = poolAllocatorAlloc(&pool);
+    u64 refill_time = bench_clock() - start;
+    double stride = 0;
+    for (u32 i = 1; i < POOL_BENCH_REFILL; i++) stride += abs((i32) refill[i] - (i32) refill[i - 1]);
+    stride /= POOL_BENCH_REFILL - 1;
+
+    bool valid = pool.size == POOL_BENCH_SLOTS / 2 + POOL_BENCH_REFILL;
+    for (u32 i = 0; i < POOL_BENCH_SLOTS; i++) {
+        if (slots[i] == UINT32_MAX) continue;
+        valid &= !taken[slots[i]];
+        taken[slots[i]] = 1;
+    }
+    for (u32 i = 0; i < POOL_BENCH_REFILL; i++) {
+        valid &= refill[i] < POOL_BENCH_SLOTS && !taken[refill[i]];
+        if (refill[i] < POOL_BENCH_SLOTS) taken[refill[i]] = 1;
+    }
+
+    u64 iterate_time = 0;
+    if (bitmap) {
+        u32 live = 0, used = poolAllocatorUsed(&pool);
+        start = bench_clock();
+        for (u32 i = poolAllocatorNextLive(&pool, 0); i < used; i = poolAllocatorNextLive(&pool, i + 1)) {
+            live++;
+            valid &= taken[i];
+        }
+        iterate_time = bench_clock() - start;
+        valid &= live == pool.size;
+    }
+
+    INFO("%s: %.1fns per alloc, %.1fns per free, %.1fns per alloc into holes %.0f slots apart on average%s%s",
+         bitmap ? "Bitmap" : "Free list", (double) fill_time / POOL_BENCH_SLOTS,
+         (double) free_time / (POOL_BENCH_SLOTS / 2), (double) refill_time / POOL_BENCH_REFILL, stride,
+         bitmap ? "" : ", no live slot iteration", valid ? "" : ", BROKEN");
+    if (bitmap) {
+        INFO("Bitmap: %.2fms to iterate over %u live slots out of %u, %.2fns per slot", iterate_time / 1e6, pool.size,
+             poolAllocatorUsed(&pool), (double) iterate_time / poolAllocatorUsed(&pool));
+    }
+    free(refill);
+    free(taken);
+    free(slots);
+    poolAllocatorDestroy(&pool);
+}
+
+// the same random half of the slots is freed in both pools
+void bench_pool(void) {
+    u32 *order = (u32 *) malloc(POOL_BENCH_SLOTS * sizeof(u32));
+    if (!order) FATAL("Out of memory.");
+    u32 random = 0x9e3779b9u;
+    for (u32 i = 0; i < POOL_BENCH_SLOTS; i++) order[i] = i;
+    for (u32 i = POOL_BENCH_SLOTS - 1; i > 0; i--) {
+        u32 j = bench_random(&random) % (i + 1), swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    bench_pool_run(false, order);
+    bench_pool_run(true, order);
+    free(order);
+}
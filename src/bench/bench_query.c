@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench.h"
+#include "common/log.h"
+#include "common/materials.h"
+#include "common/terrain.h"
+#include "common/terrain_query.h"
+
+#define QUERY_BENCH_DEPTH (6)
+#define QUERY_BENCH_RAYS (16384)
+#define QUERY_BENCH_POINTS (65536)
+#define QUERY_BENCH_BOXES (4096)
+#define QUERY_BENCH_BOX_SIZE (24)
+#define QUERY_BENCH_LINES (65536)
+#define QUERY_BENCH_LINE_REACH (64)
+#define QUERY_BENCH_EYE_HEIGHT (2)
+#define QUERY_BENCH_WALKERS (256)
+#define QUERY_BENCH_WALK_MOVES (64)
+#define QUERY_BENCH_MOVE (5000.f / 60) // how far the camera goes in a frame at full speed and 60 frames per second
+#define QUERY_BENCH_BOX_RADIUS (0.25f)
+
+static float bench_uniform(u32 *state, float low, float high) {
+    return low + (high - low) * (float) (bench_random(state) / (double) UINT32_MAX);
+}
+
+// somewhere a little above the surface of a random column
+static vec3 bench_eye(const Terrain *terrain, u32 *state) {
+    u32 x = bench_random(state) % terrain->width, y = bench_random(state) % terrain->width;
+    u32 height = terrain->heightmap[x + (size_t) y * terrain->width];
+    return (vec3) {{x + bench_uniform(state, 0, 1), y + bench_uniform(state, 0, 1),
+                    min(height + QUERY_BENCH_EYE_HEIGHT, terrain->width - 1) + bench_uniform(state, 0, 1)}};
+}
+
+static vec3 bench_direction(u32 *state) {
+    float yaw = bench_uniform(state, 0, 2 * (float) M_PI), pitch = asinf(bench_uniform(state, -1, 1));
+    return (vec3) {{cosf(yaw) * cosf(pitch), sinf(yaw) * cosf(pitch), sinf(pitch)}};
+}
+
+/**
+ * Voxel by voxel from the origin, in or out of the world, until max_distance, reading every voxel on the way with
+ * terrain_get_voxel. With skip_first, the voxel the ray starts in is air.
+ */
+static bool bench_reference_ray(const Terrain *terrain, vec3 origin, vec3 direction, double max_distance,
+                                bool skip_first, TerrainRayHit *hit) {
+    double length = sqrt((double) direction.x * direction.x + (double) direction.y * direction.y +
+                         (double) direction.z * direction.z), t_max[3], t_delta[3], t = 0;
+    i64 voxel[3], step[3];
+    i32 normal[3] = {0, 0, 0};
+    for (u32 axis = 0; axis < 3; axis++) {
+        double dir = direction.arr[axis] / length;
+        voxel[axis] = (i64) floor(origin.arr[axis]);
+        step[axis] = dir < 0 ? -1 : 1;
+        t_delta[axis] = dir == 0 ? INFINITY : fabs(1. / dir);
+        double border = (double) (dir < 0 ? voxel[axis] : voxel[axis] + 1);
+        t_max[axis] = dir == 0 ? INFINITY : (border - origin.arr[axis]) / dir;
+    }
+    for (bool first = true; t <= max_distance; first = false) {
+        bool inside = true;
+        for (u32 axis = 0; axis < 3; axis++) inside &= voxel[axis] >= 0 && voxel[axis] < terrain->width;
+        Voxel material = inside ? terrain_get_voxel(terrain, voxel[0], voxel[1], voxel[2]) : AIR;
+        if (material != AIR && !(first && skip_first)) {
+            for (u32 axis = 0; axis < 3; axis++) {
+                hit->voxel.arr[axis] = (u32) voxel[axis];
+                hit->normal.arr[axis] = normal[axis];
+            }
+            hit->distance = (float) t;
+            hit->material = material;
+            return true;
+        }
+        u32 axis = t_max[0] < t_max[1] ? (t_max[0] < t_max[2] ? 0 : 2) : (t_max[1] < t_max[2] ? 1 : 2);
+        t = t_max[axis];
+        voxel[axis] += step[axis];
+        t_max[axis] += t_delta[axis];
+        for (u32 i = 0; i < 3; i++) normal[i] = i == axis ? (i32) -step[axis] : 0;
+    }
+    return false;
+}
+
+static bool bench_same_hit(bool found, const TerrainRayHit *hit, bool expected, const TerrainRayHit *reference) {
+    if (found != expected) return false;
+    if (!found) return true;
+    bool same = hit->material == reference->material && fabsf(hit->distance - reference->distance) < 1e-3f;
+    for (u32 axis = 0; axis < 3; axis++) {
+        same &= hit->voxel.arr[axis] == reference->voxel.arr[axis] &&
+                hit->normal.arr[axis] == reference->normal.arr[axis];
+    }
+    return same;
+}
+
+static bool bench_reference_sight(const Terrain *terrain, const TerrainSightLine *line) {
+    vec3 direction = {{line->to.x - line->from.x, line->to.y - line->from.y, line->to.z - line->from.z}};
+    double length = sqrt((double) direction.x * direction.x + (double) direction.y * direction.y +
+                         (double) direction.z * direction.z);
+    TerrainRayHit hit;
+    if (!(length > 0) || !bench_reference_ray(terrain, line->from, direction, length, true, &hit)) return true;
+    return hit.voxel.x == (u32) floorf(line->to.x) && hit.voxel.y == (u32) floorf(line->to.y) &&
+           hit.voxel.z == (u32) floorf(line->to.z);
+}
+
+/**
+ * Rays from above the surface and from anywhere in and around the world, random points and boxes, all checked against
+ * the same queries answered voxel by voxel. Boxes walking randomly from above the surface by camera-sized moves must
+ * never go through anything on their way. Then a batch of lines of sight between eyes near each other, answered
+ * one line at a time and in one call spread across threads, which must agree with each other and with the reference.
+ */
+void bench_query(void) {
+    Terrain terrain;
+    terrain_init(&terrain, QUERY_BENCH_DEPTH);
+    u32 random = 0x9e3779b9u, ray_mismatches = 0, hits = 0;
+    u64 ray_time = 0, reference_time = 0;
+    for (u32 i = 0; i < QUERY_BENCH_RAYS; i++) {
+        float width = (float) terrain.width;
+        vec3 origin = i % 2 ? bench_eye(&terrain, &random) : (vec3) {{bench_uniform(&random, -width / 2, width * 1.5f),
+                bench_uniform(&random, -width / 2, width * 1.5f), bench_uniform(&random, -width / 2, width * 1.5f)}};
+        vec3 direction = bench_direction(&random);
+        TerrainRayHit hit, reference;
+        u64 start = bench_clock();
+        bool found = terrain_raycast(&terrain, origin, direction, 2 * width, &hit);
+        ray_time += bench_clock() - start;
+        start = bench_clock();
+        bool expected = bench_reference_ray(&terrain, origin, direction, 2 * width, false, &reference);
+        reference_time += bench_clock() - start;
+        hits += expected;
+        ray_mismatches += !bench_same_hit(found, &hit, expected, &reference);
+    }
+
+    u32 point_mismatches = 0;
+    for (u32 i = 0; i < QUERY_BENCH_POINTS; i++) {
+        float width = (float) terrain.width;
+        vec3 point = {{bench_uniform(&random, -8, width + 8), bench_uniform(&random, -8, width + 8),
+                       bench_uniform(&random, -8, width + 8)}};
+        Voxel expected = AIR;
+        if (point.x >= 0 && point.y >= 0 && point.z >= 0 && point.x < width && point.y < width && point.z < width) {
+            expected = terrain_get_voxel(&terrain, (u32) point.x, (u32) point.y, (u32) point.z);
+        }
+        point_mismatches += terrain_material_at(&terrain, point) != expected;
+    }
+
+    u32 box_mismatches = 0;
+    u64 box_time = 0, box_voxels = 0;
+    for (u32 i = 0; i < QUERY_BENCH_BOXES; i++) {
+        vec3 center = bench_eye(&terrain, &random), low, high;
+        for (u32 axis = 0; axis < 3; axis++) {
+            low.arr[axis] = center.arr[axis] - bench_uniform(&random, 0, QUERY_BENCH_BOX_SIZE);
+            high.arr[axis] = center.arr[axis] + bench_uniform(&random, 0, QUERY_BENCH_BOX_SIZE);
+        }
+        u64 start = bench_clock();
+        u64 count = terrain_box_occupancy(&terrain, low, high, false), any = terrain_box_occupancy(&terrain, low, high,
+                                                                                                  true);
+        box_time += bench_clock() - start;
+        u64 expected = 0;
+        i64 from[3], to[3];
+        for (u32 axis = 0; axis < 3; axis++) {
+            from[axis] = max(0, (i32) floorf(low.arr[axis]));
+            to[axis] = min((i32) terrain.width, (i32) ceilf(high.arr[axis]));
+        }
+        for (i64 z = from[2]; z < to[2]; z++) {
+            for (i64 y = from[1]; y < to[1]; y++) {
+                for (i64 x = from[0]; x < to[0]; x++) expected += terrain_get_voxel(&terrain, x, y, z) != AIR;
+            }
+        }
+        box_voxels += (u64) max(0, (i32) (to[0] - from[0])) * max(0, (i32) (to[1] - from[1])) *
+                      max(0, (i32) (to[2] - from[2]));
+        box_mismatches += count != expected || any != (expected > 0);
+    }
+
+    u32 moves = 0, slides = 0, escapes = 0;
+    u64 move_time = 0, slowest_move = 0;
+    for (u32 walker = 0; walker < QUERY_BENCH_WALKERS; walker++) {
+        vec3 position = bench_eye(&terrain, &random);
+        for (u32 i = 0; i < QUERY_BENCH_WALK_MOVES; i++) {
+            vec3 low, high, motion = bench_direction(&random);
+            for (u32 axis = 0; axis < 3; axis++) {
+                low.arr[axis] = position.arr[axis] - QUERY_BENCH_BOX_RADIUS;
+                high.arr[axis] = position.arr[axis] + QUERY_BENCH_BOX_RADIUS;
+                motion.arr[axis] *= QUERY_BENCH_MOVE;
+            }
+            bool clear = !terrain_box_occupancy(&terrain, low, high, true);
+            u64 start = bench_clock();
+            vec3 moved = terrain_move_box(&terrain, low, high, motion);
+            u64 time = bench_clock() - start;
+            move_time += time;
+            if (time > slowest_move) slowest_move = time;
+            moves++;
+
+            // axis by axis in the same order, the box must not have gone through anything
+            u32 order[3] = {0, 1, 2}, blocked = 0;
+            for (u32 j = 0; j < 3; j++) {
+                for (u32 k = j; k > 0 && fabsf(motion.arr[order[k]]) > fabsf(motion.arr[order[k - 1]]); k--) {
+                    u32 swap = order[k];
+                    order[k] = order[k - 1];
+                    order[k - 1] = swap;
+                }
+            }
+            for (u32 j = 0; j < 3; j++) {
+                u32 axis = order[j];
+                bool overshot = fabsf(moved.arr[axis]) > fabsf(motion.arr[axis]) ||
+                                moved.arr[axis] * motion.arr[axis] < 0;
+                blocked += fabsf(moved.arr[axis]) < fabsf(motion.arr[axis]);
+                vec3 swept_low = low, swept_high = high;
+                swept_low.arr[axis] += fminf(moved.arr[axis], 0);
+                swept_high.arr[axis] += fmaxf(moved.arr[axis], 0);
+                escapes += overshot || (clear && terrain_box_occupancy(&terrain, swept_low, swept_high, true));
+                low.arr[axis] += moved.arr[axis];
+                high.arr[axis] += moved.arr[axis];
+            }
+            slides += blocked && blocked < 3;
+            position = add(position, moved);
+        }
+    }
+
+    TerrainSightLine *lines = (TerrainSightLine *) malloc(QUERY_BENCH_LINES * sizeof(TerrainSightLine));
+    bool *serial = (bool *) malloc(QUERY_BENCH_LINES), *batched = (bool *) malloc(QUERY_BENCH_LINES);
+    if (!lines || !serial || !batched) FATAL("Out of memory.");
+    for (u32 i = 0; i < QUERY_BENCH_LINES; i++) {
+        lines[i].from = bench_eye(&terrain, &random);
+        vec3 direction = bench_direction(&random);
+        float reach = bench_uniform(&random, 0, QUERY_BENCH_LINE_REACH);
+        for (u32 axis = 0; axis < 3; axis++) {
+            float end = lines[i].from.arr[axis] + direction.arr[axis] * reach;
+            lines[i].to.arr[axis] = fminf(fmaxf(end, 0), nextafterf((float) terrain.width, 0));
+        }
+    }
+    u64 start = bench_clock();
+    for (u32 i = 0; i < QUERY_BENCH_LINES; i++) terrain_line_of_sight(&terrain, &lines[i], 1, &serial[i]);
+    u64 serial_time = bench_clock() - start;
+    start = bench_clock();
+    terrain_line_of_sight(&terrain, lines, QUERY_BENCH_LINES, batched);
+    u64 batched_time = bench_clock() - start;
+    u32 sight_mismatches = 0, visible = 0;
+    for (u32 i = 0; i < QUERY_BENCH_LINES; i++) {
+        visible += batched[i];
+        sight_mismatches += serial[i] != batched[i] || batched[i] != bench_reference_sight(&terrain, &lines[i]);
+    }
+    u32 threads = min(TERRAIN_QUERY_MAX_THREADS, (u32) sysconf(_SC_NPROCESSORS_ONLN));
+    threads = max(1, min(threads, QUERY_BENCH_LINES / TERRAIN_QUERY_BATCH_GRAIN));
+
+    INFO("Raycasts: %.0fns per ray through the tree, %.0fns voxel by voxel, %u hits out of %u rays, %u mismatches",
+         (double) ray_time / QUERY_BENCH_RAYS, (double) reference_time / QUERY_BENCH_RAYS, hits, QUERY_BENCH_RAYS,
+         ray_mismatches);
+    INFO("Points: %u mismatches out of %u. Boxes: %.0fns per count and test of %.0f voxels, %u mismatches out of %u",
+         point_mismatches, QUERY_BENCH_POINTS, (double) box_time / QUERY_BENCH_BOXES,
+         (double) box_voxels / QUERY_BENCH_BOXES, box_mismatches, QUERY_BENCH_BOXES);
+    INFO("Moves of %.0f voxels: %.1fus per move on average, %.1fus at worst, %u/%u sliding along something, %u going "
+         "through it", QUERY_BENCH_MOVE, move_time / 1e3 / moves, slowest_move / 1e3, slides, moves, escapes);
+    INFO("Lines of sight: %.2fms one by one, %.2fms batched over %u threads (%.1fx), %u/%u visible, %u mismatches%s",
+         serial_time / 1e6, batched_time / 1e6, threads, (double) serial_time / (double) batched_time, visible,
+         QUERY_BENCH_LINES, sight_mismatches,
+         ray_mismatches || point_mismatches || box_mismatches || escapes || sight_mismatches ? ", BROKEN" : "");
+    free(batched);
+    free(serial);
+    free(lines);
+    terrain_destroy(&terrain);
+}
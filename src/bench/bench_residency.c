@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench.h"
+#include "common/log.h"
+#include "common/terrain.h"
+#include "server/jobs.h"
+#include "server/pipeline.h"
+
+#define RESIDENCY_BENCH_DEPTH (6)
+#define RESIDENCY_BENCH_SLAB_DEPTH (3)
+#define RESIDENCY_BENCH_KEEP_RADIUS (2)
+#define RESIDENCY_BENCH_SAMPLES (65536)
+#define RESIDENCY_BENCH_BAND (16)
+
+static Terrain terrain;
+static pthread_mutex_t terrain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// nobody reads the deltas here
+static void bench_residency_publish(void) {
+    terrain_clear_deltas(&terrain, terrain.delta_count);
+}
+
+static void bench_residency_wait(void) {
+    while (!pipeline_is_idle()) sched_yield();
+}
+
+static size_t bench_resident_bytes(const Terrain *world) {
+    return (size_t) world->nodePool.size * sizeof(Node) + (size_t) world->chunkPool.size * sizeof(Chunk);
+}
+
+/**
+ * Every voxel of the band above the surface, where structures are, and voxels anywhere in the world. Only columns of
+ * regions done with every stage are compared unless all is set. Returns how many voxels and skylight columns differ
+ * from the reference.
+ */
+static u32 bench_residency_compare(const Terrain *reference, bool all, u32 *compared) {
+    u32 random = 0x9e3779b9u, mismatches = 0;
+    *compared = 0;
+    for (u32 y = 0; y < terrain.width; y++) {
+        for (u32 x = 0; x < terrain.width; x++) {
+            if (!all && !pipeline_is_done(x, y, 1, REGION_LIGHT)) continue;
+            (*compared)++;
+            mismatches += terrain_get_skylight(&terrain, x, y) != terrain_get_skylight(reference, x, y);
+            u32 height = reference->heightmap[x + (size_t) y * terrain.width];
+            for (u32 z = height; z < min(height + RESIDENCY_BENCH_BAND, terrain.width); z++) {
+                mismatches += terrain_get_voxel(&terrain, x, y, z) != terrain_get_voxel(reference, x, y, z);
+            }
+        }
+    }
+    for (u32 i = 0; i < RESIDENCY_BENCH_SAMPLES; i++) {
+        u32 x = bench_random(&random) % terrain.width, y = bench_random(&random) % terrain.width;
+        u32 z = bench_random(&random) % terrain.width;
+        if (!all && !pipeline_is_done(x, y, 1, REGION_LIGHT)) continue;
+        mismatches += terrain_get_voxel(&terrain, x, y, z) != terrain_get_voxel(reference, x, y, z);
+    }
+    return mismatches;
+}
+
+/**
+ * Generates the whole world through the pipeline, reports half of its regions as seen more recently than the other
+ * half, and trims it to half of its memory around a corner. What is kept must be untouched, regions must have been
+ * collapsed least recently seen first, and once the whole world is requested again it must be the same as the world
+ * generated in one go, structures reaching across regions included.
+ */
+void bench_residency(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    jobs_start(cores > 1 ? (u32) cores - 1 : 1);
+    PipelineHooks hooks = {.lock=&terrain_lock, .publish=bench_residency_publish};
+    pipeline_start(&terrain, RESIDENCY_BENCH_DEPTH, RESIDENCY_BENCH_SLAB_DEPTH, &hooks);
+    pipeline_request(0, 0, terrain.width, REGION_LIGHT);
+    bench_residency_wait();
+    Terrain reference;
+    terrain_init(&reference, RESIDENCY_BENCH_DEPTH);
+
+    u32 region_width = CHUNK_WIDTH << RESIDENCY_BENCH_SLAB_DEPTH, width_regions = terrain.width / region_width;
+    u32 *frames = (u32 *) malloc((size_t) width_regions * width_regions * sizeof(u32));
+    if (!frames) FATAL("Out of memory.");
+    for (u32 i = 0; i < width_regions * width_regions; i++) frames[i] = 1 + i % 2;
+    pipeline_mark_seen(frames);
+
+    size_t generated = bench_resident_bytes(&terrain);
+    u64 start = jobs_clock();
+    size_t dropped = pipeline_trim(generated / 2, 0, 0, RESIDENCY_BENCH_KEEP_RADIUS);
+    u64 trim_time = jobs_clock() - start;
+    size_t trimmed = bench_resident_bytes(&terrain);
+
+    // every region collapsed must have been seen before every candidate that was kept
+    u32 collapsed = 0, oldest_kept = UINT32_MAX, newest_collapsed = 0;
+    bool kept_near = true;
+    for (u32 i = 0; i < width_regions * width_regions; i++) {
+        u32 rx = i % width_regions, ry = i / width_regions;
+        bool done = pipeline_is_done(rx * region_width, ry * region_width, 1, REGION_LIGHT);
+        if (max(rx, ry) < RESIDENCY_BENCH_KEEP_RADIUS) kept_near &= done;
+        else if (done) oldest_kept = min(oldest_kept, frames[i]);
+        else newest_collapsed = max(newest_collapsed, frames[i]);
+        collapsed += !done;
+    }
+    bool ordered = kept_near && (!collapsed || newest_collapsed <= oldest_kept);
+    u32 kept_compared, kept_mismatches = bench_residency_compare(&reference, false, &kept_compared);
+    bool edit_dropped = true;
+    for (u32 i = 0; i < width_regions * width_regions; i++) {
+        u32 x = i % width_regions * region_width, y = i / width_regions * region_width;
+        if (!pipeline_is_done(x, y, 1, REGION_LIGHT)) edit_dropped &= !pipeline_claim_edit(x, y);
+    }
+
+    start = jobs_clock();
+    pipeline_request(0, 0, terrain.width, REGION_LIGHT);
+    bench_residency_wait();
+    u64 regeneration_time = jobs_clock() - start;
+    jobs_stop();
+    jobs_join();
+    u32 compared, mismatches = bench_residency_compare(&reference, true, &compared);
+
+    INFO("Trimmed to %.1f MB out of %.1f MB in %.2fms: %u/%u regions collapsed, %.1f MB dropped, least recently seen "
+         "first: %s", trimmed / 1e6, generated / 1e6, trim_time / 1e3, collapsed, width_regions * width_regions,
+         dropped / 1e6, ordered ? "yes" : "no");
+    INFO("%u differences in the %u columns of kept regions, edits to collapsed regions %s", kept_mismatches,
+         kept_compared, edit_dropped ? "dropped" : "accepted");
+    INFO("Regenerated in %.2fms, %.1f MB: %u differences with the world generated in one go over %u columns%s",
+         regeneration_time / 1e3, bench_resident_bytes(&terrain) / 1e6, mismatches, compared,
+         !ordered || kept_mismatches || mismatches || !edit_dropped || trimmed > generated / 2 ? ", BROKEN" : "");
+
+    free(frames);
+    terrain_destroy(&reference);
+    terrain_destroy(&terrain);
+    pipeline_destroy();
+}
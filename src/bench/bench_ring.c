@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+
+#include <immintrin.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include "bench.h"
+#include "common/ring.h"
+#include "common/log.h"
+
+#define RING_BENCH_CAPACITY (4096)
+#define RING_BENCH_ITEMS (1u << 22)
+#define RING_BENCH_MAX_PRODUCERS (8)
+
+// a thread finding the ring full or empty spins that many times before it starts yielding its core
+#define RING_BENCH_SPINS (64)
+
+// latencies are bucketed per microsecond up to that, everything above lands in the last bucket
+#define RING_BENCH_LATENCY_BUCKETS (1024)
+
+typedef struct BenchItem {
+    u64 timestamp;
+    u32 producer;
+    u32 sequence;
+} BenchItem;
+
+typedef struct BenchProducer {
+    Ring *ring;
+    u32 index, count, batch;
+} BenchProducer;
+
+static void bench_ring_backoff(u32 *attempts) {
+    if (++*attempts < RING_BENCH_SPINS) {
+        _mm_pause();
+    } else {
+        sched_yield();
+    }
+}
+
+static void *bench_ring_producer(void *arg) {
+    BenchProducer *producer = arg;
+    BenchItem items[256];
+    for (u32 sent = 0; sent < producer->count;) {
+        u32 batch = min(producer->batch, producer->count - sent);
+        u64 now = bench_clock();
+        for (u32 i = 0; i < batch; i++) {
+            items[i] = (BenchItem) {.timestamp=now, .producer=producer->index, .sequence=sent + i};
+        }
+        u32 pushed = 0, attempts = 0;
+        while (pushed < batch) {
+            u32 count = ring_push(producer->ring, items + pushed, batch - pushed);
+            if (count) {
+                pushed += count;
+                attempts = 0;
+            } else {
+                bench_ring_backoff(&attempts);
+            }
+        }
+        sent += batch;
+    }
+    return NULL;
+}
+
+/**
+ * One consumer draining as fast as it can while producers push. Latency is from just before a batch is pushed to
+ * when it is popped, so it includes the time spent waiting for room in a full ring.
+ */
+static void bench_ring_run(u32 producer_count, u32 batch) {
+    Ring ring;
+    ring_create(&ring, RING_BENCH_CAPACITY, sizeof(BenchItem), producer_count > 1);
+    pthread_t threads[RING_BENCH_MAX_PRODUCERS];
+    BenchProducer producers[RING_BENCH_MAX_PRODUCERS];
+    u32 next_sequence[RING_BENCH_MAX_PRODUCERS] = {0};
+    static u64 histogram[RING_BENCH_LATENCY_BUCKETS];
+    memset(histogram, 0, sizeof(histogram));
+
+    u64 start = bench_clock();
+    for (u32 i = 0; i < producer_count; i++) {
+        producers[i] = (BenchProducer) {.ring=&ring, .index=i, .count=RING_BENCH_ITEMS / producer_count, .batch=batch};
+        if (pthread_create(&threads[i], NULL, bench_ring_producer, &producers[i])) FATAL("Could not create thread.");
+    }
+
+    u64 received = 0, total = (u64) (RING_BENCH_ITEMS / producer_count) * producer_count, latency_sum = 0;
+    u32 out_of_order = 0, attempts = 0;
+    BenchItem items[256];
+    while (received < total) {
+        u32 count = ring_pop(&ring, items, batch);
+        if (!count) {
+            bench_ring_backoff(&attempts);
+            continue;
+        }
+        attempts = 0;
+        u64 now = bench_clock();
+        for (u32 i = 0; i < count; i++) {
+            u64 latency = now - items[i].timestamp;
+            latency_sum += latency;
+            u64 bucket = latency / 1000;
+            histogram[bucket < RING_BENCH_LATENCY_BUCKETS ? bucket : RING_BENCH_LATENCY_BUCKETS - 1]++;
+            if (items[i].sequence != next_sequence[items[i].producer]++) out_of_order++;
+        }
+        received += count;
+    }
+    u64 elapsed = bench_clock() - start;
+    for (u32 i = 0; i < producer_count; i++) pthread_join(threads[i], NULL);
+
+    u64 p99_target = received * 99 / 100, seen = 0;
+    u32 p99 = 0;
+    while (p99 < RING_BENCH_LATENCY_BUCKETS - 1 && (seen += histogram[p99]) < p99_target) p99++;
+    INFO("%s, %u producer(s), batches of %3u: %6.1f M items/s, latency %.2fus average, %s%uus p99%s",
+         producer_count > 1 ? "MPSC" : "SPSC", producer_count, batch, received / (elapsed / 1e3), latency_sum / 1e3 / received,
+         p99 == RING_BENCH_LATENCY_BUCKETS - 1 ? ">" : "<", p99 == RING_BENCH_LATENCY_BUCKETS - 1 ? p99 : p99 + 1,
+         out_of_order ? ", ORDER VIOLATED" : "");
+    ring_destroy(&ring);
+}
+
+/**
+ * Producer counts that would leave the consumer without a core of its own are skipped, they would only measure the
+ * scheduler.
+ */
+void bench_ring(void) {
+    u32 batches[] = {1, 16, 256};
+    u32 producers[] = {1, 2, 4, 8};
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 max_producers = cores > 2 ? (u32) cores - 1 : 1;
+    for (u32 p = 0; p < sizeof(producers) / sizeof(producers[0]); p++) {
+        if (producers[p] > max_producers) {
+            INFO("Skipping %u producers and more, %ld cores leave room for %u producer(s) next to the consumer",
+                 producers[p], cores, max_producers);
+            break;
+        }
+        for (u32 b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) bench_ring_run(producers[p], batches[b]);
+    }
+}
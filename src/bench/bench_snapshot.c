@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+
+#include "bench.h"
+#include "common/log.h"
+#include "common/materials.h"
+#include "common/terrain.h"
+
+#define SNAPSHOT_BENCH_DEPTH (6)
+#define SNAPSHOT_BENCH_EDITS (16384)
+#define SNAPSHOT_BENCH_SAMPLES (16384)
+
+typedef struct BenchSample {
+    u32 x, y, z;
+    Voxel voxel;
+} BenchSample;
+
+static size_t bench_terrain_bytes(const Terrain *terrain) {
+    return (size_t) terrain->nodePool.size * sizeof(Node) + (size_t) terrain->chunkPool.size * sizeof(Chunk);
+}
+
+// how many samples don't match what the tree starting at root holds
+static u32 bench_snapshot_check(const Terrain *terrain, u32 root, const BenchSample *samples) {
+    u32 mismatches = 0;
+    for (u32 i = 0; i < SNAPSHOT_BENCH_SAMPLES; i++) {
+        if (terrain_get_snapshot_voxel(terrain, root, samples[i].x, samples[i].y, samples[i].z) != samples[i].voxel) {
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+/**
+ * Snapshots a generated world, edits it, and checks that the snapshot didn't change, that restoring it brings the
+ * world back, and that releasing it frees everything only it used. Memory is compared to a full copy of both pools.
+ */
+void bench_snapshot(void) {
+    Terrain terrain;
+    terrain_init(&terrain, SNAPSHOT_BENCH_DEPTH);
+    u32 random = 0x9e3779b9u;
+
+    // one sample per column of a coarse grid, so that no two of them are on the same voxel
+    static BenchSample samples[SNAPSHOT_BENCH_SAMPLES];
+    u32 grid = 128, spacing = terrain.width / grid;
+    for (u32 i = 0; i < SNAPSHOT_BENCH_SAMPLES; i++) {
+        BenchSample *sample = &samples[i];
+        sample->x = i % grid * spacing + bench_random(&random) % spacing;
+        sample->y = i / grid % grid * spacing + bench_random(&random) % spacing;
+        sample->z = bench_random(&random) % terrain.width;
+        sample->voxel = terrain_get_voxel(&terrain, sample->x, sample->y, sample->z);
+    }
+
+    size_t full_copy = bench_terrain_bytes(&terrain);
+    u64 start = bench_clock();
+    u32 snapshot = terrain_snapshot(&terrain);
+    u64 snapshot_time = bench_clock() - start;
+
+    // edits right where the samples are, so that every one of them is on a copied path
+    start = bench_clock();
+    for (u32 i = 0; i < SNAPSHOT_BENCH_EDITS; i++) {
+        const BenchSample *sample = &samples[i % SNAPSHOT_BENCH_SAMPLES];
+        terrain_set_voxel(&terrain, sample->x, sample->y, sample->z, sample->voxel == AIR ? STONE : AIR);
+    }
+    u64 edit_time = bench_clock() - start;
+    size_t edited = bench_terrain_bytes(&terrain);
+    u32 snapshot_mismatches = bench_snapshot_check(&terrain, snapshot, samples);
+    u32 live_mismatches = bench_snapshot_check(&terrain, terrain.root_node_address, samples);
+
+    start = bench_clock();
+    terrain_restore_snapshot(&terrain, snapshot);
+    u64 restore_time = bench_clock() - start;
+    u32 restored_mismatches = bench_snapshot_check(&terrain, terrain.root_node_address, samples);
+    size_t restored = bench_terrain_bytes(&terrain);
+
+    start = bench_clock();
+    terrain_release_snapshot(&terrain, snapshot);
+    u64 release_time = bench_clock() - start;
+    size_t released = bench_terrain_bytes(&terrain);
+
+    INFO("Snapshot of a %.1f MB tree in %luns", full_copy / 1e6, snapshot_time);
+    INFO("%u edits in %.2fms, %.0f bytes copied per edit, %.1f%% of a full copy",
+         SNAPSHOT_BENCH_EDITS, edit_time / 1e6, (edited - full_copy) / (double) SNAPSHOT_BENCH_EDITS,
+         (edited - full_copy) * 100. / full_copy);
+    INFO("Restored in %.2fms, released in %luns, the tree is back to %.1f MB (%.1f MB before the release)",
+         restore_time / 1e6, release_time, released / 1e6, restored / 1e6);
+    INFO("%u/%u samples changed in the snapshot, %u/%u edits missing from the live tree, %u/%u wrong after restoring%s",
+         snapshot_mismatches, SNAPSHOT_BENCH_SAMPLES, SNAPSHOT_BENCH_SAMPLES - live_mismatches, SNAPSHOT_BENCH_SAMPLES,
+         restored_mismatches, SNAPSHOT_BENCH_SAMPLES,
+         snapshot_mismatches || live_mismatches != SNAPSHOT_BENCH_SAMPLES || restored_mismatches ? ", BROKEN" : "");
+    terrain_destroy(&terrain);
+}
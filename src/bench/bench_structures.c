@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include "bench.h"
+#include "common/log.h"
+#include "common/materials.h"
+#include "common/terrain.h"
+#include "common/terrain_decoration.h"
+
+#define STRUCTURES_BENCH_DEPTH (6)
+#define STRUCTURES_BENCH_SLAB_DEPTH (3)
+
+static size_t bench_terrain_bytes(const Terrain *terrain) {
+    return (size_t) poolAllocatorUsed(&terrain->nodePool) * sizeof(Node) +
+           (size_t) poolAllocatorUsed(&terrain->chunkPool) * sizeof(Chunk);
+}
+
+/**
+ * Generates a world up to its soil, then places its structures one footprint at a time, last footprint first, and
+ * reports what they cost in memory. The voxels right above the surface are then compared to those of the same world
+ * generated in one go, which placed them in the opposite order.
+ */
+void bench_structures(void) {
+    Terrain terrain;
+    TerrainSlab *slabs;
+    u32 slab_count = terrain_init_progressive(&terrain, STRUCTURES_BENCH_DEPTH, STRUCTURES_BENCH_SLAB_DEPTH, &slabs);
+    terrain_generate_heightmap_columns(&terrain, 0, 0, terrain.width);
+    u32 footprint = CHUNK_WIDTH << STRUCTURES_BENCH_SLAB_DEPTH, footprints = terrain.width / footprint;
+    for (u32 i = 0; i < footprints * footprints; i++) {
+        terrain_refine_pyramid(&terrain, i % footprints * footprint, i / footprints * footprint, footprint);
+    }
+    for (u32 i = 0; i < slab_count; i++) {
+        Terrain scratch;
+        terrain_generate_slab(&terrain, &slabs[i], &scratch);
+        terrain_graft_slab(&terrain, &slabs[i], &scratch);
+    }
+    free(slabs);
+    terrain_lay_soil(&terrain, 0, 0, terrain.width);
+    terrain_clear_deltas(&terrain, terrain.delta_count);
+
+    size_t before = bench_terrain_bytes(&terrain);
+    u32 nodes = poolAllocatorUsed(&terrain.nodePool), chunks = poolAllocatorUsed(&terrain.chunkPool);
+    TerrainStructureStats stats = {0};
+    u64 start = bench_clock();
+    for (u32 i = footprints * footprints; i-- > 0;) {
+        terrain_place_structures(&terrain, i % footprints * footprint, i / footprints * footprint, footprint, &stats);
+    }
+    u64 time = bench_clock() - start;
+    size_t added = bench_terrain_bytes(&terrain) - before;
+    INFO("%u structures placed in %.2fms, %.2fus each, stamping %u chunks of which %u were split out of uniform "
+         "subnodes", stats.structures, time / 1e6, stats.structures ? time / 1e3 / stats.structures : 0.,
+         stats.chunks_stamped, stats.chunks_split);
+    INFO("%u nodes and %u chunks added, %.1f KB on top of %.1f KB (%.2f%%), %.1f KB per 1000 structures",
+         poolAllocatorUsed(&terrain.nodePool) - nodes, poolAllocatorUsed(&terrain.chunkPool) - chunks, added / 1e3,
+         before / 1e3, added * 100. / before, stats.structures ? added / 1e3 * 1000 / stats.structures : 0.);
+
+    Terrain reference;
+    terrain_init(&reference, STRUCTURES_BENCH_DEPTH);
+    u32 logs = 0, leaves = 0, plants = 0, mismatches = 0, checked = 0;
+    for (u32 y = 0; y < terrain.width; y++) {
+        for (u32 x = 0; x < terrain.width; x++) {
+            u32 h = terrain.heightmap[x + (size_t) y * terrain.width];
+            for (u32 z = h ? h - 1 : 0; z < min(h + TERRAIN_STRUCTURE_HEIGHT, terrain.width); z++, checked++) {
+                Voxel voxel = terrain_get_voxel(&terrain, x, y, z);
+                logs += voxel == LOG;
+                leaves += voxel == LEAVES;
+                plants += voxel == SHORT_GRASS || voxel == FLOWER;
+                if (voxel != terrain_get_voxel(&reference, x, y, z)) mismatches++;
+            }
+        }
+    }
+    INFO("%u log, %u leaves and %u plant voxels, %u/%u voxels differ from the world generated in one go%s", logs,
+         leaves, plants, mismatches, checked, mismatches || !logs || !leaves || !plants ? ", BROKEN" : "");
+
+    terrain_destroy(&reference);
+    terrain_destroy(&terrain);
+}
@@ -0,0 +1,112 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "bench.h"
+#include "common/log.h"
+#include "common/materials.h"
+#include "common/terrain.h"
+#include "common/terrain_sync.h"
+
+#define SYNC_BENCH_DEPTH (6)
+#define SYNC_BENCH_EDITS (256)
+#define SYNC_BENCH_SAMPLES (65536)
+
+typedef struct BenchServer {
+    const Terrain *terrain;
+    int fd;
+    TerrainSyncStats stats;
+    bool ok;
+} BenchServer;
+
+static size_t bench_terrain_bytes(const Terrain *terrain) {
+    return (size_t) poolAllocatorUsed(&terrain->nodePool) * sizeof(Node) +
+           (size_t) poolAllocatorUsed(&terrain->chunkPool) * sizeof(Chunk);
+}
+
+static void *bench_sync_serve(void *arg) {
+    BenchServer *server = arg;
+    server->ok = terrain_sync_serve(server->terrain, server->fd, &server->stats);
+    return NULL;
+}
+
+// one sync over a Unix socket pair, the source being served from its own thread like it would from another process
+static bool bench_sync_run(const Terrain *source, Terrain *replica, TerrainSyncStats *stats, u64 *time) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) FATAL("Could not create socket pair.");
+    BenchServer server = {.terrain=source, .fd=fds[0]};
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, bench_sync_serve, &server)) FATAL("Could not create thread.");
+    u64 start = bench_clock();
+    bool ok = terrain_sync_pull(replica, fds[1], stats);
+    *time = bench_clock() - start;
+    pthread_join(thread, NULL);
+    close(fds[0]);
+    close(fds[1]);
+    return ok && server.ok;
+}
+
+static u32 bench_sync_check(const Terrain *source, const Terrain *replica) {
+    u32 random = 0x85ebca6bu, mismatches = 0;
+    for (u32 i = 0; i < SYNC_BENCH_SAMPLES; i++) {
+        u32 x = bench_random(&random) % source->width, y = bench_random(&random) % source->width;
+        u32 z = bench_random(&random) % source->width;
+        if (terrain_get_voxel(source, x, y, z) != terrain_get_voxel(replica, x, y, z)) mismatches++;
+    }
+    return mismatches;
+}
+
+static void bench_sync_report(const char *name, bool ok, const TerrainSyncStats *stats, u64 time, size_t full,
+                              const Terrain *source, const Terrain *replica) {
+    u32 diff = terrain_diff(source, replica, NULL, NULL);
+    u32 mismatches = bench_sync_check(source, replica);
+    bool same = terrain_root_hash(source) == terrain_root_hash(replica);
+    INFO("%s: %.2fms, %u rounds, %u subtrees compared, %u sent, %.1f KB sent and %.1f KB received (%.2f%% of the tree)",
+         name, time / 1e6, stats->rounds, stats->compared, stats->sent, stats->bytes_sent / 1e3,
+         stats->bytes_received / 1e3, stats->bytes_received * 100. / full);
+    INFO("%s: %u subtrees still differ, root hashes %s, %u/%u samples wrong%s", name, diff, same ? "match" : "differ",
+         mismatches, SYNC_BENCH_SAMPLES, !ok || diff || !same || mismatches ? ", BROKEN" : "");
+}
+
+/**
+ * Edits a generated world in a few scattered places and brings a replica of it back up to date, then fills an empty
+ * one from scratch. Bytes are compared to what the pools of the source hold.
+ */
+void bench_sync(void) {
+    Terrain source, replica, empty;
+    terrain_init(&source, SYNC_BENCH_DEPTH);
+    terrain_init(&replica, SYNC_BENCH_DEPTH);
+    terrain_init_empty(&empty, SYNC_BENCH_DEPTH);
+    terrain_build_hashes(&source);
+    terrain_build_hashes(&replica);
+    terrain_build_hashes(&empty);
+    if (terrain_root_hash(&source) != terrain_root_hash(&replica)) WARN("Two generations of the same world differ!");
+
+    u32 random = 0x9e3779b9u;
+    u64 start = bench_clock();
+    for (u32 i = 0; i < SYNC_BENCH_EDITS; i++) {
+        u32 x = bench_random(&random) % source.width, y = bench_random(&random) % source.width;
+        u32 z = bench_random(&random) % source.width;
+        terrain_set_voxel(&source, x, y, z, terrain_get_voxel(&source, x, y, z) == AIR ? LOG : AIR);
+    }
+    u64 edit_time = bench_clock() - start;
+    size_t full = bench_terrain_bytes(&source);
+
+    start = bench_clock();
+    u32 diff = terrain_diff(&source, &replica, NULL, NULL);
+    u64 diff_time = bench_clock() - start;
+    INFO("%u edits in %.2fms with hashes kept up to date, %u differing subtrees found in %.2fms", SYNC_BENCH_EDITS,
+         edit_time / 1e6, diff, diff_time / 1e6);
+
+    TerrainSyncStats stats;
+    u64 time;
+    bool ok = bench_sync_run(&source, &replica, &stats, &time);
+    bench_sync_report("Incremental", ok, &stats, time, full, &source, &replica);
+    ok = bench_sync_run(&source, &empty, &stats, &time);
+    bench_sync_report("From scratch", ok, &stats, time, full, &source, &empty);
+
+    terrain_destroy(&source);
+    terrain_destroy(&replica);
+    terrain_destroy(&empty);
+}
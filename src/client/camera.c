@@ -1,35 +1,48 @@
 #include "camera.h"
 #include "context.h"
 #include "common/log.h"
+#include "common/terrain_query.h"
 
 vec3 camera_pos = (vec3) {0, 0, 0};
 vec3 camera_forward = (vec3) {0.5, 0.5, 0};
 
-void camera_update(GLFWwindow *window, float deltaTime) {
+void camera_update(GLFWwindow *window, const Terrain *terrain, float deltaTime) {
     static float accum = 0;
     static bool has_recently_moved_keyboard = false, has_recently_moved_mouse = false;
     accum += deltaTime;
 
+    vec3 motion = {{0, 0, 0}};
     float speed = glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS ? CAMERA_FAST_SPEED * CAMERA_SPEED_MULTIPLIER : CAMERA_BASE_SPEED * CAMERA_SPEED_MULTIPLIER;
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
         has_recently_moved_keyboard = true;
-        camera_pos = add(camera_pos, mul(camera_forward, deltaTime * speed));
+        motion = add(motion, mul(camera_forward, deltaTime * speed));
     }
     if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) {
         has_recently_moved_keyboard = true;
-        camera_pos = add(camera_pos, mul(camera_forward, -deltaTime * speed));
+        motion = add(motion, mul(camera_forward, -deltaTime * speed));
     }
 
     vec3 right = normalize(cross(camera_forward, ((vec3) {0, 1, 0})));
     if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) {
         has_recently_moved_keyboard = true;
-        camera_pos = add(camera_pos, mul(right, -deltaTime * speed));
+        motion = add(motion, mul(right, -deltaTime * speed));
     }
     if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) {
         has_recently_moved_keyboard = true;
-        camera_pos = add(camera_pos, mul(right, deltaTime * speed));
+        motion = add(motion, mul(right, deltaTime * speed));
     }
 
+    if (context_collision_mode) {
+        // the camera is y up, the terrain z up
+        vec3 low = {{camera_pos.x - CAMERA_COLLISION_RADIUS, camera_pos.z - CAMERA_COLLISION_RADIUS,
+                     camera_pos.y - CAMERA_COLLISION_RADIUS}};
+        vec3 high = {{camera_pos.x + CAMERA_COLLISION_RADIUS, camera_pos.z + CAMERA_COLLISION_RADIUS,
+                      camera_pos.y + CAMERA_COLLISION_RADIUS}};
+        vec3 moved = terrain_move_box(terrain, low, high, (vec3) {{motion.x, motion.z, motion.y}});
+        motion = (vec3) {{moved.x, moved.z, moved.y}};
+    }
+    camera_pos = add(camera_pos, motion);
+
     static double oldPosX = 0.0;
     static double oldPosY = 0.0;
 
@@ -3,13 +3,21 @@
 #include "glad/glad.h"
 #include "GLFW/glfw3.h"
 #include "cpmath.h"
+#include "common/terrain.h"
 
 #define CAMERA_BASE_SPEED (100)
 #define CAMERA_FAST_SPEED (500)
 #define CAMERA_SPEED_MULTIPLIER (10)
 #define CAMERA_MOUSE_SENSITIVITY (5)
 
+// half the width of the box that collides with the terrain around the camera, in voxels
+#define CAMERA_COLLISION_RADIUS (0.25f)
+
 extern vec3 camera_pos;
 extern vec3 camera_forward;
 
-void camera_update(GLFWwindow *window, float deltaTime);
\ No newline at end of file
+/**
+ * Moves and turns the camera from the inputs. Unless context_collision_mode is off, it slides along the terrain rather
+ * than going through it.
+ */
+void camera_update(GLFWwindow *window, const Terrain *terrain, float deltaTime);
\ No newline at end of file
@@ -1,25 +1,41 @@
+#include <stdlib.h>
 #include <unistd.h>
 #include "client/client.h"
 #include "client/context.h"
 #include "client/camera.h"
 #include "common/log.h"
 #include "common/terrain.h"
+#include "common/terrain_query.h"
+#include "common/materials.h"
+#include "server/server.h"
+#include "server/jobs.h"
 #include "cptime.h"
 #include "render.h"
 
 #define UCLOCKS_PER_SECONDS (1e6)
+#define CLIENT_MAX_DELTAS_PER_FRAME (1024)
+
+// edits are spheres of that radius, around the first solid voxel in front of the camera
+#define CLIENT_EDIT_RADIUS (4)
+#define CLIENT_EDIT_REACH (512)
+
+// how many frames apart what was seen is read back from the tracer and reported to the server
+#define CLIENT_VIEW_REPORT_INTERVAL (30)
+
+static void client_edit(Terrain *terrain, Voxel material);
+
+static void client_report_view(const Terrain *terrain, u32 *region_frames);
 
 
 void client_start(void) {
     /**
-     * Generating world data
-     * Assuming a node width of 2 and a chunk size of 8, a depth 8 means a 2048x2048x2048 world.
+     * The world data is owned by the server, that is still filling it in. We render whatever is there already.
      */
-    INFO("Generating terrain.");
-    Terrain terrain;
-    terrain_init(&terrain, 6);
-    camera_pos = (vec3){-0.25*terrain.width,1.25*terrain.width, -0.25*terrain.width};
+    Terrain *terrain = server_acquire_terrain();
+    camera_pos = (vec3){-0.25*terrain->width,1.25*terrain->width, -0.25*terrain->width};
     camera_forward = (vec3) {0.5, -0.6, 0.5};
+    server_release_terrain();
+    TerrainDelta deltas[CLIENT_MAX_DELTAS_PER_FRAME];
 
     /**
      * Creating context
@@ -33,12 +49,16 @@ void client_start(void) {
      */
     INFO("Initializing renderer.");
     render_init(window);
+    u32 region_width = server_region_width(), width_regions = terrain->width / region_width;
+    render_track_recency(region_width, width_regions);
+    u32 *region_frames = (u32 *) malloc((size_t) width_regions * width_regions * sizeof(u32));
+    if (!region_frames) FATAL("Out of memory.");
 
     /**
      * Setup some stats in order to compute framerate
      */
-    u32 frametime = 0, accum = 0, count = 0, time = uclock();
-    char win_title[128];
+    u32 frametime = 0, accum = 0, count = 0, frames = 0, time = uclock();
+    char win_title[192];
 
     /**
      * Get the graphic card name, for display/debug purpose
@@ -52,17 +72,46 @@ void client_start(void) {
     INFO("Client ticking!");
     while (!glfwWindowShouldClose(window)) {
         /**
-         * Handle camera movements
+         * Handle camera movements. Collisions walk the tree, so the terrain is held while they do.
          */
         glfwPollEvents();
-        camera_update(window, frametime / UCLOCKS_PER_SECONDS);
+        server_acquire_terrain();
+        camera_update(window, terrain, frametime / UCLOCKS_PER_SECONDS);
+        server_release_terrain();
 
         /**
          * Do the actual rendering
          */
-        render_draw_frame(&terrain);
+        /**
+         * Uploading what changed on the server side. The terrain is only held while its memory is being copied.
+         */
+        u32 delta_count = server_poll_deltas(deltas, CLIENT_MAX_DELTAS_PER_FRAME);
+        if (delta_count) {
+            server_acquire_terrain();
+            render_update_terrain(terrain, deltas, delta_count);
+            server_release_terrain();
+        }
+
+        /**
+         * Sending the edits requested this frame
+         */
+        if (context_edit_requested) {
+            context_edit_requested = false;
+            client_edit(terrain, context_edit_material);
+        }
+
+        if (context_benchmark_requested) {
+            context_benchmark_requested = false;
+            render_benchmark_traversal(terrain);
+        }
+        render_draw_frame(terrain);
         glfwSwapBuffers(window);
 
+        /**
+         * Telling the server what was seen lately, so that it knows what to keep in memory
+         */
+        if (++frames % CLIENT_VIEW_REPORT_INTERVAL == 0) client_report_view(terrain, region_frames);
+
         /**
          * Punctually print the average frame time
          */
@@ -72,7 +121,15 @@ void client_start(void) {
         count++;
         if (accum / UCLOCKS_PER_SECONDS >= 1) {
             float frame_time = (accum / (float) count / UCLOCKS_PER_SECONDS * 1000.0f);
-            snprintf(win_title, 128, "iVy - %0.2fms - %0.2fFPS - %s %s - %dx%d", frame_time, 1e3/frame_time, gl_vendor_name, gl_renderer_name, render_resolution_x, render_resolution_y);
+            JobMetrics jobs;
+            jobs_get_metrics(&jobs);
+            snprintf(win_title, 192, "iVy - %0.2fms - %0.2fFPS - %s %s - %dx%d - %u jobs", frame_time, 1e3/frame_time, gl_vendor_name, gl_renderer_name, render_resolution_x, render_resolution_y, jobs.queued + jobs.running);
+            if (context_stats_mode) {
+                INFO("%.1f steps per ray (temporal reprojection %s)", render_read_steps_per_ray(), context_reprojection_mode ? "on" : "off");
+                INFO("Server jobs: %u queued, %u running, %lu done. Latency over the last %u jobs: %.2fms average, %.2fms max",
+                     jobs.queued, jobs.running, (unsigned long) jobs.completed, jobs.started, jobs.average_latency_ms,
+                     jobs.max_latency_ms);
+            }
             glfwSetWindowTitle(window, win_title);
             accum = 0;
             count = 0;
@@ -83,11 +140,52 @@ void client_start(void) {
     /**
      * Closing all opened buffers and destroying context since all the GL stuff is above
      */
+    free(region_frames);
     render_terminate();
     context_terminate();
+}
 
-    /**
-     * Freeing the world data
-     */
-    terrain_destroy(&terrain);
+// camera space is y-up while the terrain is z-up, and the camera may be outside of the terrain
+static void client_report_view(const Terrain *terrain, u32 *region_frames) {
+    render_read_recency(region_frames);
+    u32 x = (u32) fmaxf(0, fminf(camera_pos.x, terrain->width - 1));
+    u32 y = (u32) fmaxf(0, fminf(camera_pos.z, terrain->width - 1));
+    server_report_view(x, y, region_frames);
+}
+
+/**
+ * Marching from the camera until the first solid voxel, then sending a whole sphere of edits around it at once.
+ * Removing is centered on the voxel that was hit, placing on the last empty one in front of it. The terrain is only
+ * held during the raycast, the edits are queued once it's released.
+ * Camera space is y-up while the terrain is z-up.
+ */
+static void client_edit(Terrain *terrain, Voxel material) {
+    // the camera is y up, the terrain z up
+    TerrainRayHit hit;
+    vec3 origin = {{camera_pos.x, camera_pos.z, camera_pos.y}};
+    vec3 direction = {{camera_forward.x, camera_forward.z, camera_forward.y}};
+    server_acquire_terrain();
+    bool found = terrain_raycast(terrain, origin, direction, CLIENT_EDIT_REACH, &hit);
+    server_release_terrain();
+    if (!found) return;
+
+    // digging is centered on the voxel hit, building on the one in front of the face the ray went in through
+    i32 center[3];
+    for (u32 axis = 0; axis < 3; axis++) {
+        center[axis] = (i32) hit.voxel.arr[axis] + (material == AIR ? 0 : hit.normal.arr[axis]);
+    }
+    EditCommand edits[(2 * CLIENT_EDIT_RADIUS + 1) * (2 * CLIENT_EDIT_RADIUS + 1) * (2 * CLIENT_EDIT_RADIUS + 1)];
+    u32 count = 0;
+    for (i32 dx = -CLIENT_EDIT_RADIUS; dx <= CLIENT_EDIT_RADIUS; dx++) {
+        for (i32 dy = -CLIENT_EDIT_RADIUS; dy <= CLIENT_EDIT_RADIUS; dy++) {
+            for (i32 dz = -CLIENT_EDIT_RADIUS; dz <= CLIENT_EDIT_RADIUS; dz++) {
+                if (dx * dx + dy * dy + dz * dz > CLIENT_EDIT_RADIUS * CLIENT_EDIT_RADIUS) continue;
+                i32 x = center[0] + dx, y = center[1] + dy, z = center[2] + dz;
+                if (x < 0 || y < 0 || z < 0) continue;
+                edits[count++] = (EditCommand) {.x=x, .y=y, .z=z, .material=material};
+            }
+        }
+    }
+    u32 submitted = server_submit_edits(edits, count);
+    if (submitted < count) WARN("Edit queue is full, dropped %u of %u edits.", count - submitted, count);
 }
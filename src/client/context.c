@@ -1,11 +1,16 @@
 #include "context.h"
 #include "client.h"
 #include "common/log.h"
+#include "common/materials.h"
 #include "gllib.h"
 #include <string.h>
 
 int win_x, win_y;
-bool context_heat_map_mode, context_depth_map_mode, context_is_fullscreen, context_imgui_enabled, context_sticky_win;
+bool context_heat_map_mode, context_depth_map_mode, context_is_fullscreen, context_imgui_enabled, context_sticky_win,
+     context_reprojection_mode = true, context_stats_mode,
+     context_pyramid_mode, context_bounds_mode = true, context_collision_mode = true, context_benchmark_requested,
+     context_edit_requested;
+uint8_t context_edit_material;
 
 static int prev_win_width = CLIENT_WIN_WIDTH, prev_win_height = CLIENT_WIN_HEIGHT;
 static GLFWwindow *window = NULL;
@@ -129,6 +134,30 @@ static void key_callback(GLFWwindow *_window, int key, int scancode, int action,
                 context_imgui_enabled = !context_imgui_enabled;
                 INFO(context_imgui_enabled ? "Enabling Imgui" : "Disabling Imgui");
                 break;
+            case GLFW_KEY_F4:
+                context_reprojection_mode = !context_reprojection_mode;
+                INFO(context_reprojection_mode ? "Enabling temporal reprojection" : "Disabling temporal reprojection");
+                break;
+            case GLFW_KEY_F5:
+                context_stats_mode = !context_stats_mode;
+                INFO(context_stats_mode ? "Enabling traversal stats" : "Disabling traversal stats");
+                break;
+            case GLFW_KEY_F6:
+                context_pyramid_mode = !context_pyramid_mode;
+                INFO(context_pyramid_mode ? "Enabling heightmap pyramid traversal" : "Disabling heightmap pyramid traversal");
+                break;
+            case GLFW_KEY_F7:
+                context_benchmark_requested = true;
+                INFO("Benchmarking traversal modes");
+                break;
+            case GLFW_KEY_F8:
+                context_bounds_mode = !context_bounds_mode;
+                INFO(context_bounds_mode ? "Enabling node bounds clipping" : "Disabling node bounds clipping");
+                break;
+            case GLFW_KEY_F9:
+                context_collision_mode = !context_collision_mode;
+                INFO(context_collision_mode ? "Enabling camera collisions" : "Disabling camera collisions");
+                break;
             case GLFW_KEY_F11:
                 context_is_fullscreen = !context_is_fullscreen;
                 context_set_fullscreen(context_is_fullscreen);
@@ -155,6 +184,14 @@ static void mouse_button_callback(GLFWwindow *_window, int button, int action, i
                     glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
                 }
                 break;
+            case GLFW_MOUSE_BUTTON_RIGHT:
+                context_edit_requested = true;
+                context_edit_material = AIR;
+                break;
+            case GLFW_MOUSE_BUTTON_MIDDLE:
+                context_edit_requested = true;
+                context_edit_material = STONE;
+                break;
             default:
                 break;
         }
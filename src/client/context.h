@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "glad/glad.h"
 #include "GLFW/glfw3.h"
 
@@ -12,7 +13,17 @@ extern bool context_heat_map_mode,
             context_depth_map_mode,
             context_is_fullscreen,
             context_imgui_enabled,
-            context_sticky_win;
+            context_sticky_win,
+            context_reprojection_mode,
+            context_stats_mode,
+            context_pyramid_mode,
+            context_bounds_mode,
+            context_collision_mode,
+            context_benchmark_requested,
+            context_edit_requested;
+
+// material of the requested edit, AIR for digging
+extern uint8_t context_edit_material;
 
 GLFWwindow *context_init(void);
 void context_terminate(void);
\ No newline at end of file
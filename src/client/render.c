@@ -2,19 +2,62 @@
 #include "cpmath.h"
 #include "common/terrain.h"
 #include "client/camera.h"
+#include "client/context.h"
 #include "gllib.h"
 #include "stb_include.h"
 
+// pool buffers are allocated ahead of the pools, and grow 2x at a time, so that new slots are only uploaded once
 static u32 terrainChunkPoolSSBO;
 static u32 currentChunkBufferSize = 0;
 
 static u32 terrainNodePoolSSBO;
 static u32 currentNodeBufferSize = 0;
 
+static u32 terrainFarPoolSSBO;
+static u32 currentFarBufferSize = 0;
+
+// nodes past the boundsCount first ones have no bounds uploaded, the tracer doesn't clip rays to them
+static u32 terrainBoundsPoolSSBO;
+static u32 currentBoundsBufferSize = 0;
+static u32 boundsCount = 0;
+
+static u32 terrainSkylightSSBO;
+
+static u32 terrainHeightPyramidSSBO;
+static u32 heightPyramidOffsets[16];
+
+// the root the uploaded pools were last consistent with, which may lag behind the live one
+static u32 terrainRootNode = 0;
+
+// GPU timing of the tracer dispatch, only used while benchmarking since reading it back stalls the pipeline
+static u32 tracerTimerQuery;
+static bool benchmarking = false;
+static u64 benchmarkTracerTime = 0;
+
 static u32 svo_tracer_shader;
 static u32 svo_framebuffer;
 static Texture *svoTexture = 0;
 
+// temporal reprojection. Hit distances are ping-ponged between two textures, the previous one being splat into the
+// current frame before tracing
+#define NO_REPROJECTION (0xffffffffu)
+static u32 reproject_shader;
+static Texture *hitDistanceTextures[2] = {0};
+static Texture *reprojectedDistanceTexture = 0;
+static u32 currentHitDistanceTexture = 0;
+static bool hasPreviousFrame = false;
+static mat4 previous_view_matrix, previous_projection_matrix;
+static vec3 previous_camera_pos;
+
+// {total steps, total rays}, accumulated by the tracer until read back
+static u32 traversalStatsSSBO;
+
+// the last frame each cell of recencyCellWidth columns was hit in, 0 if never, for the server to know what is in view.
+// Frames are counted from 1, and recencyWidth is 0 until render_track_recency.
+static u32 recencySSBO;
+static u32 recencyCellWidth = 0, recencyWidth = 0;
+static u32 frameIndex = 0;
+
 int render_resolution_x;
 int render_resolution_y;
 
@@ -23,9 +66,19 @@ static void render_framebuffer_size_callback(GLFWwindow *_window, int width, int
 void render_init(GLFWwindow *window) {
     glCreateBuffers(1, &terrainChunkPoolSSBO);
     glCreateBuffers(1, &terrainNodePoolSSBO);
+    glCreateBuffers(1, &terrainFarPoolSSBO);
+    glCreateBuffers(1, &terrainBoundsPoolSSBO);
+    glCreateBuffers(1, &terrainSkylightSSBO);
+    glCreateBuffers(1, &terrainHeightPyramidSSBO);
+    glCreateQueries(GL_TIME_ELAPSED, 1, &tracerTimerQuery);
     glCreateFramebuffers(1, &svo_framebuffer);
+    glCreateBuffers(1, &traversalStatsSSBO);
+    glNamedBufferData(traversalStatsSSBO, 2 * sizeof(u32), (u32[2]) {0, 0}, GL_DYNAMIC_READ);
+    glCreateBuffers(1, &recencySSBO);
+    glNamedBufferData(recencySSBO, sizeof(u32), (u32[1]) {0}, GL_DYNAMIC_READ);
 
     svo_tracer_shader = gllib_makeCompute("resources/shaders/compute/svo_tracer.glsl");
+    reproject_shader = gllib_makeCompute("resources/shaders/compute/reproject.glsl");
 
     glfwSetFramebufferSizeCallback(window, render_framebuffer_size_callback);
     glfwGetWindowSize(window, &render_resolution_x, &render_resolution_y);
@@ -35,9 +88,175 @@ void render_init(GLFWwindow *window) {
 void render_terminate(void) {
     glDeleteBuffers(1, &terrainChunkPoolSSBO);
     glDeleteBuffers(1, &terrainNodePoolSSBO);
+    glDeleteBuffers(1, &terrainFarPoolSSBO);
+    glDeleteBuffers(1, &terrainBoundsPoolSSBO);
+    glDeleteBuffers(1, &terrainSkylightSSBO);
+    glDeleteBuffers(1, &terrainHeightPyramidSSBO);
+    glDeleteQueries(1, &tracerTimerQuery);
     glDeleteFramebuffers(1, &svo_framebuffer);
+    glDeleteBuffers(1, &traversalStatsSSBO);
+    glDeleteBuffers(1, &recencySSBO);
 
     glDeleteProgram(svo_tracer_shader);
+    glDeleteProgram(reproject_shader);
+}
+
+float render_read_steps_per_ray(void) {
+    u32 stats[2];
+    glGetNamedBufferSubData(traversalStatsSSBO, 0, sizeof(stats), stats);
+    glNamedBufferSubData(traversalStatsSSBO, 0, sizeof(stats), (u32[2]) {0, 0});
+    return stats[1] ? stats[0] / (float) stats[1] : 0;
+}
+
+void render_track_recency(u32 cell_width, u32 width_cells) {
+    recencyCellWidth = cell_width;
+    recencyWidth = width_cells;
+    glNamedBufferData(recencySSBO, (size_t) width_cells * width_cells * sizeof(u32), NULL, GL_DYNAMIC_READ);
+    glClearNamedBufferData(recencySSBO, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+}
+
+// like the stats, reading it back stalls until the last frame is traced, which is why it's only done once in a while
+void render_read_recency(u32 *frames) {
+    glGetNamedBufferSubData(recencySSBO, 0, (size_t) recencyWidth * recencyWidth * sizeof(u32), frames);
+}
+
+// (re)allocates the buffer if the pool outgrew it, in which case the whole pool is uploaded. Returns true if it was.
+static bool render_reserve_pool(u32 buffer, u32 *buffer_size, const PoolAllocator *pool, u32 slots) {
+    if (slots <= *buffer_size) return false;
+    while (*buffer_size < slots) *buffer_size = *buffer_size ? *buffer_size * 2 : 1024;
+    glNamedBufferData(buffer, (size_t) *buffer_size * pool->unitSize, NULL, GL_DYNAMIC_DRAW);
+    // the pool may have grown again since slots was read, anything past the buffer comes with a later delta
+    u32 used = min(poolAllocatorUsed(pool), *buffer_size);
+    glNamedBufferSubData(buffer, 0, (size_t) used * pool->unitSize, poolAllocatorGet(pool, 0));
+    return true;
+}
+
+static void render_upload_pool_range(u32 buffer, u32 *buffer_size, const PoolAllocator *pool, u32 first, u32 count) {
+    if (render_reserve_pool(buffer, buffer_size, pool, first + count)) return;
+    glNamedBufferSubData(buffer, (size_t) first * pool->unitSize, (size_t) count * pool->unitSize,
+                         poolAllocatorGet(pool, first));
+}
+
+/**
+ * Bounds change along with their node, so they come with node deltas. Slots the bounds pool grew by since the last
+ * upload are sent along with the first delta past them, they were never written otherwise.
+ */
+static void render_upload_bounds(const Terrain *terrain, u32 first, u32 count) {
+    const PoolAllocator *pool = &terrain->boundsPool;
+    if (!pool->memory) return;
+    u32 end = min(first + count, poolAllocatorUsed(pool));
+    if (end <= first) return;
+    first = min(first, boundsCount);
+    render_upload_pool_range(terrainBoundsPoolSSBO, &currentBoundsBufferSize, pool, first, end - first);
+    boundsCount = max(boundsCount, min(end, currentBoundsBufferSize));
+}
+
+void render_update_terrain(const Terrain *terrain, const TerrainDelta *deltas, u32 count) {
+    // Last frame's hit distances are meaningless if the terrain changed under them
+    if (count) hasPreviousFrame = false;
+
+    for (u32 i = 0; i < count; i++) {
+        const TerrainDelta *delta = &deltas[i];
+        switch (delta->kind) {
+            case TERRAIN_DELTA_ALL: {
+                // Pools are uploaded up to their highest slot ever used, holes included
+                currentChunkBufferSize = currentNodeBufferSize = currentFarBufferSize = currentBoundsBufferSize = 0;
+                terrainRootNode = __atomic_load_n(&terrain->root_node_address, __ATOMIC_ACQUIRE);
+                render_reserve_pool(terrainChunkPoolSSBO, &currentChunkBufferSize, &terrain->chunkPool,
+                                    poolAllocatorUsed(&terrain->chunkPool));
+                render_reserve_pool(terrainNodePoolSSBO, &currentNodeBufferSize, &terrain->nodePool,
+                                    poolAllocatorUsed(&terrain->nodePool));
+
+                // The far pool usually doesn't exist, the tracer still needs something bound there
+                if (terrain->farPool.memory) {
+                    render_reserve_pool(terrainFarPoolSSBO, &currentFarBufferSize, &terrain->farPool,
+                                        poolAllocatorUsed(&terrain->farPool));
+                } else {
+                    glNamedBufferData(terrainFarPoolSSBO, sizeof(Node), NULL, GL_DYNAMIC_DRAW);
+                }
+                boundsCount = 0;
+                glNamedBufferData(terrainBoundsPoolSSBO, sizeof(u32), NULL, GL_DYNAMIC_DRAW);
+                render_upload_bounds(terrain, 0, poolAllocatorUsed(&terrain->nodePool));
+
+                // The skylight map never changes size, it's always one u32 per column
+                glNamedBufferData(terrainSkylightSSBO, (size_t) terrain->width * terrain->width * sizeof(u32),
+                                  terrain->skylight, GL_DYNAMIC_DRAW);
+
+                // Same for the height pyramid, all levels are packed one after the other
+                if (terrain->depth >= 16) FATAL("The height pyramid has more levels than the tracer supports.");
+                for (u32 level = 0; level <= terrain->depth; level++) {
+                    heightPyramidOffsets[level] = terrain_pyramid_offset(terrain, level);
+                }
+                glNamedBufferData(terrainHeightPyramidSSBO,
+                                  terrain_pyramid_offset(terrain, terrain->depth + 1) * sizeof(HeightApprox), NULL,
+                                  GL_DYNAMIC_DRAW);
+                for (u32 level = 0; level <= terrain->depth; level++) {
+                    size_t level_size = (size_t) (terrain->width_chunks >> level) * (terrain->width_chunks >> level);
+                    glNamedBufferSubData(terrainHeightPyramidSSBO, heightPyramidOffsets[level] * sizeof(HeightApprox),
+                                         level_size * sizeof(HeightApprox), terrain->approx_heightmaps[level]);
+                }
+                break;
+            }
+            case TERRAIN_DELTA_NODES:
+                render_upload_pool_range(terrainNodePoolSSBO, &currentNodeBufferSize, &terrain->nodePool,
+                                         delta->first, delta->count);
+                render_upload_bounds(terrain, delta->first, delta->count);
+                break;
+            case TERRAIN_DELTA_CHUNKS:
+                render_upload_pool_range(terrainChunkPoolSSBO, &currentChunkBufferSize, &terrain->chunkPool,
+                                         delta->first, delta->count);
+                break;
+            case TERRAIN_DELTA_FAR:
+                render_upload_pool_range(terrainFarPoolSSBO, &currentFarBufferSize, &terrain->farPool, delta->first,
+                                         delta->count);
+                break;
+            case TERRAIN_DELTA_SKYLIGHT:
+                glNamedBufferSubData(terrainSkylightSSBO, (size_t) delta->first * sizeof(u32),
+                                     (size_t) delta->count * sizeof(u32), terrain->skylight + delta->first);
+                break;
+            case TERRAIN_DELTA_PYRAMID: {
+                // levels are separate arrays on the CPU side, so a range spanning several of them is split
+                u32 level = 0, first = delta->first, end = delta->first + delta->count;
+                while (first < end) {
+                    while (level < terrain->depth && heightPyramidOffsets[level + 1] <= first) level++;
+                    u32 level_end = heightPyramidOffsets[level] + (terrain->width_chunks >> level) * (terrain->width_chunks >> level);
+                    u32 range = min(end, level_end) - first;
+                    glNamedBufferSubData(terrainHeightPyramidSSBO, (size_t) first * sizeof(HeightApprox),
+                                         (size_t) range * sizeof(HeightApprox),
+                                         terrain->approx_heightmaps[level] + (first - heightPyramidOffsets[level]));
+                    first += range;
+                }
+                break;
+            }
+            case TERRAIN_DELTA_ROOT:
+                terrainRootNode = delta->first;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void render_reproject(mat4 view_matrix, mat4 projection_matrix) {
+    // Every pixel starts with "nothing reprojected here", meaning a full trace
+    u32 clear_value = NO_REPROJECTION;
+    glClearTexImage(reprojectedDistanceTexture->handle, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, &clear_value);
+    if (!hasPreviousFrame) return;
+
+    glUseProgram(reproject_shader);
+    gllib_bindTexture(hitDistanceTextures[currentHitDistanceTexture ^ 1], 1, GL_READ_ONLY);
+    gllib_bindTexture(reprojectedDistanceTexture, 2, GL_READ_WRITE);
+
+    glUniform2ui(glGetUniformLocation(reproject_shader, "screenSize"), render_resolution_x, render_resolution_y);
+    glUniform3f(glGetUniformLocation(reproject_shader, "camPos"), camera_pos.x, camera_pos.y, camera_pos.z);
+    glUniformMatrix4fv(glGetUniformLocation(reproject_shader, "viewMat"), 1, GL_FALSE, view_matrix.arr);
+    glUniformMatrix4fv(glGetUniformLocation(reproject_shader, "projMat"), 1, GL_FALSE, projection_matrix.arr);
+    glUniform3f(glGetUniformLocation(reproject_shader, "previousCamPos"), previous_camera_pos.x, previous_camera_pos.y, previous_camera_pos.z);
+    glUniformMatrix4fv(glGetUniformLocation(reproject_shader, "previousViewMat"), 1, GL_FALSE, previous_view_matrix.arr);
+    glUniformMatrix4fv(glGetUniformLocation(reproject_shader, "previousProjMat"), 1, GL_FALSE, previous_projection_matrix.arr);
+
+    glDispatchCompute(ceilf(render_resolution_x / 8.0f), ceilf(render_resolution_y / 8.0f), 1);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
 }
 
 void render_draw_frame(Terrain *terrain) {
@@ -45,27 +264,9 @@ void render_draw_frame(Terrain *terrain) {
     mat4 view_matrix = worldToCamMatrix(camera_pos, camera_forward, (vec3) {0, 1, 0});
     mat4 projection_matrix = perspectiveProjectionMatrix(radians(70.0f), render_resolution_x / (float) render_resolution_y, 0.01, 1000);
 
-    // If the terrain has not been uploaded yet, or if it has been modified
-    if (terrain->dirty) {
-        terrain->dirty = false;
-
-        // (Re)Uploading the SVO
-        // Naive implementation. Must be improved
-        if (terrain->chunkPool.size != currentChunkBufferSize) {
-            glNamedBufferData(terrainChunkPoolSSBO, terrain->chunkPool.size * terrain->chunkPool.unitSize,
-                              terrain->chunkPool.memory, GL_STATIC_COPY);
-        } else {
-            glNamedBufferSubData(terrainChunkPoolSSBO, 0, terrain->chunkPool.size * terrain->chunkPool.unitSize,
-                                 terrain->chunkPool.memory);
-        }
-        if (terrain->nodePool.size != currentNodeBufferSize) {
-            glNamedBufferData(terrainNodePoolSSBO, terrain->nodePool.size * terrain->nodePool.unitSize,
-                              terrain->nodePool.memory, GL_STATIC_COPY);
-        } else {
-            glNamedBufferSubData(terrainNodePoolSSBO, 0, terrain->nodePool.size * terrain->nodePool.unitSize,
-                                 terrain->nodePool.memory);
-        }
-    }
+    // Seeding this frame's rays with last frame's hit distances
+    currentHitDistanceTexture ^= 1;
+    if (context_reprojection_mode) render_reproject(view_matrix, projection_matrix);
 
     // Doing the actual render
     glUseProgram(svo_tracer_shader);
@@ -73,31 +274,99 @@ void render_draw_frame(Terrain *terrain) {
     // Binding the SVO
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, terrainNodePoolSSBO);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, terrainChunkPoolSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, traversalStatsSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, terrainSkylightSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, terrainHeightPyramidSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, terrainFarPoolSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, recencySSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, terrainBoundsPoolSSBO);
 
     // Binding the uniforms
     gllib_bindTexture(svoTexture, 0, GL_WRITE_ONLY);
+    gllib_bindTexture(hitDistanceTextures[currentHitDistanceTexture], 1, GL_WRITE_ONLY);
+    gllib_bindTexture(reprojectedDistanceTexture, 2, GL_READ_ONLY);
 
     glUniform2ui(glGetUniformLocation(svo_tracer_shader, "screenSize"), render_resolution_x, render_resolution_y);
     glUniform3ui(glGetUniformLocation(svo_tracer_shader, "terrainSize"), terrain->width, terrain->width, terrain->width);
     glUniform1ui(glGetUniformLocation(svo_tracer_shader, "treeDepth"), terrain->depth);
+    glUniform1ui(glGetUniformLocation(svo_tracer_shader, "rootNode"), terrainRootNode);
     glUniform3f(glGetUniformLocation(svo_tracer_shader, "camPos"), camera_pos.x, camera_pos.y, camera_pos.z);
     glUniformMatrix4fv(glGetUniformLocation(svo_tracer_shader, "viewMat"), 1, GL_FALSE, view_matrix.arr);
     glUniformMatrix4fv(glGetUniformLocation(svo_tracer_shader, "projMat"), 1, GL_FALSE, projection_matrix.arr);
+    glUniform1i(glGetUniformLocation(svo_tracer_shader, "useReprojection"), context_reprojection_mode);
+    glUniform1i(glGetUniformLocation(svo_tracer_shader, "collectStats"), context_stats_mode);
+    glUniform1i(glGetUniformLocation(svo_tracer_shader, "usePyramid"), context_pyramid_mode);
+    glUniform1ui(glGetUniformLocation(svo_tracer_shader, "boundsCount"), context_bounds_mode ? boundsCount : 0);
+    glUniform1uiv(glGetUniformLocation(svo_tracer_shader, "pyramidOffsets"), 16, heightPyramidOffsets);
+    glUniform1ui(glGetUniformLocation(svo_tracer_shader, "frameIndex"), ++frameIndex);
+    glUniform1ui(glGetUniformLocation(svo_tracer_shader, "recencyCellWidth"), recencyCellWidth);
+    glUniform1ui(glGetUniformLocation(svo_tracer_shader, "recencyWidth"), recencyWidth);
 
     // Dispatching the compute-shader and pushing the result to the framebuffer
+    if (benchmarking) glBeginQuery(GL_TIME_ELAPSED, tracerTimerQuery);
     glDispatchCompute(ceilf(render_resolution_x / 8.0f), ceilf(render_resolution_y / 8.0f), 1);
+    if (benchmarking) {
+        glEndQuery(GL_TIME_ELAPSED);
+        GLuint64 elapsed;
+        glGetQueryObjectui64v(tracerTimerQuery, GL_QUERY_RESULT, &elapsed);
+        benchmarkTracerTime += elapsed;
+    }
     glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
     glBlitNamedFramebuffer(svo_framebuffer, 0,
                            0, 0, render_resolution_x, render_resolution_y,
                            0, 0, render_resolution_x, render_resolution_y,
                            GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+    // Keeping this frame's camera around for the next frame's reprojection
+    previous_view_matrix = view_matrix;
+    previous_projection_matrix = projection_matrix;
+    previous_camera_pos = camera_pos;
+    hasPreviousFrame = true;
+}
+
+/**
+ * Traces the current view a few times with each traversal mode and logs the tracer's GPU time and steps per ray.
+ * Reprojection is disabled meanwhile so that only primary ray traversal is compared.
+ */
+void render_benchmark_traversal(Terrain *terrain) {
+    const char *mode_names[] = {"SVO", "heightmap pyramid + SVO", "SVO with node bounds",
+                                "heightmap pyramid + SVO with node bounds"};
+    const u32 frame_count = 100;
+    bool previous_reprojection_mode = context_reprojection_mode, previous_stats_mode = context_stats_mode;
+    bool previous_pyramid_mode = context_pyramid_mode, previous_bounds_mode = context_bounds_mode;
+
+    context_reprojection_mode = false;
+    context_stats_mode = true;
+    for (u32 mode = 0; mode < 4; mode++) {
+        context_pyramid_mode = mode & 1;
+        context_bounds_mode = mode & 2;
+        render_draw_frame(terrain); // warm-up, and uploads the terrain if needed
+        render_read_steps_per_ray();
+
+        benchmarkTracerTime = 0;
+        benchmarking = true;
+        for (u32 i = 0; i < frame_count; i++) render_draw_frame(terrain);
+        benchmarking = false;
+        INFO("%s traversal: %.3fms per frame, %.1f steps per ray at %dx%d.", mode_names[mode],
+             benchmarkTracerTime / 1e6 / frame_count, render_read_steps_per_ray(), render_resolution_x, render_resolution_y);
+    }
+
+    context_reprojection_mode = previous_reprojection_mode;
+    context_stats_mode = previous_stats_mode;
+    context_pyramid_mode = previous_pyramid_mode;
+    context_bounds_mode = previous_bounds_mode;
 }
 
 static void render_framebuffer_size_callback(GLFWwindow *_window, int width, int height) {
     if (svoTexture) gllib_destroyTexture(svoTexture);
+    if (reprojectedDistanceTexture) gllib_destroyTexture(reprojectedDistanceTexture);
+    for (int i = 0; i < 2; i++) if (hitDistanceTextures[i]) gllib_destroyTexture(hitDistanceTextures[i]);
     glViewport(0, 0, width, height);
     render_resolution_x = max(1, width);
     render_resolution_y = max(1, height);
     svoTexture = gllib_makeDefaultTexture(render_resolution_x, render_resolution_y, GL_RGBA8, GL_NEAREST);
+    reprojectedDistanceTexture = gllib_makeDefaultTexture(render_resolution_x, render_resolution_y, GL_R32UI, GL_NEAREST);
+    for (int i = 0; i < 2; i++) hitDistanceTextures[i] = gllib_makeDefaultTexture(render_resolution_x, render_resolution_y, GL_R32F, GL_NEAREST);
+    hasPreviousFrame = false;
     glNamedFramebufferTexture(svo_framebuffer, GL_COLOR_ATTACHMENT0, svoTexture->handle, 0);
 }
\ No newline at end of file
@@ -8,4 +8,14 @@ extern int render_resolution_x, render_resolution_y;
 
 void render_init(GLFWwindow *window);
 void render_terminate(void);
+void render_update_terrain(const Terrain *terrain, const TerrainDelta *deltas, u32 count);
 void render_draw_frame(Terrain *terrain);
+float render_read_steps_per_ray(void);
+
+/**
+ * The tracer records the last frame each square of cell_width x cell_width columns was hit in. render_read_recency
+ * copies the width_cells**2 frames out, in row order, 0 meaning never.
+ */
+void render_track_recency(u32 cell_width, u32 width_cells);
+void render_read_recency(u32 *frames);
+void render_benchmark_traversal(Terrain *terrain);
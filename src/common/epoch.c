@@ -0,0 +1,143 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "epoch.h"
+#include "log.h"
+
+#define EPOCH_CACHE_LINE (64)
+
+// things retired during epoch e are reclaimed when the epoch moves past e + 2, so three lists are enough
+#define EPOCH_BUCKETS (3)
+
+typedef struct EpochReader {
+    _Alignas(EPOCH_CACHE_LINE) _Atomic(u64) epoch; // 0 when not pinned
+    atomic_bool taken;
+} EpochReader;
+
+typedef struct EpochRetired {
+    EpochReclaim reclaim;
+    void *context;
+    uintptr_t value;
+} EpochRetired;
+
+typedef struct EpochBucket {
+    EpochRetired *items;
+    u32 count, capacity;
+} EpochBucket;
+
+static EpochReader readers[EPOCH_MAX_THREADS];
+static _Atomic(u64) global_epoch = 1;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static EpochBucket buckets[EPOCH_BUCKETS];
+static u64 retired = 0, reclaimed = 0;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static _Thread_local EpochReader *reader = NULL;
+static _Thread_local u32 nesting = 0;
+
+// the slot of a thread is given back when it exits, since server threads come and go
+static void epoch_release_reader(void *data) {
+    EpochReader *slot = data;
+    atomic_store(&slot->epoch, 0);
+    atomic_store(&slot->taken, false);
+}
+
+static void epoch_create_key(void) {
+    if (pthread_key_create(&key, epoch_release_reader)) FATAL("Could not create thread key.");
+}
+
+static EpochReader *epoch_take_reader(void) {
+    pthread_once(&key_once, epoch_create_key);
+    for (u32 i = 0; i < EPOCH_MAX_THREADS; i++) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&readers[i].taken, &expected, true)) {
+            pthread_setspecific(key, &readers[i]);
+            return &readers[i];
+        }
+    }
+    FATAL("More than %d threads are reading epoch-protected data.", EPOCH_MAX_THREADS);
+    return NULL;
+}
+
+/**
+ * The pinned epoch has to be visible before anything protected is read, and the epoch must not have moved in between,
+ * or a collect that didn't see this reader yet could reclaim what it's about to read.
+ */
+void epoch_pin(void) {
+    if (nesting++) return;
+    if (!reader) reader = epoch_take_reader();
+    u64 epoch = atomic_load(&global_epoch);
+    for (;;) {
+        atomic_store(&reader->epoch, epoch);
+        u64 now = atomic_load(&global_epoch);
+        if (now == epoch) break;
+        epoch = now;
+    }
+}
+
+void epoch_unpin(void) {
+    if (!nesting) FATAL("Unpinning an epoch that was never pinned!");
+    if (--nesting) return;
+    atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+}
+
+void epoch_retire(EpochReclaim reclaim, void *context, uintptr_t value) {
+    pthread_mutex_lock(&mutex);
+    EpochBucket *bucket = &buckets[atomic_load(&global_epoch) % EPOCH_BUCKETS];
+    if (bucket->count == bucket->capacity) {
+        bucket->capacity = bucket->capacity ? bucket->capacity * 2 : 64;
+        bucket->items = realloc(bucket->items, bucket->capacity * sizeof(EpochRetired));
+        if (!bucket->items) FATAL("Out of memory.");
+    }
+    bucket->items[bucket->count++] = (EpochRetired) {.reclaim=reclaim, .context=context, .value=value};
+    retired++;
+    pthread_mutex_unlock(&mutex);
+}
+
+static u32 epoch_reclaim_bucket(EpochBucket *bucket) {
+    u32 count = bucket->count;
+    for (u32 i = 0; i < count; i++) bucket->items[i].reclaim(bucket->items[i].context, bucket->items[i].value);
+    bucket->count = 0;
+    reclaimed += count;
+    return count;
+}
+
+u32 epoch_collect(void) {
+    pthread_mutex_lock(&mutex);
+    u64 epoch = atomic_load(&global_epoch);
+    for (u32 i = 0; i < EPOCH_MAX_THREADS; i++) {
+        u64 pinned = atomic_load(&readers[i].epoch);
+        if (pinned && pinned != epoch) { // somebody is still on the previous epoch
+            pthread_mutex_unlock(&mutex);
+            return 0;
+        }
+    }
+
+    // every reader is on epoch or later, so nothing retired during epoch - 2 is reachable anymore
+    atomic_store(&global_epoch, epoch + 1);
+    u32 count = epoch_reclaim_bucket(&buckets[(epoch + 1) % EPOCH_BUCKETS]);
+    pthread_mutex_unlock(&mutex);
+    return count;
+}
+
+void epoch_reclaim_all(void) {
+    pthread_mutex_lock(&mutex);
+    for (u32 i = 0; i < EPOCH_MAX_THREADS; i++) {
+        if (atomic_load(&readers[i].epoch)) WARN("Reclaiming everything while a reader is still pinned!");
+    }
+    for (u32 i = 0; i < EPOCH_BUCKETS; i++) {
+        epoch_reclaim_bucket(&buckets[i]);
+        free(buckets[i].items);
+        buckets[i] = (EpochBucket) {0};
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+void epoch_get_stats(EpochStats *stats) {
+    pthread_mutex_lock(&mutex);
+    *stats = (EpochStats) {.epoch=atomic_load(&global_epoch), .retired=retired, .reclaimed=reclaimed,
+            .pending=(u32) (retired - reclaimed)};
+    pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include "cpmath.h"
+
+/**
+ * Epoch-based reclamation, so that readers can walk a structure while a writer changes it, without taking any lock.
+ * Readers pin the current epoch for the time of a read. A writer that unlinks memory a reader could still be using
+ * retires it rather than freeing it, and it is only reclaimed once every pinned reader has moved past the epoch it
+ * was retired in. The global epoch only advances when every pinned reader is on it, so anything retired two epochs ago
+ * can't be reachable anymore.
+ */
+#define EPOCH_MAX_THREADS (64)
+
+typedef void (*EpochReclaim)(void *context, uintptr_t value);
+
+typedef struct EpochStats {
+    u64 epoch;
+    u64 retired;
+    u64 reclaimed;
+    u32 pending;
+} EpochStats;
+
+// pins can nest, only the outermost pair matters. Every thread that ever pins takes one of EPOCH_MAX_THREADS slots.
+void epoch_pin(void);
+void epoch_unpin(void);
+
+// reclaim(context, value) will be called from a later epoch_collect, once no reader can still see the value
+void epoch_retire(EpochReclaim reclaim, void *context, uintptr_t value);
+
+// tries to advance the epoch and reclaims what became unreachable, returns how many retirements were reclaimed
+u32 epoch_collect(void);
+
+// reclaims everything at once, only once no reader is left
+void epoch_reclaim_all(void);
+
+void epoch_get_stats(EpochStats *stats);
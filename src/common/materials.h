@@ -8,4 +8,16 @@
 #define LOG     (0b00000101)
 #define LEAVES  (0b00000110)
 #define SHORT_GRASS  (0b00000111)
-#define FLOWER  (0b00001000)
\ No newline at end of file
+#define FLOWER  (0b00001000)
+#define LAMP    (0b00001001)
+#define SAND    (0b00001010)
+#define WATER   (0b00001011)
+
+// Whether a material blocks light, used by the skylight map
+#define MATERIAL_IS_OPAQUE(material) ((material) != UNKNOWN && (material) != AIR && (material) != SHORT_GRASS && (material) != FLOWER)
+
+// Level of block light a material emits, 0 for most of them (see terrain_light.h)
+#define MATERIAL_LIGHT(material) ((material) == LAMP ? 15 : 0)
+
+// Whether a material falls and flows, moved by the automaton (see terrain_automaton.h)
+#define MATERIAL_IS_LOOSE(material) ((material) == SAND || (material) == WATER)
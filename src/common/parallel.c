@@ -0,0 +1,80 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "parallel.h"
+#include "log.h"
+
+/**
+ * Workers wait for the generation to change, then take part in the run if their index is below its thread count.
+ * The caller waits for every one of them to be done before the next run can change anything.
+ */
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER; // held for the whole of a run
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t started = PTHREAD_COND_INITIALIZER, finished = PTHREAD_COND_INITIALIZER;
+static u32 worker_count = 1; // the caller is always worker 0
+static u64 generation;
+static ParallelWork run_work;
+static void *run_data;
+static u32 run_thread_count, pending;
+static _Thread_local bool is_worker;
+
+static void *parallel_worker(void *arg) {
+    u32 worker = (u32) (uintptr_t) arg;
+    u64 seen = 0;
+    is_worker = true;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (generation == seen) pthread_cond_wait(&started, &lock);
+        seen = generation;
+        if (worker >= run_thread_count) continue;
+        ParallelWork work = run_work;
+        void *data = run_data;
+        pthread_mutex_unlock(&lock);
+        work(data, worker);
+        pthread_mutex_lock(&lock);
+        if (!--pending) pthread_cond_signal(&finished);
+    }
+    return NULL;
+}
+
+u32 parallel_thread_count(u64 items, u64 grain, u32 max_threads) {
+    u64 wanted = items / (grain ? grain : 1);
+    u32 thread_count = (u32) (wanted < max_threads ? wanted : max_threads);
+    thread_count = max(1, min(thread_count, PARALLEL_MAX_THREADS));
+    // sysconf reads it from /sys, work too small to be split doesn't have to pay for that
+    if (thread_count > 1) thread_count = max(1, min(thread_count, (u32) sysconf(_SC_NPROCESSORS_ONLN)));
+    return thread_count;
+}
+
+void parallel_run(ParallelWork work, void *data, u32 thread_count) {
+    thread_count = max(1, min(thread_count, PARALLEL_MAX_THREADS));
+    if (thread_count == 1 || is_worker || pthread_mutex_trylock(&run_lock)) {
+        for (u32 worker = 0; worker < thread_count; worker++) work(data, worker);
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    for (; worker_count < thread_count; worker_count++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, parallel_worker, (void *) (uintptr_t) worker_count)) {
+            FATAL("Could not create thread.");
+        }
+        pthread_detach(thread);
+    }
+    run_work = work;
+    run_data = data;
+    run_thread_count = thread_count;
+    pending = thread_count - 1;
+    generation++;
+    pthread_cond_broadcast(&started);
+    pthread_mutex_unlock(&lock);
+
+    work(data, 0);
+
+    pthread_mutex_lock(&lock);
+    while (pending) pthread_cond_wait(&finished, &lock);
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&run_lock);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "cpmath.h"
+
+/**
+ * Fork-join over a pool of threads, started the first time they are needed and then kept for the whole process, so
+ * that short batches run many times in a row don't pay for creating threads each time. The calling thread takes part
+ * as worker 0.
+ * Runs don't nest: a run started from a worker, or while another thread runs one, is done on the calling thread alone,
+ * calling the work of every worker in turn. Work has to be correct that way too, which it is as long as workers don't
+ * wait on each other.
+ * Pool threads are never joined, a worker that pins an epoch keeps one of the EPOCH_MAX_THREADS slots for good.
+ */
+#define PARALLEL_MAX_THREADS (16)
+
+typedef void (*ParallelWork)(void *data, u32 worker);
+
+// threads worth using for that many items, at least grain of them each, no more than max_threads nor the cores
+u32 parallel_thread_count(u64 items, u64 grain, u32 max_threads);
+
+// calls work(data, worker) for every worker below thread_count, and returns once they all returned
+void parallel_run(ParallelWork work, void *data, u32 thread_count);
@@ -2,6 +2,7 @@
 #define SIMPLEVOXELTRACER_POOL_ALLOCATOR_H
 
 //#include "cplog.h"
+#include <stdlib.h>
 #include "log.h"
 #include "memory.h"
 typedef struct PoolAllocator
@@ -15,6 +16,20 @@ typedef struct PoolAllocator
     u32 size;
     bool ownsMemory;
 
+    // when set, the old memory is handed to it on growth instead of being freed, for concurrent readers to finish
+    void (*retireMemory)(void* memory);
+
+    // when set, pools that don't own their memory grow by having it resized, what it held kept. It may move, so
+    // nothing may read the pool while it grows.
+    void* (*resizeMemory)(void* context, void* memory, size_t bytes);
+    void* resizeContext;
+
+    // bitmap pools (see poolAllocatorCreateBitmap) track live slots with a bit each instead of the free list. Every word
+    // before firstFreeWord is full, and the bitmap only covers the slots handed out so far.
+    u64* occupancy;
+    u32 occupancyWords;
+    u32 firstFreeWord;
+
 } __attribute__((aligned(32))) PoolAllocator;
 
 static INLINE void poolAllocatorFreeAll(PoolAllocator* poolAllocator)
@@ -22,49 +37,107 @@ static INLINE void poolAllocatorFreeAll(PoolAllocator* poolAllocator)
     poolAllocator->size = 0;
     poolAllocator->unused = poolAllocator->maxSize;
     poolAllocator->nextFree = NULL;
+    if (poolAllocator->occupancy)
+        memset(poolAllocator->occupancy, 0, (size_t) poolAllocator->occupancyWords * sizeof(u64));
+    poolAllocator->firstFreeWord = 0;
 }
 
 static INLINE void poolAllocatorDestroy(PoolAllocator* poolAllocator)
 {
     if (poolAllocator->ownsMemory)
         _mm_free(poolAllocator->memory);
+    free(poolAllocator->occupancy);
+    poolAllocator->occupancy = NULL;
     poolAllocator->maxSize = 0;
 }
 
+// resize by 2x, up to every index a u32 can hold. Pools that don't own their memory can only grow with resizeMemory.
+static bool poolAllocatorGrow(PoolAllocator* poolAllocator)
+{
+    if (!poolAllocator->ownsMemory && !poolAllocator->resizeMemory) return false;
+    if(poolAllocator->maxSize==UINT32_MAX) FATAL("Reached max pool size!");
+    // the new memory is published before the new size, see poolAllocatorUsed
+    u32 old_size = poolAllocator->maxSize;
+    u32 new_size = old_size > UINT32_MAX / 2 ? UINT32_MAX : old_size * 2;
+    void* oldMemory = poolAllocator->memory;
+    if (!poolAllocator->ownsMemory)
+    {
+        void* resized = poolAllocator->resizeMemory(poolAllocator->resizeContext, oldMemory,
+                                                    (size_t)new_size * poolAllocator->unitSize);
+        __atomic_store_n(&poolAllocator->memory, resized, __ATOMIC_RELEASE);
+        __atomic_store_n(&poolAllocator->maxSize, new_size, __ATOMIC_RELEASE);
+        __atomic_store_n(&poolAllocator->unused, poolAllocator->unused + new_size - old_size, __ATOMIC_RELEASE);
+        return true;
+    }
+    void* newMemory = _mm_malloc((size_t)new_size * poolAllocator->unitSize, 64);
+    if(!newMemory) FATAL("Out of memory.");
+    memcpy(newMemory, oldMemory, (size_t)old_size * poolAllocator->unitSize);
+    __atomic_store_n(&poolAllocator->memory, newMemory, __ATOMIC_RELEASE);
+    __atomic_store_n(&poolAllocator->maxSize, new_size, __ATOMIC_RELEASE);
+    __atomic_store_n(&poolAllocator->unused, poolAllocator->unused + new_size - old_size, __ATOMIC_RELEASE);
+    if (poolAllocator->retireMemory) poolAllocator->retireMemory(oldMemory);
+    else _mm_free(oldMemory);
+    return true;
+}
+
+// lowest free slot of a bitmap pool, which is the first slot never handed out when there's no hole below it
+static u32 poolAllocatorLowestFree(PoolAllocator* poolAllocator)
+{
+    u32 used = poolAllocator->maxSize - poolAllocator->unused;
+    u32 words = (u32) (((u64) used + 63) / 64);
+    u32 word = poolAllocator->firstFreeWord;
+    while (word < words && poolAllocator->occupancy[word] == ~0ull) word++;
+    poolAllocator->firstFreeWord = word;
+    if (word == words) return used;
+    u32 index = word * 64 + (u32) __builtin_ctzll(~poolAllocator->occupancy[word]);
+    return index < used ? index : used;
+}
+
+static void* poolAllocatorAllocLowestPtr(PoolAllocator* poolAllocator)
+{
+    u32 index = poolAllocatorLowestFree(poolAllocator);
+    if (index == poolAllocator->maxSize - poolAllocator->unused)
+    {
+        if (!poolAllocator->unused && !poolAllocatorGrow(poolAllocator))
+        {
+            ERROR("Pool Allocator is full!");
+            return NULL;
+        }
+        if (index / 64 >= poolAllocator->occupancyWords)
+        {
+            u32 words = poolAllocator->occupancyWords;
+            while (words <= index / 64) words *= 2;
+            poolAllocator->occupancy = (u64*) realloc(poolAllocator->occupancy, (size_t) words * sizeof(u64));
+            if (!poolAllocator->occupancy) FATAL("Out of memory.");
+            memset(poolAllocator->occupancy + poolAllocator->occupancyWords, 0,
+                   (size_t) (words - poolAllocator->occupancyWords) * sizeof(u64));
+            poolAllocator->occupancyWords = words;
+        }
+        __atomic_store_n(&poolAllocator->unused, poolAllocator->unused - 1, __ATOMIC_RELEASE);
+    }
+    poolAllocator->occupancy[index / 64] |= 1ull << (index % 64);
+    poolAllocator->size++;
+    return (void*) (((uintptr_t) poolAllocator->memory) + (size_t) index * poolAllocator->unitSize);
+}
+
 static void* poolAllocatorAllocPtr(PoolAllocator* poolAllocator)
 {
     void* ptr;
-        if (poolAllocator->nextFree != NULL)
+        if (poolAllocator->occupancy)
+        {
+            return poolAllocatorAllocLowestPtr(poolAllocator);
+        } else if (poolAllocator->nextFree != NULL)
         {
             ptr = poolAllocator->nextFree;
             poolAllocator->nextFree = (void*) *((uintptr_t*) poolAllocator->nextFree);
-        } else if (poolAllocator->unused > 0)
+        } else if (poolAllocator->unused > 0 || poolAllocatorGrow(poolAllocator))
         {
-            ptr = (void*) (((uintptr_t) poolAllocator->memory) + (poolAllocator->maxSize - poolAllocator->unused) * poolAllocator->unitSize);
-            poolAllocator->unused--;
+            ptr = (void*) (((uintptr_t) poolAllocator->memory) + (size_t) (poolAllocator->maxSize - poolAllocator->unused) * poolAllocator->unitSize);
+            __atomic_store_n(&poolAllocator->unused, poolAllocator->unused - 1, __ATOMIC_RELEASE);
         } else // allocator is full
         {
-            if (poolAllocator->ownsMemory)
-            {
-                // resize by 2x
-                if(poolAllocator->maxSize>UINT32_MAX/2) FATAL("Reached max pool size!");
-                u32 old_size = poolAllocator->maxSize;
-                poolAllocator->unused += poolAllocator->maxSize;
-                poolAllocator->maxSize *= 2;
-                void* oldMemory = poolAllocator->memory;
-                poolAllocator->memory = _mm_malloc((size_t)poolAllocator->maxSize * poolAllocator->unitSize, 64);
-                if(!poolAllocator->memory) FATAL("Out of memory.");
-                memcpy(poolAllocator->memory, oldMemory, poolAllocator->maxSize / 2 * poolAllocator->unitSize);
-                _mm_free(oldMemory);
-
-                ptr = (void*) (((uintptr_t) poolAllocator->memory) + (poolAllocator->maxSize - poolAllocator->unused) * poolAllocator->unitSize);
-                poolAllocator->unused--;
-            }
-            else
-            {
-                ERROR("Pool Allocator is full!");
-                return NULL;
-            }
+            ERROR("Pool Allocator is full!");
+            return NULL;
         }
 
         poolAllocator->size++;
@@ -77,8 +150,17 @@ static INLINE u32 poolAllocatorAlloc(PoolAllocator* poolAllocator)
     return ptr == NULL ? 0 : (((uintptr_t) ptr) - ((uintptr_t) poolAllocator->memory)) / poolAllocator->unitSize;
 }
 
+// bitmap pools leave the slot as it was, the free list keeps its link in it
 static INLINE void poolAllocatorDeallocPtr(PoolAllocator* poolAllocator, void* ptr)
 {
+    if (poolAllocator->occupancy)
+    {
+        u32 index = (u32) ((((uintptr_t) ptr) - ((uintptr_t) poolAllocator->memory)) / poolAllocator->unitSize);
+        poolAllocator->occupancy[index / 64] &= ~(1ull << (index % 64));
+        if (index / 64 < poolAllocator->firstFreeWord) poolAllocator->firstFreeWord = index / 64;
+        poolAllocator->size--;
+        return;
+    }
     void** tmp = (void**) ptr;
     *tmp = poolAllocator->nextFree;
     poolAllocator->nextFree = ptr;
@@ -87,12 +169,77 @@ static INLINE void poolAllocatorDeallocPtr(PoolAllocator* poolAllocator, void* p
 
 static INLINE void poolAllocatorDealloc(PoolAllocator* poolAllocator, u32 idx)
 {
-    poolAllocatorDeallocPtr(poolAllocator, (void*) (((uintptr_t) poolAllocator->memory) + idx * poolAllocator->unitSize));
+    poolAllocatorDeallocPtr(poolAllocator, (void*) (((uintptr_t) poolAllocator->memory) + (size_t) idx * poolAllocator->unitSize));
 }
 
+// safe to call from a reader while another thread allocates, as long as the old memory is retired rather than freed
 static INLINE void* poolAllocatorGet(const PoolAllocator* poolAllocator, u32 idx)
 {
-    return (void*) (((uintptr_t) poolAllocator->memory) + idx * poolAllocator->unitSize);
+    return (void*) (((uintptr_t) __atomic_load_n(&poolAllocator->memory, __ATOMIC_ACQUIRE)) + (size_t) idx * poolAllocator->unitSize);
+}
+
+// number of slots ever handed out. Unused is read first: whatever maxSize is seen next, the result fits in the memory
+// read after it
+static INLINE u32 poolAllocatorUsed(const PoolAllocator* poolAllocator)
+{
+    u32 unused = __atomic_load_n(&poolAllocator->unused, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&poolAllocator->maxSize, __ATOMIC_ACQUIRE) - unused;
+}
+
+// hands out every slot below count at once, for free list pools that are used as growable arrays and never
+// deallocated from
+static INLINE void poolAllocatorReserve(PoolAllocator* poolAllocator, u32 count)
+{
+    while (poolAllocatorUsed(poolAllocator) < count)
+    {
+        u32 missing = count - poolAllocatorUsed(poolAllocator);
+        if (poolAllocator->unused > 0)
+        {
+            u32 taken = missing < poolAllocator->unused ? missing : poolAllocator->unused;
+            poolAllocator->size += taken;
+            __atomic_store_n(&poolAllocator->unused, poolAllocator->unused - taken, __ATOMIC_RELEASE);
+        }
+        else poolAllocatorAllocPtr(poolAllocator); // grows it
+    }
+}
+
+// gives back the memory past the highest slot ever handed out, keeping a power of two of at least minCount slots.
+// Free slots would keep pointing into the old memory, so it's only done with an empty free list, and no reader.
+static INLINE void poolAllocatorShrink(PoolAllocator* poolAllocator, u32 minCount)
+{
+    u32 used = poolAllocatorUsed(poolAllocator);
+    u32 new_size = minCount;
+    while (new_size < used) new_size = new_size > UINT32_MAX / 2 ? UINT32_MAX : new_size * 2;
+    if (!poolAllocator->ownsMemory || poolAllocator->nextFree || new_size >= poolAllocator->maxSize) return;
+    void* oldMemory = poolAllocator->memory;
+    void* newMemory = _mm_malloc((size_t)new_size * poolAllocator->unitSize, 64);
+    if(!newMemory) FATAL("Out of memory.");
+    memcpy(newMemory, oldMemory, (size_t)used * poolAllocator->unitSize);
+    poolAllocator->memory = newMemory;
+    poolAllocator->maxSize = new_size;
+    poolAllocator->unused = new_size - used;
+    if (poolAllocator->retireMemory) poolAllocator->retireMemory(oldMemory);
+    else _mm_free(oldMemory);
+}
+
+// whether a slot of a bitmap pool is allocated
+static INLINE bool poolAllocatorIsLive(const PoolAllocator* poolAllocator, u32 idx)
+{
+    return idx / 64 < poolAllocator->occupancyWords && (poolAllocator->occupancy[idx / 64] >> (idx % 64) & 1);
+}
+
+// first allocated slot of a bitmap pool at or after idx, or poolAllocatorUsed if there's none. Live slots are visited
+// in order with: for (u32 i = poolAllocatorNextLive(pool, 0); i < poolAllocatorUsed(pool); i = poolAllocatorNextLive(pool, i + 1))
+static INLINE u32 poolAllocatorNextLive(const PoolAllocator* poolAllocator, u32 idx)
+{
+    u32 used = poolAllocatorUsed(poolAllocator);
+    while (idx < used)
+    {
+        u64 word = poolAllocator->occupancy[idx / 64] >> (idx % 64);
+        if (word) return idx + (u32) __builtin_ctzll(word) < used ? idx + (u32) __builtin_ctzll(word) : used;
+        idx = (idx / 64 + 1) * 64;
+    }
+    return used;
 }
 
 // creates memory internally if memory = NULL
@@ -100,6 +247,11 @@ static void poolAllocatorCreate(PoolAllocator* allocator, u32 maxCount, u32 item
 {
     allocator->maxSize = maxCount;
     allocator->unitSize = itemByteSize;
+    allocator->retireMemory = NULL;
+    allocator->resizeMemory = NULL;
+    allocator->resizeContext = NULL;
+    allocator->occupancy = NULL;
+    allocator->occupancyWords = 0;
 
     if (memory != NULL)
     {
@@ -116,4 +268,13 @@ static void poolAllocatorCreate(PoolAllocator* allocator, u32 maxCount, u32 item
     poolAllocatorFreeAll(allocator);
 }
 
+// same, but slots are handed out lowest first and live ones can be iterated over, see PoolAllocator.occupancy
+static void poolAllocatorCreateBitmap(PoolAllocator* allocator, u32 maxCount, u32 itemByteSize, void* memory)
+{
+    poolAllocatorCreate(allocator, maxCount, itemByteSize, memory);
+    allocator->occupancyWords = 16;
+    allocator->occupancy = (u64*) calloc(allocator->occupancyWords, sizeof(u64));
+    if (!allocator->occupancy) FATAL("Out of memory.");
+}
+
 #endif //SIMPLEVOXELTRACER_POOL_ALLOCATOR_H
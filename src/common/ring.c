@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+#include "log.h"
+
+typedef struct RingSlot {
+    _Atomic(u64) sequence;
+    u8 data[];
+} RingSlot;
+
+static inline RingSlot *ring_slot(const Ring *ring, u64 position) {
+    // slots are cache line aligned, whatever the alignment of the byte pointer says
+    return (RingSlot *) (void *) (ring->slots + (position & (ring->capacity - 1)) * ring->slot_stride);
+}
+
+void ring_create(Ring *ring, u32 capacity, u32 item_size, bool multi_producer) {
+    if (!capacity || capacity & (capacity - 1)) FATAL("Ring capacity must be a power of two, got %u", capacity);
+    ring->capacity = capacity;
+    ring->item_size = item_size;
+    ring->slot_stride = (sizeof(RingSlot) + item_size + RING_CACHE_LINE - 1) / RING_CACHE_LINE * RING_CACHE_LINE;
+    ring->multi_producer = multi_producer;
+    ring->slots = (u8 *) aligned_alloc(RING_CACHE_LINE, (size_t) capacity * ring->slot_stride);
+    if (!ring->slots) FATAL("Out of memory.");
+    for (u32 i = 0; i < capacity; i++) atomic_init(&ring_slot(ring, i)->sequence, 0);
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+void ring_destroy(Ring *ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+u32 ring_push(Ring *ring, const void *items, u32 count) {
+    /**
+     * Reserving as many positions as there is room for. With a single producer nobody else moves head, so there is
+     * no need to loop on a compare-and-swap.
+     */
+    u64 head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    u32 reserved;
+    do {
+        u64 tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        u64 room = ring->capacity - (head - tail);
+        reserved = count < room ? count : (u32) room;
+        if (!reserved) return 0;
+        if (!ring->multi_producer) {
+            atomic_store_explicit(&ring->head, head + reserved, memory_order_relaxed);
+            break;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&ring->head, &head, head + reserved, memory_order_relaxed,
+                                                    memory_order_relaxed));
+
+    for (u32 i = 0; i < reserved; i++) {
+        RingSlot *slot = ring_slot(ring, head + i);
+        memcpy(slot->data, (const u8 *) items + (size_t) i * ring->item_size, ring->item_size);
+        atomic_store_explicit(&slot->sequence, head + i + 1, memory_order_release);
+    }
+    return reserved;
+}
+
+u32 ring_pop(Ring *ring, void *items, u32 max) {
+    u64 tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    u32 taken = 0;
+    for (; taken < max; taken++) {
+        RingSlot *slot = ring_slot(ring, tail + taken);
+        // a producer that reserved this position may not have published it yet, everything after it waits
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != tail + taken + 1) break;
+        memcpy((u8 *) items + (size_t) taken * ring->item_size, slot->data, ring->item_size);
+    }
+    if (taken) atomic_store_explicit(&ring->tail, tail + taken, memory_order_release);
+    return taken;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include "cpmath.h"
+
+#define RING_CACHE_LINE (64)
+
+/**
+ * Bounded lock-free ring buffer of fixed size items, with a single consumer and either one or many producers.
+ * Producers reserve a run of positions on head, fill the slots, then publish each of them by setting its sequence to
+ * its position + 1. The consumer takes every published slot in order and releases them all at once by moving tail.
+ * Slots are padded to whole cache lines, so that a producer filling a slot never shares a line with the consumer
+ * reading the previous one.
+ */
+typedef struct Ring {
+    _Alignas(RING_CACHE_LINE) _Atomic(u64) head;
+    _Alignas(RING_CACHE_LINE) _Atomic(u64) tail;
+    _Alignas(RING_CACHE_LINE) u8 *slots;
+    u32 capacity;
+    u32 item_size;
+    u32 slot_stride;
+    bool multi_producer;
+} Ring;
+
+void ring_create(Ring *ring, u32 capacity, u32 item_size, bool multi_producer);
+void ring_destroy(Ring *ring);
+
+// publishes up to count items at once, returns how many did fit
+u32 ring_push(Ring *ring, const void *items, u32 count);
+
+// consumes up to max published items at once, returns how many were taken. Only one thread may ever consume.
+u32 ring_pop(Ring *ring, void *items, u32 max);
@@ -1,8 +1,15 @@
+#define _GNU_SOURCE
+
 #include <memory.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include "terrain.h"
 #include "cplog.h"
 #include "pool_allocator.h"
 #include "materials.h"
+#include "terrain_decoration.h"
 
 #define FNL_IMPL
 
@@ -14,20 +21,163 @@ typedef struct SvoGenStats {
     u32 *empty_nodes_per_level;
     u32 *uniform_nodes_per_level;
     u32 *mixed_nodes_per_level;
+    u64 sampled_voxels; // voxels whose density was sampled, in chunks that interval bounds couldn't classify
 } SvoGenStats;
 
+/**
+ * Backing files of an out-of-core terrain. Both pools, the heightmap and the skylight map are shared mappings of sparse
+ * temporary files, so the kernel can write them back and drop them from memory whenever we ask it to.
+ */
+typedef struct TerrainSpillFile {
+    int file;
+    size_t bytes;
+    void *memory;
+} TerrainSpillFile;
+
+typedef struct TerrainSpill {
+    TerrainSpillFile nodes, chunks, heightmap, skylight;
+    size_t unflushed_bytes;
+} TerrainSpill;
+
+typedef struct TerrainSlabList {
+    TerrainSlab *slabs;
+    u32 count, capacity;
+} TerrainSlabList;
+
+/**
+ * 3D density on top of the heightmap (see terrain_classify). Both noises are lattice value noises, whose lattice
+ * spacing is a multiple of the chunk width so that a chunk always fits in a single lattice cell.
+ */
+#define TERRAIN_DENSITY_PERIOD (16)
+#define TERRAIN_OVERHANG_SEED (0x68e31da4u)
+#define TERRAIN_CAVE_SEED (0xb5297a4du)
+#define TERRAIN_CAVE_SEED_2 (0x1b56c4e9u)
+#define TERRAIN_CAVE_WIDTH (0.08f)
+
+// octaves of the height noise's ridged fractal
+#define TERRAIN_HEIGHT_OCTAVES (3)
+
+/**
+ * How fast a single OpenSimplex2 octave can change, per unit of its skewed input. Unlike the fractal's, its steepest
+ * spots aren't rare, sampling finds them: it measured at 6.91 over 50 million points.
+ */
+#define TERRAIN_SIMPLEX_LIPSCHITZ (7.)
+
+/**
+ * How much steeper the bicubic Catmull-Rom interpolation of samples can be than what was sampled: 1.5 along an axis,
+ * times 1.25 for the sum of the absolute weights across it, times sqrt(2) for both axes at once.
+ */
+#define TERRAIN_CUBIC_LIPSCHITZ (1.5 * 1.25 * 1.41421356)
+
+/**
+ * How fast the height noise can change, per unit of its input. Each octave is folded into ridges, doubling its slope,
+ * has its input skewed by up to sqrt(3), and adds 4/7, 2/7 then 1/7 of its ridges at 1, 2 then 4 times the frequency
+ * of the first, so that each adds the same slope. Coarse octaves are interpolated, which makes them steeper.
+ * That's about 87, the fractal itself measures at about 22 over the columns of the widest world.
+ */
+#define TERRAIN_HEIGHT_NOISE_LIPSCHITZ (2. * 1.7320508 * 4. / 7. * TERRAIN_SIMPLEX_LIPSCHITZ * \
+        (TERRAIN_HEIGHT_OCTAVES - TERRAIN_COARSE_OCTAVES + TERRAIN_COARSE_OCTAVES * TERRAIN_CUBIC_LIPSCHITZ))
+
+// the full resolution heightmap is sampled in tiles that wide, to keep the noise on the stack
+#define TERRAIN_HEIGHT_TILE_WIDTH (128)
+
+// coarse samples along a tile, from one before its first column to two after its last
+#define TERRAIN_COARSE_GRID_WIDTH ((TERRAIN_HEIGHT_TILE_WIDTH - 1) / TERRAIN_COARSE_NOISE_SPACING + 5)
+
+// slots the spilled pools start with, at least, before they are sized from the world and grow 2x from there
+#define TERRAIN_SPILL_MIN_SLOTS (1024)
+
+// how far an out-of-core footprint went, see terrain_init_out_of_core
+#define TERRAIN_FOOTPRINT_GENERATED (1)
+#define TERRAIN_FOOTPRINT_DECORATED (2)
+#define TERRAIN_FOOTPRINT_LIT (3)
+
 static fnl_state noiseGen2D;
 
+static void terrain_init_common(Terrain *terrain, u32 depth);
+
+static void terrain_setup_noise(void);
+
 static void terrain_generate(Terrain *terrain);
 
-static void terrain_generate_heightmap_recursive(Terrain *terrain, u32 width_chunks, HeightApprox **heightmaps, u32 depth);
+static u64 terrain_bound_heights(Terrain *terrain, u32 x, u32 y, u32 width, u32 top, u32 bottom, bool sample);
+
+static u64 terrain_bound_cell(Terrain *terrain, u32 level, u32 cx, u32 cy, u32 bottom, bool sample, u32 known);
 
 static void terrain_generate_recursive(Terrain *terrain, u32 cx, u32 cy, u32 cz, u32 depth, HeightApprox **approx_heightmaps, u32 node_address, SvoGenStats *stats);
 
-static void terrain_generate_chunk(Terrain *pTerrain, u32 x, u32 y, u32 z, Chunk (*node));
+static bool terrain_generate_chunk(Terrain *pTerrain, u32 x, u32 y, u32 z, Chunk (*node));
+
+static Voxel terrain_classify(u32 x, u32 y, u32 z, u32 width, HeightApprox height);
+
+static u32 terrain_sample_height(const Terrain *terrain, u32 x, u32 y);
+
+static u32 terrain_height_from_noise(const Terrain *terrain, float noise);
+
+static void terrain_skylight_build_recursive(Terrain *terrain, u32 node_address, u32 x, u32 y, u32 z, u32 depth);
+
+static void terrain_skylight_build_subnode(Terrain *terrain, Voxel material, u32 child, u32 x, u32 y, u32 z, u32 depth);
+
+static void terrain_skylight_build_footprint_recursive(Terrain *terrain, u32 node_address, u32 nx, u32 ny, u32 nz,
+                                                       u32 depth, u32 x, u32 y, u32 width);
+
+static void terrain_skylight_fill(Terrain *terrain, u32 x, u32 y, u32 width, u32 height);
+
+static void terrain_generate_skeleton_recursive(Terrain *terrain, u32 cx, u32 cy, u32 cz, u32 depth, u32 slab_depth,
+                                                u32 node_address, TerrainSlabList *slabs, SvoGenStats *stats);
+
+static void terrain_generate_slab_into(const Terrain *terrain, const TerrainSlab *slab, Terrain *scratch,
+                                       SvoGenStats *stats);
+
+static void terrain_graft_slab_from(Terrain *terrain, const TerrainSlab *slab, const Terrain *scratch);
+
+static u32 terrain_copy_subtree(Terrain *terrain, const Terrain *source, u32 source_address, u32 depth);
+
 
 void terrain_init(Terrain *terrain, u32 depth) {
+    terrain_init_empty(terrain, depth);
+    terrain_setup_noise();
+    terrain_generate(terrain);
+}
+
+static void terrain_setup_noise(void) {
+    // Setup the worldgen noises
+    srand(41233125);
+    noiseGen2D = fnlCreateState();
+    noiseGen2D.noise_type = FNL_NOISE_OPENSIMPLEX2;
+    noiseGen2D.fractal_type = FNL_FRACTAL_RIDGED;
+    noiseGen2D.octaves = TERRAIN_HEIGHT_OCTAVES;
+    noiseGen2D.seed = 41233125;
+    noiseGen2D.frequency = 1;
+}
+
+/**
+ * Allocates everything a terrain needs, and leaves it filled with air.
+ * Chunk 0 is reserved so that a 0 address in a node entry always means "uniform", and the root is always node 0.
+ */
+void terrain_init_empty(Terrain *terrain, u32 depth) {
+    terrain_init_common(terrain, depth);
+
+    // allocate ~128 Mo of RAM for each pool
+    u32 initialPoolSize = 128 * 1024;
+    poolAllocatorCreateBitmap(&terrain->chunkPool, initialPoolSize, sizeof(Chunk), NULL);
+    poolAllocatorCreateBitmap(&terrain->nodePool, initialPoolSize, sizeof(Node), NULL);
+    poolAllocatorAlloc(&terrain->chunkPool);
+    terrain->root_node_address = poolAllocatorAlloc(&terrain->nodePool);
+    for (u32 i = 0; i < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; i++) {
+        terrain_node_set(terrain, terrain->root_node_address, i, AIR, 0);
+    }
+
+    // heightmaps, all zeroes meaning "nothing here"
+    terrain->heightmap = (u32 *) calloc((size_t) terrain->width * terrain->width, sizeof(u32));
+    terrain->skylight = (u32 *) calloc((size_t) terrain->width * terrain->width, sizeof(u32));
+    if (!terrain->heightmap || !terrain->skylight) FATAL("Out of memory.");
+}
+
+// Everything but the pools and the full resolution maps, which out-of-core terrains don't keep in memory
+static void terrain_init_common(Terrain *terrain, u32 depth) {
     if (depth <= 0) FATAL("Minimum SVO depth is 1");
+    if (depth > TERRAIN_MAX_DEPTH) FATAL("Maximum SVO depth is %u", TERRAIN_MAX_DEPTH);
 
     // info message
     terrain->width = CHUNK_WIDTH * (u32) pow(NODE_WIDTH, depth);
@@ -39,49 +189,72 @@ void terrain_init(Terrain *terrain, u32 depth) {
              terrain->width);
     INFO(message);
 
-    // allocate ~128 Mo of RAM for each pool
-    u32 initialPoolSize = 128 * 1024;
-    poolAllocatorCreate(&terrain->chunkPool, initialPoolSize, sizeof(Chunk), NULL);
-    poolAllocatorCreate(&terrain->nodePool, initialPoolSize, sizeof(Node), NULL);
-
-    // Setup the worldgen noises
-    srand(41233125);
-    noiseGen2D = fnlCreateState();
-    noiseGen2D.noise_type = FNL_NOISE_OPENSIMPLEX2;
-    noiseGen2D.fractal_type = FNL_FRACTAL_RIDGED;
-    noiseGen2D.octaves = 3;
-    noiseGen2D.seed = 41233125;
-    noiseGen2D.frequency = 1;
+    terrain->heightmap = NULL;
+    terrain->skylight = NULL;
+    terrain->spill = NULL;
+    terrain->farPool = (PoolAllocator) {0};
+    terrain->boundsPool = (PoolAllocator) {0};
+    terrain->retire_slot = NULL;
+    terrain->node_shares = terrain->chunk_shares = NULL;
+    terrain->node_shares_size = terrain->chunk_shares_size = 0;
+    terrain->node_hashes = terrain->chunk_hashes = NULL;
+    terrain->node_hashes_size = terrain->chunk_hashes_size = 0;
+    terrain->approx_heightmaps = (HeightApprox **) malloc((terrain->depth + 1) * sizeof(HeightApprox *));
+    if (!terrain->approx_heightmaps) FATAL("Out of memory.");
+    for (u32 level = 0; level <= terrain->depth; level++) {
+        u32 level_width = terrain->width_chunks / (u32) pow(NODE_WIDTH, level);
+        terrain->approx_heightmaps[level] = (HeightApprox *) calloc((size_t) level_width * level_width, sizeof(HeightApprox));
+        if (!terrain->approx_heightmaps[level]) FATAL("Out of memory.");
+    }
 
-    terrain->dirty = true;
-    terrain_generate(terrain);
+    terrain->delta_count = 0;
+    terrain_record_delta(terrain, TERRAIN_DELTA_ALL, 0, 0);
 }
 
 void terrain_destroy(Terrain *terrain) {
     poolAllocatorDestroy(&terrain->chunkPool);
     poolAllocatorDestroy(&terrain->nodePool);
+    poolAllocatorDestroy(&terrain->farPool);
+    poolAllocatorDestroy(&terrain->boundsPool);
     for (int i = 0; i <= terrain->depth; i++) {
         free(terrain->approx_heightmaps[i]);
     }
     free(terrain->approx_heightmaps);
-    free(terrain->heightmap);
+    free(terrain->node_shares);
+    free(terrain->chunk_shares);
+    free(terrain->node_hashes);
+    free(terrain->chunk_hashes);
+    if (terrain->spill) {
+        TerrainSpill *spill = terrain->spill;
+        TerrainSpillFile *files[] = {&spill->nodes, &spill->chunks, &spill->heightmap, &spill->skylight};
+        for (u32 i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+            munmap(files[i]->memory, files[i]->bytes);
+            close(files[i]->file);
+        }
+        free(spill);
+    } else {
+        free(terrain->heightmap);
+        free(terrain->skylight);
+    }
 }
 
 static void terrain_generate(Terrain *terrain) {
-    // issue: we want bot to top heightmap to have height min/max per chunk, but top to bot optimal svo tree gen
-    // solution: generate them separately, starting with the heightmap at chunk res!
+    // the tree is generated top to bottom, and so are the height bounds it's classified with, ahead of it
 
     /**
-     * Generating the heightmaps using a first recursive function
+     * Bounding the heights of the whole pyramid, sampling only where it matters
      */
     u32 time = uclock();
-    terrain->approx_heightmaps = (u32 **) malloc((terrain->depth + 1) * sizeof(u32 *));
-    terrain->heightmap = (u32 *) malloc(terrain->width * terrain->width * sizeof(u32));
-    if (!terrain->heightmap | !terrain->approx_heightmaps) FATAL("Out of memory.");
-    terrain_generate_heightmap_recursive(terrain, terrain->width_chunks, terrain->approx_heightmaps, 0);
-    INFO("Generating heightmaps took %.2fms. Min height is %u, max height is %u.", (uclock() - time) / 1e3,
+    u64 samples = terrain_bound_heights(terrain, 0, 0, terrain->width, terrain->depth, 0, true);
+    INFO("Bounding heights took %.2fms, %llu samples for %llu chunk columns. Min height is %u, max height is %u.",
+         (uclock() - time) / 1e3, (unsigned long long) samples,
+         (unsigned long long) terrain->width_chunks * terrain->width_chunks,
          terrain->approx_heightmaps[terrain->depth][0].min, terrain->approx_heightmaps[terrain->depth][0].max);
 
+    time = uclock();
+    terrain_generate_heightmap_columns(terrain, 0, 0, terrain->width);
+    INFO("Sampling the full resolution heightmap took %.2fms", (uclock() - time) / 1e3);
+
     time = uclock(); // resetting the timer in order to get the SVO generation time
 
     /**
@@ -97,9 +270,8 @@ static void terrain_generate(Terrain *terrain) {
     memset(stats.uniform_nodes_per_level, 0, terrain->depth * sizeof(u32));
 
     /**
-     * Creating the root node, and feeding it to the recursive function to create its leaves
+     * Feeding the root node to the recursive function to create its leaves
      */
-    terrain->root_node_address = poolAllocatorAlloc(&terrain->nodePool);
     terrain_generate_recursive(terrain, 0, 0, 0, terrain->depth, terrain->approx_heightmaps,
                                terrain->root_node_address,
                                &stats);
@@ -112,67 +284,535 @@ static void terrain_generate(Terrain *terrain) {
     INFO("Chunk pool memory footprint: %.00f MB, %d bits addressing minimum", (size_t) terrain->chunkPool.size * terrain->chunkPool.unitSize / 1e6, (int) ceil(log2(terrain->chunkPool.size)));
     INFO("SVO nodes pool memory footprint: %.00f MB, %d bits addressing minimum", (size_t) terrain->nodePool.size * terrain->nodePool.unitSize / 1e6, (int) ceil(log2(terrain->nodePool.size)));
 
+    INFO("Density was sampled for %llu voxels, %.3f%% of the world, everything else was classified from interval "
+         "bounds", (unsigned long long) stats.sampled_voxels,
+         stats.sampled_voxels * 100. / ((double) terrain->width * terrain->width * terrain->width));
+
     free(stats.mixed_nodes_per_level);
     free(stats.uniform_nodes_per_level);
     free(stats.empty_nodes_per_level);
     INFO("Generating SVO from heightmaps took %.2fms", (uclock() - time) / 1e3);
+    terrain_build_bounds(terrain);
+
+    time = uclock();
+    terrain_decorate(terrain, 0, 0, terrain->width);
+    INFO("Decorating the terrain took %.2fms", (uclock() - time) / 1e3);
+
+    /**
+     * Building the skylight map from the freshly generated tree
+     */
+    time = uclock();
+    terrain_rebuild_skylight(terrain);
+    INFO("Building skylight map took %.2fms", (uclock() - time) / 1e3);
 }
 
-static void terrain_generate_heightmap_recursive(Terrain *terrain, u32 width_chunks, HeightApprox **heightmaps,
-                                                 u32 depth) {
-    if (depth > terrain->depth) return;
-    if (depth == 0) {
-        // Create a heightmap at the right size
-        heightmaps[0] = (HeightApprox *) malloc(width_chunks * width_chunks * sizeof(HeightApprox));
-        if (!heightmaps[0]) FATAL("Out of memory.");
-        INFO("Generating heightmap of size %ux%u, depth %u and size %u. One heightmap entry is one %ux%u chunk.",
-             width_chunks, width_chunks, depth, (u32)(width_chunks * width_chunks * sizeof(HeightApprox)), (u32) CHUNK_WIDTH, (u32) CHUNK_WIDTH);
-
-        // For every chunk of the map...
-        for (u32 cx = 0; cx < width_chunks; cx++) {
-            for (u32 cy = 0; cy < width_chunks; cy++) {
-                // Generate a precise heightmap but only keep a min and a max per chunk
-                u32 min = UINT32_MAX, max = 0;
-                for (u32 dx = 0; dx < CHUNK_WIDTH; dx+=CHUNK_WIDTH/NOISE_SAMPLE_PER_CHUNK_WIDTH) {
-                    for (u32 dy = 0; dy < CHUNK_WIDTH; dy+=CHUNK_WIDTH/NOISE_SAMPLE_PER_CHUNK_WIDTH) {
-                        u32 hx = cx * CHUNK_WIDTH + dx;
-                        u32 hy = cy * CHUNK_WIDTH + dy;
-                        u32 scale = min(terrain->width, 8192);
-                        u32 h = 0.25 * scale +
-                                0.5 * scale * (fnlGetNoise2D(&noiseGen2D, hx * 1e-4, hy * 1e-4) * 0.5 + 0.5);
-                        terrain->heightmap[hx + (u64) terrain->width * hy] = h;
-                        if (h < min) min = h;
-                        if (h > max) max = h;
-                    }
+/**
+ * Maps a sparse, already unlinked temporary file of the given size. Nothing is actually written until it is touched.
+ */
+static void *terrain_spill_map(TerrainSpillFile *spill_file, size_t bytes) {
+    const char *directory = getenv("TMPDIR");
+    char path[512];
+    snprintf(path, sizeof(path), "%s/ivy-terrain-XXXXXX", directory ? directory : "/tmp");
+    spill_file->file = mkstemp(path);
+    if (spill_file->file < 0) FATAL("Could not create a terrain spill file in %s", directory ? directory : "/tmp");
+    unlink(path);
+    if (ftruncate(spill_file->file, (off_t) bytes)) FATAL("Could not grow terrain spill file to %zu bytes", bytes);
+    spill_file->memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, spill_file->file, 0);
+    if (spill_file->memory == MAP_FAILED) FATAL("Could not map terrain spill file of %zu bytes", bytes);
+    spill_file->bytes = bytes;
+    return spill_file->memory;
+}
+
+// grows a spilled pool: its file is extended, then remapped, wherever the kernel finds room for it
+static void *terrain_spill_resize(void *context, void *memory, size_t bytes) {
+    TerrainSpillFile *spill_file = (TerrainSpillFile *) context;
+    if (ftruncate(spill_file->file, (off_t) bytes)) FATAL("Could not grow terrain spill file to %zu bytes", bytes);
+    memory = mremap(memory, spill_file->bytes, bytes, MREMAP_MAYMOVE);
+    if (memory == MAP_FAILED) FATAL("Could not map terrain spill file of %zu bytes", bytes);
+    spill_file->memory = memory;
+    spill_file->bytes = bytes;
+    return memory;
+}
+
+// a pool on a spill file, growing with it
+static void terrain_spill_pool(PoolAllocator *pool, TerrainSpillFile *spill_file, u32 slots, u32 unit_size) {
+    poolAllocatorCreateBitmap(pool, slots, unit_size, terrain_spill_map(spill_file, (size_t) slots * unit_size));
+    pool->resizeMemory = terrain_spill_resize;
+    pool->resizeContext = spill_file;
+}
+
+// grows a spilled pool up front so that it holds at least that many slots
+static void terrain_spill_reserve(PoolAllocator *pool, size_t slots) {
+    while (pool->maxSize < slots && pool->maxSize < UINT32_MAX) poolAllocatorGrow(pool);
+}
+
+// writes back everything spilled so far, then lets the kernel reclaim it. It'll be paged back in when read again.
+static void terrain_spill_flush(Terrain *terrain) {
+    TerrainSpill *spill = terrain->spill;
+    size_t node_bytes = (size_t) (terrain->nodePool.maxSize - terrain->nodePool.unused) * terrain->nodePool.unitSize;
+    size_t chunk_bytes = (size_t) (terrain->chunkPool.maxSize - terrain->chunkPool.unused) * terrain->chunkPool.unitSize;
+    size_t used_bytes[] = {node_bytes, chunk_bytes, spill->heightmap.bytes, spill->skylight.bytes};
+    TerrainSpillFile *files[] = {&spill->nodes, &spill->chunks, &spill->heightmap, &spill->skylight};
+    for (u32 i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        msync(files[i]->memory, used_bytes[i], MS_SYNC);
+        madvise(files[i]->memory, used_bytes[i], MADV_DONTNEED);
+    }
+    spill->unflushed_bytes = 0;
+}
+
+// slabs by footprint, in rows, then top down within a footprint
+static int terrain_compare_slabs(const void *a, const void *b) {
+    const TerrainSlab *left = a, *right = b;
+    if (left->y != right->y) return left->y < right->y ? -1 : 1;
+    if (left->x != right->x) return left->x < right->x ? -1 : 1;
+    return (left->z < right->z) - (left->z > right->z);
+}
+
+// whether a footprint and all of its neighbours went through a stage
+static bool terrain_footprint_ready(const u8 *stages, u32 width_footprints, u32 fx, u32 fy, u8 stage) {
+    for (u32 y = fy ? fy - 1 : 0; y <= fy + 1 && y < width_footprints; y++) {
+        for (u32 x = fx ? fx - 1 : 0; x <= fx + 1 && x < width_footprints; x++) {
+            if (stages[x + y * width_footprints] < stage) return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Moves the footprints around a freshly generated one as far as they can go: decorated once their neighbours are
+ * generated, then lit once their neighbours are decorated, since structures reach into them. Decorating the
+ * neighbours of the footprint can only free the footprints next to them for lighting.
+ */
+static void terrain_advance_footprints(Terrain *terrain, u8 *stages, u32 width_footprints, u32 fx, u32 fy) {
+    u32 footprint_width = terrain->width / width_footprints;
+    for (u32 reach = 1, stage = TERRAIN_FOOTPRINT_GENERATED; stage < TERRAIN_FOOTPRINT_LIT; reach++, stage++) {
+        for (u32 y = fy >= reach ? fy - reach : 0; y <= fy + reach && y < width_footprints; y++) {
+            for (u32 x = fx >= reach ? fx - reach : 0; x <= fx + reach && x < width_footprints; x++) {
+                if (stages[x + y * width_footprints] != stage) continue;
+                if (!terrain_footprint_ready(stages, width_footprints, x, y, (u8) stage)) continue;
+                if (stage == TERRAIN_FOOTPRINT_GENERATED) {
+                    terrain_decorate(terrain, x * footprint_width, y * footprint_width, footprint_width);
+                } else {
+                    terrain_build_skylight(terrain, x * footprint_width, y * footprint_width, footprint_width);
                 }
-                heightmaps[0][cx + cy * width_chunks] = (HeightApprox) {.min=min, .max=max};
+                stages[x + y * width_footprints] = (u8) (stage + 1);
             }
         }
-    } else { // Aggregate fine-grained heightmaps into simplified heightmaps
-        // Create a heightmap at the right size
-        heightmaps[depth] = (HeightApprox *) malloc(width_chunks * width_chunks * sizeof(HeightApprox));
-        if (!heightmaps[depth]) FATAL("Out of memory.");
-        INFO("Generating sub-heightmap of size %ux%u, depth %u and size %u. One heightmap entry is corresponding to one %ux%u voxels level %u chunk.",
-             width_chunks, width_chunks, depth, (u32)(width_chunks * width_chunks * sizeof(HeightApprox)), CHUNK_WIDTH * (u32) pow(NODE_WIDTH, depth),
-             CHUNK_WIDTH * (u32) pow(NODE_WIDTH, depth), depth);
-
-        // For every chunk of the map...
-        for (u32 cx = 0; cx < width_chunks; cx++) {
-            for (u32 cy = 0; cy < width_chunks; cy++) {
-                u32 min = UINT32_MAX, max = 0;
-                for (u32 dx = 0; dx < NODE_WIDTH; dx++) {
-                    for (u32 dy = 0; dy < NODE_WIDTH; dy++) {
-                        HeightApprox h = heightmaps[depth - 1][cx*NODE_WIDTH + dx + (cy*NODE_WIDTH + dy) * width_chunks*NODE_WIDTH];
-                        if (h.min < min) min = h.min;
-                        if (h.max > max) max = h.max;
+    }
+}
+
+void terrain_init_out_of_core(Terrain *terrain, u32 depth, size_t memory_budget) {
+    if (depth < 2) {
+        WARN("A depth %u world is too small to be built out-of-core, generating it in memory", depth);
+        terrain_init(terrain, depth);
+        return;
+    }
+    terrain_init_common(terrain, depth);
+    terrain_setup_noise();
+
+    /**
+     * The heightmap pyramid is small enough to stay in memory, about a third of a u64 per chunk column
+     */
+    size_t pyramid_bytes = 0;
+    for (u32 level = 0; level <= terrain->depth; level++) {
+        pyramid_bytes += (size_t) (terrain->width_chunks >> level) * (terrain->width_chunks >> level) * sizeof(HeightApprox);
+    }
+    if (pyramid_bytes > memory_budget / 2) {
+        FATAL("A %.00f MB memory budget cannot even hold the %.00f MB heightmap pyramid", memory_budget / 1e6,
+              pyramid_bytes / 1e6);
+    }
+    u32 time = uclock();
+    u64 samples = terrain_bound_heights(terrain, 0, 0, terrain->width, terrain->depth, 0, true);
+    INFO("Bounding heights took %.2fms, %llu samples for %llu chunk columns. Min height is %u, max height is %u.",
+         (uclock() - time) / 1e3, (unsigned long long) samples,
+         (unsigned long long) terrain->width_chunks * terrain->width_chunks,
+         terrain->approx_heightmaps[terrain->depth][0].min, terrain->approx_heightmaps[terrain->depth][0].max);
+
+    /**
+     * Picking the largest slab whose worst case fits in a quarter of the budget. A slab is generated in scratch pools
+     * that grow 2x at a time, so they may briefly hold 3 times what the slab needs.
+     */
+    u32 slab_depth = 1;
+    for (u32 level = terrain->depth - 1; level >= 1; level--) {
+        u32 level_width = terrain->width_chunks >> level;
+        size_t worst_chunks = 0;
+        for (size_t i = 0; i < (size_t) level_width * level_width; i++) {
+            HeightApprox height = terrain->approx_heightmaps[level][i];
+            size_t chunks = ((size_t) 1 << (2 * level)) * ((height.max - height.min) / CHUNK_WIDTH + 2);
+            if (chunks > worst_chunks) worst_chunks = chunks;
+        }
+        if (worst_chunks * (sizeof(Chunk) + sizeof(Node)) * 3 <= memory_budget / 4) {
+            slab_depth = level;
+            break;
+        }
+    }
+
+    /**
+     * Final pools, heightmap and skylight map are mapped on sparse temporary files
+     */
+    TerrainSpill *spill = (TerrainSpill *) calloc(1, sizeof(TerrainSpill));
+    if (!spill) FATAL("Out of memory.");
+    size_t map_bytes = (size_t) terrain->width * terrain->width * sizeof(u32);
+    terrain->spill = spill;
+    terrain->heightmap = (u32 *) terrain_spill_map(&spill->heightmap, map_bytes);
+    terrain->skylight = (u32 *) terrain_spill_map(&spill->skylight, map_bytes);
+    u32 width_footprints = terrain->width_chunks >> slab_depth;
+    u32 skeleton_slots = max(TERRAIN_SPILL_MIN_SLOTS, width_footprints * width_footprints);
+    terrain_spill_pool(&terrain->chunkPool, &spill->chunks, TERRAIN_SPILL_MIN_SLOTS, sizeof(Chunk));
+    terrain_spill_pool(&terrain->nodePool, &spill->nodes, skeleton_slots, sizeof(Node));
+    poolAllocatorAlloc(&terrain->chunkPool);
+    terrain->root_node_address = poolAllocatorAlloc(&terrain->nodePool);
+
+    SvoGenStats stats = (SvoGenStats) {.empty_nodes_per_level=(u32 *) calloc(terrain->depth, sizeof(u32)),
+            .mixed_nodes_per_level=(u32 *) calloc(terrain->depth, sizeof(u32)),
+            .uniform_nodes_per_level=(u32 *) calloc(terrain->depth, sizeof(u32))};
+    if (!stats.empty_nodes_per_level || !stats.mixed_nodes_per_level || !stats.uniform_nodes_per_level) FATAL(
+            "Out of memory.");
+
+    /**
+     * Levels above the slabs first, then footprints as wide as a slab, in rows. The heightmap of a footprint is
+     * sampled, then its slabs are generated top down, one at a time in the same scratch pools, and copied into the
+     * mapped ones. Structures reach out of their footprint, so like in the generation pipeline (see server/pipeline.h)
+     * a footprint is only decorated once its neighbours are generated, and only lit once they are decorated.
+     */
+    time = uclock();
+    TerrainSlabList slabs = {0};
+    terrain_generate_skeleton_recursive(terrain, 0, 0, 0, terrain->depth, slab_depth, terrain->root_node_address,
+                                        &slabs, &stats);
+    terrain_build_bounds(terrain);
+    qsort(slabs.slabs, slabs.count, sizeof(TerrainSlab), terrain_compare_slabs);
+    // the surface crosses every chunk column of a slab about once, with a node over every 4 columns on each level
+    size_t slab_columns = (size_t) slabs.count << (2 * slab_depth);
+    terrain_spill_reserve(&terrain->chunkPool, slab_columns);
+    terrain_spill_reserve(&terrain->nodePool, terrain->nodePool.size + slab_columns / 3);
+    u32 footprint_width = CHUNK_WIDTH << slab_depth;
+    u8 *stages = (u8 *) calloc((size_t) width_footprints * width_footprints, sizeof(u8));
+    if (!stages) FATAL("Out of memory.");
+    Terrain scratch = *terrain;
+    scratch.spill = NULL;
+    scratch.farPool = scratch.boundsPool = (PoolAllocator) {0};
+    poolAllocatorCreate(&scratch.chunkPool, 1024, sizeof(Chunk), NULL);
+    poolAllocatorCreate(&scratch.nodePool, 1024, sizeof(Node), NULL);
+    for (u32 footprint = 0, next_slab = 0; footprint < width_footprints * width_footprints; footprint++) {
+        u32 fx = footprint % width_footprints, fy = footprint / width_footprints;
+        terrain_generate_heightmap_columns(terrain, fx * footprint_width, fy * footprint_width, footprint_width);
+        spill->unflushed_bytes += (size_t) footprint_width * footprint_width * sizeof(u32);
+        for (; next_slab < slabs.count && slabs.slabs[next_slab].x == fx * footprint_width &&
+               slabs.slabs[next_slab].y == fy * footprint_width; next_slab++) {
+            const TerrainSlab *slab = &slabs.slabs[next_slab];
+            terrain_generate_slab_into(terrain, slab, &scratch, &stats);
+            spill->unflushed_bytes += (size_t) scratch.nodePool.size * sizeof(Node) +
+                                      (size_t) scratch.chunkPool.size * sizeof(Chunk);
+            terrain_graft_slab_from(terrain, slab, &scratch);
+        }
+        stages[footprint] = TERRAIN_FOOTPRINT_GENERATED;
+        terrain_advance_footprints(terrain, stages, width_footprints, fx, fy);
+        if (spill->unflushed_bytes > memory_budget / 4) terrain_spill_flush(terrain);
+    }
+    terrain_spill_flush(terrain);
+    poolAllocatorDestroy(&scratch.chunkPool);
+    poolAllocatorDestroy(&scratch.nodePool);
+    poolAllocatorDestroy(&scratch.farPool);
+    free(stages);
+    free(slabs.slabs);
+
+    for (u16 i = terrain->depth - 1; i >= 0 && i < terrain->depth; i--) {
+        INFO("SVO level %u contains %u air nodes, %u uniform non-air nodes and %u %s.", i,
+             stats.empty_nodes_per_level[i], stats.uniform_nodes_per_level[i], stats.mixed_nodes_per_level[i],
+             i == 0 ? "chunks" : "mixed nodes");
+    }
+    INFO("Density was sampled for %llu voxels, %.3f%% of the world", (unsigned long long) stats.sampled_voxels,
+         stats.sampled_voxels * 100. / ((double) terrain->width * terrain->width * terrain->width));
+    free(stats.mixed_nodes_per_level);
+    free(stats.uniform_nodes_per_level);
+    free(stats.empty_nodes_per_level);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    INFO("Generating SVO out-of-core took %.2fms: %u slabs of depth %u, %u nodes and %u chunks spilled to disk",
+         (uclock() - time) / 1e3, slabs.count, slab_depth, terrain->nodePool.size, terrain->chunkPool.size);
+    INFO("Peak resident memory was %.00f MB for a %.00f MB budget", usage.ru_maxrss * 1e3 / 1e6, memory_budget / 1e6);
+}
+
+u32 terrain_init_progressive(Terrain *terrain, u32 depth, u32 slab_depth, TerrainSlab **slabs) {
+    terrain_init_empty(terrain, depth);
+    terrain_setup_noise();
+    if (slab_depth >= depth) slab_depth = depth - 1;
+    if (slab_depth == 0) { // nothing to postpone, the whole world is one slab
+        terrain_generate(terrain);
+        *slabs = NULL;
+        return 0;
+    }
+
+    // levels below the slabs inherit their bounds until their footprint is refined, see terrain_refine_pyramid
+    u32 time = uclock();
+    u64 samples = terrain_bound_heights(terrain, 0, 0, terrain->width, terrain->depth, slab_depth, true);
+    terrain_bound_heights(terrain, 0, 0, terrain->width, slab_depth - 1, 0, false);
+    SvoGenStats stats = (SvoGenStats) {.empty_nodes_per_level=(u32 *) calloc(terrain->depth, sizeof(u32)),
+            .mixed_nodes_per_level=(u32 *) calloc(terrain->depth, sizeof(u32)),
+            .uniform_nodes_per_level=(u32 *) calloc(terrain->depth, sizeof(u32))};
+    if (!stats.empty_nodes_per_level || !stats.mixed_nodes_per_level || !stats.uniform_nodes_per_level) FATAL(
+            "Out of memory.");
+    TerrainSlabList list = {0};
+    terrain_generate_skeleton_recursive(terrain, 0, 0, 0, terrain->depth, slab_depth, terrain->root_node_address,
+                                        &list, &stats);
+    terrain_build_bounds(terrain);
+    free(stats.mixed_nodes_per_level);
+    free(stats.uniform_nodes_per_level);
+    free(stats.empty_nodes_per_level);
+    INFO("Generated the top %u SVO levels in %.2fms from %llu height samples, %u slabs of depth %u left to generate",
+         terrain->depth - slab_depth, (uclock() - time) / 1e3, (unsigned long long) samples, list.count, slab_depth);
+    *slabs = list.slabs;
+    return list.count;
+}
+
+void terrain_generate_slab(const Terrain *terrain, const TerrainSlab *slab, Terrain *scratch) {
+    // sizes and the heightmaps are all the generator reads, the pools may be reallocated by a concurrent graft
+    *scratch = (Terrain) {.depth=terrain->depth, .width=terrain->width, .width_chunks=terrain->width_chunks,
+            .heightmap=terrain->heightmap, .approx_heightmaps=terrain->approx_heightmaps};
+    poolAllocatorCreate(&scratch->chunkPool, 64, sizeof(Chunk), NULL);
+    poolAllocatorCreate(&scratch->nodePool, 64, sizeof(Node), NULL);
+    SvoGenStats stats = (SvoGenStats) {.empty_nodes_per_level=(u32 *) calloc(terrain->depth, sizeof(u32)),
+            .mixed_nodes_per_level=(u32 *) calloc(terrain->depth, sizeof(u32)),
+            .uniform_nodes_per_level=(u32 *) calloc(terrain->depth, sizeof(u32))};
+    if (!stats.empty_nodes_per_level || !stats.mixed_nodes_per_level || !stats.uniform_nodes_per_level) FATAL(
+            "Out of memory.");
+    terrain_generate_slab_into(terrain, slab, scratch, &stats);
+    free(stats.mixed_nodes_per_level);
+    free(stats.uniform_nodes_per_level);
+    free(stats.empty_nodes_per_level);
+}
+
+void terrain_graft_slab(Terrain *terrain, const TerrainSlab *slab, Terrain *scratch) {
+    terrain_graft_slab_from(terrain, slab, scratch);
+    poolAllocatorDestroy(&scratch->chunkPool);
+    poolAllocatorDestroy(&scratch->nodePool);
+    poolAllocatorDestroy(&scratch->farPool);
+}
+
+/**
+ * Same classification as terrain_generate_recursive, but mixed subnodes at the slab level are left as uniform grass
+ * placeholders and queued for later. Uniform stone already gets its skylight here, slabs once their footprint is lit.
+ */
+static void terrain_generate_skeleton_recursive(Terrain *terrain, u32 cx, u32 cy, u32 cz, u32 depth, u32 slab_depth,
+                                                u32 node_address, TerrainSlabList *slabs, SvoGenStats *stats) {
+    depth -= 1;
+    u32 subnode_width = (u32) pow(NODE_WIDTH, depth) * CHUNK_WIDTH;
+    for (u32 dx = 0; dx < NODE_WIDTH; dx++) {
+        for (u32 dy = 0; dy < NODE_WIDTH; dy++) {
+            HeightApprox height = terrain->approx_heightmaps[depth][(int) ((cx / subnode_width + dx) + (cy / subnode_width + dy) * pow(NODE_WIDTH, terrain->depth - depth))];
+            for (i32 dz = NODE_WIDTH - 1; dz >= 0; dz--) {
+                u32 sx = cx + dx * subnode_width, sy = cy + dy * subnode_width, sz = cz + dz * subnode_width;
+                Voxel material = terrain_classify(sx, sy, sz, subnode_width, height);
+                if (material == STONE) {
+                    terrain_node_set(terrain, node_address, NODE_SLOT(dx, dy, dz), STONE, 0);
+                    terrain_skylight_fill(terrain, sx, sy, subnode_width, sz + subnode_width);
+                    stats->uniform_nodes_per_level[depth] += 1;
+                } else if (material == AIR) {
+                    terrain_node_set(terrain, node_address, NODE_SLOT(dx, dy, dz), AIR, 0);
+                    stats->empty_nodes_per_level[depth] += 1;
+                } else if (depth > slab_depth) {
+                    u32 subnode_id = poolAllocatorAlloc(&terrain->nodePool);
+                    if (!subnode_id) FATAL("SVO node pool is full!");
+                    terrain_node_set(terrain, node_address, NODE_SLOT(dx, dy, dz), GRASS, subnode_id);
+                    stats->mixed_nodes_per_level[depth] += 1;
+                    terrain_generate_skeleton_recursive(terrain, sx, sy, sz, depth, slab_depth, subnode_id, slabs,
+                                                        stats);
+                } else {
+                    terrain_node_set(terrain, node_address, NODE_SLOT(dx, dy, dz), GRASS, 0);
+                    stats->mixed_nodes_per_level[depth] += 1;
+                    if (slabs->count == slabs->capacity) {
+                        slabs->capacity = slabs->capacity ? slabs->capacity * 2 : 64;
+                        slabs->slabs = (TerrainSlab *) realloc(slabs->slabs, slabs->capacity * sizeof(TerrainSlab));
+                        if (!slabs->slabs) FATAL("Out of memory.");
                     }
+                    slabs->slabs[slabs->count++] = (TerrainSlab) {.node_address=node_address,
+                            .slot=NODE_SLOT(dx, dy, dz), .x=sx, .y=sy, .z=sz, .depth=depth};
                 }
-                // Generate a precise heightmap but only keep a min and a max per chunk
-                heightmaps[depth][cx + cy * width_chunks] = (HeightApprox) {.min=min, .max=max};
             }
         }
     }
-    terrain_generate_heightmap_recursive(terrain, width_chunks / NODE_WIDTH, heightmaps, depth + 1);
+}
+
+// generates a slab from its own root node, in emptied scratch pools. Only reads the terrain heightmap pyramid.
+static void terrain_generate_slab_into(const Terrain *terrain, const TerrainSlab *slab, Terrain *scratch,
+                                       SvoGenStats *stats) {
+    poolAllocatorFreeAll(&scratch->chunkPool);
+    poolAllocatorFreeAll(&scratch->nodePool);
+    poolAllocatorAlloc(&scratch->chunkPool);
+    poolAllocatorAlloc(&scratch->nodePool);
+    terrain_generate_recursive(scratch, slab->x, slab->y, slab->z, slab->depth, terrain->approx_heightmaps, 0, stats);
+}
+
+// copies the slab held by the scratch pools into the terrain pools, in place of its placeholder or of what a collapse
+// left of it
+static void terrain_graft_slab_from(Terrain *terrain, const TerrainSlab *slab, const Terrain *scratch) {
+    u32 previous = terrain_node_child(terrain, slab->node_address, slab->slot);
+    u32 root = terrain_copy_subtree(terrain, scratch, 0, slab->depth);
+    terrain_node_set(terrain, slab->node_address, slab->slot, GRASS, root);
+    terrain_record_delta(terrain, TERRAIN_DELTA_NODES, slab->node_address, 1);
+    if (previous) terrain_release(terrain, previous, slab->depth);
+    terrain_rebound_path(terrain, slab->x, slab->y, slab->z, slab->depth + 1);
+}
+
+// what the slots of a subtree weigh, shared ones included
+static size_t terrain_subtree_bytes(const Terrain *terrain, u32 address, u32 level) {
+    if (!level) return sizeof(Chunk);
+    size_t bytes = sizeof(Node);
+    for (u32 slot = 0; slot < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; slot++) {
+        u32 child = terrain_node_child(terrain, address, slot);
+        if (child) bytes += terrain_subtree_bytes(terrain, child, level - 1);
+    }
+    return bytes;
+}
+
+// the entries of a node of the given depth whose subnodes are at level or below are made uniform, deeper ones recursed
+static size_t terrain_collapse_recursive(Terrain *terrain, u32 node_address, u32 depth, u32 level) {
+    size_t dropped = 0;
+    bool changed = false;
+    for (u32 slot = 0; slot < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; slot++) {
+        u32 entry = terrain_node_entry(terrain, node_address, slot);
+        u32 child = terrain_entry_child(terrain, node_address, slot, entry);
+        if (!child) continue;
+        if (depth - 1 > level) {
+            dropped += terrain_collapse_recursive(terrain, child, depth - 1, level);
+            continue;
+        }
+        dropped += terrain_subtree_bytes(terrain, child, depth - 1);
+        terrain_node_set(terrain, node_address, slot, terrain_entry_material(entry), 0);
+        terrain_release(terrain, child, depth - 1);
+        changed = true;
+    }
+    if (changed) terrain_record_delta(terrain, TERRAIN_DELTA_NODES, node_address, 1);
+    terrain_rebound_node(terrain, node_address, depth);
+    return dropped;
+}
+
+size_t terrain_collapse_slab(Terrain *terrain, const TerrainSlab *slab, u32 level) {
+    u32 root = terrain_node_child(terrain, slab->node_address, slab->slot);
+    if (!root) return 0;
+    size_t dropped;
+    if (level < slab->depth) {
+        dropped = terrain_collapse_recursive(terrain, root, slab->depth, level);
+    } else {
+        dropped = terrain_subtree_bytes(terrain, root, slab->depth);
+        terrain_node_set(terrain, slab->node_address, slab->slot, GRASS, 0);
+        terrain_record_delta(terrain, TERRAIN_DELTA_NODES, slab->node_address, 1);
+        terrain_release(terrain, root, slab->depth);
+    }
+    terrain_rebound_path(terrain, slab->x, slab->y, slab->z, slab->depth + 1);
+    return dropped;
+}
+
+static u32 terrain_copy_subtree(Terrain *terrain, const Terrain *source, u32 source_address, u32 depth) {
+    u32 node_address = poolAllocatorAlloc(&terrain->nodePool);
+    if (!node_address) FATAL("SVO node pool is full!");
+    for (u32 slot = 0; slot < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; slot++) {
+        u32 child = terrain_node_child(source, source_address, slot);
+        Voxel material = terrain_node_material(source, source_address, slot);
+        if (child && depth == 1) {
+            u32 chunk_id = poolAllocatorAlloc(&terrain->chunkPool);
+            if (!chunk_id) FATAL("SVO chunk pool is full!");
+            memcpy(poolAllocatorGet(&terrain->chunkPool, chunk_id), poolAllocatorGet(&source->chunkPool, child),
+                   sizeof(Chunk));
+            terrain_record_delta(terrain, TERRAIN_DELTA_CHUNKS, chunk_id, 1);
+            child = chunk_id;
+        } else if (child) {
+            child = terrain_copy_subtree(terrain, source, child, depth - 1);
+        }
+        terrain_node_set(terrain, node_address, slot, material, child);
+    }
+    terrain_record_delta(terrain, TERRAIN_DELTA_NODES, node_address, 1);
+    terrain_rebound_node(terrain, node_address, depth);
+    return node_address;
+}
+
+/**
+ * Bounds of a pyramid cell and of every cell under it down to level bottom, its parent being bounded already. The cell
+ * is sampled once, which bounds its columns within the distance the height can move from the sample, intersected with
+ * its parent. That's only done where the band of heights the parent lets classification depend on straddles two nodes
+ * of the cell's level: otherwise the whole band is in a single node, every other one of the column being uniform
+ * whatever the bounds, and the cell just inherits its parent's bounds. Once its children are bounded, the cell is
+ * tightened to their union. With sample false every cell inherits, bounds are then conservative but loose until
+ * refined. Returns how many heights were sampled.
+ * A cell is sampled at the center of one of its chunks, picked so that it's the chunk one of its children samples as
+ * well, which then reuses it: only chunk columns ever sample the noise, and at most once. Alternating which child that
+ * is from one level to the next keeps the sample within two thirds of the cell width of its columns.
+ */
+static u64 terrain_bound_cell(Terrain *terrain, u32 level, u32 cx, u32 cy, u32 bottom, bool sample, u32 known) {
+    u32 level_width = terrain->width_chunks >> level, cell_width = CHUNK_WIDTH << level, scale = min(terrain->width, 8192);
+    u32 low = (u32) (0.25 * scale), high = (u32) (0.75 * scale); // see terrain_sample_height
+    if (level < terrain->depth) {
+        HeightApprox parent = terrain->approx_heightmaps[level + 1][cx / NODE_WIDTH + cy / NODE_WIDTH * (level_width / NODE_WIDTH)];
+        low = parent.min;
+        high = parent.max - TERRAIN_OVERHANG;
+    }
+
+    // the chunk the cell samples, and which child samples it too
+    u32 offset = 0, shared_child = level & 1;
+    for (u32 i = 1; i <= level; i++) offset += (i & 1) << (i - 1);
+    u64 samples = 0;
+    u32 h = UINT32_MAX;
+    u32 band_low = low > TERRAIN_CAVE_DEPTH + TERRAIN_OVERHANG ? low - TERRAIN_CAVE_DEPTH - TERRAIN_OVERHANG : 0;
+    if (sample && band_low / cell_width != (high + TERRAIN_OVERHANG) / cell_width) {
+        u32 sample_offset = offset * CHUNK_WIDTH + CHUNK_WIDTH / 2;
+        if (known != UINT32_MAX) h = known;
+        else {
+            h = terrain_sample_height(terrain, cx * cell_width + sample_offset, cy * cell_width + sample_offset);
+            samples++;
+        }
+        double slope = 0.25 * scale * TERRAIN_HEIGHT_NOISE_LIPSCHITZ * 1e-4; // in voxels per voxel
+        double distance = max(sample_offset, cell_width - 1 - sample_offset) * sqrt(2.);
+        u32 reach = (u32) ceil(slope * distance) + 1; // +1 as heights are rounded down
+        if (h > low + reach) low = h - reach;
+        if (h + reach < high) high = h + reach;
+    }
+    HeightApprox *cell = &terrain->approx_heightmaps[level][cx + cy * level_width];
+    *cell = (HeightApprox) {.min=low, .max=high + TERRAIN_OVERHANG};
+    if (level == bottom) return samples;
+
+    HeightApprox children = {.min=UINT32_MAX, .max=0};
+    for (u32 dy = 0; dy < NODE_WIDTH; dy++) {
+        for (u32 dx = 0; dx < NODE_WIDTH; dx++) {
+            u32 child_known = dx == shared_child && dy == shared_child ? h : UINT32_MAX;
+            u32 child_x = cx * NODE_WIDTH + dx, child_y = cy * NODE_WIDTH + dy;
+            samples += terrain_bound_cell(terrain, level - 1, child_x, child_y, bottom, sample, child_known);
+            HeightApprox child = terrain->approx_heightmaps[level - 1][child_x + child_y * level_width * NODE_WIDTH];
+            if (child.min < children.min) children.min = child.min;
+            if (child.max > children.max) children.max = child.max;
+        }
+    }
+    if (children.min > cell->min) cell->min = children.min;
+    if (children.max < cell->max) cell->max = children.max;
+    return samples;
+}
+
+// every cell of levels top to bottom under a footprint, the levels above being bounded already
+static u64 terrain_bound_heights(Terrain *terrain, u32 x, u32 y, u32 width, u32 top, u32 bottom, bool sample) {
+    u32 cell_width = CHUNK_WIDTH << top;
+    u64 samples = 0;
+    for (u32 cy = y / cell_width; cy < (y + width + cell_width - 1) / cell_width; cy++) {
+        for (u32 cx = x / cell_width; cx < (x + width + cell_width - 1) / cell_width; cx++) {
+            samples += terrain_bound_cell(terrain, top, cx, cy, bottom, sample, UINT32_MAX);
+        }
+    }
+    return samples;
+}
+
+// the footprint is a single cell of the pyramid, bounded already, and every level under it is refined
+void terrain_refine_pyramid(Terrain *terrain, u32 x, u32 y, u32 width) {
+    u32 top = 0;
+    while ((CHUNK_WIDTH << top) < width) top++;
+    if (!top) return;
+    terrain_bound_heights(terrain, x, y, width, top - 1, 0, true);
+    for (u32 level = 0; level < top; level++) {
+        u32 level_width = terrain->width_chunks >> level, cell_width = CHUNK_WIDTH << level;
+        for (u32 cy = y / cell_width; cy < (y + width) / cell_width; cy++) {
+            terrain_record_delta(terrain, TERRAIN_DELTA_PYRAMID,
+                                 terrain_pyramid_offset(terrain, level) + x / cell_width + cy * level_width,
+                                 width / cell_width);
+        }
+    }
 }
 
 static void terrain_generate_recursive(Terrain *terrain, u32 cx, u32 cy, u32 cz, u32 depth,
@@ -190,15 +830,17 @@ static void terrain_generate_recursive(Terrain *terrain, u32 cx, u32 cy, u32 cz,
 
             // For every subnode in the subnode column...
             for (u32 dz = 0; dz < NODE_WIDTH; dz++) {
+                Voxel material = terrain_classify(cx + dx * subnode_width, cy + dy * subnode_width,
+                                                  cz + dz * subnode_width, subnode_width, height);
 
-                // If the top block height of the chunk is inferior to the min height for the chunk, it's made out of stone
-                if (cz + (dz + 1) * subnode_width - 1 <= height.min) {
+                // If the density is positive all over the subnode, it's made out of stone
+                if (material == STONE) {
                     (*node)[dx + dy * NODE_WIDTH + dz * NODE_WIDTH * NODE_WIDTH] = STONE << 24;
                     stats->uniform_nodes_per_level[depth] += 1;
 
                 }
-                    // If the bottom block height of the chunk is superior to the max height for the chunk, it's pure air.
-                else if (cz + dz * subnode_width > height.max) {
+                    // If it's negative all over it, it's pure air.
+                else if (material == AIR) {
                     (*node)[dx + dy * NODE_WIDTH + dz * NODE_WIDTH * NODE_WIDTH] = AIR << 24;
                     stats->empty_nodes_per_level[depth] += 1;
                 }
@@ -213,15 +855,26 @@ static void terrain_generate_recursive(Terrain *terrain, u32 cx, u32 cy, u32 cz,
                         node = poolAllocatorGet(&terrain->nodePool, node_address);
 
                         // placing the address of the newly create chunk in its parent node
-                        // For now, we are not generating the actual chunk nor passing the actual chunk address
-                        (*node)[dx + dy * NODE_WIDTH + dz * NODE_WIDTH * NODE_WIDTH] = (GRASS << 24); // | (chunk_id & 0x0fff);
+                        terrain_node_set(terrain, node_address, NODE_SLOT(dx, dy, dz), GRASS, chunk_id);
 
                         // actual chunk gen is here, in the terrain_generate_chunk function.
-                        terrain_generate_chunk(terrain,
-                                               cx + dx * subnode_width,
-                                               cy + dy * subnode_width,
-                                               cz + dz * subnode_width,
-                                               poolAllocatorGet(&terrain->chunkPool, chunk_id));
+                        Chunk *chunk = poolAllocatorGet(&terrain->chunkPool, chunk_id);
+                        bool mixed = terrain_generate_chunk(terrain,
+                                                            cx + dx * subnode_width,
+                                                            cy + dy * subnode_width,
+                                                            cz + dz * subnode_width,
+                                                            chunk);
+                        stats->sampled_voxels += sizeof(Chunk);
+
+                        // bounds aren't tight, so sampling may still find the chunk uniform, in which case it goes
+                        if (!mixed) {
+                            Voxel uniform = (*chunk)[0];
+                            terrain_node_set(terrain, node_address, NODE_SLOT(dx, dy, dz), uniform, 0);
+                            poolAllocatorDealloc(&terrain->chunkPool, chunk_id);
+                            if (uniform == AIR) stats->empty_nodes_per_level[depth] += 1;
+                            else stats->uniform_nodes_per_level[depth] += 1;
+                            continue;
+                        }
 
                         // at last updating the stats...
                         stats->mixed_nodes_per_level[depth] += 1;
@@ -230,8 +883,7 @@ static void terrain_generate_recursive(Terrain *terrain, u32 cx, u32 cy, u32 cz,
                         node = poolAllocatorGet(&terrain->nodePool, node_address);
 
 
-                        if (subnode_id & 0xff000000) FATAL("SVO node pool index overflow!")
-                        (*node)[dx + dy * NODE_WIDTH + dz * NODE_WIDTH * NODE_WIDTH] = (GRASS << 24) | (subnode_id & 0x00ffffff);
+                        terrain_node_set(terrain, node_address, NODE_SLOT(dx, dy, dz), GRASS, subnode_id);
 
                         stats->mixed_nodes_per_level[depth] += 1;
                         /**
@@ -256,18 +908,892 @@ static void terrain_generate_recursive(Terrain *terrain, u32 cx, u32 cy, u32 cz,
 
 }
 
-static void terrain_generate_chunk(Terrain *terrain, u32 x, u32 y, u32 z, Chunk (*chunk)) {
+// one octave of the height noise before it's folded into ridges, at the column coordinates fnlGetNoise2D is given
+static float terrain_height_octave(u32 octave, double x, double y) {
+    FNLfloat noise_x = (FNLfloat) (x * 1e-4), noise_y = (FNLfloat) (y * 1e-4);
+    _fnlTransformNoiseCoordinate2D(&noiseGen2D, &noise_x, &noise_y);
+    for (u32 i = 0; i < octave; i++) {
+        noise_x *= noiseGen2D.lacunarity;
+        noise_y *= noiseGen2D.lacunarity;
+    }
+    return _fnlSingleSimplex2D(noiseGen2D.seed + (int) octave, noise_x, noise_y);
+}
+
+// Catmull-Rom weights of the 4 samples around a point t of the way between the middle two
+static void terrain_cubic_weights(float t, float weights[4]) {
+    weights[0] = t * ((2 - t) * t - 1) / 2;
+    weights[1] = (t * t * (3 * t - 5) + 2) / 2;
+    weights[2] = t * ((4 - 3 * t) * t + 1) / 2;
+    weights[3] = (t - 1) * t * t / 2;
+}
+
+/**
+ * The octaves of the ridged fractal add up independently, and the first ones barely move over thousands of columns.
+ * The first coarse_octaves of them are sampled every TERRAIN_COARSE_NOISE_SPACING columns and upsampled, the others
+ * are evaluated per column. It's the signed noise that is interpolated, folding it into ridges first would leave
+ * creases between the samples. Samples sit at fixed columns and every column is interpolated the same way, so the
+ * result doesn't depend on the block it was sampled in.
+ * That sum is what FastNoiseLite's ridged fractal computes with no weighted strength, rebuilt from its internals.
+ * Blocks are at most TERRAIN_HEIGHT_TILE_WIDTH wide, so that the coarse samples fit on the stack.
+ */
+void terrain_sample_height_noise(u32 x, u32 y, u32 width, u32 coarse_octaves, float *noise) {
+    if (width > TERRAIN_HEIGHT_TILE_WIDTH) FATAL("Height noise blocks are at most %u wide", TERRAIN_HEIGHT_TILE_WIDTH);
+    if (!coarse_octaves) {
+        for (u32 dy = 0; dy < width; dy++) {
+            for (u32 dx = 0; dx < width; dx++) {
+                noise[dx + dy * width] = fnlGetNoise2D(&noiseGen2D, (x + dx) * 1e-4, (y + dy) * 1e-4);
+            }
+        }
+        return;
+    }
+    u32 octaves = (u32) noiseGen2D.octaves, spacing = TERRAIN_COARSE_NOISE_SPACING;
+    if (coarse_octaves > octaves) coarse_octaves = octaves;
+
+    // the samples around the block, from one before its first to two after its last, on both axes
+    i64 first_x = (i64) (x / spacing) - 1, first_y = (i64) (y / spacing) - 1;
+    u32 grid_width = max((x + width - 1) / spacing - x / spacing, (y + width - 1) / spacing - y / spacing) + 4;
+    size_t grid_size = (size_t) grid_width * grid_width;
+    float grid[TERRAIN_HEIGHT_OCTAVES * TERRAIN_COARSE_GRID_WIDTH * TERRAIN_COARSE_GRID_WIDTH];
+    for (u32 octave = 0; octave < coarse_octaves; octave++) {
+        for (u32 gy = 0; gy < grid_width; gy++) {
+            for (u32 gx = 0; gx < grid_width; gx++) {
+                grid[octave * grid_size + gx + gy * grid_width] = terrain_height_octave(
+                        octave, (double) ((first_x + gx) * spacing), (double) ((first_y + gy) * spacing));
+            }
+        }
+    }
+
+    // columns are interpolated along y once per row, then each column along x
+    float rows[TERRAIN_HEIGHT_OCTAVES * TERRAIN_COARSE_GRID_WIDTH], weights_x[TERRAIN_HEIGHT_TILE_WIDTH][4];
+    for (u32 dx = 0; dx < width; dx++) terrain_cubic_weights((float) ((x + dx) % spacing) / (float) spacing, weights_x[dx]);
+    float bounding = _fnlCalculateFractalBounding(&noiseGen2D), gain = noiseGen2D.gain;
+    for (u32 dy = 0; dy < width; dy++) {
+        float weights_y[4];
+        terrain_cubic_weights((float) ((y + dy) % spacing) / (float) spacing, weights_y);
+        const float *samples = grid + ((y + dy) / spacing - y / spacing) * grid_width;
+        for (u32 octave = 0; octave < coarse_octaves; octave++) {
+            for (u32 gx = 0; gx < grid_width; gx++) {
+                const float *column = samples + octave * grid_size + gx;
+                rows[octave * grid_width + gx] = weights_y[0] * column[0] + weights_y[1] * column[grid_width] +
+                                                 weights_y[2] * column[2 * grid_width] +
+                                                 weights_y[3] * column[3 * grid_width];
+            }
+        }
+        for (u32 dx = 0; dx < width; dx++) {
+            const float *row = rows + (x + dx) / spacing - x / spacing;
+            float sum = 0, amplitude = bounding;
+            for (u32 octave = 0; octave < coarse_octaves; octave++, row += grid_width) {
+                float value = weights_x[dx][0] * row[0] + weights_x[dx][1] * row[1] + weights_x[dx][2] * row[2] +
+                              weights_x[dx][3] * row[3];
+                value = fabsf(value) < 1.f ? fabsf(value) : 1.f; // the interpolation overshoots a bit
+                sum += (value * -2 + 1) * amplitude;
+                amplitude *= gain;
+            }
+            if (coarse_octaves < octaves) {
+                FNLfloat noise_x = (FNLfloat) ((x + dx) * 1e-4), noise_y = (FNLfloat) ((y + dy) * 1e-4);
+                _fnlTransformNoiseCoordinate2D(&noiseGen2D, &noise_x, &noise_y);
+                for (u32 octave = 0; octave < coarse_octaves; octave++) {
+                    noise_x *= noiseGen2D.lacunarity;
+                    noise_y *= noiseGen2D.lacunarity;
+                }
+                for (u32 octave = coarse_octaves; octave < octaves; octave++) {
+                    float value = _fnlSingleSimplex2D(noiseGen2D.seed + (int) octave, noise_x, noise_y);
+                    sum += (fabsf(value) * -2 + 1) * amplitude;
+                    noise_x *= noiseGen2D.lacunarity;
+                    noise_y *= noiseGen2D.lacunarity;
+                    amplitude *= gain;
+                }
+            }
+            noise[dx + dy * width] = sum;
+        }
+    }
+}
+
+static u32 terrain_height_from_noise(const Terrain *terrain, float noise) {
     u32 scale = min(terrain->width, 8192);
+    return 0.25 * scale + 0.5 * scale * (noise * 0.5 + 0.5);
+}
+
+static u32 terrain_sample_height(const Terrain *terrain, u32 x, u32 y) {
+    float noise;
+    terrain_sample_height_noise(x, y, 1, TERRAIN_COARSE_OCTAVES, &noise);
+    return terrain_height_from_noise(terrain, noise);
+}
+
+// every column of the footprint, so that chunks read their heights rather than sampling them again
+void terrain_generate_heightmap_columns(Terrain *terrain, u32 x, u32 y, u32 width) {
+    u32 tile_width = min(width, TERRAIN_HEIGHT_TILE_WIDTH);
+    float noise[TERRAIN_HEIGHT_TILE_WIDTH * TERRAIN_HEIGHT_TILE_WIDTH];
+    for (u32 ty = y; ty < y + width; ty += tile_width) {
+        for (u32 tx = x; tx < x + width; tx += tile_width) {
+            terrain_sample_height_noise(tx, ty, tile_width, TERRAIN_COARSE_OCTAVES, noise);
+            for (u32 dy = 0; dy < tile_width; dy++) {
+                for (u32 dx = 0; dx < tile_width; dx++) {
+                    terrain->heightmap[tx + dx + (size_t) (ty + dy) * terrain->width] =
+                            terrain_height_from_noise(terrain, noise[dx + dy * tile_width]);
+                }
+            }
+        }
+    }
+}
+
+// a lattice point of a density noise, in [-1, 1]
+static float terrain_lattice_value(u32 x, u32 y, u32 z, u32 seed) {
+    u32 hash = x * 0x8da6b343u ^ y * 0xd8163841u ^ z * 0xcb1ab31fu ^ seed;
+    hash ^= hash >> 16;
+    hash *= 0x7feb352du;
+    hash ^= hash >> 15;
+    hash *= 0x846ca68bu;
+    hash ^= hash >> 16;
+    return (float) hash / 2147483647.5f - 1.f;
+}
+
+// smoothstep, so that the noise has no visible creases along the lattice
+static float terrain_lattice_fade(u32 offset) {
+    float t = (float) offset / TERRAIN_DENSITY_PERIOD;
+    return t * t * (3.f - 2.f * t);
+}
+
+// the 8 lattice points around a lattice cell, x first
+static void terrain_lattice_cell(u32 lx, u32 ly, u32 lz, u32 seed, float corners[8]) {
+    for (u32 i = 0; i < 8; i++) corners[i] = terrain_lattice_value(lx + (i & 1), ly + (i >> 1 & 1), lz + (i >> 2), seed);
+}
+
+// the noise at both x ends of a lattice cell, for faded y and z offsets in it
+static void terrain_lattice_faces(const float corners[8], float ty, float tz, float faces[2]) {
+    for (u32 bx = 0; bx < 2; bx++) {
+        float bottom = corners[bx] + (corners[bx | 2] - corners[bx]) * ty;
+        float top = corners[bx | 4] + (corners[bx | 6] - corners[bx | 4]) * ty;
+        faces[bx] = bottom + (top - bottom) * tz;
+    }
+}
+
+// the noise at a point of a lattice cell, from its faded offsets in it
+static float terrain_lattice_interpolate(const float corners[8], float tx, float ty, float tz) {
+    float faces[2];
+    terrain_lattice_faces(corners, ty, tz, faces);
+    return faces[0] + (faces[1] - faces[0]) * tx;
+}
+
+// a density noise over a whole chunk, which lies in a single lattice cell. Same arithmetic as above, row by row.
+static void terrain_density_noise_chunk(u32 x, u32 y, u32 z, u32 seed, float noise[sizeof(Chunk)]) {
+    float corners[8], fades[3][CHUNK_WIDTH];
+    terrain_lattice_cell(x / TERRAIN_DENSITY_PERIOD, y / TERRAIN_DENSITY_PERIOD, z / TERRAIN_DENSITY_PERIOD, seed,
+                         corners);
+    for (u32 d = 0; d < CHUNK_WIDTH; d++) {
+        fades[0][d] = terrain_lattice_fade(x % TERRAIN_DENSITY_PERIOD + d);
+        fades[1][d] = terrain_lattice_fade(y % TERRAIN_DENSITY_PERIOD + d);
+        fades[2][d] = terrain_lattice_fade(z % TERRAIN_DENSITY_PERIOD + d);
+    }
+    for (u32 dz = 0; dz < CHUNK_WIDTH; dz++) {
+        for (u32 dy = 0; dy < CHUNK_WIDTH; dy++) {
+            float faces[2];
+            terrain_lattice_faces(corners, fades[1][dy], fades[2][dz], faces);
+            for (u32 dx = 0; dx < CHUNK_WIDTH; dx++) {
+                noise[CHUNK_SLOT(dx, dy, dz)] = faces[0] + (faces[1] - faces[0]) * fades[0][dx];
+            }
+        }
+    }
+}
+
+/**
+ * Bounds of a density noise over the voxels of a cubic box. Within a lattice cell, the noise is multilinear in the
+ * faded offsets, and fading is monotonic, so its extremes over the part of the box in the cell are at the corners of
+ * that part. Boxes over more than 2 cells a side are bounded by the lattice points around them instead, since the
+ * weights of the interpolation are all positive and sum to 1. Bounds are widened a little, for rounding.
+ */
+static void terrain_density_noise_bounds(u32 x, u32 y, u32 z, u32 width, u32 seed, float *low, float *high) {
+    u32 first_x = x / TERRAIN_DENSITY_PERIOD, last_x = (x + width - 1) / TERRAIN_DENSITY_PERIOD;
+    u32 first_y = y / TERRAIN_DENSITY_PERIOD, last_y = (y + width - 1) / TERRAIN_DENSITY_PERIOD;
+    u32 first_z = z / TERRAIN_DENSITY_PERIOD, last_z = (z + width - 1) / TERRAIN_DENSITY_PERIOD;
+    *low = 1.f;
+    *high = -1.f;
+    if (last_x - first_x > 1) {
+        for (u32 lz = first_z; lz <= last_z + 1; lz++) {
+            for (u32 ly = first_y; ly <= last_y + 1; ly++) {
+                for (u32 lx = first_x; lx <= last_x + 1; lx++) {
+                    float value = terrain_lattice_value(lx, ly, lz, seed);
+                    *low = fminf(*low, value);
+                    *high = fmaxf(*high, value);
+                }
+            }
+        }
+    } else {
+        for (u32 lz = first_z; lz <= last_z; lz++) {
+            for (u32 ly = first_y; ly <= last_y; ly++) {
+                for (u32 lx = first_x; lx <= last_x; lx++) {
+                    float corners[8];
+                    terrain_lattice_cell(lx, ly, lz, seed, corners);
+                    u32 cell_x = lx * TERRAIN_DENSITY_PERIOD, cell_y = ly * TERRAIN_DENSITY_PERIOD;
+                    u32 cell_z = lz * TERRAIN_DENSITY_PERIOD, end = TERRAIN_DENSITY_PERIOD - 1;
+                    float txs[2] = {terrain_lattice_fade(max(x, cell_x) - cell_x),
+                                    terrain_lattice_fade(min(x + width - 1, cell_x + end) - cell_x)};
+                    float tys[2] = {terrain_lattice_fade(max(y, cell_y) - cell_y),
+                                    terrain_lattice_fade(min(y + width - 1, cell_y + end) - cell_y)};
+                    float tzs[2] = {terrain_lattice_fade(max(z, cell_z) - cell_z),
+                                    terrain_lattice_fade(min(z + width - 1, cell_z + end) - cell_z)};
+                    for (u32 i = 0; i < 8; i++) {
+                        float value = terrain_lattice_interpolate(corners, txs[i & 1], tys[i >> 1 & 1], tzs[i >> 2]);
+                        *low = fminf(*low, value);
+                        *high = fmaxf(*high, value);
+                    }
+                }
+            }
+        }
+    }
+    *low -= 1e-4f;
+    *high += 1e-4f;
+}
+
+/**
+ * The density of a voxel is h - z + TERRAIN_OVERHANG * overhang_noise, h being the height of its column, and it is
+ * stone where that is positive. Stone less than TERRAIN_CAVE_DEPTH under the heightmap surface is then carved where
+ * both cave noises are close to 0, which makes long winding tunnels.
+ * This classifies a cubic box from interval bounds on the density over it: STONE or AIR if the whole box is, UNKNOWN if
+ * it has to be looked at closer. Heights are bounded by the pyramid cell of the box, whose max covers overhangs.
+ * Noises are only bounded when the height alone can't tell.
+ */
+static Voxel terrain_classify(u32 x, u32 y, u32 z, u32 width, HeightApprox height) {
+    float height_low = (float) height.min, height_high = (float) height.max - TERRAIN_OVERHANG;
+    float bottom = (float) z, top = (float) (z + width - 1), low = -1.f, high = 1.f;
+    if (height_high - bottom + TERRAIN_OVERHANG <= 0) return AIR;
+    if (height_low - top - TERRAIN_OVERHANG <= 0) {
+        terrain_density_noise_bounds(x, y, z, width, TERRAIN_OVERHANG_SEED, &low, &high);
+        if (height_high - bottom + TERRAIN_OVERHANG * high <= 0) return AIR;
+        if (height_low - top + TERRAIN_OVERHANG * low <= 0) return UNKNOWN;
+    }
+
+    // all stone but for caves, which can't reach that deep, or can't be where either noise keeps away from 0
+    if (top + TERRAIN_CAVE_DEPTH <= height_low) return STONE;
+    terrain_density_noise_bounds(x, y, z, width, TERRAIN_CAVE_SEED, &low, &high);
+    if (low >= TERRAIN_CAVE_WIDTH || high <= -TERRAIN_CAVE_WIDTH) return STONE;
+    terrain_density_noise_bounds(x, y, z, width, TERRAIN_CAVE_SEED_2, &low, &high);
+    if (low >= TERRAIN_CAVE_WIDTH || high <= -TERRAIN_CAVE_WIDTH) return STONE;
+    return UNKNOWN;
+}
+
+/**
+ * Samples the density of every voxel of a chunk, and returns whether it's mixed. Heights are read from the heightmap,
+ * which must have been generated under the chunk.
+ */
+static bool terrain_generate_chunk(Terrain *terrain, u32 x, u32 y, u32 z, Chunk (*chunk)) {
+    float overhang[sizeof(Chunk)], caves[sizeof(Chunk)], caves_2[sizeof(Chunk)];
+    terrain_density_noise_chunk(x, y, z, TERRAIN_OVERHANG_SEED, overhang);
+    terrain_density_noise_chunk(x, y, z, TERRAIN_CAVE_SEED, caves);
+    terrain_density_noise_chunk(x, y, z, TERRAIN_CAVE_SEED_2, caves_2);
+    u32 stone = 0;
     for(int dx=0; dx<CHUNK_WIDTH; dx++){
         for(int dy=0; dy<CHUNK_WIDTH; dy++){
-            u32 h = 0.25 * scale + 0.5 * scale * (fnlGetNoise2D(&noiseGen2D, (x+dx) * 1e-4, (y+dy) * 1e-4) * 0.5 + 0.5);
-            u32 offset = (x+dx)+(y+dy)*CHUNK_WIDTH;
-            for(int dz=0; z+dz<h; dz++){
-                *chunk[offset+(z+dz)*CHUNK_WIDTH*CHUNK_WIDTH] = STONE;
+            u32 h = terrain->heightmap[x + dx + (size_t) (y + dy) * terrain->width];
+            for(int dz=0; dz<CHUNK_WIDTH; dz++){
+                u32 slot = CHUNK_SLOT(dx, dy, dz), vz = z + dz;
+                bool solid = (float) h - (float) vz + TERRAIN_OVERHANG * overhang[slot] > 0;
+                if (solid && vz + TERRAIN_CAVE_DEPTH > h) {
+                    solid = fabsf(caves[slot]) >= TERRAIN_CAVE_WIDTH || fabsf(caves_2[slot]) >= TERRAIN_CAVE_WIDTH;
+                }
+                (*chunk)[slot] = solid ? STONE : AIR;
+                stone += solid;
+            }
+        }
+    }
+    return stone && stone < sizeof(Chunk);
+}
+
+/**
+ * Raises the skylight map to the top-most opaque voxel of every column of the subtree. Higher subnodes are visited
+ * first, so that chunk columns already covered by something higher are not scanned at all. Since it only ever raises
+ * columns, subtrees can be added in any order, e.g. as they are grafted in a progressively generated terrain.
+ */
+static void terrain_skylight_build_recursive(Terrain *terrain, u32 node_address, u32 x, u32 y, u32 z, u32 depth) {
+    depth -= 1;
+    u32 subnode_width = (u32) pow(NODE_WIDTH, depth) * CHUNK_WIDTH;
+    for (i32 dz = NODE_WIDTH - 1; dz >= 0; dz--) {
+        for (u32 dx = 0; dx < NODE_WIDTH; dx++) {
+            for (u32 dy = 0; dy < NODE_WIDTH; dy++) {
+                u32 slot = NODE_SLOT(dx, dy, dz), entry = terrain_node_entry(terrain, node_address, slot);
+                terrain_skylight_build_subnode(terrain, terrain_entry_material(entry),
+                                               terrain_entry_child(terrain, node_address, slot, entry),
+                                               x + dx * subnode_width, y + dy * subnode_width, z + dz * subnode_width,
+                                               depth);
+            }
+        }
+    }
+}
+
+// one entry of a node, depth being the level of the subnode it points to
+static void terrain_skylight_build_subnode(Terrain *terrain, Voxel material, u32 child, u32 x, u32 y, u32 z, u32 depth) {
+    if (child && depth > 0) {
+        terrain_skylight_build_recursive(terrain, child, x, y, z, depth);
+    } else if (child) { // it's a chunk, we scan each of its columns from the top
+        Chunk *chunk = poolAllocatorGet(&terrain->chunkPool, child);
+        for (u32 cx = 0; cx < CHUNK_WIDTH; cx++) {
+            for (u32 cy = 0; cy < CHUNK_WIDTH; cy++) {
+                u32 *column = &terrain->skylight[x + cx + (size_t) (y + cy) * terrain->width];
+                if (*column >= z + CHUNK_WIDTH) continue;
+                for (i32 cz = CHUNK_WIDTH - 1; cz >= 0; cz--) {
+                    if (MATERIAL_IS_OPAQUE((*chunk)[CHUNK_SLOT(cx, cy, cz)])) {
+                        if (*column < z + cz + 1) __atomic_store_n(column, z + cz + 1, __ATOMIC_RELAXED);
+                        break;
+                    }
+                }
+            }
+        }
+    } else if (MATERIAL_IS_OPAQUE(material)) {
+        terrain_skylight_fill(terrain, x, y, CHUNK_WIDTH << depth, z + (CHUNK_WIDTH << depth));
+    }
+}
+
+/**
+ * Only the column of subnodes above and below the footprint is visited, down to the level where a subnode is exactly
+ * as wide as it. Higher ones first, like terrain_skylight_build_recursive.
+ */
+static void terrain_skylight_build_footprint_recursive(Terrain *terrain, u32 node_address, u32 nx, u32 ny, u32 nz,
+                                                       u32 depth, u32 x, u32 y, u32 width) {
+    depth -= 1;
+    u32 subnode_width = CHUNK_WIDTH << depth;
+    u32 dx = (x - nx) / subnode_width, dy = (y - ny) / subnode_width;
+    for (i32 dz = NODE_WIDTH - 1; dz >= 0; dz--) {
+        u32 slot = NODE_SLOT(dx, dy, dz), entry = terrain_node_entry(terrain, node_address, slot);
+        u32 child = terrain_entry_child(terrain, node_address, slot, entry);
+        u32 sx = nx + dx * subnode_width, sy = ny + dy * subnode_width, sz = nz + dz * subnode_width;
+        if (subnode_width == width) {
+            terrain_skylight_build_subnode(terrain, terrain_entry_material(entry), child, sx, sy, sz, depth);
+        } else if (child) {
+            terrain_skylight_build_footprint_recursive(terrain, child, sx, sy, sz, depth, x, y, width);
+        } else if (MATERIAL_IS_OPAQUE(terrain_entry_material(entry))) {
+            terrain_skylight_fill(terrain, x, y, width, sz + subnode_width);
+        }
+    }
+}
+
+/**
+ * Raises the skylight of a square footprint, aligned on its width, to whatever the tree now holds there. Like every
+ * skylight build it only ever raises columns.
+ */
+void terrain_build_skylight(Terrain *terrain, u32 x, u32 y, u32 width) {
+    if (width >= terrain->width) {
+        terrain_skylight_build_recursive(terrain, terrain->root_node_address, 0, 0, 0, terrain->depth);
+    } else {
+        terrain_skylight_build_footprint_recursive(terrain, terrain->root_node_address, 0, 0, 0, terrain->depth, x, y,
+                                                   width);
+    }
+    // one range from the first to the last column of the footprint, rather than one per row
+    terrain_record_delta(terrain, TERRAIN_DELTA_SKYLIGHT, x + y * terrain->width, (width - 1) * terrain->width + width);
+}
+
+// a uniform opaque subnode is the top of every column of its footprint that doesn't have a higher one yet
+static void terrain_skylight_fill(Terrain *terrain, u32 x, u32 y, u32 width, u32 height) {
+    for (u32 cy = 0; cy < width; cy++) {
+        u32 *column = &terrain->skylight[x + (size_t) (y + cy) * terrain->width];
+        for (u32 cx = 0; cx < width; cx++) {
+            if (column[cx] < height) __atomic_store_n(&column[cx], height, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+Voxel terrain_get_voxel(const Terrain *terrain, u32 x, u32 y, u32 z) {
+    return terrain_get_snapshot_voxel(terrain, __atomic_load_n(&terrain->root_node_address, __ATOMIC_ACQUIRE), x, y, z);
+}
+
+Voxel terrain_get_snapshot_voxel(const Terrain *terrain, u32 snapshot, u32 x, u32 y, u32 z) {
+    if (x >= terrain->width || y >= terrain->width || z >= terrain->width) return AIR;
+    u32 node_address = snapshot;
+    u32 subnode_width = terrain->width;
+    for (u32 depth = terrain->depth; depth > 0; depth--) {
+        subnode_width /= NODE_WIDTH;
+        u32 slot = NODE_SLOT(x / subnode_width % NODE_WIDTH, y / subnode_width % NODE_WIDTH, z / subnode_width % NODE_WIDTH);
+        u32 entry = terrain_node_entry(terrain, node_address, slot);
+        u32 child = terrain_entry_child(terrain, node_address, slot, entry);
+        if (!child) return terrain_entry_material(entry);
+        if (depth == 1) {
+            Chunk *chunk = poolAllocatorGet(&terrain->chunkPool, child);
+            return __atomic_load_n(&(*chunk)[CHUNK_SLOT(x % CHUNK_WIDTH, y % CHUNK_WIDTH, z % CHUNK_WIDTH)],
+                                   __ATOMIC_RELAXED);
+        }
+        node_address = child;
+    }
+    return UNKNOWN; // unreachable, the loop always ends on a uniform subnode or a chunk
+}
+
+/**
+ * Sets a single voxel, splitting the uniform subnodes on the way down when needed.
+ * Split subnodes keep their material as LOD color. A chunk that becomes uniform is merged back into its parent entry,
+ * and its slot freed through terrain_free_slot since readers may still be in it. Nodes are never merged back for now.
+ * Subnodes shared with a snapshot are copied on the way down, the root included.
+ */
+void terrain_set_voxel(Terrain *terrain, u32 x, u32 y, u32 z, Voxel voxel) {
+    if (x >= terrain->width || y >= terrain->width || z >= terrain->width) return;
+    if (terrain_get_voxel(terrain, x, y, z) == voxel) return; // nothing to do, and above all nothing to copy
+
+    u32 node_address = terrain_unshare(terrain, terrain->root_node_address, terrain->depth);
+    if (node_address != terrain->root_node_address) {
+        __atomic_store_n(&terrain->root_node_address, node_address, __ATOMIC_RELEASE);
+        terrain_record_delta(terrain, TERRAIN_DELTA_ROOT, node_address, 1);
+    }
+    u32 path[TERRAIN_MAX_DEPTH + 1], chunk_address = 0;
+    u32 subnode_width = terrain->width;
+    for (u32 depth = terrain->depth; depth > 0; depth--) {
+        path[depth] = node_address;
+        subnode_width /= NODE_WIDTH;
+        u32 slot = NODE_SLOT(x / subnode_width % NODE_WIDTH, y / subnode_width % NODE_WIDTH, z / subnode_width % NODE_WIDTH);
+        u32 child = terrain_node_child(terrain, node_address, slot);
+        Voxel material = terrain_node_material(terrain, node_address, slot);
+        if (child) {
+            u32 copy = terrain_unshare(terrain, child, depth - 1);
+            if (copy != child) {
+                terrain_node_set(terrain, node_address, slot, material, copy);
+                terrain_record_delta(terrain, TERRAIN_DELTA_NODES, node_address, 1);
+                child = copy;
+            }
+        } else {
+            if (material == voxel) return; // nothing to do, the whole subnode is already made of it
+            if (depth == 1) {
+                child = poolAllocatorAlloc(&terrain->chunkPool);
+                memset(poolAllocatorGet(&terrain->chunkPool, child), material, sizeof(Chunk));
+            } else {
+                child = poolAllocatorAlloc(&terrain->nodePool);
+                for (u32 i = 0; i < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; i++) terrain_node_set(terrain, child, i, material, 0);
+                terrain_record_delta(terrain, TERRAIN_DELTA_NODES, child, 1);
+            }
+            terrain_node_set(terrain, node_address, slot, material, child);
+            terrain_record_delta(terrain, TERRAIN_DELTA_NODES, node_address, 1);
+        }
+        if (depth == 1) {
+            Chunk *chunk = poolAllocatorGet(&terrain->chunkPool, child);
+            __atomic_store_n(&(*chunk)[CHUNK_SLOT(x % CHUNK_WIDTH, y % CHUNK_WIDTH, z % CHUNK_WIDTH)], voxel,
+                             __ATOMIC_RELAXED);
+            u32 i = 0;
+            while (i < sizeof(Chunk) && (*chunk)[i] == voxel) i++;
+            if (i == sizeof(Chunk)) {
+                terrain_node_set(terrain, node_address, slot, voxel, 0);
+                terrain_record_delta(terrain, TERRAIN_DELTA_NODES, node_address, 1);
+                terrain_release(terrain, child, 0);
+                break;
+            }
+            terrain_record_delta(terrain, TERRAIN_DELTA_CHUNKS, child, 1);
+            chunk_address = child;
+        }
+        node_address = child;
+    }
+
+    // So are bounds, which only change up to the first node whose bounds stay the same
+    for (u32 level = 1; level <= terrain->depth; level++) {
+        if (!terrain_rebound_node(terrain, path[level], level)) break;
+    }
+
+    // Hashes are only ever out of date along the path that was just walked
+    if (terrain->node_hashes) {
+        if (chunk_address) terrain_rehash_chunk(terrain, chunk_address);
+        for (u32 level = 1; level <= terrain->depth; level++) terrain_rehash_node(terrain, path[level], level);
+    }
+
+    terrain_widen_pyramid(terrain, x, y, z, 1, voxel != AIR, voxel == AIR);
+
+    // Keeping the skylight map up to date. Removing the top-most voxel means looking down for the next opaque one.
+    // The column is stored once, so that concurrent readers never see it half updated.
+    u32 *column = &terrain->skylight[x + (size_t) y * terrain->width];
+    u32 previous_skylight = *column, skylight = previous_skylight;
+    if (MATERIAL_IS_OPAQUE(voxel)) {
+        if (z + 1 > skylight) skylight = z + 1;
+    } else if (z + 1 == skylight) {
+        skylight = 0;
+        for (i32 dz = (i32) z - 1; dz >= 0; dz--) {
+            if (MATERIAL_IS_OPAQUE(terrain_get_voxel(terrain, x, y, dz))) {
+                skylight = dz + 1;
+                break;
+            }
+        }
+    }
+    if (skylight != previous_skylight) {
+        __atomic_store_n(column, skylight, __ATOMIC_RELAXED);
+        terrain_record_delta(terrain, TERRAIN_DELTA_SKYLIGHT, x + y * terrain->width, 1);
+    }
+}
+
+/**
+ * Same walk as terrain_set_voxel, but stops at the chunk holding the voxel and returns it, split out of a uniform
+ * subnode or copied out of a snapshot if needed, so that it can be written in place. Nothing else is kept up to date:
+ * the caller records the chunk delta, and takes care of the pyramid, skylight map and hashes if what it writes changes
+ * them. Chunks that become uniform aren't merged back.
+ */
+u32 terrain_edit_chunk(Terrain *terrain, u32 x, u32 y, u32 z) {
+    u32 node_address = terrain_unshare(terrain, terrain->root_node_address, terrain->depth);
+    if (node_address != terrain->root_node_address) {
+        __atomic_store_n(&terrain->root_node_address, node_address, __ATOMIC_RELEASE);
+        terrain_record_delta(terrain, TERRAIN_DELTA_ROOT, node_address, 1);
+    }
+    u32 subnode_width = terrain->width;
+    for (u32 depth = terrain->depth; depth > 0; depth--) {
+        subnode_width /= NODE_WIDTH;
+        u32 slot = NODE_SLOT(x / subnode_width % NODE_WIDTH, y / subnode_width % NODE_WIDTH, z / subnode_width % NODE_WIDTH);
+        u32 child = terrain_node_child(terrain, node_address, slot);
+        Voxel material = terrain_node_material(terrain, node_address, slot);
+        u32 copy;
+        if (!child && depth == 1) {
+            copy = poolAllocatorAlloc(&terrain->chunkPool);
+            memset(poolAllocatorGet(&terrain->chunkPool, copy), material, sizeof(Chunk));
+        } else if (!child) {
+            copy = poolAllocatorAlloc(&terrain->nodePool);
+            for (u32 i = 0; i < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; i++) terrain_node_set(terrain, copy, i, material, 0);
+            terrain_record_delta(terrain, TERRAIN_DELTA_NODES, copy, 1);
+        } else {
+            copy = terrain_unshare(terrain, child, depth - 1);
+        }
+        if (copy != child) {
+            terrain_node_set(terrain, node_address, slot, material, copy);
+            terrain_record_delta(terrain, TERRAIN_DELTA_NODES, node_address, 1);
+        }
+        node_address = copy;
+    }
+    return node_address;
+}
+
+// the chunk holding a voxel, or 0 if it's in a uniform subnode
+u32 terrain_chunk_at(const Terrain *terrain, u32 x, u32 y, u32 z) {
+    u32 node_address = terrain->root_node_address, subnode_width = terrain->width;
+    for (u32 depth = terrain->depth; depth > 0; depth--) {
+        subnode_width /= NODE_WIDTH;
+        u32 slot = NODE_SLOT(x / subnode_width % NODE_WIDTH, y / subnode_width % NODE_WIDTH, z / subnode_width % NODE_WIDTH);
+        node_address = terrain_node_child(terrain, node_address, slot);
+        if (!node_address) return 0;
+    }
+    return node_address;
+}
+
+/**
+ * Keeping the height pyramid conservative for a cubic region that now holds non-air voxels (solid) and/or air ones:
+ * max has to cover every non-air voxel, min every air one below it
+ */
+void terrain_widen_pyramid(Terrain *terrain, u32 x, u32 y, u32 z, u32 width, bool solid, bool air) {
+    for (u32 level = 0; level <= terrain->depth; level++) {
+        u32 level_width = terrain->width_chunks >> level;
+        u32 cell_width = CHUNK_WIDTH << level;
+        for (u32 cy = y / cell_width; cy <= (y + width - 1) / cell_width; cy++) {
+            for (u32 cx = x / cell_width; cx <= (x + width - 1) / cell_width; cx++) {
+                u32 cell = cx + cy * level_width;
+                HeightApprox *height = &terrain->approx_heightmaps[level][cell];
+                if (solid && z + width - 1 > height->max) {
+                    height->max = z + width - 1;
+                    terrain_record_delta(terrain, TERRAIN_DELTA_PYRAMID, terrain_pyramid_offset(terrain, level) + cell, 1);
+                }
+                if (air && z <= height->min) {
+                    height->min = z ? z - 1 : 0;
+                    terrain_record_delta(terrain, TERRAIN_DELTA_PYRAMID, terrain_pyramid_offset(terrain, level) + cell, 1);
+                }
+            }
+        }
+    }
+}
+
+// an entry of the per slot side arrays below, that grow when the slot is past their end. New entries are zeroed.
+static void *terrain_side_array(void **array, u32 *size, u32 index, size_t item_size) {
+    if (index >= *size) {
+        u32 new_size = *size ? *size : 1024;
+        while (new_size <= index) new_size = new_size > UINT32_MAX / 2 ? UINT32_MAX : new_size * 2;
+        *array = realloc(*array, (size_t) new_size * item_size);
+        if (!*array) FATAL("Out of memory.");
+        memset((u8 *) *array + (size_t) *size * item_size, 0, (size_t) (new_size - *size) * item_size);
+        *size = new_size;
+    }
+    return (u8 *) *array + (size_t) index * item_size;
+}
+
+/**
+ * The far pool is created on the first far entry, and then grows up to the highest node holding one. It keeps whatever
+ * retireMemory was set on it before, so that readers can keep following far entries while it grows.
+ */
+u32 terrain_set_far_child(Terrain *terrain, u32 node_address, u32 slot, u32 child) {
+    PoolAllocator *pool = &terrain->farPool;
+    if (!pool->memory) {
+        void (*retire_memory)(void *memory) = pool->retireMemory;
+        poolAllocatorCreate(pool, 1024, sizeof(Node), NULL);
+        pool->retireMemory = retire_memory;
+    }
+    poolAllocatorReserve(pool, node_address + 1);
+    __atomic_store_n(&(*(Node *) poolAllocatorGet(pool, node_address))[slot], child, __ATOMIC_RELEASE);
+    terrain_record_delta(terrain, TERRAIN_DELTA_FAR, node_address, 1);
+    return TERRAIN_ENTRY_FAR;
+}
+
+// like the far pool, the bounds pool is created on first use and keeps its retireMemory. Slots it grows by are zeroed.
+static bool terrain_set_bounds(Terrain *terrain, u32 node_address, u32 bounds) {
+    if (terrain_node_bounds(terrain, node_address) == bounds) return false;
+    PoolAllocator *pool = &terrain->boundsPool;
+    if (!pool->memory) {
+        void (*retire_memory)(void *memory) = pool->retireMemory;
+        poolAllocatorCreate(pool, 1024, sizeof(u32), NULL);
+        pool->retireMemory = retire_memory;
+    }
+    u32 used = poolAllocatorUsed(pool);
+    if (node_address >= used) {
+        poolAllocatorReserve(pool, node_address + 1);
+        memset(poolAllocatorGet(pool, used), 0, (size_t) (node_address + 1 - used) * sizeof(u32));
+    }
+    __atomic_store_n((u32 *) poolAllocatorGet(pool, node_address), bounds, __ATOMIC_RELAXED);
+    terrain_record_delta(terrain, TERRAIN_DELTA_NODES, node_address, 1);
+    return true;
+}
+
+// what isn't air in a chunk, as the lowest and past the highest voxel along each axis. Rows of x are tested at once.
+static bool terrain_chunk_extent(const Chunk *chunk, u32 low[3], u32 high[3]) {
+    bool found = false;
+    for (u32 z = 0; z < CHUNK_WIDTH; z++) {
+        for (u32 y = 0; y < CHUNK_WIDTH; y++) {
+            u64 row;
+            memcpy(&row, &(*chunk)[CHUNK_SLOT(0, y, z)], sizeof(row));
+            row ^= AIR * 0x0101010101010101ull;
+            if (!row) continue;
+            u32 row_low = (u32) __builtin_ctzll(row) / 8, row_high = (63 - (u32) __builtin_clzll(row)) / 8 + 1;
+            if (!found) {
+                low[0] = row_low, low[1] = y, low[2] = z;
+                high[0] = row_high, high[1] = y + 1, high[2] = z + 1;
+                found = true;
+                continue;
             }
-            for(int dz=h; dz<CHUNK_WIDTH; dz++){
-                *chunk[offset+(z+dz)*CHUNK_WIDTH*CHUNK_WIDTH] = AIR;
+            low[0] = min(low[0], row_low), low[1] = min(low[1], y);
+            high[0] = max(high[0], row_high), high[1] = max(high[1], y + 1), high[2] = z + 1;
+        }
+    }
+    return found;
+}
+
+bool terrain_rebound_node(Terrain *terrain, u32 node_address, u32 level) {
+    u32 subnode_width = CHUNK_WIDTH << (level - 1), low[3] = {UINT32_MAX, UINT32_MAX, UINT32_MAX}, high[3] = {0};
+    for (u32 slot = 0; slot < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; slot++) {
+        u32 entry = terrain_node_entry(terrain, node_address, slot);
+        u32 child = terrain_entry_child(terrain, node_address, slot, entry);
+        if (!child && terrain_entry_material(entry) == AIR) continue;
+        u32 offset[3] = {slot % NODE_WIDTH, slot / NODE_WIDTH % NODE_WIDTH, slot / (NODE_WIDTH * NODE_WIDTH)};
+        u32 child_low[3] = {0}, child_high[3] = {subnode_width, subnode_width, subnode_width};
+        if (child && level == 1) {
+            if (!terrain_chunk_extent(poolAllocatorGet(&terrain->chunkPool, child), child_low, child_high)) continue;
+        } else if (child) {
+            u32 bounds = terrain_node_bounds(terrain, child), step = subnode_width / TERRAIN_BOUNDS_STEPS;
+            if (bounds == TERRAIN_BOUNDS_EMPTY) continue;
+            for (u32 axis = 0; axis < 3; axis++) {
+                child_low[axis] = (bounds >> axis * 8 & 15) * step;
+                child_high[axis] = (TERRAIN_BOUNDS_STEPS - (bounds >> (axis * 8 + 4) & 15)) * step;
             }
         }
+        for (u32 axis = 0; axis < 3; axis++) {
+            low[axis] = min(low[axis], offset[axis] * subnode_width + child_low[axis]);
+            high[axis] = max(high[axis], offset[axis] * subnode_width + child_high[axis]);
+        }
+    }
+    // rounded outwards, whole steps only
+    u32 bounds = TERRAIN_BOUNDS_EMPTY, step = subnode_width * NODE_WIDTH / TERRAIN_BOUNDS_STEPS;
+    if (high[0]) {
+        bounds = 0;
+        for (u32 axis = 0; axis < 3; axis++) {
+            bounds |= (low[axis] / step | (TERRAIN_BOUNDS_STEPS - 1 - (high[axis] - 1) / step) << 4) << axis * 8;
+        }
+    }
+    return terrain_set_bounds(terrain, node_address, bounds);
+}
+
+void terrain_rebound_path(Terrain *terrain, u32 x, u32 y, u32 z, u32 level) {
+    u32 path[TERRAIN_MAX_DEPTH + 1], node_address = terrain->root_node_address, subnode_width = terrain->width;
+    u32 depth = terrain->depth;
+    for (; depth > level; depth--) {
+        path[depth] = node_address;
+        subnode_width /= NODE_WIDTH;
+        u32 slot = NODE_SLOT(x / subnode_width % NODE_WIDTH, y / subnode_width % NODE_WIDTH, z / subnode_width % NODE_WIDTH);
+        node_address = terrain_node_child(terrain, node_address, slot);
+        if (!node_address) break; // nothing below was bounded, whatever changed there was dropped since
+    }
+    if (node_address) path[depth] = node_address;
+    for (; depth <= terrain->depth; depth++) {
+        if (!terrain_rebound_node(terrain, path[depth], depth)) return;
+    }
+}
+
+// subnodes first, since their parents are bounded from their bounds
+static void terrain_build_bounds_recursive(Terrain *terrain, u32 node_address, u32 level) {
+    if (level > 1) {
+        for (u32 slot = 0; slot < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; slot++) {
+            u32 child = terrain_node_child(terrain, node_address, slot);
+            if (child) terrain_build_bounds_recursive(terrain, child, level - 1);
+        }
+    }
+    terrain_rebound_node(terrain, node_address, level);
+}
+
+void terrain_build_bounds(Terrain *terrain) {
+    u32 time = uclock();
+    terrain_build_bounds_recursive(terrain, terrain->root_node_address, terrain->depth);
+    INFO("Bounded %u nodes in %.2fms", terrain->nodePool.size, (uclock() - time) / 1e3);
+}
+
+// share count of a node (level > 0) or chunk (level 0)
+static u32 *terrain_shares(Terrain *terrain, u32 address, u32 level) {
+    if (level) return terrain_side_array((void **) &terrain->node_shares, &terrain->node_shares_size, address, sizeof(u32));
+    return terrain_side_array((void **) &terrain->chunk_shares, &terrain->chunk_shares_size, address, sizeof(u32));
+}
+
+/**
+ * Returns a subnode that can be written in place: the subnode itself, or a private copy of it if it's shared. The
+ * copy's own subnodes get one more parent, and it's up to the caller to point the parent entry to it, once it's whole.
+ */
+u32 terrain_unshare(Terrain *terrain, u32 address, u32 level) {
+    if (!*terrain_shares(terrain, address, level)) return address;
+    u32 copy;
+    if (level) {
+        copy = poolAllocatorAlloc(&terrain->nodePool);
+        for (u32 i = 0; i < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; i++) {
+            u32 entry = terrain_node_entry(terrain, address, i);
+            u32 child = terrain_entry_child(terrain, address, i, entry);
+            if (child) (*terrain_shares(terrain, child, level - 1))++;
+            terrain_node_set(terrain, copy, i, terrain_entry_material(entry), child);
+        }
+        terrain_record_delta(terrain, TERRAIN_DELTA_NODES, copy, 1);
+        terrain_set_bounds(terrain, copy, terrain_node_bounds(terrain, address));
+    } else {
+        copy = poolAllocatorAlloc(&terrain->chunkPool);
+        memcpy(poolAllocatorGet(&terrain->chunkPool, copy), poolAllocatorGet(&terrain->chunkPool, address), sizeof(Chunk));
+        terrain_record_delta(terrain, TERRAIN_DELTA_CHUNKS, copy, 1);
+    }
+    (*terrain_shares(terrain, address, level))--;
+    if (terrain->node_hashes) {
+        u64 *hash = level ? terrain_side_array((void **) &terrain->node_hashes, &terrain->node_hashes_size, copy, sizeof(u64))
+                          : terrain_side_array((void **) &terrain->chunk_hashes, &terrain->chunk_hashes_size, copy, sizeof(u64));
+        *hash = terrain_get_hash(terrain, address, level);
+    }
+    return copy;
+}
+
+/**
+ * Drops a reference to a subnode. The last one frees it, and drops a reference to each of its own subnodes in turn,
+ * so that releasing a snapshot only walks what it doesn't share with anything else. Node 0 is never freed, since 0
+ * isn't a valid child address.
+ */
+void terrain_release(Terrain *terrain, u32 address, u32 level) {
+    u32 *shares = terrain_shares(terrain, address, level);
+    if (*shares) {
+        (*shares)--;
+        return;
+    }
+    if (!level) {
+        terrain_free_slot(terrain, &terrain->chunkPool, address);
+        return;
+    }
+    for (u32 i = 0; i < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; i++) {
+        u32 child = terrain_node_child(terrain, address, i);
+        if (child) terrain_release(terrain, child, level - 1);
+    }
+    if (address) terrain_free_slot(terrain, &terrain->nodePool, address);
+}
+
+u32 terrain_snapshot(Terrain *terrain) {
+    (*terrain_shares(terrain, terrain->root_node_address, terrain->depth))++;
+    return terrain->root_node_address;
+}
+
+void terrain_release_snapshot(Terrain *terrain, u32 snapshot) {
+    terrain_release(terrain, snapshot, terrain->depth);
+}
+
+/**
+ * The snapshot stays valid, the live tree becomes one more user of it. The skylight map is rebuilt from scratch, so
+ * concurrent readers may see some columns without any sky light until it's done.
+ */
+void terrain_restore_snapshot(Terrain *terrain, u32 snapshot) {
+    u32 previous = terrain->root_node_address;
+    if (snapshot == previous) return;
+    (*terrain_shares(terrain, snapshot, terrain->depth))++;
+    __atomic_store_n(&terrain->root_node_address, snapshot, __ATOMIC_RELEASE);
+    terrain_record_delta(terrain, TERRAIN_DELTA_ROOT, snapshot, 1);
+    terrain_release(terrain, previous, terrain->depth);
+    terrain_rebuild_skylight(terrain);
+}
+
+// from scratch, so that columns can go down too. Concurrent readers may see some columns unlit until it's done.
+void terrain_rebuild_skylight(Terrain *terrain) {
+    size_t columns = (size_t) terrain->width * terrain->width;
+    for (size_t i = 0; i < columns; i++) __atomic_store_n(&terrain->skylight[i], 0, __ATOMIC_RELAXED);
+    terrain_skylight_build_recursive(terrain, terrain->root_node_address, 0, 0, 0, terrain->depth);
+    terrain_record_delta(terrain, TERRAIN_DELTA_SKYLIGHT, 0, (u32) columns);
+}
+
+/**
+ * Merkle hashes. A chunk hashes its voxels, a node the hashes of its 8 entries, where a uniform entry hashes its
+ * material and level. Two subtrees with the same hash are assumed identical, which with 64 bits is a safe bet for any
+ * world that fits in the pools.
+ */
+static u64 terrain_hash_mix(u64 hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+u64 terrain_rehash_chunk(Terrain *terrain, u32 address) {
+    const u64 *words = poolAllocatorGet(&terrain->chunkPool, address);
+    u64 hash = 0x9e3779b97f4a7c15ull;
+    for (u32 i = 0; i < sizeof(Chunk) / sizeof(u64); i++) hash = terrain_hash_mix(hash ^ words[i]) + i;
+    u64 *slot = terrain_side_array((void **) &terrain->chunk_hashes, &terrain->chunk_hashes_size, address, sizeof(u64));
+    return *slot = hash;
+}
+
+u64 terrain_rehash_node(Terrain *terrain, u32 address, u32 level) {
+    u64 hash = 0x2545f4914f6cdd1dull;
+    for (u32 i = 0; i < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; i++) {
+        u32 entry = terrain_node_entry(terrain, address, i);
+        u64 subnode = terrain_subnode_hash(terrain, terrain_entry_material(entry),
+                                           terrain_entry_child(terrain, address, i, entry), level - 1);
+        hash = terrain_hash_mix(hash ^ subnode) + i;
     }
+    u64 *slot = terrain_side_array((void **) &terrain->node_hashes, &terrain->node_hashes_size, address, sizeof(u64));
+    return *slot = hash;
+}
+
+// hash of a node (level > 0) or chunk (level 0) that has been hashed already
+u64 terrain_get_hash(const Terrain *terrain, u32 address, u32 level) {
+    if (level) return address < terrain->node_hashes_size ? terrain->node_hashes[address] : 0;
+    return address < terrain->chunk_hashes_size ? terrain->chunk_hashes[address] : 0;
+}
+
+// the material of a mixed entry is its LOD color, which is hashed too
+u64 terrain_subnode_hash(const Terrain *terrain, Voxel material, u32 child, u32 level) {
+    if (child) return terrain_hash_mix(terrain_get_hash(terrain, child, level) + material);
+    return terrain_hash_mix((u64) material | (u64) level << 8 | 0x7500000000000000ull);
+}
+
+static u64 terrain_build_hashes_recursive(Terrain *terrain, u32 address, u32 level) {
+    if (!level) return terrain_rehash_chunk(terrain, address);
+    for (u32 i = 0; i < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; i++) {
+        u32 child = terrain_node_child(terrain, address, i);
+        if (child) terrain_build_hashes_recursive(terrain, child, level - 1);
+    }
+    return terrain_rehash_node(terrain, address, level);
+}
+
+u64 terrain_build_hashes(Terrain *terrain) {
+    u32 time = uclock();
+    u64 hash = terrain_build_hashes_recursive(terrain, terrain->root_node_address, terrain->depth);
+    INFO("Hashed %u nodes and %u chunks in %.2fms", terrain->nodePool.size, terrain->chunkPool.size,
+         (uclock() - time) / 1e3);
+    return hash;
+}
+
+u64 terrain_root_hash(const Terrain *terrain) {
+    return terrain_get_hash(terrain, terrain->root_node_address, terrain->depth);
+}
+
+// where a level starts when all levels of the height pyramid are packed one after the other, finest first
+u32 terrain_pyramid_offset(const Terrain *terrain, u32 level) {
+    u32 offset = 0;
+    for (u32 i = 0; i < level; i++) offset += (terrain->width_chunks >> i) * (terrain->width_chunks >> i);
+    return offset;
+}
+
+u32 terrain_get_skylight(const Terrain *terrain, u32 x, u32 y) {
+    if (x >= terrain->width || y >= terrain->width) return 0;
+    return __atomic_load_n(&terrain->skylight[x + (size_t) y * terrain->width], __ATOMIC_RELAXED);
+}
+
+// true when nothing opaque is above the voxel, whatever the voxel itself is made of
+bool terrain_is_under_sky(const Terrain *terrain, u32 x, u32 y, u32 z) {
+    return z + 1 >= terrain_get_skylight(terrain, x, y);
 }
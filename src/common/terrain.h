@@ -3,10 +3,23 @@
 #include "memory.h"
 #include "cpmath.h"
 #include "pool_allocator.h"
+#include "log.h"
 
 #define CHUNK_WIDTH (8)
-#define NOISE_SAMPLE_PER_CHUNK_WIDTH (1)
 #define NODE_WIDTH (2)
+#define TERRAIN_MAX_DEPTH (15)
+
+// how deep the grass and dirt layer on top of the stone goes
+#define TERRAIN_SOIL_DEPTH (3)
+
+// how many of the height noise's lowest octaves are sampled every TERRAIN_COARSE_NOISE_SPACING columns and upsampled
+// rather than evaluated per column, 0 evaluating the whole noise per column
+#define TERRAIN_COARSE_OCTAVES (2)
+#define TERRAIN_COARSE_NOISE_SPACING (32)
+
+// how far the 3D density moves the heightmap surface up or down, and how deep under it caves are carved
+#define TERRAIN_OVERHANG (8)
+#define TERRAIN_CAVE_DEPTH (32)
 
 /**
  * The LOD problem: How am I supposed to do LOD with 8x8x8 chunks?
@@ -34,28 +47,89 @@ typedef u8 Voxel;
 typedef Voxel Chunk[CHUNK_WIDTH*CHUNK_WIDTH*CHUNK_WIDTH];
 
 /**
- * 4x4x4x4 bytes aka TWO cache line
- * Contains 24 bit address to chunks and 8 bit voxel for far chunk LOD color
- * 24 bits means ~ 2**24 chunk address.
- * If the 8 bit voxel is 0xff, then the LOD color is "air"
- * Similarly an address of 0xff means no node/chunk
- * Since a chunk is 512 bytes, we can address ~ 8 Go RAM worth of chunks
- * If the 8 bit voxel is 0xff, it's an address to a Node or to air rather than a chunk
+ * 2x2x2x4 bytes aka half a cache line
+ * Contains an entry per subnode, with the address of the subnode and an 8 bit voxel for its LOD color
  */
 typedef u32 Node[NODE_WIDTH*NODE_WIDTH*NODE_WIDTH];
 
+/**
+ * Node entries are read through the helpers below rather than by hand.
+ * The top 8 bits are the material (or LOD color for mixed subnodes), then a far bit, then 23 bits of value. On the
+ * last level of the tree the subnode is in the chunk pool, otherwise in the node pool.
+ * - A value of 0 with the far bit clear means the subnode is uniform: it's entirely made of its material.
+ * - Otherwise the value of a near entry is the signed offset from the node to its subnode, skipping 0 so that it never
+ * looks uniform. Subnodes are mostly allocated right after their parent, so most of them are near.
+ * - Subnodes further away than that are far entries, whose address is in farPool, at the same slot of the far node
+ * that has the node's address. Far nodes only exist up to the highest node that ever held a far entry, so small worlds
+ * don't have any.
+ * Both pools reserve their slot 0 (the root node, and a dummy chunk) so that 0 is never a valid child address.
+ */
+#define TERRAIN_ENTRY_FAR (1u << 23)
+#define TERRAIN_ENTRY_CHILD (0x00ffffffu) // far bit and value, 0 for uniform subnodes
+#define TERRAIN_NEAR_RANGE (1 << 22)
+#define NODE_SLOT(dx, dy, dz) ((dx) + (dy) * NODE_WIDTH + (dz) * NODE_WIDTH * NODE_WIDTH)
+#define CHUNK_SLOT(dx, dy, dz) ((dx) + (dy) * CHUNK_WIDTH + (dz) * CHUNK_WIDTH * CHUNK_WIDTH)
+
+/**
+ * Bounds of what a node holds that isn't air, in sixteenths of the node along each axis, so that rays can be clipped
+ * to them. For x, y and z in turn, 4 bits of lower bound then 4 bits of 15 minus the upper bound, both inclusive: 0 is
+ * the whole node, which is what nodes that were never bounded read as. TERRAIN_BOUNDS_EMPTY is a node of air only.
+ */
+#define TERRAIN_BOUNDS_STEPS (16)
+#define TERRAIN_BOUNDS_EMPTY (1u << 24)
+
 typedef struct HeightApprox {
     u32 min;
     u32 max;
 } HeightApprox;
 
+/**
+ * A mixed subtree of a progressively generated terrain. Until it is generated and grafted, its parent node entry is a
+ * uniform grass placeholder.
+ */
+typedef struct TerrainSlab {
+    u32 node_address, slot;
+    u32 x, y, z, depth;
+} TerrainSlab;
+
+/**
+ * A range of the terrain that changed and has to be uploaded again. Nodes and chunks ranges are in pool slots,
+ * skylight ranges in columns (x + y * width), and pyramid ranges in cells of all levels packed one after the other.
+ * A root delta means the tree now starts at node first, after its root was copied on write. Far ranges are in far
+ * pool slots.
+ */
+typedef enum TerrainDeltaKind {
+    TERRAIN_DELTA_ALL,
+    TERRAIN_DELTA_NODES,
+    TERRAIN_DELTA_CHUNKS,
+    TERRAIN_DELTA_SKYLIGHT,
+    TERRAIN_DELTA_PYRAMID,
+    TERRAIN_DELTA_ROOT,
+    TERRAIN_DELTA_FAR
+} TerrainDeltaKind;
+
+typedef struct TerrainDelta {
+    u32 kind;
+    u32 first, count;
+} TerrainDelta;
+
+// past that many pending deltas, they are folded into a single TERRAIN_DELTA_ALL
+#define TERRAIN_MAX_DELTAS (256)
+
 typedef struct Terrain {
 
     // pool allocator that holds all 4x4x4 chunks and leaves
     PoolAllocator chunkPool;
     PoolAllocator nodePool;
 
-    // pool address of the root node
+    // addresses of far subnodes, indexed like the node pool (see TERRAIN_ENTRY_FAR). Empty until the first far entry.
+    PoolAllocator farPool;
+
+    // bounds of each node (see TERRAIN_BOUNDS_STEPS), indexed like the node pool. Empty until the first node is
+    // bounded, nodes past its end are unbounded.
+    PoolAllocator boundsPool;
+
+    // pool address of the root node. It's node 0 until the root is copied on write, after a snapshot.
     u32 root_node_address;
 
     // depth of the tree. 8 means 4**8 = 65 536 voxels aka 4096 MC chunks
@@ -63,13 +137,238 @@ typedef struct Terrain {
     u32 width;
     u32 width_chunks;
 
-    // heightmap. It's currently unused after world gen, but maybe someday we'll want to play with it.
+    // heightmap, the generated surface of each column that chunks and decoration are made from. It's currently unused
+    // after world gen, but maybe someday we'll want to play with it. Out-of-core terrains map it on a temporary file.
+    // approx_heightmaps[level] holds a min/max per (width_chunks >> level)**2 columns, max being raised by
+    // TERRAIN_OVERHANG so that it also covers overhangs. Bounds come from a few samples and the slope of the noise,
+    // they aren't tight. It's kept conservative on edits and uploaded to the GPU for heightmap pyramid traversal.
     u32 *heightmap;
     HeightApprox **approx_heightmaps;
 
-    // is set to true when the terrain has changed so its GPU-memory copy is updated.
-    bool dirty;
+    // skylight map. For each voxel column, the height right above its top-most opaque voxel, or 0 if the column is
+    // empty. It is kept up to date by terrain_set_voxel, and uploaded as is to the GPU.
+    u32 *skylight;
+
+    // what changed since the deltas were last taken, so that its GPU-memory copy can be updated
+    TerrainDelta deltas[TERRAIN_MAX_DELTAS];
+    u32 delta_count;
+
+    // backing files of the pools and skylight map of an out-of-core terrain, NULL for in-memory terrains.
+    struct TerrainSpill *spill;
+
+    // called instead of freeing node and chunk slots right away when the terrain is read concurrently, NULL otherwise
+    void (*retire_slot)(PoolAllocator *pool, u32 index);
+
+    // copy-on-write: for each node and chunk slot, how many more parents or snapshots point to it than one. Grown as
+    // needed, slots past the end aren't shared.
+    u32 *node_shares, *chunk_shares;
+    u32 node_shares_size, chunk_shares_size;
+
+    // Merkle hash of each node and chunk slot, NULL until terrain_build_hashes. Kept up to date by terrain_set_voxel.
+    u64 *node_hashes, *chunk_hashes;
+    u32 node_hashes_size, chunk_hashes_size;
 } Terrain;
 
+/**
+ * Adjacent or overlapping ranges are merged with one of the last few deltas, which is enough for sequential
+ * allocations even when nodes and chunks are allocated in turn
+ */
+#define TERRAIN_DELTA_MERGE_WINDOW (4)
+
+static INLINE void terrain_record_delta(Terrain *terrain, TerrainDeltaKind kind, u32 first, u32 count) {
+    if (terrain->delta_count && terrain->deltas[0].kind == TERRAIN_DELTA_ALL) return;
+    if (kind == TERRAIN_DELTA_ALL || terrain->delta_count == TERRAIN_MAX_DELTAS) {
+        terrain->deltas[0] = (TerrainDelta) {.kind=TERRAIN_DELTA_ALL};
+        terrain->delta_count = 1;
+        return;
+    }
+    // root deltas hold an address rather than a range, they are never merged
+    for (u32 i = terrain->delta_count;
+         kind != TERRAIN_DELTA_ROOT && i > 0 && i + TERRAIN_DELTA_MERGE_WINDOW > terrain->delta_count; i--) {
+        TerrainDelta *delta = &terrain->deltas[i - 1];
+        if (delta->kind == kind && first <= delta->first + delta->count && delta->first <= first + count) {
+            u32 end = max(delta->first + delta->count, first + count);
+            delta->first = min(delta->first, first);
+            delta->count = end - delta->first;
+            return;
+        }
+    }
+    terrain->deltas[terrain->delta_count++] = (TerrainDelta) {.kind=kind, .first=first, .count=count};
+}
+
+// drops the first count deltas, once they have been handed over
+static INLINE void terrain_clear_deltas(Terrain *terrain, u32 count) {
+    if (count > terrain->delta_count) count = terrain->delta_count;
+    memmove(terrain->deltas, terrain->deltas + count, (terrain->delta_count - count) * sizeof(TerrainDelta));
+    terrain->delta_count -= count;
+}
+
+/**
+ * Entries are loaded with acquire and stored with release semantics, so that a reader pinned in an epoch (see epoch.h)
+ * can walk the tree while it is edited: a subnode is always filled before the entry pointing to it is published.
+ */
+static INLINE u32 terrain_node_entry(const Terrain *terrain, u32 node_address, u32 slot) {
+    return __atomic_load_n(&(*(Node *) poolAllocatorGet(&terrain->nodePool, node_address))[slot], __ATOMIC_ACQUIRE);
+}
+
+static INLINE Voxel terrain_entry_material(u32 entry) {
+    return entry >> 24;
+}
+
+// the address of the subnode an entry of the node at node_address points to, 0 if it's uniform
+static INLINE u32 terrain_entry_child(const Terrain *terrain, u32 node_address, u32 slot, u32 entry) {
+    if (!(entry & TERRAIN_ENTRY_CHILD)) return 0;
+    if (entry & TERRAIN_ENTRY_FAR) {
+        return __atomic_load_n(&(*(Node *) poolAllocatorGet(&terrain->farPool, node_address))[slot], __ATOMIC_ACQUIRE);
+    }
+    i32 offset = (i32) (entry << 9) >> 9;
+    return node_address + (u32) (offset - (offset > 0));
+}
+
+static INLINE u32 terrain_node_child(const Terrain *terrain, u32 node_address, u32 slot) {
+    return terrain_entry_child(terrain, node_address, slot, terrain_node_entry(terrain, node_address, slot));
+}
+
+static INLINE Voxel terrain_node_material(const Terrain *terrain, u32 node_address, u32 slot) {
+    return terrain_entry_material(terrain_node_entry(terrain, node_address, slot));
+}
+
+u32 terrain_set_far_child(Terrain *terrain, u32 node_address, u32 slot, u32 child);
+
+// addresses wrap around, so a child is near whenever it's close enough modulo 2**32
+static INLINE void terrain_node_set(Terrain *terrain, u32 node_address, u32 slot, Voxel material, u32 child) {
+    u32 value = 0;
+    if (child) {
+        i32 offset = (i32) (child - node_address);
+        if (offset >= -TERRAIN_NEAR_RANGE && offset <= TERRAIN_NEAR_RANGE - 2) {
+            value = (u32) (offset + (offset >= 0)) & (TERRAIN_ENTRY_FAR - 1);
+        } else {
+            value = terrain_set_far_child(terrain, node_address, slot, child);
+        }
+    }
+    __atomic_store_n(&(*(Node *) poolAllocatorGet(&terrain->nodePool, node_address))[slot],
+                     ((u32) material << 24) | value, __ATOMIC_RELEASE);
+}
+
+static INLINE u32 terrain_node_bounds(const Terrain *terrain, u32 node_address) {
+    const PoolAllocator *pool = &terrain->boundsPool;
+    if (!pool->memory || node_address >= poolAllocatorUsed(pool)) return 0;
+    return __atomic_load_n((u32 *) poolAllocatorGet(pool, node_address), __ATOMIC_RELAXED);
+}
+
+/**
+ * Slots that concurrent readers may still be walking go through retire_slot, when set, rather than straight back.
+ * Freed nodes are unbounded right away, which is always conservative, so that whatever reuses them starts unbounded.
+ */
+static INLINE void terrain_free_slot(Terrain *terrain, PoolAllocator *pool, u32 index) {
+    if (pool == &terrain->nodePool && terrain_node_bounds(terrain, index)) {
+        __atomic_store_n((u32 *) poolAllocatorGet(&terrain->boundsPool, index), 0, __ATOMIC_RELAXED);
+    }
+    if (terrain->retire_slot) terrain->retire_slot(pool, index);
+    else poolAllocatorDealloc(pool, index);
+}
+
 void terrain_init(Terrain* terrain, u32 depth);
+void terrain_init_empty(Terrain *terrain, u32 depth);
+
+/**
+ * Generates the same world as terrain_init, without ever holding more than about memory_budget bytes of it in RAM.
+ * The tree is generated slab by slab into scratch pools, then spilled into pools mapped on temporary files, that are
+ * written back to disk and dropped from memory as the build goes. Footprints are decorated as soon as their neighbours
+ * are generated, and lit as soon as their neighbours are decorated. The resulting terrain is used like any other one,
+ * except that its pools grow by remapping their files, which may move them: they can't be read while allocating.
+ */
+void terrain_init_out_of_core(Terrain *terrain, u32 depth, size_t memory_budget);
+
+/**
+ * Progressive generation: terrain_init_progressive only generates the height pyramid and the levels above slab_depth,
+ * with placeholders for every mixed slab below, and returns the malloc'd list of slabs, higher ones first.
+ * The rest is done per footprint, in this order (see server/pipeline.h):
+ * - terrain_generate_heightmap_columns samples the full resolution heightmap. terrain_refine_pyramid tightens the
+ * height pyramid under the footprint, whose levels below slab_depth only hold the bounds of their slab until then. It
+ * records deltas, and must not run concurrently with anything else using the terrain.
+ * - terrain_generate_slab only reads the terrain and can run on any thread while it is rendered. terrain_graft_slab
+ * then puts the result in the tree, and must not run concurrently with anything else using the terrain.
+ * - terrain_decorate (see terrain_decoration.h) lays the soil on top of it and places structures.
+ * - terrain_build_skylight lights the footprint. Footprints are square, at least a chunk wide and aligned on their
+ * width.
+ */
+u32 terrain_init_progressive(Terrain *terrain, u32 depth, u32 slab_depth, TerrainSlab **slabs);
+void terrain_generate_heightmap_columns(Terrain *terrain, u32 x, u32 y, u32 width);
+void terrain_refine_pyramid(Terrain *terrain, u32 x, u32 y, u32 width);
+void terrain_generate_slab(const Terrain *terrain, const TerrainSlab *slab, Terrain *scratch);
+void terrain_graft_slab(Terrain *terrain, const TerrainSlab *slab, Terrain *scratch);
+void terrain_build_skylight(Terrain *terrain, u32 x, u32 y, u32 width);
 void terrain_destroy(Terrain* terrain);
+
+/**
+ * Grafted slabs can be collapsed back to LOD leaves, to bound how much of a progressive terrain is held in memory:
+ * every subnode of the slab at the given level becomes uniform, made of its LOD material, and what was under it is
+ * released. Returns how many bytes of slots were dropped from the tree. Grafting the slab again puts it back whole.
+ * Like grafting, it must not run concurrently with anything else writing to the terrain, nor after a snapshot, and
+ * leaves the hashes, skylight map and height pyramid as they were: the last two still describe the generated slab.
+ */
+size_t terrain_collapse_slab(Terrain *terrain, const TerrainSlab *slab, u32 level);
+
+Voxel terrain_get_voxel(const Terrain *terrain, u32 x, u32 y, u32 z);
+void terrain_set_voxel(Terrain *terrain, u32 x, u32 y, u32 z, Voxel voxel);
+u32 terrain_edit_chunk(Terrain *terrain, u32 x, u32 y, u32 z);
+u32 terrain_chunk_at(const Terrain *terrain, u32 x, u32 y, u32 z);
+
+/**
+ * Node bounds are built along with the tree by every kind of generation, and kept up to date by terrain_set_voxel,
+ * grafts, collapses and copies on write. terrain_rebound_node bounds a node from its subnodes, which must be bounded
+ * already, records a node delta if its bounds changed and returns whether they did. terrain_rebound_path does it for
+ * the node of the given level holding a voxel and every node above it, stopping at the first one that didn't change,
+ * and is up to whoever writes to the chunks of terrain_edit_chunk. terrain_build_bounds bounds the whole tree.
+ */
+bool terrain_rebound_node(Terrain *terrain, u32 node_address, u32 level);
+void terrain_rebound_path(Terrain *terrain, u32 x, u32 y, u32 z, u32 level);
+void terrain_build_bounds(Terrain *terrain);
+
+/**
+ * Copy-on-write snapshots of the tree. A snapshot is the address of a root node, that shares every subnode with the
+ * live tree: taking one is O(1), and each terrain_set_voxel after it copies at most the path from the root to the
+ * edited chunk. Subnodes are reclaimed once neither the live tree nor any snapshot uses them anymore.
+ * Only the tree is versioned: restoring a snapshot rebuilds the skylight map, and keeps the height pyramid as is since
+ * it only ever grew more conservative since. Slabs of a progressive terrain must all be grafted before the first one.
+ */
+u32 terrain_snapshot(Terrain *terrain);
+void terrain_release_snapshot(Terrain *terrain, u32 snapshot);
+void terrain_restore_snapshot(Terrain *terrain, u32 snapshot);
+Voxel terrain_get_snapshot_voxel(const Terrain *terrain, u32 snapshot, u32 x, u32 y, u32 z);
+
+/**
+ * Copy-on-write primitives, levels being 0 for chunks and terrain->depth for the root. terrain_unshare returns a
+ * private copy of a shared subnode, that the caller has to put in the parent entry. terrain_release drops a reference.
+ */
+u32 terrain_unshare(Terrain *terrain, u32 address, u32 level);
+void terrain_release(Terrain *terrain, u32 address, u32 level);
+
+/**
+ * Merkle hashes of every subtree, to find what differs between two terrains without comparing them voxel by voxel
+ * (see terrain_sync.h). terrain_build_hashes hashes the whole tree once it's complete, and terrain_set_voxel then
+ * rehashes the path it edits. Generation and grafting don't maintain them, anything else changing the tree has to
+ * rehash what it changed, bottom-up. terrain_get_hash is the hash of a node or chunk, terrain_subnode_hash the one of
+ * a node entry, be it uniform or not.
+ */
+u64 terrain_build_hashes(Terrain *terrain);
+u64 terrain_root_hash(const Terrain *terrain);
+u64 terrain_get_hash(const Terrain *terrain, u32 address, u32 level);
+u64 terrain_subnode_hash(const Terrain *terrain, Voxel material, u32 child, u32 level);
+u64 terrain_rehash_node(Terrain *terrain, u32 address, u32 level);
+u64 terrain_rehash_chunk(Terrain *terrain, u32 address);
+
+void terrain_rebuild_skylight(Terrain *terrain);
+void terrain_widen_pyramid(Terrain *terrain, u32 x, u32 y, u32 z, u32 width, bool solid, bool air);
+
+/**
+ * The height noise of a width*width block of columns, row by row, in [-1, 1], with that many coarse octaves (see
+ * TERRAIN_COARSE_OCTAVES). Generation always uses TERRAIN_COARSE_OCTAVES, 0 is fnlGetNoise2D itself. Only valid once a
+ * terrain was initialized, and for blocks at most 128 columns wide.
+ */
+void terrain_sample_height_noise(u32 x, u32 y, u32 width, u32 coarse_octaves, float *noise);
+
+u32 terrain_get_skylight(const Terrain *terrain, u32 x, u32 y);
+u32 terrain_pyramid_offset(const Terrain *terrain, u32 level);
+bool terrain_is_under_sky(const Terrain *terrain, u32 x, u32 y, u32 z);
@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <string.h>
+#include "terrain_automaton.h"
+#include "materials.h"
+#include "parallel.h"
+#include "log.h"
+
+// a chunk and the voxels around it, as copied for evaluation
+#define AUTOMATON_SPAN (CHUNK_WIDTH + 2)
+#define AUTOMATON_CELL(x, y, z) ((x) + (y) * AUTOMATON_SPAN + (z) * AUTOMATON_SPAN * AUTOMATON_SPAN)
+#define AUTOMATON_CELLS (AUTOMATON_SPAN * AUTOMATON_SPAN * AUTOMATON_SPAN)
+#define AUTOMATON_NONE (UINT32_MAX)
+
+/**
+ * Chunks are 64 bits keys of 20 bits per axis, then their phase in the top bits so that sorted keys are grouped by
+ * phase. Writes are 18 bits per axis, then the new material of the voxel.
+ */
+#define AUTOMATON_CHUNK_KEY(x, y, z) ((u64) (x) | (u64) (y) << 20 | (u64) (z) << 40 | \
+                                      (u64) (((x) & 1) | ((y) & 1) << 1 | ((z) & 1) << 2) << 60)
+#define AUTOMATON_WRITE(x, y, z, material) ((u64) (x) | (u64) (y) << 18 | (u64) (z) << 36 | (u64) (material) << 54)
+
+typedef struct AutomatonJob {
+    TerrainAutomaton *automaton;
+    const u64 *chunks;
+    u32 chunk_count, *next_chunk;
+    u64 *writes;
+    u32 write_count, write_capacity;
+    u64 voxels_ticked;
+} AutomatonJob;
+
+static const i32 sides[4][2] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+
+static u32 automaton_hash(u32 x, u32 y, u32 z, u32 tick) {
+    u32 hash = x * 0x9e3779b1u ^ y * 0x85ebca77u ^ z * 0xc2b2ae3du ^ tick * 0x27d4eb2fu;
+    hash ^= hash >> 15;
+    hash *= 0x2c1b3c6du;
+    return hash ^ hash >> 13;
+}
+
+// the chunk holding a voxel, or NULL and the material of the uniform subnode holding it
+static Chunk *automaton_find_chunk(const Terrain *terrain, u32 x, u32 y, u32 z, Voxel *material) {
+    u32 node_address = terrain->root_node_address, subnode_width = terrain->width;
+    for (u32 depth = terrain->depth; depth > 0; depth--) {
+        subnode_width /= NODE_WIDTH;
+        u32 slot = NODE_SLOT(x / subnode_width % NODE_WIDTH, y / subnode_width % NODE_WIDTH,
+                             z / subnode_width % NODE_WIDTH);
+        u32 entry = terrain_node_entry(terrain, node_address, slot);
+        u32 child = terrain_entry_child(terrain, node_address, slot, entry);
+        if (!child) {
+            *material = terrain_entry_material(entry);
+            return NULL;
+        }
+        if (depth == 1) return poolAllocatorGet(&terrain->chunkPool, child);
+        node_address = child;
+    }
+    return NULL; // unreachable, the loop always ends on a uniform subnode or a chunk
+}
+
+// copies a chunk and the voxels around it, those out of the world being UNKNOWN, which nothing moves into
+static void automaton_load(const Terrain *terrain, const u32 *chunk, Voxel *cells) {
+    for (i32 dz = -1; dz <= 1; dz++) {
+        for (i32 dy = -1; dy <= 1; dy++) {
+            for (i32 dx = -1; dx <= 1; dx++) {
+                i32 offset[3] = {dx, dy, dz};
+                u32 neighbour[3], from[3], to[3];
+                bool inside = true;
+                for (u32 axis = 0; axis < 3; axis++) {
+                    neighbour[axis] = chunk[axis] + (u32) offset[axis];
+                    inside &= neighbour[axis] < terrain->width_chunks;
+                    from[axis] = offset[axis] < 0 ? 0 : offset[axis] ? CHUNK_WIDTH + 1 : 1;
+                    to[axis] = offset[axis] < 0 ? 1 : offset[axis] ? CHUNK_WIDTH + 2 : CHUNK_WIDTH + 1;
+                }
+                Voxel material = UNKNOWN;
+                Chunk *voxels = inside ? automaton_find_chunk(terrain, neighbour[0] * CHUNK_WIDTH,
+                                                              neighbour[1] * CHUNK_WIDTH,
+                                                              neighbour[2] * CHUNK_WIDTH, &material) : NULL;
+                for (u32 z = from[2]; z < to[2]; z++) {
+                    for (u32 y = from[1]; y < to[1]; y++) {
+                        for (u32 x = from[0]; x < to[0]; x++) {
+                            Voxel voxel = material;
+                            if (voxels) {
+                                u32 slot = CHUNK_SLOT((x + CHUNK_WIDTH - 1) % CHUNK_WIDTH,
+                                                      (y + CHUNK_WIDTH - 1) % CHUNK_WIDTH,
+                                                      (z + CHUNK_WIDTH - 1) % CHUNK_WIDTH);
+                                voxel = __atomic_load_n(&(*voxels)[slot], __ATOMIC_RELAXED);
+                            }
+                            cells[AUTOMATON_CELL(x, y, z)] = voxel;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// whether a voxel can take the place of a loose one, sand sinking through water
+static bool automaton_free(Voxel voxel, bool sinks) {
+    return voxel == AIR || (sinks && voxel == WATER);
+}
+
+// where a loose voxel moves to this tick, as a cell of the copy, or AUTOMATON_NONE if it stays
+static u32 automaton_target(const Voxel *cells, u32 cell, u32 hash) {
+    const u32 layer = AUTOMATON_SPAN * AUTOMATON_SPAN;
+    bool sand = cells[cell] == SAND;
+    if (automaton_free(cells[cell - layer], sand)) return cell - layer;
+    for (u32 i = 0; i < 4; i++) {
+        const i32 *side = sides[(hash + i) & 3];
+        u32 beside = cell + (u32) (side[0] + side[1] * AUTOMATON_SPAN);
+        if (automaton_free(cells[beside], sand) && automaton_free(cells[beside - layer], sand)) return beside - layer;
+    }
+    if (sand || cells[cell + layer] != WATER) return AUTOMATON_NONE;
+    for (u32 i = 0; i < 4; i++) {
+        const i32 *side = sides[(hash + i) & 3];
+        u32 beside = cell + (u32) (side[0] + side[1] * AUTOMATON_SPAN);
+        if (cells[beside] == AIR) return beside;
+    }
+    return AUTOMATON_NONE;
+}
+
+static void automaton_chunk(AutomatonJob *job, u64 key) {
+    TerrainAutomaton *automaton = job->automaton;
+    const Terrain *terrain = automaton->terrain;
+    u32 chunk[3] = {key & 0xfffff, key >> 20 & 0xfffff, key >> 40 & 0xfffff};
+    Voxel material;
+    if (!automaton_find_chunk(terrain, chunk[0] * CHUNK_WIDTH, chunk[1] * CHUNK_WIDTH, chunk[2] * CHUNK_WIDTH,
+                              &material) && !MATERIAL_IS_LOOSE(material)) {
+        return;
+    }
+    Voxel cells[AUTOMATON_CELLS], before[AUTOMATON_CELLS];
+    bool moved[AUTOMATON_CELLS] = {0};
+    automaton_load(terrain, chunk, cells);
+    memcpy(before, cells, sizeof(cells));
+
+    // bottom up, so that a whole column falls at once
+    u32 origin[3] = {chunk[0] * CHUNK_WIDTH - 1, chunk[1] * CHUNK_WIDTH - 1, chunk[2] * CHUNK_WIDTH - 1};
+    for (u32 z = 1; z <= CHUNK_WIDTH; z++) {
+        for (u32 y = 1; y <= CHUNK_WIDTH; y++) {
+            for (u32 x = 1; x <= CHUNK_WIDTH; x++) {
+                u32 cell = AUTOMATON_CELL(x, y, z);
+                Voxel voxel = cells[cell];
+                if (!MATERIAL_IS_LOOSE(voxel) || moved[cell]) continue;
+                job->voxels_ticked++;
+                u32 hash = automaton_hash(origin[0] + x, origin[1] + y, origin[2] + z, automaton->tick);
+                u32 target = automaton_target(cells, cell, hash);
+                if (target == AUTOMATON_NONE) continue;
+                cells[cell] = cells[target];
+                cells[target] = voxel;
+                moved[cell] = moved[target] = true;
+            }
+        }
+    }
+
+    for (u32 cell = 0; cell < AUTOMATON_CELLS; cell++) {
+        if (cells[cell] == before[cell]) continue;
+        if (job->write_count == job->write_capacity) {
+            job->write_capacity = job->write_capacity ? 2 * job->write_capacity : 256;
+            job->writes = (u64 *) realloc(job->writes, job->write_capacity * sizeof(u64));
+            if (!job->writes) FATAL("Out of memory.");
+        }
+        u32 x = cell % AUTOMATON_SPAN, y = cell / AUTOMATON_SPAN % AUTOMATON_SPAN;
+        u32 z = cell / (AUTOMATON_SPAN * AUTOMATON_SPAN);
+        job->writes[job->write_count++] = AUTOMATON_WRITE(origin[0] + x, origin[1] + y, origin[2] + z, cells[cell]);
+    }
+}
+
+static void automaton_job(void *data, u32 worker) {
+    AutomatonJob *job = (AutomatonJob *) data + worker;
+    for (u32 i; (i = __atomic_fetch_add(job->next_chunk, 1, __ATOMIC_RELAXED)) < job->chunk_count;) {
+        automaton_chunk(job, job->chunks[i]);
+    }
+}
+
+// evaluates the chunks of a phase across threads, then writes what they changed
+static void automaton_run_phase(TerrainAutomaton *automaton, const u64 *chunks, u32 count) {
+    u32 thread_count = parallel_thread_count(count, TERRAIN_AUTOMATON_CHUNK_GRAIN, TERRAIN_AUTOMATON_MAX_THREADS);
+    AutomatonJob jobs[TERRAIN_AUTOMATON_MAX_THREADS];
+    u32 next_chunk = 0;
+    for (u32 i = 0; i < thread_count; i++) {
+        jobs[i] = (AutomatonJob) {.automaton=automaton, .chunks=chunks, .chunk_count=count, .next_chunk=&next_chunk};
+    }
+    parallel_run(automaton_job, jobs, thread_count);
+
+    for (u32 i = 0; i < thread_count; i++) {
+        for (u32 write = 0; write < jobs[i].write_count; write++) {
+            u64 value = jobs[i].writes[write];
+            u32 x = value & 0x3ffff, y = value >> 18 & 0x3ffff, z = value >> 36 & 0x3ffff;
+            terrain_set_voxel(automaton->terrain, x, y, z, (Voxel) (value >> 54));
+            terrain_automaton_activate(automaton, x, y, z);
+        }
+        automaton->voxels_ticked += jobs[i].voxels_ticked;
+        automaton->voxels_changed += jobs[i].write_count;
+        free(jobs[i].writes);
+    }
+}
+
+static int automaton_compare(const void *a, const void *b) {
+    u64 left = *(const u64 *) a, right = *(const u64 *) b;
+    return (left > right) - (left < right);
+}
+
+void terrain_automaton_init(TerrainAutomaton *automaton, Terrain *terrain) {
+    *automaton = (TerrainAutomaton) {.terrain=terrain};
+}
+
+void terrain_automaton_destroy(TerrainAutomaton *automaton) {
+    free(automaton->active);
+    *automaton = (TerrainAutomaton) {0};
+}
+
+void terrain_automaton_activate(TerrainAutomaton *automaton, u32 x, u32 y, u32 z) {
+    u32 width = automaton->terrain->width, position[3] = {x, y, z}, low[3], high[3];
+    if (x >= width || y >= width || z >= width) return;
+    for (u32 axis = 0; axis < 3; axis++) {
+        low[axis] = (position[axis] ? position[axis] - 1 : 0) / CHUNK_WIDTH;
+        high[axis] = min(position[axis] + 1, width - 1) / CHUNK_WIDTH;
+    }
+    for (u32 chunk_z = low[2]; chunk_z <= high[2]; chunk_z++) {
+        for (u32 chunk_y = low[1]; chunk_y <= high[1]; chunk_y++) {
+            for (u32 chunk_x = low[0]; chunk_x <= high[0]; chunk_x++) {
+                if (automaton->active_count == automaton->active_capacity) {
+                    automaton->active_capacity = automaton->active_capacity ? 2 * automaton->active_capacity : 256;
+                    automaton->active = (u64 *) realloc(automaton->active, automaton->active_capacity * sizeof(u64));
+                    if (!automaton->active) FATAL("Out of memory.");
+                }
+                automaton->active[automaton->active_count++] = AUTOMATON_CHUNK_KEY(chunk_x, chunk_y, chunk_z);
+            }
+        }
+    }
+}
+
+u64 terrain_automaton_tick(TerrainAutomaton *automaton) {
+    u64 *chunks = automaton->active;
+    u32 count = 0;
+    qsort(chunks, automaton->active_count, sizeof(u64), automaton_compare);
+    for (u32 i = 0; i < automaton->active_count; i++) {
+        if (!count || chunks[count - 1] != chunks[i]) chunks[count++] = chunks[i];
+    }
+
+    // what moves during the tick is activated for the next one
+    automaton->active = NULL;
+    automaton->active_count = automaton->active_capacity = 0;
+    automaton->chunks_ticked = count;
+    automaton->voxels_ticked = automaton->voxels_changed = 0;
+    for (u32 begin = 0, end = 0; begin < count; begin = end) {
+        while (end < count && chunks[end] >> 60 == chunks[begin] >> 60) end++;
+        automaton_run_phase(automaton, chunks + begin, end - begin);
+    }
+    automaton->tick++;
+    free(chunks);
+    return automaton->voxels_changed;
+}
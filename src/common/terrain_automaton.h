@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include "terrain.h"
+
+/**
+ * Falling sand and flowing water, as a cellular automaton over the voxels. At each tick, every loose voxel (see
+ * MATERIAL_IS_LOOSE) of an active chunk moves at most once:
+ * - sand falls through air and sinks through water, else slides down one of its 4 sides when both the side and the
+ * voxel under it are free.
+ * - water falls through air, else flows down one of its sides, else spreads sideways when more water weighs on it.
+ * Chunks are evaluated bottom up, and where a voxel slides or spreads to is picked from a hash of its position and
+ * the tick, so that piles and puddles don't lean one way.
+ * Only active chunks are ticked. A chunk stays active while voxels move in or around it, and settles once nothing
+ * does: edits have to activate what they touch with terrain_automaton_activate for it to start moving.
+ * Moves reach at most one voxel out of their chunk, so the active chunks are split in 8 phases by the parity of their
+ * coordinates, whose chunks never read nor write the same voxels. The chunks of a phase are evaluated in parallel
+ * from a copy of them and their neighbouring voxels, then what changed is written with terrain_set_voxel, which keeps
+ * the deltas, bounds, skylight and hashes of the terrain up to date. Ticks must not run concurrently with anything
+ * else writing to the terrain.
+ */
+#define TERRAIN_AUTOMATON_MAX_THREADS (16) // no more than PARALLEL_MAX_THREADS
+#define TERRAIN_AUTOMATON_CHUNK_GRAIN (4) // chunks evaluated per thread, at least
+
+typedef struct TerrainAutomaton {
+    Terrain *terrain;
+
+    // chunks to tick next, as keys that may be listed more than once until the tick sorts them
+    u64 *active;
+    u32 active_count, active_capacity;
+    u32 tick;
+
+    // what the last tick did: chunks evaluated, loose voxels evaluated, and voxels that changed
+    u32 chunks_ticked;
+    u64 voxels_ticked, voxels_changed;
+} TerrainAutomaton;
+
+void terrain_automaton_init(TerrainAutomaton *automaton, Terrain *terrain);
+void terrain_automaton_destroy(TerrainAutomaton *automaton);
+
+// activates the chunks of a voxel and of all of its neighbours, to be called for every voxel edited
+void terrain_automaton_activate(TerrainAutomaton *automaton, u32 x, u32 y, u32 z);
+
+// moves the loose voxels of every active chunk once, returning how many voxels changed
+u64 terrain_automaton_tick(TerrainAutomaton *automaton);
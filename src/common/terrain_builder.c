@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+
+#include <memory.h>
+#include "terrain_builder.h"
+#include "materials.h"
+#include "parallel.h"
+#include "log.h"
+#include "cptime.h"
+
+#define BUILDER_VOXEL_GRAIN (1 << 16) // voxels sorted per thread, at least
+#define RADIX_BITS (8)
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+/**
+ * Voxels are sorted as 64 bits keys: the morton code of their position, then their material in the lower 8 bits.
+ * Morton codes interleave the bits as zyx, so that the 3 bits of each level are exactly a NODE_SLOT and all voxels of a
+ * chunk, and all chunks of a node, end up contiguous once sorted.
+ */
+#define KEY_MATERIAL_BITS (8)
+#define CHUNK_MORTON_BITS (9) // 3 * log2(CHUNK_WIDTH)
+
+typedef struct KeyJob {
+    const VoxelStreamEntry *voxels;
+    u64 *keys;
+    size_t begin, end, valid_count;
+    u32 width;
+} KeyJob;
+
+typedef struct RadixJob {
+    const u64 *src;
+    u64 *dst;
+    size_t begin, end;
+    u32 shift;
+    size_t histogram[RADIX_SIZE];
+} RadixJob;
+
+// one entry of a level being built, i.e. what will be written in its parent node
+typedef struct BuilderEntry {
+    u64 code;
+    Voxel material;
+    u32 child;
+} BuilderEntry;
+
+typedef struct BuilderLevel {
+    BuilderEntry *entries;
+    size_t size, capacity;
+} BuilderLevel;
+
+static u64 morton_spread(u64 v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffff;
+    v = (v | v << 16) & 0x1f0000ff0000ff;
+    v = (v | v << 8) & 0x100f00f00f00f00f;
+    v = (v | v << 4) & 0x10c30c30c30c30c3;
+    v = (v | v << 2) & 0x1249249249249249;
+    return v;
+}
+
+static u32 morton_compact(u64 v) {
+    v &= 0x1249249249249249;
+    v = (v ^ (v >> 2)) & 0x10c30c30c30c30c3;
+    v = (v ^ (v >> 4)) & 0x100f00f00f00f00f;
+    v = (v ^ (v >> 8)) & 0x1f0000ff0000ff;
+    v = (v ^ (v >> 16)) & 0x1f00000000ffff;
+    v = (v ^ (v >> 32)) & 0x1fffff;
+    return (u32) v;
+}
+
+static void key_job(void *data, u32 worker) {
+    KeyJob *job = (KeyJob *) data + worker;
+    job->valid_count = 0;
+    for (size_t i = job->begin; i < job->end; i++) {
+        const VoxelStreamEntry *v = &job->voxels[i];
+        if (v->x >= job->width || v->y >= job->width || v->z >= job->width) continue;
+        u64 morton = morton_spread(v->x) | morton_spread(v->y) << 1 | morton_spread(v->z) << 2;
+        job->keys[job->begin + job->valid_count++] = morton << KEY_MATERIAL_BITS | v->material;
+    }
+}
+
+static void radix_histogram_job(void *data, u32 worker) {
+    RadixJob *job = (RadixJob *) data + worker;
+    memset(job->histogram, 0, sizeof(job->histogram));
+    for (size_t i = job->begin; i < job->end; i++) job->histogram[(job->src[i] >> job->shift) & (RADIX_SIZE - 1)]++;
+}
+
+// histogram has been turned into per-thread output offsets by then
+static void radix_scatter_job(void *data, u32 worker) {
+    RadixJob *job = (RadixJob *) data + worker;
+    for (size_t i = job->begin; i < job->end; i++) {
+        u64 key = job->src[i];
+        job->dst[job->histogram[(key >> job->shift) & (RADIX_SIZE - 1)]++] = key;
+    }
+}
+
+/**
+ * Parallel LSD radix sort on the morton part of the keys. It's stable, so duplicated positions keep their stream order.
+ * Returns whichever of keys and tmp holds the result.
+ */
+static u64 *radix_sort(u64 *keys, u64 *tmp, size_t count, u32 key_bits, u32 thread_count) {
+    RadixJob jobs[PARALLEL_MAX_THREADS];
+    for (u32 shift = KEY_MATERIAL_BITS; shift < KEY_MATERIAL_BITS + key_bits; shift += RADIX_BITS) {
+        for (u32 t = 0; t < thread_count; t++) {
+            jobs[t] = (RadixJob) {.src=keys, .dst=tmp, .begin=count * t / thread_count,
+                    .end=count * (t + 1) / thread_count, .shift=shift};
+        }
+        parallel_run(radix_histogram_job, jobs, thread_count);
+
+        // digit-major, thread-minor exclusive prefix sum, which keeps the sort stable
+        size_t offset = 0;
+        for (u32 digit = 0; digit < RADIX_SIZE; digit++) {
+            for (u32 t = 0; t < thread_count; t++) {
+                size_t digit_count = jobs[t].histogram[digit];
+                jobs[t].histogram[digit] = offset;
+                offset += digit_count;
+            }
+        }
+        parallel_run(radix_scatter_job, jobs, thread_count);
+
+        u64 *swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+    return keys;
+}
+
+static void builder_level_push(BuilderLevel *level, BuilderEntry entry) {
+    if (level->size == level->capacity) {
+        level->capacity = level->capacity ? level->capacity * 2 : 1024;
+        level->entries = realloc(level->entries, level->capacity * sizeof(BuilderEntry));
+        if (!level->entries) FATAL("Out of memory.");
+    }
+    level->entries[level->size++] = entry;
+}
+
+// most common non-air material, used as LOD color of mixed nodes and chunks
+static Voxel builder_lod_material(const u32 counts[256]) {
+    Voxel best = AIR;
+    for (u32 material = 0; material < 256; material++) {
+        if (material != AIR && counts[material] > (best == AIR ? 0 : counts[best])) best = material;
+    }
+    return best;
+}
+
+/**
+ * Turns a run of sorted keys into chunks, the first level of the bottom-up build.
+ * Uniform chunks are not allocated, they become uniform entries in their parent.
+ */
+static void builder_build_chunks(Terrain *terrain, const u64 *keys, size_t count, BuilderLevel *out) {
+    Chunk chunk;
+    u32 counts[256];
+    for (size_t i = 0; i < count;) {
+        u64 chunk_code = keys[i] >> (KEY_MATERIAL_BITS + CHUNK_MORTON_BITS);
+        memset(chunk, AIR, sizeof(Chunk));
+        for (; i < count && keys[i] >> (KEY_MATERIAL_BITS + CHUNK_MORTON_BITS) == chunk_code; i++) {
+            u64 local = (keys[i] >> KEY_MATERIAL_BITS) & ((1 << CHUNK_MORTON_BITS) - 1);
+            chunk[CHUNK_SLOT(morton_compact(local), morton_compact(local >> 1), morton_compact(local >> 2))] = (Voxel) keys[i];
+        }
+
+        // heightmap and skylight of the columns of the chunk
+        u32 x = morton_compact(chunk_code) * CHUNK_WIDTH;
+        u32 y = morton_compact(chunk_code >> 1) * CHUNK_WIDTH;
+        u32 z = morton_compact(chunk_code >> 2) * CHUNK_WIDTH;
+        memset(counts, 0, sizeof(counts));
+        for (u32 dx = 0; dx < CHUNK_WIDTH; dx++) {
+            for (u32 dy = 0; dy < CHUNK_WIDTH; dy++) {
+                size_t column = x + dx + (size_t) (y + dy) * terrain->width;
+                for (i32 dz = CHUNK_WIDTH - 1; dz >= 0; dz--) {
+                    Voxel voxel = chunk[CHUNK_SLOT(dx, dy, dz)];
+                    counts[voxel]++;
+                    if (voxel != AIR && terrain->heightmap[column] < z + dz + 1) terrain->heightmap[column] = z + dz + 1;
+                    if (MATERIAL_IS_OPAQUE(voxel) && terrain->skylight[column] < z + dz + 1) terrain->skylight[column] = z + dz + 1;
+                }
+            }
+        }
+
+        if (counts[chunk[0]] == CHUNK_WIDTH * CHUNK_WIDTH * CHUNK_WIDTH) {
+            if (chunk[0] != AIR) builder_level_push(out, (BuilderEntry) {.code=chunk_code, .material=chunk[0], .child=0});
+        } else {
+            u32 chunk_id = poolAllocatorAlloc(&terrain->chunkPool);
+            memcpy(poolAllocatorGet(&terrain->chunkPool, chunk_id), chunk, sizeof(Chunk));
+            builder_level_push(out, (BuilderEntry) {.code=chunk_code, .material=builder_lod_material(counts), .child=chunk_id});
+        }
+    }
+}
+
+/**
+ * Groups the entries of a level by parent. Parents whose 8 subnodes are uniform and identical are collapsed,
+ * the others are allocated. The root is always node 0 so the last level is written there instead.
+ */
+static void builder_build_nodes(Terrain *terrain, const BuilderLevel *in, BuilderLevel *out, bool is_root) {
+    u32 counts[256];
+    for (size_t i = 0; i < in->size;) {
+        u64 parent_code = in->entries[i].code >> 3;
+        BuilderEntry children[NODE_WIDTH * NODE_WIDTH * NODE_WIDTH];
+        for (u32 slot = 0; slot < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; slot++) {
+            children[slot] = (BuilderEntry) {.material=AIR, .child=0};
+        }
+        for (; i < in->size && in->entries[i].code >> 3 == parent_code; i++) {
+            children[in->entries[i].code & 7] = in->entries[i];
+        }
+
+        bool uniform = true;
+        memset(counts, 0, sizeof(counts));
+        for (u32 slot = 0; slot < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; slot++) {
+            uniform &= children[slot].child == 0 && children[slot].material == children[0].material;
+            counts[children[slot].material]++;
+        }
+        if (uniform && !is_root) {
+            if (children[0].material != AIR) builder_level_push(out, (BuilderEntry) {.code=parent_code, .material=children[0].material, .child=0});
+            continue;
+        }
+
+        u32 node_address = is_root ? terrain->root_node_address : poolAllocatorAlloc(&terrain->nodePool);
+        for (u32 slot = 0; slot < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; slot++) {
+            terrain_node_set(terrain, node_address, slot, children[slot].material, children[slot].child);
+        }
+        builder_level_push(out, (BuilderEntry) {.code=parent_code, .material=builder_lod_material(counts), .child=node_address});
+    }
+}
+
+// Level 0 of the pyramid from the full resolution heightmap, then every level from the previous one
+static void builder_build_height_pyramid(Terrain *terrain) {
+    for (u32 cx = 0; cx < terrain->width_chunks; cx++) {
+        for (u32 cy = 0; cy < terrain->width_chunks; cy++) {
+            u32 min = UINT32_MAX, max = 0;
+            for (u32 dx = 0; dx < CHUNK_WIDTH; dx++) {
+                for (u32 dy = 0; dy < CHUNK_WIDTH; dy++) {
+                    u32 h = terrain->heightmap[cx * CHUNK_WIDTH + dx + (size_t) (cy * CHUNK_WIDTH + dy) * terrain->width];
+                    if (h < min) min = h;
+                    if (h > max) max = h;
+                }
+            }
+            terrain->approx_heightmaps[0][cx + cy * terrain->width_chunks] = (HeightApprox) {.min=min, .max=max};
+        }
+    }
+    for (u32 level = 1; level <= terrain->depth; level++) {
+        u32 level_width = terrain->width_chunks >> level;
+        for (u32 cx = 0; cx < level_width; cx++) {
+            for (u32 cy = 0; cy < level_width; cy++) {
+                u32 min = UINT32_MAX, max = 0;
+                for (u32 dx = 0; dx < NODE_WIDTH; dx++) {
+                    for (u32 dy = 0; dy < NODE_WIDTH; dy++) {
+                        HeightApprox h = terrain->approx_heightmaps[level - 1][cx * NODE_WIDTH + dx + (cy * NODE_WIDTH + dy) * level_width * NODE_WIDTH];
+                        if (h.min < min) min = h.min;
+                        if (h.max > max) max = h.max;
+                    }
+                }
+                terrain->approx_heightmaps[level][cx + cy * level_width] = (HeightApprox) {.min=min, .max=max};
+            }
+        }
+    }
+}
+
+/**
+ * Builds a whole terrain from an unsorted stream of voxels, bottom-up.
+ * Voxels are turned into morton keys and radix-sorted in parallel. A single linear pass over the sorted keys then
+ * creates the chunks, and each level of nodes is built from the (much smaller) previous one.
+ */
+void terrain_build_from_voxels(Terrain *terrain, u32 depth, const VoxelStreamEntry *voxels, size_t count) {
+    // morton keys have 21 bits per axis, minus the bits we keep for the material
+    if (depth + 3 > (64 - KEY_MATERIAL_BITS) / 3) FATAL("Bulk SVO construction supports at most a depth of %u.", (64 - KEY_MATERIAL_BITS) / 3 - 3);
+    terrain_init_empty(terrain, depth);
+
+    u64 time = uclock(), start_time = time;
+    u32 thread_count = parallel_thread_count(count, BUILDER_VOXEL_GRAIN, PARALLEL_MAX_THREADS);
+    u64 *keys = (u64 *) malloc(max(1, count) * sizeof(u64));
+    u64 *tmp = (u64 *) malloc(max(1, count) * sizeof(u64));
+    if (!keys || !tmp) FATAL("Out of memory.");
+
+    /**
+     * Computing the keys in parallel, then packing the slices of each thread together since out-of-bound voxels
+     * were dropped
+     */
+    KeyJob key_jobs[PARALLEL_MAX_THREADS];
+    for (u32 t = 0; t < thread_count; t++) {
+        key_jobs[t] = (KeyJob) {.voxels=voxels, .keys=keys, .begin=count * t / thread_count,
+                .end=count * (t + 1) / thread_count, .width=terrain->width};
+    }
+    parallel_run(key_job, key_jobs, thread_count);
+    size_t valid_count = 0;
+    for (u32 t = 0; t < thread_count; t++) {
+        memmove(keys + valid_count, keys + key_jobs[t].begin, key_jobs[t].valid_count * sizeof(u64));
+        valid_count += key_jobs[t].valid_count;
+    }
+    if (valid_count != count) WARN("%zu voxels were outside of the world and have been ignored.", count - valid_count);
+
+    u64 *sorted = radix_sort(keys, tmp, valid_count, 3 * (depth + 3), thread_count);
+    u64 sort_time = uclock() - time;
+    time = uclock();
+
+    /**
+     * Bottom-up construction, one level at a time
+     */
+    BuilderLevel levels[2] = {0};
+    builder_build_chunks(terrain, sorted, valid_count, &levels[0]);
+    free(keys);
+    free(tmp);
+    for (u32 level = 1; level <= depth; level++) {
+        BuilderLevel *in = &levels[(level - 1) % 2], *out = &levels[level % 2];
+        out->size = 0;
+        builder_build_nodes(terrain, in, out, level == depth);
+    }
+    free(levels[0].entries);
+    free(levels[1].entries);
+    builder_build_height_pyramid(terrain);
+    terrain_build_bounds(terrain);
+    terrain_record_delta(terrain, TERRAIN_DELTA_ALL, 0, 0);
+
+    u64 build_time = uclock() - time;
+    u64 total_time = uclock() - start_time;
+    INFO("Built SVO from %zu voxels in %.2fms (sort %.2fms on %u threads, build %.2fms), %.0f MB/s of voxel stream.",
+         count, total_time / 1e3, sort_time / 1e3, thread_count, build_time / 1e3,
+         count * sizeof(VoxelStreamEntry) / (total_time / 1e6) / 1e6);
+    INFO("SVO has %u nodes and %u chunks.", terrain->nodePool.size, terrain->chunkPool.size);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "terrain.h"
+
+/**
+ * One voxel of an unsorted voxel stream, as imported from external voxel data.
+ * Voxels that are not in the stream are air. If a position appears several times, the last one wins.
+ */
+typedef struct VoxelStreamEntry {
+    u32 x, y, z;
+    Voxel material;
+} VoxelStreamEntry;
+
+void terrain_build_from_voxels(Terrain *terrain, u32 depth, const VoxelStreamEntry *voxels, size_t count);
@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+
+#include <immintrin.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <memory.h>
+#include "terrain_decoration.h"
+#include "materials.h"
+#include "log.h"
+
+#define STRUCTURE_SEED (0x2545f491u)
+#define STRUCTURE_MAX_WIDTH (2 * TERRAIN_STRUCTURE_REACH + 1)
+
+// chances per chunk column, in percent for trees, and tries at a plant
+#define STRUCTURE_TREE_PERCENT (6)
+#define STRUCTURE_PLANT_TRIES (4)
+
+typedef enum StructureKind {
+    STRUCTURE_OAK,
+    STRUCTURE_TALL_TREE,
+    STRUCTURE_SHORT_GRASS,
+    STRUCTURE_FLOWER,
+    STRUCTURE_KIND_COUNT
+} StructureKind;
+
+/**
+ * A square footprint of width columns, height voxels tall, that stands on the column in its middle. Voxels are stored
+ * x + y * width + z * width * width, UNKNOWN ones are left as they are when stamped.
+ */
+typedef struct StructureTemplate {
+    u32 width, height;
+    Voxel voxels[STRUCTURE_MAX_WIDTH * STRUCTURE_MAX_WIDTH * TERRAIN_STRUCTURE_HEIGHT];
+} StructureTemplate;
+
+// one layer of a tree crown: leaves up to radius columns from the trunk, without the 4 corners if round
+typedef struct CrownLayer {
+    i32 radius;
+    bool round;
+} CrownLayer;
+
+static StructureTemplate templates[STRUCTURE_KIND_COUNT];
+static pthread_once_t templates_once = PTHREAD_ONCE_INIT;
+
+static void structure_build_templates(void);
+
+static void structure_build_tree(StructureTemplate *template, u32 width, u32 height, u32 trunk_height,
+                                 const CrownLayer *crown);
+
+static bool structure_place(Terrain *terrain, const StructureTemplate *template, u32 x, u32 y,
+                            TerrainStructureStats *stats);
+
+static u32 structure_blit(Voxel *chunk, const Voxel *stamp, bool write);
+
+void terrain_decorate(Terrain *terrain, u32 x, u32 y, u32 width) {
+    TerrainStructureStats stats = {0};
+    terrain_lay_soil(terrain, x, y, width);
+    terrain_place_structures(terrain, x, y, width, &stats);
+}
+
+/**
+ * Turns the top of every stone column of the footprint into a layer of soil: grass on top, then dirt. Only chunks that
+ * are already mixed are touched: the height pyramid only samples one column per chunk, so the heightmap surface may
+ * be inside a subnode that was generated as uniform stone, whose top then is the actual surface. Materials are swapped
+ * for other opaque ones, so the pyramid and skylight map stay as they are.
+ */
+void terrain_lay_soil(Terrain *terrain, u32 x, u32 y, u32 width) {
+    u32 first_chunk = UINT32_MAX, last_chunk = 0;
+    for (u32 cy = y; cy < y + width; cy += CHUNK_WIDTH) {
+        for (u32 cx = x; cx < x + width; cx += CHUNK_WIDTH) {
+            u32 heights[CHUNK_WIDTH][CHUNK_WIDTH], low = UINT32_MAX, high = 0;
+            for (u32 dy = 0; dy < CHUNK_WIDTH; dy++) {
+                for (u32 dx = 0; dx < CHUNK_WIDTH; dx++) {
+                    u32 h = terrain->heightmap[cx + dx + (size_t) (cy + dy) * terrain->width];
+                    heights[dy][dx] = h;
+                    low = min(low, h > TERRAIN_SOIL_DEPTH ? h - TERRAIN_SOIL_DEPTH : 0);
+                    high = max(high, h);
+                }
+            }
+
+            // the soil of a column spans [h - TERRAIN_SOIL_DEPTH, h), chunks that none of them reach are left alone
+            for (u32 cz = low / CHUNK_WIDTH * CHUNK_WIDTH; cz < high; cz += CHUNK_WIDTH) {
+                bool reached = false;
+                for (u32 i = 0; i < CHUNK_WIDTH * CHUNK_WIDTH && !reached; i++) {
+                    u32 h = heights[i / CHUNK_WIDTH][i % CHUNK_WIDTH];
+                    reached = h > cz && h <= cz + CHUNK_WIDTH + TERRAIN_SOIL_DEPTH - 1;
+                }
+                if (!reached || !terrain_chunk_at(terrain, cx, cy, cz)) continue;
+                u32 chunk_address = terrain_edit_chunk(terrain, cx, cy, cz);
+                Chunk *chunk = poolAllocatorGet(&terrain->chunkPool, chunk_address);
+                for (u32 dy = 0; dy < CHUNK_WIDTH; dy++) {
+                    for (u32 dx = 0; dx < CHUNK_WIDTH; dx++) {
+                        for (u32 dz = 0; dz < CHUNK_WIDTH; dz++) {
+                            u32 h = heights[dy][dx], vz = cz + dz;
+                            Voxel *voxel = &(*chunk)[CHUNK_SLOT(dx, dy, dz)];
+                            if (vz >= h || vz + TERRAIN_SOIL_DEPTH < h || *voxel != STONE) continue;
+                            __atomic_store_n(voxel, vz + 1 == h ? GRASS : DIRT, __ATOMIC_RELAXED);
+                        }
+                    }
+                }
+                first_chunk = min(first_chunk, chunk_address);
+                last_chunk = max(last_chunk, chunk_address);
+            }
+        }
+    }
+
+    // the chunks of a region were mostly allocated together, a single range is cheaper than one delta per chunk
+    if (first_chunk <= last_chunk) {
+        terrain_record_delta(terrain, TERRAIN_DELTA_CHUNKS, first_chunk, last_chunk - first_chunk + 1);
+    }
+}
+
+// a well mixed hash of a chunk column and a draw index, so that what stands on a column never depends on the footprint
+static u32 structure_hash(u32 cx, u32 cy, u32 draw) {
+    u32 hash = cx * 0x8da6b343u ^ cy * 0xd8163841u ^ draw * 0xcb1ab31fu ^ STRUCTURE_SEED;
+    hash ^= hash >> 16;
+    hash *= 0x7feb352du;
+    hash ^= hash >> 15;
+    hash *= 0x846ca68bu;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/**
+ * Each chunk column of the footprint may get a tree, and a few plants, on random columns of its own. Those that don't
+ * stand on grass, or that would stick out of the world, are dropped.
+ */
+void terrain_place_structures(Terrain *terrain, u32 x, u32 y, u32 width, TerrainStructureStats *stats) {
+    pthread_once(&templates_once, structure_build_templates);
+    for (u32 cy = y / CHUNK_WIDTH; cy < (y + width) / CHUNK_WIDTH; cy++) {
+        for (u32 cx = x / CHUNK_WIDTH; cx < (x + width) / CHUNK_WIDTH; cx++) {
+            u32 hash = structure_hash(cx, cy, 0);
+            if (hash % 100 < STRUCTURE_TREE_PERCENT) {
+                const StructureTemplate *tree = &templates[hash >> 16 & 3 ? STRUCTURE_OAK : STRUCTURE_TALL_TREE];
+                u32 column = hash >> 8 & (CHUNK_WIDTH * CHUNK_WIDTH - 1);
+                if (structure_place(terrain, tree, cx * CHUNK_WIDTH + column % CHUNK_WIDTH,
+                                    cy * CHUNK_WIDTH + column / CHUNK_WIDTH, stats)) stats->structures++;
+            }
+            for (u32 i = 0; i < STRUCTURE_PLANT_TRIES; i++) {
+                hash = structure_hash(cx, cy, i + 1);
+                const StructureTemplate *plant = &templates[hash >> 16 & 7 ? STRUCTURE_SHORT_GRASS : STRUCTURE_FLOWER];
+                u32 column = hash >> 8 & (CHUNK_WIDTH * CHUNK_WIDTH - 1);
+                if (structure_place(terrain, plant, cx * CHUNK_WIDTH + column % CHUNK_WIDTH,
+                                    cy * CHUNK_WIDTH + column / CHUNK_WIDTH, stats)) stats->structures++;
+            }
+        }
+    }
+}
+
+/**
+ * Stamps a template on top of a column, chunk by chunk. The part of the template that overlaps a chunk is copied in
+ * the chunk layout first, so that blitting it is a few wide operations. A uniform subnode is only split if something
+ * of the template actually ends up in it.
+ */
+static bool structure_place(Terrain *terrain, const StructureTemplate *template, u32 x, u32 y,
+                            TerrainStructureStats *stats) {
+    u32 reach = template->width / 2, z = terrain->heightmap[x + (size_t) y * terrain->width];
+    if (x < reach || y < reach || x + reach >= terrain->width || y + reach >= terrain->width) return false;
+    if (!z || z + template->height > terrain->width || terrain_get_voxel(terrain, x, y, z - 1) != GRASS) return false;
+
+    u32 tx = x - reach, ty = y - reach, w = template->width;
+    for (u32 cz = z / CHUNK_WIDTH * CHUNK_WIDTH; cz < z + template->height; cz += CHUNK_WIDTH) {
+        for (u32 cy = ty / CHUNK_WIDTH * CHUNK_WIDTH; cy < ty + w; cy += CHUNK_WIDTH) {
+            for (u32 cx = tx / CHUNK_WIDTH * CHUNK_WIDTH; cx < tx + w; cx += CHUNK_WIDTH) {
+                Chunk stamp = {0};
+                bool any = false;
+                u32 x0 = max(cx, tx), x1 = min(cx + CHUNK_WIDTH, tx + w);
+                for (u32 vz = max(cz, z); vz < min(cz + CHUNK_WIDTH, z + template->height); vz++) {
+                    for (u32 vy = max(cy, ty); vy < min(cy + CHUNK_WIDTH, ty + w); vy++) {
+                        const Voxel *row = &template->voxels[x0 - tx + (vy - ty) * w + (vz - z) * w * w];
+                        memcpy(&stamp[CHUNK_SLOT(x0 - cx, vy - cy, vz - cz)], row, x1 - x0);
+                        for (u32 i = 0; i < x1 - x0; i++) any |= row[i] != UNKNOWN;
+                    }
+                }
+                if (!any) continue;
+
+                bool split = !terrain_chunk_at(terrain, cx, cy, cz);
+                if (split) {
+                    Chunk uniform;
+                    memset(uniform, terrain_get_voxel(terrain, cx, cy, cz), sizeof(Chunk));
+                    if (!structure_blit(uniform, stamp, false)) continue; // nothing in it beats what's there
+                }
+                u32 chunk_address = terrain_edit_chunk(terrain, cx, cy, cz);
+                if (structure_blit(*(Chunk *) poolAllocatorGet(&terrain->chunkPool, chunk_address), stamp, true)) {
+                    terrain_record_delta(terrain, TERRAIN_DELTA_CHUNKS, chunk_address, 1);
+                    terrain_rebound_path(terrain, cx, cy, cz, 1);
+                    stats->chunks_stamped++;
+                    stats->chunks_split += split;
+                }
+            }
+        }
+    }
+
+    // the pyramid only needs max to cover the top of the structure, which is at least as tall as it is wide
+    terrain_widen_pyramid(terrain, tx, ty, z + template->height - w, w, true, false);
+    return true;
+}
+
+/**
+ * Writes the voxels of a stamp that win over those of the chunk, and returns how many there were. A voxel wins if its
+ * key is higher: solid ground beats logs, that beat leaves, that beat plants, that beat air, ties going to the
+ * highest material. Overlapping structures thus end up the same whatever order they are stamped in.
+ * Keys are looked up with a byte shuffle, which only works while materials fit in 4 bits. The chunk may be read
+ * concurrently, so the mask is computed 32 voxels at a time but winners are stored one by one, as relaxed atomics.
+ */
+static u32 structure_blit(Voxel *chunk, const Voxel *stamp, bool write) {
+    const __m256i keys = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+            0x00, 0x01, 0x42, 0x43, 0x44, 0x35, 0x26, 0x17, 0x18, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f));
+    u32 written = 0;
+    for (u32 i = 0; i < sizeof(Chunk); i += sizeof(__m256i)) {
+        __m256i current = _mm256_loadu_si256((const void *) (chunk + i));
+        __m256i stamped = _mm256_loadu_si256((const void *) (stamp + i));
+        __m256i wins = _mm256_cmpgt_epi8(_mm256_shuffle_epi8(keys, stamped), _mm256_shuffle_epi8(keys, current));
+        u32 mask = (u32) _mm256_movemask_epi8(wins);
+        written += (u32) __builtin_popcount(mask);
+        for (; write && mask; mask &= mask - 1) {
+            u32 slot = i + (u32) __builtin_ctz(mask);
+            __atomic_store_n(&chunk[slot], stamp[slot], __ATOMIC_RELAXED);
+        }
+    }
+    return written;
+}
+
+static void structure_build_templates(void) {
+    static const CrownLayer oak_crown[] = {{-1, 0}, {-1, 0}, {-1, 0}, {2, true}, {2, true}, {1, false}, {1, true}};
+    static const CrownLayer tall_crown[] = {{-1, 0}, {-1, 0}, {-1, 0}, {-1, 0}, {1, false}, {1, false}, {1, true},
+                                            {0, false}};
+    structure_build_tree(&templates[STRUCTURE_OAK], 5, 7, 5, oak_crown);
+    structure_build_tree(&templates[STRUCTURE_TALL_TREE], 3, 8, 6, tall_crown);
+    templates[STRUCTURE_SHORT_GRASS] = (StructureTemplate) {.width=1, .height=1, .voxels={SHORT_GRASS}};
+    templates[STRUCTURE_FLOWER] = (StructureTemplate) {.width=1, .height=1, .voxels={FLOWER}};
+}
+
+// a trunk in the middle of the footprint, and the crown around it, one layer per voxel of height
+static void structure_build_tree(StructureTemplate *template, u32 width, u32 height, u32 trunk_height,
+                                 const CrownLayer *crown) {
+    *template = (StructureTemplate) {.width=width, .height=height};
+    i32 reach = (i32) width / 2;
+    for (u32 z = 0; z < height; z++) {
+        for (i32 dy = -reach; dy <= reach; dy++) {
+            for (i32 dx = -reach; dx <= reach; dx++) {
+                i32 distance = max(abs(dx), abs(dy)), radius = crown[z].radius;
+                bool corner = abs(dx) == radius && abs(dy) == radius && radius > 0;
+                Voxel *voxel = &template->voxels[(u32) (dx + reach) + (u32) (dy + reach) * width + z * width * width];
+                if (!dx && !dy && z < trunk_height) *voxel = LOG;
+                else if (distance <= radius && !(crown[z].round && corner)) *voxel = LEAVES;
+            }
+        }
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "terrain.h"
+
+// how far a structure reaches out of the column it stands on, and how tall it is at most
+#define TERRAIN_STRUCTURE_REACH (2)
+#define TERRAIN_STRUCTURE_HEIGHT (8)
+
+typedef struct TerrainStructureStats {
+    u32 structures;     // structures placed
+    u32 chunks_stamped; // chunks that were written to, one per structure they hold
+    u32 chunks_split;   // how many of them had to be split out of a uniform subnode first
+} TerrainStructureStats;
+
+/**
+ * Decoration of a generated footprint, terrain_decorate doing both passes below in order. Footprints follow the same
+ * rules as the other progressive generation steps (see terrain.h).
+ * - terrain_lay_soil turns the top of stone columns into grass and dirt.
+ * - terrain_place_structures stands pre-built voxel templates on the grass: trees, short grass and flowers. Where they
+ * stand is seeded by chunk column, and overlapping structures always resolve the same way, so the world doesn't depend
+ * on the order footprints are decorated in. Structures reach up to TERRAIN_STRUCTURE_REACH columns out of the
+ * footprint, whose neighbours must be generated already. The height pyramid is widened over them, the skylight map is
+ * left for terrain_build_skylight.
+ */
+void terrain_decorate(Terrain *terrain, u32 x, u32 y, u32 width);
+void terrain_lay_soil(Terrain *terrain, u32 x, u32 y, u32 width);
+void terrain_place_structures(Terrain *terrain, u32 x, u32 y, u32 width, TerrainStructureStats *stats);
@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <string.h>
+#include "terrain_gc.h"
+#include "materials.h"
+#include "log.h"
+#include "cptime.h"
+
+// how many parents or roots point to each slot of a pool, 0 for unreachable ones
+typedef struct GcMarks {
+    u32 *node_refs, *chunk_refs;
+    u8 *node_levels; // so that compaction knows which pool the children of a node are in
+    u32 nodes, chunks;
+} GcMarks;
+
+// subnodes shared by several parents are only walked the first time they are met
+static void gc_mark(const Terrain *terrain, GcMarks *marks, u32 address, u32 level) {
+    if (!level) {
+        if (!marks->chunk_refs[address]++) marks->chunks++;
+        return;
+    }
+    if (marks->node_refs[address]++) return;
+    marks->nodes++;
+    marks->node_levels[address] = (u8) level;
+    for (u32 i = 0; i < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; i++) {
+        u32 child = terrain_node_child(terrain, address, i);
+        if (child) gc_mark(terrain, marks, child, level - 1);
+    }
+}
+
+// bitmap pools only have to know which of the slots below end are live, all of them when refs is NULL
+static void gc_set_occupancy(PoolAllocator *pool, const u32 *refs, u32 end) {
+    memset(pool->occupancy, 0, (size_t) pool->occupancyWords * sizeof(u64));
+    for (u32 i = 0; i < end; i++) {
+        if (!i || !refs || refs[i]) pool->occupancy[i / 64] |= 1ull << (i % 64);
+    }
+    pool->firstFreeWord = 0;
+}
+
+/**
+ * Unreachable slots go back on the free list, lowest first, and the ones past the last reachable slot go back to the
+ * slots never handed out. Slot 0 is reserved in both pools, it's never freed.
+ */
+static void gc_sweep(PoolAllocator *pool, const u32 *refs) {
+    u32 end = 1;
+    for (u32 i = poolAllocatorUsed(pool); i-- > 1;) {
+        if (refs[i]) {
+            end = i + 1;
+            break;
+        }
+    }
+    pool->nextFree = NULL;
+    pool->size = 1;
+    if (pool->occupancy) gc_set_occupancy(pool, refs, end);
+    for (u32 i = end; i-- > 1;) {
+        if (refs[i]) {
+            pool->size++;
+        } else if (!pool->occupancy) {
+            *(void **) poolAllocatorGet(pool, i) = pool->nextFree;
+            pool->nextFree = poolAllocatorGet(pool, i);
+        }
+    }
+    pool->unused = pool->maxSize - end;
+}
+
+// freed nodes are unbounded, see terrain_free_slot. Past the end of the bounds pool they already are.
+static void gc_unbound(Terrain *terrain, const u32 *node_refs, u32 first, u32 end) {
+    end = min(end, poolAllocatorUsed(&terrain->boundsPool));
+    for (u32 i = first; i < end; i++) {
+        if (!node_refs || !node_refs[i]) *(u32 *) poolAllocatorGet(&terrain->boundsPool, i) = 0;
+    }
+}
+
+// the slot each reachable one moves to, in the same order. Slot 0 stays where it is. Returns how many slots are kept.
+static u32 gc_remap(const u32 *refs, u32 used, u32 *remap) {
+    u32 next = 1;
+    remap[0] = 0;
+    for (u32 i = 1; i < used; i++) remap[i] = refs[i] ? next++ : 0;
+    return next;
+}
+
+// shares count the parents and roots past the first one, see terrain_shares
+static void gc_rebuild_shares(u32 **shares, u32 *shares_size, const u32 *refs, const u32 *remap, u32 used) {
+    free(*shares);
+    *shares = (u32 *) calloc(used, sizeof(u32));
+    if (!*shares) FATAL("Out of memory.");
+    *shares_size = used;
+    for (u32 i = 0; i < used; i++) {
+        if (refs[i]) (*shares)[remap ? remap[i] : i] = refs[i] - 1;
+    }
+}
+
+/**
+ * Slots are visited in address order and only ever move down, so every slot is read before anything is written over
+ * it. Entries are decoded at the old address of their node and encoded again at the new one, since near entries are
+ * relative to it and far ones indexed by it.
+ */
+static void gc_compact(Terrain *terrain, const GcMarks *marks, const u32 *node_remap, const u32 *chunk_remap,
+                       u32 nodes_used, u32 chunks_used, TerrainGcStats *stats) {
+    for (u32 i = 1; i < chunks_used; i++) {
+        if (!marks->chunk_refs[i] || chunk_remap[i] == i) continue;
+        memcpy(poolAllocatorGet(&terrain->chunkPool, chunk_remap[i]), poolAllocatorGet(&terrain->chunkPool, i),
+               sizeof(Chunk));
+        if (i < terrain->chunk_hashes_size) terrain->chunk_hashes[chunk_remap[i]] = terrain->chunk_hashes[i];
+        stats->moved_chunks++;
+    }
+    for (u32 i = 0; i < nodes_used; i++) {
+        if (!marks->node_refs[i]) continue;
+        const u32 *children_remap = marks->node_levels[i] == 1 ? chunk_remap : node_remap;
+        Voxel materials[NODE_WIDTH * NODE_WIDTH * NODE_WIDTH];
+        u32 children[NODE_WIDTH * NODE_WIDTH * NODE_WIDTH];
+        for (u32 slot = 0; slot < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; slot++) {
+            u32 entry = terrain_node_entry(terrain, i, slot);
+            u32 child = terrain_entry_child(terrain, i, slot, entry);
+            materials[slot] = terrain_entry_material(entry);
+            children[slot] = child ? children_remap[child] : 0;
+        }
+        for (u32 slot = 0; slot < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; slot++) {
+            terrain_node_set(terrain, node_remap[i], slot, materials[slot], children[slot]);
+        }
+        if (node_remap[i] == i) continue;
+        if (i < terrain->node_hashes_size) terrain->node_hashes[node_remap[i]] = terrain->node_hashes[i];
+        if (i < poolAllocatorUsed(&terrain->boundsPool)) {
+            *(u32 *) poolAllocatorGet(&terrain->boundsPool, node_remap[i]) = terrain_node_bounds(terrain, i);
+        }
+        stats->moved_nodes++;
+    }
+}
+
+void terrain_collect_garbage(Terrain *terrain, u32 *snapshots, u32 snapshot_count, bool compact,
+                             TerrainGcStats *stats) {
+    u32 time = uclock();
+    *stats = (TerrainGcStats) {0};
+    u32 nodes_used = poolAllocatorUsed(&terrain->nodePool), chunks_used = poolAllocatorUsed(&terrain->chunkPool);
+    u32 nodes_allocated = terrain->nodePool.size, chunks_allocated = terrain->chunkPool.size;
+    GcMarks marks = {.node_refs=(u32 *) calloc(nodes_used, sizeof(u32)),
+            .chunk_refs=(u32 *) calloc(chunks_used, sizeof(u32)), .node_levels=(u8 *) calloc(nodes_used, sizeof(u8))};
+    if (!marks.node_refs || !marks.chunk_refs || !marks.node_levels) FATAL("Out of memory.");
+
+    gc_mark(terrain, &marks, terrain->root_node_address, terrain->depth);
+    for (u32 i = 0; i < snapshot_count; i++) gc_mark(terrain, &marks, snapshots[i], terrain->depth);
+    stats->live_nodes = marks.nodes;
+    stats->live_chunks = marks.chunks;
+
+    // node 0 is only ever a root. Once no root is there anymore it's kept for its slot, pointing to nothing.
+    if (!marks.node_refs[0]) {
+        for (u32 i = 0; i < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; i++) terrain_node_set(terrain, 0, i, AIR, 0);
+        terrain_record_delta(terrain, TERRAIN_DELTA_NODES, 0, 1);
+    }
+
+    if (!compact) {
+        gc_sweep(&terrain->nodePool, marks.node_refs);
+        gc_unbound(terrain, marks.node_refs, 1, nodes_used);
+        gc_sweep(&terrain->chunkPool, marks.chunk_refs);
+        gc_rebuild_shares(&terrain->node_shares, &terrain->node_shares_size, marks.node_refs, NULL, nodes_used);
+        gc_rebuild_shares(&terrain->chunk_shares, &terrain->chunk_shares_size, marks.chunk_refs, NULL, chunks_used);
+    } else {
+        u32 *node_remap = (u32 *) malloc(nodes_used * sizeof(u32));
+        u32 *chunk_remap = (u32 *) malloc(chunks_used * sizeof(u32));
+        if (!node_remap || !chunk_remap) FATAL("Out of memory.");
+        u32 nodes_kept = gc_remap(marks.node_refs, nodes_used, node_remap);
+        u32 chunks_kept = gc_remap(marks.chunk_refs, chunks_used, chunk_remap);
+        gc_compact(terrain, &marks, node_remap, chunk_remap, nodes_used, chunks_used, stats);
+        gc_rebuild_shares(&terrain->node_shares, &terrain->node_shares_size, marks.node_refs, node_remap, nodes_used);
+        gc_rebuild_shares(&terrain->chunk_shares, &terrain->chunk_shares_size, marks.chunk_refs, chunk_remap,
+                          chunks_used);
+
+        terrain->root_node_address = node_remap[terrain->root_node_address];
+        for (u32 i = 0; i < snapshot_count; i++) snapshots[i] = node_remap[snapshots[i]];
+        free(node_remap);
+        free(chunk_remap);
+
+        PoolAllocator *pools[2] = {&terrain->nodePool, &terrain->chunkPool};
+        u32 kept[2] = {nodes_kept, chunks_kept};
+        for (u32 i = 0; i < 2; i++) {
+            pools[i]->nextFree = NULL;
+            pools[i]->size = kept[i];
+            pools[i]->unused = pools[i]->maxSize - kept[i];
+            if (pools[i]->occupancy) gc_set_occupancy(pools[i], NULL, kept[i]);
+            poolAllocatorShrink(pools[i], 1024);
+        }
+        gc_unbound(terrain, NULL, nodes_kept, nodes_used);
+        // far nodes past the last node kept are stale
+        PoolAllocator *far = &terrain->farPool;
+        if (far->memory && poolAllocatorUsed(far) > nodes_kept) {
+            far->size = nodes_kept;
+            far->unused = far->maxSize - nodes_kept;
+            poolAllocatorShrink(far, 64);
+        }
+        terrain_record_delta(terrain, TERRAIN_DELTA_ALL, 0, 0);
+    }
+    stats->freed_nodes = nodes_allocated - terrain->nodePool.size;
+    stats->freed_chunks = chunks_allocated - terrain->chunkPool.size;
+    free(marks.node_refs);
+    free(marks.chunk_refs);
+    free(marks.node_levels);
+
+    INFO("Collected %u nodes and %u chunks in %.2fms, %u nodes and %u chunks are reachable, %u and %u were moved",
+         stats->freed_nodes, stats->freed_chunks, (uclock() - time) / 1e3, stats->live_nodes, stats->live_chunks,
+         stats->moved_nodes, stats->moved_chunks);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include "terrain.h"
+
+/**
+ * Mark-and-sweep garbage collection of the pools. Share counts already free whatever the live tree and snapshots stop
+ * using, but anything that drops a subtree without releasing it leaves it allocated for good, and freed slots are
+ * handed out again in whatever order they were freed. terrain_collect_garbage marks every node and chunk reachable
+ * from the live tree or one of the snapshots, frees every other slot so that the lowest ones are handed out first, and
+ * rebuilds the share counts from what it found.
+ * With compact set, reachable slots are also moved to the front of their pool in address order, leaving no free slot
+ * behind them. The snapshots are then remapped in place, the pools that own their memory give back what they no longer
+ * use, and a TERRAIN_DELTA_ALL is recorded so that the GPU copy shrinks too.
+ * It must not run concurrently with anything else using the terrain, and slots handed to retire_slot must all have
+ * been freed already, since it can't tell them apart from unreachable ones.
+ */
+typedef struct TerrainGcStats {
+    u32 live_nodes, live_chunks;   // reachable from the live tree or a snapshot
+    u32 freed_nodes, freed_chunks; // allocated but unreachable, now back in their pool
+    u32 moved_nodes, moved_chunks; // moved to a lower slot by compaction
+} TerrainGcStats;
+
+void terrain_collect_garbage(Terrain *terrain, u32 *snapshots, u32 snapshot_count, bool compact,
+                             TerrainGcStats *stats);
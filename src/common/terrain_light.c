@@ -0,0 +1,391 @@
+#include <stdlib.h>
+#include <string.h>
+#include "terrain_light.h"
+#include "materials.h"
+#include "parallel.h"
+#include "log.h"
+
+#define LIGHT_BLOCK (0)
+#define LIGHT_SKY (1)
+
+/**
+ * Queue entries pack a voxel, its channel and a level: 18 bits per axis, then 4 bits of level and the channel. In the
+ * removal queue, the level is what the voxel had before it was put out. In the addition queue, it's the level of a
+ * new source, set once every removal is done, or 0 for voxels that only spread what they already have.
+ */
+#define LIGHT_ENTRY(x, y, z, channel, level) \
+    ((u64) (x) | (u64) (y) << 18 | (u64) (z) << 36 | (u64) (level) << 54 | (u64) (channel) << 58)
+
+typedef struct LightQueue {
+    u64 *entries;
+    u32 head, count, capacity;
+} LightQueue;
+
+// a region of columns and its range of sorted edits
+typedef struct LightGroup {
+    u32 region, begin, end;
+} LightGroup;
+
+typedef struct LightJob {
+    TerrainLight *light;
+    const uvec3 *voxels;
+    const u64 *keys;
+    const LightGroup *groups;
+    u32 group_count, *next_group;
+    bool build;
+    LightQueue removals, additions;
+    u64 steps;
+} LightJob;
+
+static const i32 neighbours[6][3] = {{-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}};
+
+static void light_push(LightQueue *queue, u64 entry) {
+    if (queue->count == queue->capacity) {
+        queue->capacity = queue->capacity ? 2 * queue->capacity : 1024;
+        queue->entries = (u64 *) realloc(queue->entries, queue->capacity * sizeof(u64));
+        if (!queue->entries) FATAL("Out of memory.");
+    }
+    queue->entries[queue->count++] = entry;
+}
+
+static TerrainLightChunk *light_chunk(const TerrainLight *light, u32 x, u32 y, u32 z) {
+    TerrainLightChunk **column = light->columns[x / CHUNK_WIDTH + y / CHUNK_WIDTH * light->width_chunks];
+    return column ? column[z / CHUNK_WIDTH] : NULL;
+}
+
+// whether a voxel gets the sky straight from above, in which case its sky light isn't stored and is always the max
+static bool light_sees_sky(const TerrainLight *light, u32 x, u32 y, u32 z) {
+    return z >= light->skylight[x + y * light->terrain->width];
+}
+
+static u32 light_level(const TerrainLight *light, u32 x, u32 y, u32 z, u32 channel) {
+    if (channel == LIGHT_SKY && light_sees_sky(light, x, y, z)) return TERRAIN_LIGHT_MAX;
+    TerrainLightChunk *chunk = light_chunk(light, x, y, z);
+    if (!chunk) return 0;
+    return chunk->levels[CHUNK_SLOT(x % CHUNK_WIDTH, y % CHUNK_WIDTH, z % CHUNK_WIDTH)] >> channel * 4 & 0xf;
+}
+
+/**
+ * Chunks are allocated by the first voxel lit in them and freed with the last one put out. Regions relit in parallel
+ * never share a column of chunks, so neither needs a lock.
+ */
+static void light_store(TerrainLight *light, u32 x, u32 y, u32 z, u32 channel, u32 level) {
+    TerrainLightChunk ***column = &light->columns[x / CHUNK_WIDTH + y / CHUNK_WIDTH * light->width_chunks];
+    TerrainLightChunk *chunk = *column ? (*column)[z / CHUNK_WIDTH] : NULL;
+    if (!chunk) {
+        if (!level) return;
+        if (!*column) {
+            *column = (TerrainLightChunk **) calloc(light->width_chunks, sizeof(TerrainLightChunk *));
+            if (!*column) FATAL("Out of memory.");
+        }
+        chunk = (TerrainLightChunk *) calloc(1, sizeof(TerrainLightChunk));
+        if (!chunk) FATAL("Out of memory.");
+        (*column)[z / CHUNK_WIDTH] = chunk;
+        __atomic_add_fetch(&light->chunk_count, 1, __ATOMIC_RELAXED);
+    }
+    u8 *levels = &chunk->levels[CHUNK_SLOT(x % CHUNK_WIDTH, y % CHUNK_WIDTH, z % CHUNK_WIDTH)];
+    bool was_lit = *levels;
+    *levels = (u8) ((*levels & ~(0xfu << channel * 4)) | level << channel * 4);
+    if (was_lit && !*levels && !--chunk->lit) {
+        free(chunk);
+        (*column)[z / CHUNK_WIDTH] = NULL;
+        __atomic_sub_fetch(&light->chunk_count, 1, __ATOMIC_RELAXED);
+    } else if (!was_lit && *levels) {
+        chunk->lit++;
+    }
+}
+
+static bool light_neighbour(const Terrain *terrain, u32 x, u32 y, u32 z, u32 direction, u32 *neighbour) {
+    u32 position[3] = {x, y, z};
+    for (u32 axis = 0; axis < 3; axis++) {
+        neighbour[axis] = position[axis] + (u32) neighbours[direction][axis];
+        if (neighbour[axis] >= terrain->width) return false;
+    }
+    return true;
+}
+
+/**
+ * Takes away the light of what changed. Neighbours darker than the voxel put out could have had their light from it,
+ * so they are put out as well, while brighter or as bright ones have it from elsewhere and spread it back once every
+ * removal is done, along with voxels that see the sky.
+ */
+static void light_remove(LightJob *job) {
+    TerrainLight *light = job->light;
+    const Terrain *terrain = light->terrain;
+    LightQueue *queue = &job->removals;
+    for (; queue->head < queue->count; queue->head++) {
+        u64 entry = queue->entries[queue->head];
+        u32 x = entry & 0x3ffff, y = entry >> 18 & 0x3ffff, z = entry >> 36 & 0x3ffff;
+        u32 level = entry >> 54 & 0xf, channel = entry >> 58 & 1;
+        for (u32 direction = 0; direction < 6; direction++) {
+            u32 n[3];
+            if (!light_neighbour(terrain, x, y, z, direction, n)) continue;
+            if (channel == LIGHT_SKY && light_sees_sky(light, n[0], n[1], n[2])) {
+                light_push(&job->additions, LIGHT_ENTRY(n[0], n[1], n[2], channel, 0));
+                continue;
+            }
+            u32 neighbour_level = light_level(light, n[0], n[1], n[2], channel);
+            if (!neighbour_level) continue;
+            if (neighbour_level >= level) {
+                light_push(&job->additions, LIGHT_ENTRY(n[0], n[1], n[2], channel, 0));
+                continue;
+            }
+            light_store(light, n[0], n[1], n[2], channel, 0);
+            light_push(queue, LIGHT_ENTRY(n[0], n[1], n[2], channel, neighbour_level));
+            u32 emitted = channel == LIGHT_BLOCK ? MATERIAL_LIGHT(terrain_get_voxel(terrain, n[0], n[1], n[2])) : 0;
+            if (emitted) light_push(&job->additions, LIGHT_ENTRY(n[0], n[1], n[2], channel, emitted));
+        }
+    }
+    job->steps += queue->count;
+    queue->head = queue->count = 0;
+}
+
+// spreads light to every neighbour that isn't opaque and would get more of it than it has
+static void light_add(LightJob *job) {
+    TerrainLight *light = job->light;
+    const Terrain *terrain = light->terrain;
+    LightQueue *queue = &job->additions;
+    for (; queue->head < queue->count; queue->head++) {
+        u64 entry = queue->entries[queue->head];
+        u32 x = entry & 0x3ffff, y = entry >> 18 & 0x3ffff, z = entry >> 36 & 0x3ffff;
+        u32 source = entry >> 54 & 0xf, channel = entry >> 58 & 1;
+        u32 level = light_level(light, x, y, z, channel);
+        if (source > level) {
+            light_store(light, x, y, z, channel, source);
+            level = source;
+        }
+        if (level <= 1) continue;
+        for (u32 direction = 0; direction < 6; direction++) {
+            u32 n[3];
+            if (!light_neighbour(terrain, x, y, z, direction, n)) continue;
+            if (channel == LIGHT_SKY && light_sees_sky(light, n[0], n[1], n[2])) continue;
+            if (light_level(light, n[0], n[1], n[2], channel) + 1 >= level) continue;
+            if (MATERIAL_IS_OPAQUE(terrain_get_voxel(terrain, n[0], n[1], n[2]))) continue;
+            light_store(light, n[0], n[1], n[2], channel, level - 1);
+            light_push(queue, LIGHT_ENTRY(n[0], n[1], n[2], channel, 0));
+        }
+    }
+    job->steps += queue->count;
+    queue->head = queue->count = 0;
+}
+
+/**
+ * Queues what a changed voxel needs. When the top of its column moved, the voxels in between either lost the sky or
+ * now see it. Then for each channel, the voxel is put out if it had more light than it can now have, and becomes a
+ * source if it emits, or gets the light of its neighbours back if light goes through it.
+ */
+static void light_change(LightJob *job, u32 x, u32 y, u32 z) {
+    TerrainLight *light = job->light;
+    const Terrain *terrain = light->terrain;
+    u32 column = x + y * terrain->width, old_height = light->skylight[column], height = terrain->skylight[column];
+    if (height != old_height) {
+        light->skylight[column] = height;
+        for (u32 h = min(height, old_height); h < max(height, old_height); h++) {
+            light_store(light, x, y, h, LIGHT_SKY, 0);
+            if (height > old_height) light_push(&job->removals, LIGHT_ENTRY(x, y, h, LIGHT_SKY, TERRAIN_LIGHT_MAX));
+            else light_push(&job->additions, LIGHT_ENTRY(x, y, h, LIGHT_SKY, 0));
+        }
+    }
+
+    Voxel material = terrain_get_voxel(terrain, x, y, z);
+    bool opaque = MATERIAL_IS_OPAQUE(material);
+    for (u32 channel = LIGHT_BLOCK; channel <= LIGHT_SKY; channel++) {
+        if (channel == LIGHT_SKY && z >= height) continue;
+        u32 emitted = channel == LIGHT_BLOCK ? MATERIAL_LIGHT(material) : 0, received = 0;
+        for (u32 direction = 0; direction < 6 && !opaque; direction++) {
+            u32 n[3];
+            if (!light_neighbour(terrain, x, y, z, direction, n)) continue;
+            received = max(received, light_level(light, n[0], n[1], n[2], channel));
+        }
+        received = received ? received - 1 : 0;
+        u32 level = light_level(light, x, y, z, channel);
+        if (level > max(emitted, received)) {
+            light_store(light, x, y, z, channel, 0);
+            light_push(&job->removals, LIGHT_ENTRY(x, y, z, channel, level));
+            level = 0;
+        }
+        if (emitted > level) light_push(&job->additions, LIGHT_ENTRY(x, y, z, channel, emitted));
+        if (received <= max(level, emitted)) continue;
+        for (u32 direction = 0; direction < 6; direction++) {
+            u32 n[3];
+            if (light_neighbour(terrain, x, y, z, direction, n)) {
+                light_push(&job->additions, LIGHT_ENTRY(n[0], n[1], n[2], channel, 0));
+            }
+        }
+    }
+}
+
+// the sky of a region on a fresh build: where a column is higher than its neighbour, its side sees the sky
+static void light_seed_sky(LightJob *job, u32 region) {
+    TerrainLight *light = job->light;
+    const Terrain *terrain = light->terrain;
+    u32 width = terrain->width, width_regions = (width + TERRAIN_LIGHT_REGION_WIDTH - 1) / TERRAIN_LIGHT_REGION_WIDTH;
+    u32 min_x = region % width_regions * TERRAIN_LIGHT_REGION_WIDTH;
+    u32 min_y = region / width_regions * TERRAIN_LIGHT_REGION_WIDTH;
+    for (u32 y = min_y; y < min(min_y + TERRAIN_LIGHT_REGION_WIDTH, width); y++) {
+        for (u32 x = min_x; x < min(min_x + TERRAIN_LIGHT_REGION_WIDTH, width); x++) {
+            u32 height = light->skylight[x + y * width];
+            for (u32 direction = 0; direction < 4; direction++) {
+                u32 n[3];
+                if (!light_neighbour(terrain, x, y, 0, direction, n)) continue;
+                for (u32 z = light->skylight[n[0] + n[1] * width]; z < height; z++) {
+                    if (MATERIAL_IS_OPAQUE(terrain_get_voxel(terrain, x, y, z))) continue;
+                    light_push(&job->additions, LIGHT_ENTRY(x, y, z, LIGHT_SKY, TERRAIN_LIGHT_MAX - 1));
+                }
+            }
+        }
+    }
+}
+
+static void light_job(void *data, u32 worker) {
+    LightJob *job = (LightJob *) data + worker;
+    for (u32 i; (i = __atomic_fetch_add(job->next_group, 1, __ATOMIC_RELAXED)) < job->group_count;) {
+        const LightGroup *group = &job->groups[i];
+        if (job->build) light_seed_sky(job, group->region);
+        for (u32 edit = group->begin; edit < group->end; edit++) {
+            const uvec3 *voxel = &job->voxels[(u32) job->keys[edit]];
+            light_change(job, voxel->x, voxel->y, voxel->z);
+        }
+        light_remove(job);
+        light_add(job);
+    }
+}
+
+// groups of one phase, spread over threads that each take the next group left
+static void light_run_phase(TerrainLight *light, const uvec3 *voxels, const u64 *keys, const LightGroup *groups,
+                            u32 group_count, bool build) {
+    u32 thread_count = parallel_thread_count(group_count, 1, TERRAIN_LIGHT_MAX_THREADS), next_group = 0;
+    LightJob jobs[TERRAIN_LIGHT_MAX_THREADS];
+    for (u32 i = 0; i < thread_count; i++) {
+        jobs[i] = (LightJob) {.light=light, .voxels=voxels, .keys=keys, .groups=groups, .group_count=group_count,
+                              .next_group=&next_group, .build=build};
+    }
+    parallel_run(light_job, jobs, thread_count);
+    for (u32 i = 0; i < thread_count; i++) {
+        light->steps += jobs[i].steps;
+        free(jobs[i].removals.entries);
+        free(jobs[i].additions.entries);
+    }
+}
+
+static int light_compare(const void *a, const void *b) {
+    u64 left = *(const u64 *) a, right = *(const u64 *) b;
+    return (left > right) - (left < right);
+}
+
+/**
+ * Edits are sorted by phase, then region, as 64 bits keys: 2 bits of phase, 30 bits of region and the index of the
+ * edit. A build goes through every region, edits or not, to light their sky.
+ */
+static void light_run(TerrainLight *light, const uvec3 *voxels, u32 count, bool build) {
+    u32 width_regions = (light->terrain->width + TERRAIN_LIGHT_REGION_WIDTH - 1) / TERRAIN_LIGHT_REGION_WIDTH;
+    u32 phase_regions = (width_regions + 1) / 2 * ((width_regions + 1) / 2);
+    u64 *keys = (u64 *) malloc(max(count, 1) * sizeof(u64));
+    LightGroup *groups = (LightGroup *) malloc(max(max(count, phase_regions), 1) * sizeof(LightGroup));
+    if (!keys || !groups) FATAL("Out of memory.");
+    for (u32 i = 0; i < count; i++) {
+        u32 region_x = voxels[i].x / TERRAIN_LIGHT_REGION_WIDTH, region_y = voxels[i].y / TERRAIN_LIGHT_REGION_WIDTH;
+        u32 phase = (region_x & 1) | (region_y & 1) << 1;
+        keys[i] = (u64) phase << 62 | (u64) (region_x + region_y * width_regions) << 32 | i;
+    }
+    qsort(keys, count, sizeof(u64), light_compare);
+
+    light->steps = 0;
+    u32 key = 0;
+    for (u32 phase = 0; phase < 4; phase++) {
+        u32 group_count = 0;
+        if (build) {
+            for (u32 region_y = phase >> 1; region_y < width_regions; region_y += 2) {
+                for (u32 region_x = phase & 1; region_x < width_regions; region_x += 2) {
+                    u32 region = region_x + region_y * width_regions, begin = key;
+                    while (key < count && keys[key] >> 32 == ((u64) phase << 30 | region)) key++;
+                    groups[group_count++] = (LightGroup) {.region=region, .begin=begin, .end=key};
+                }
+            }
+        } else {
+            while (key < count && keys[key] >> 62 == phase) {
+                u32 begin = key;
+                while (key < count && keys[key] >> 32 == keys[begin] >> 32) key++;
+                groups[group_count++] = (LightGroup) {.region=(u32) (keys[begin] >> 32) & 0x3fffffff,
+                                                      .begin=begin, .end=key};
+            }
+        }
+        if (group_count) light_run_phase(light, voxels, keys, groups, group_count, build);
+    }
+    free(groups);
+    free(keys);
+}
+
+// every voxel of the subnodes of a node whose material emits light
+static void light_find_emitters(const Terrain *terrain, u32 node_address, u32 x, u32 y, u32 z, u32 depth,
+                                uvec3 **emitters, u32 *count, u32 *capacity) {
+    u32 cell = CHUNK_WIDTH << (depth - 1);
+    for (u32 slot = 0; slot < 8; slot++) {
+        u32 min_x = x + (slot & 1) * cell, min_y = y + (slot >> 1 & 1) * cell, min_z = z + (slot >> 2) * cell;
+        u32 entry = terrain_node_entry(terrain, node_address, slot);
+        u32 child = terrain_entry_child(terrain, node_address, slot, entry);
+        if (child && depth > 1) {
+            if (terrain_node_bounds(terrain, child) & TERRAIN_BOUNDS_EMPTY) continue;
+            light_find_emitters(terrain, child, min_x, min_y, min_z, depth - 1, emitters, count, capacity);
+            continue;
+        }
+        Chunk *chunk = child ? poolAllocatorGet(&terrain->chunkPool, child) : NULL;
+        Voxel material = terrain_entry_material(entry);
+        if (!child && !MATERIAL_LIGHT(material)) continue;
+        for (u32 dz = 0; dz < cell; dz++) {
+            for (u32 dy = 0; dy < cell; dy++) {
+                for (u32 dx = 0; dx < cell; dx++) {
+                    if (chunk) material = __atomic_load_n(&(*chunk)[CHUNK_SLOT(dx, dy, dz)], __ATOMIC_RELAXED);
+                    if (!MATERIAL_LIGHT(material)) continue;
+                    if (*count == *capacity) {
+                        *capacity = *capacity ? 2 * *capacity : 64;
+                        *emitters = (uvec3 *) realloc(*emitters, *capacity * sizeof(uvec3));
+                        if (!*emitters) FATAL("Out of memory.");
+                    }
+                    (*emitters)[(*count)++] = (uvec3) {{min_x + dx, min_y + dy, min_z + dz}};
+                }
+            }
+        }
+    }
+}
+
+void terrain_light_init(TerrainLight *light, const Terrain *terrain) {
+    size_t columns = (size_t) terrain->width * terrain->width;
+    *light = (TerrainLight) {.terrain=terrain, .width_chunks=terrain->width_chunks};
+    light->skylight = (u32 *) malloc(columns * sizeof(u32));
+    light->columns = (TerrainLightChunk ***) calloc((size_t) light->width_chunks * light->width_chunks,
+                                                    sizeof(TerrainLightChunk **));
+    if (!light->skylight || !light->columns) FATAL("Out of memory.");
+    memcpy(light->skylight, terrain->skylight, columns * sizeof(u32));
+
+    uvec3 *emitters = NULL;
+    u32 count = 0, capacity = 0;
+    light_find_emitters(terrain, terrain->root_node_address, 0, 0, 0, terrain->depth, &emitters, &count, &capacity);
+    light_run(light, emitters, count, true);
+    free(emitters);
+}
+
+void terrain_light_destroy(TerrainLight *light) {
+    for (size_t i = 0; i < (size_t) light->width_chunks * light->width_chunks; i++) {
+        if (!light->columns[i]) continue;
+        for (u32 z = 0; z < light->width_chunks; z++) free(light->columns[i][z]);
+        free(light->columns[i]);
+    }
+    free(light->columns);
+    free(light->skylight);
+    *light = (TerrainLight) {0};
+}
+
+void terrain_light_update(TerrainLight *light, const uvec3 *voxels, u32 count) {
+    u32 width = light->terrain->width;
+    for (u32 i = 0; i < count; i++) {
+        if (voxels[i].x >= width || voxels[i].y >= width || voxels[i].z >= width) FATAL("Relighting out of the world.");
+    }
+    light_run(light, voxels, count, false);
+}
+
+u8 terrain_light_at(const TerrainLight *light, u32 x, u32 y, u32 z) {
+    u32 width = light->terrain->width;
+    if (x >= width || y >= width || z >= width) return 0;
+    return (u8) (light_level(light, x, y, z, LIGHT_SKY) << 4 | light_level(light, x, y, z, LIGHT_BLOCK));
+}
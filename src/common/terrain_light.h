@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include "terrain.h"
+
+/**
+ * Light levels of every voxel, from 0 to TERRAIN_LIGHT_MAX, flood-filled the way block games do it. There are two
+ * channels: sky light, which every voxel of a column above its top-most opaque voxel (the skylight map) has at its
+ * maximum, and block light, which emitters (see MATERIAL_LIGHT) have at their own level. From there light spreads to
+ * the 6 neighbours of each voxel that aren't opaque, one level lower at each step.
+ * Levels are kept per chunk, a byte per voxel, sky light in the high nibble. Only the chunks holding some light that
+ * isn't the sky's straight from above are allocated: voxels above the skylight map read their sky light from it, so
+ * neither open air nor dark underground costs anything.
+ * Edits are relit with queues, first taking away the light of what changed as far as it went, then spreading it again
+ * from the edges of what was taken away and from new sources. Light never goes further than TERRAIN_LIGHT_MAX voxels
+ * from its source, so the work is bounded by the edited area. Edits are grouped by square regions of columns, and the
+ * regions one out of two along each axis never reach the same voxels: they are relit in parallel, in four phases.
+ * Light reads the terrain and its skylight map, so it must not run concurrently with anything writing to them, and
+ * each TerrainLight is used by one thread at a time.
+ * Levels stay on the CPU, for gameplay: they aren't uploaded, and svo_tracer.glsl shades from the skylight map alone.
+ */
+#define TERRAIN_LIGHT_MAX (15)
+
+// width of the regions relit in parallel, at least twice as far as light goes and a multiple of the chunk width
+#define TERRAIN_LIGHT_REGION_WIDTH (32)
+#define TERRAIN_LIGHT_MAX_THREADS (16) // no more than PARALLEL_MAX_THREADS
+
+#define TERRAIN_LIGHT_SKY(light) ((light) >> 4)
+#define TERRAIN_LIGHT_BLOCK(light) ((light) & 0xf)
+
+typedef struct TerrainLightChunk {
+    u32 lit; // how many of its voxels have some light, freed when none has
+    u8 levels[CHUNK_WIDTH * CHUNK_WIDTH * CHUNK_WIDTH];
+} TerrainLightChunk;
+
+typedef struct TerrainLight {
+    const Terrain *terrain;
+    u32 width_chunks;
+
+    // the skylight map as it was when light was last spread, so that edits know which voxels lost or got the sky
+    u32 *skylight;
+
+    // for each column of chunks, NULL if none of its chunks was ever lit, else a chunk per height, NULL if it's dark
+    TerrainLightChunk ***columns;
+    u32 chunk_count;
+
+    // how many times a voxel was taken out of a queue by the last build or update, the work it did
+    u64 steps;
+} TerrainLight;
+
+/**
+ * Lights the whole terrain, its sky from the skylight map and every emitter found in the tree. Once built, light only
+ * needs terrain_light_update after edits.
+ */
+void terrain_light_init(TerrainLight *light, const Terrain *terrain);
+void terrain_light_destroy(TerrainLight *light);
+
+/**
+ * Relights around voxels whose material changed since light was last spread, once the terrain and its skylight map
+ * were edited. A voxel may be listed more than once, and edits are best batched: each batch is one round of phases.
+ */
+void terrain_light_update(TerrainLight *light, const uvec3 *voxels, u32 count);
+
+// both channels of a voxel, TERRAIN_LIGHT_SKY and TERRAIN_LIGHT_BLOCK of it, 0 out of the world
+u8 terrain_light_at(const TerrainLight *light, u32 x, u32 y, u32 z);
@@ -0,0 +1,454 @@
+#include <stdlib.h>
+#include <string.h>
+#include "terrain_path.h"
+#include "log.h"
+
+#define PATH_NONE (UINT32_MAX)
+
+struct TerrainPathCluster {
+    bool built;
+    u32 entrance_count;
+    u32 *entrances; // columns on this side of the border
+    u32 *across;    // the column each of them is crossed to, in the neighbouring cluster
+    u32 *costs;     // entrance_count**2 costs of walking between them within the cluster, PATH_NONE if there is no way
+};
+
+// a node of the entrance graph, found back from its column through an open addressing table
+typedef struct PathNode {
+    u32 column, cost, parent;
+    bool closed;
+} PathNode;
+
+typedef struct PathGraph {
+    PathNode *nodes;
+    u32 node_count, node_capacity;
+    u32 *table;
+    u32 table_capacity;
+    u64 *heap;
+    u32 heap_size, heap_capacity;
+} PathGraph;
+
+static u32 path_height(const TerrainPlanner *planner, u32 column) {
+    return planner->terrain->skylight[column];
+}
+
+static bool path_can_climb(const TerrainPlanner *planner, u32 from, u32 to) {
+    u32 a = path_height(planner, from), b = path_height(planner, to);
+    return a && b && (a > b ? a - b : b - a) <= TERRAIN_PATH_MAX_CLIMB;
+}
+
+// cost of stepping from a column to one of its 8 neighbours, PATH_NONE if it can't be done
+static u32 path_step_cost(const TerrainPlanner *planner, u32 from, u32 to) {
+    u32 width = planner->terrain->width;
+    if (!path_can_climb(planner, from, to)) return PATH_NONE;
+    u32 cost = TERRAIN_PATH_STEP_COST;
+    if (from % width != to % width && from / width != to / width) {
+        // diagonal steps don't cut corners: both columns they go around must be walkable from either end
+        u32 side_x = to % width + from / width * width, side_y = from % width + to / width * width;
+        if (!path_can_climb(planner, from, side_x) || !path_can_climb(planner, side_x, to) ||
+            !path_can_climb(planner, from, side_y) || !path_can_climb(planner, side_y, to)) {
+            return PATH_NONE;
+        }
+        cost = TERRAIN_PATH_DIAGONAL_COST;
+    }
+    u32 a = path_height(planner, from), b = path_height(planner, to);
+    return cost + TERRAIN_PATH_CLIMB_COST * (a > b ? a - b : b - a);
+}
+
+// octile distance, never more than the cost of any walk between the two columns
+static u32 path_estimate(const TerrainPlanner *planner, u32 from, u32 to) {
+    u32 width = planner->terrain->width;
+    u32 dx = abs((i32) (from % width) - (i32) (to % width)), dy = abs((i32) (from / width) - (i32) (to / width));
+    return TERRAIN_PATH_STEP_COST * max(dx, dy) + (TERRAIN_PATH_DIAGONAL_COST - TERRAIN_PATH_STEP_COST) * min(dx, dy);
+}
+
+static u32 path_cluster_of(const TerrainPlanner *planner, u32 column) {
+    u32 width = planner->terrain->width;
+    return column % width / planner->cluster_width + column / width / planner->cluster_width * planner->width_clusters;
+}
+
+static void path_heap_push(u64 *heap, u32 *size, u32 priority, u32 value) {
+    u32 i = (*size)++;
+    u64 item = (u64) priority << 32 | value;
+    while (i && heap[(i - 1) / 2] > item) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = item;
+}
+
+static u64 path_heap_pop(u64 *heap, u32 *size) {
+    u64 top = heap[0], last = heap[--(*size)];
+    u32 i = 0;
+    for (;;) {
+        u32 child = 2 * i + 1;
+        if (child >= *size) break;
+        if (child + 1 < *size && heap[child + 1] < heap[child]) child++;
+        if (heap[child] >= last) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (*size) heap[i] = last;
+    return top;
+}
+
+/**
+ * Dijkstra, or A* when target isn't PATH_NONE, from a column to every other one of its cluster without leaving it.
+ * Costs and parents are left in the scratch, in cells of the cluster, for the cells whose stamp is the current one.
+ * Returns the cost of reaching the target, PATH_NONE if it can't be reached or there is none.
+ */
+static u32 path_search_cluster(TerrainPlanner *planner, u32 source, u32 target) {
+    u32 width = planner->terrain->width, cluster_width = planner->cluster_width;
+    u32 origin_x = source % width / cluster_width * cluster_width;
+    u32 origin_y = source / width / cluster_width * cluster_width;
+    u32 *costs = planner->costs, *parents = planner->parents, *stamps = planner->stamps, heap_size = 0;
+    if (!++planner->stamp) {
+        memset(stamps, 0, (size_t) cluster_width * cluster_width * sizeof(u32));
+        planner->stamp = 1;
+    }
+    u32 stamp = planner->stamp;
+
+    u32 start = source % width - origin_x + (source / width - origin_y) * cluster_width;
+    costs[start] = 0;
+    parents[start] = PATH_NONE;
+    stamps[start] = stamp;
+    path_heap_push(planner->heap, &heap_size, target == PATH_NONE ? 0 : path_estimate(planner, source, target), start);
+    while (heap_size) {
+        u64 item = path_heap_pop(planner->heap, &heap_size);
+        u32 cell = (u32) item, x = cell % cluster_width, y = cell / cluster_width;
+        u32 column = origin_x + x + (origin_y + y) * width;
+        u32 estimate = target == PATH_NONE ? 0 : path_estimate(planner, column, target);
+        if ((u32) (item >> 32) != costs[cell] + estimate) continue; // stale, the cell was reached cheaper since
+        if (column == target) return costs[cell];
+        for (i32 dy = -1; dy <= 1; dy++) {
+            for (i32 dx = -1; dx <= 1; dx++) {
+                i32 nx = (i32) x + dx, ny = (i32) y + dy;
+                if ((!dx && !dy) || nx < 0 || ny < 0 || nx >= (i32) cluster_width || ny >= (i32) cluster_width) {
+                    continue;
+                }
+                u32 next_column = column + dx + dy * (i32) width, step = path_step_cost(planner, column, next_column);
+                if (step == PATH_NONE) continue;
+                u32 next = (u32) nx + (u32) ny * cluster_width, cost = costs[cell] + step;
+                if (stamps[next] == stamp && costs[next] <= cost) continue;
+                costs[next] = cost;
+                parents[next] = cell;
+                stamps[next] = stamp;
+                path_heap_push(planner->heap, &heap_size,
+                               cost + (target == PATH_NONE ? 0 : path_estimate(planner, next_column, target)), next);
+            }
+        }
+    }
+    return PATH_NONE;
+}
+
+// cost the last search from some column found for a column of the same cluster
+static u32 path_searched_cost(const TerrainPlanner *planner, u32 column) {
+    u32 width = planner->terrain->width, cluster_width = planner->cluster_width;
+    u32 cell = column % width % cluster_width + column / width % cluster_width * cluster_width;
+    return planner->stamps[cell] == planner->stamp ? planner->costs[cell] : PATH_NONE;
+}
+
+static void path_push_entrance(TerrainPathCluster *cluster, u32 *capacity, u32 column, u32 across) {
+    if (cluster->entrance_count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        cluster->entrances = (u32 *) realloc(cluster->entrances, *capacity * sizeof(u32));
+        cluster->across = (u32 *) realloc(cluster->across, *capacity * sizeof(u32));
+        if (!cluster->entrances || !cluster->across) FATAL("Out of memory.");
+    }
+    cluster->entrances[cluster->entrance_count] = column;
+    cluster->across[cluster->entrance_count++] = across;
+}
+
+/**
+ * Finds the entrances on the four borders of a cluster and the cost of walking between each pair of them. A run is
+ * made of crossings next to each other along the border, whose columns can be walked along the border on both sides,
+ * so that the neighbouring cluster finds the same runs from its side.
+ */
+static TerrainPathCluster *path_cluster(TerrainPlanner *planner, u32 index) {
+    TerrainPathCluster *cluster = &planner->clusters[index];
+    if (cluster->built) return cluster;
+    u32 width = planner->terrain->width, cluster_width = planner->cluster_width, capacity = 0;
+    u32 origin_x = index % planner->width_clusters * cluster_width;
+    u32 origin_y = index / planner->width_clusters * cluster_width;
+    cluster->entrance_count = 0;
+
+    // west, east, south and north borders, walked along with (step_x, step_y) and crossed with (out_x, out_y)
+    static const i32 borders[4][4] = {{0, 1, -1, 0}, {0, 1, 1, 0}, {1, 0, 0, -1}, {1, 0, 0, 1}};
+    for (u32 border = 0; border < 4; border++) {
+        i32 step_x = borders[border][0], step_y = borders[border][1];
+        i32 out_x = borders[border][2], out_y = borders[border][3];
+        u32 first_x = origin_x + (out_x > 0 ? cluster_width - 1 : 0);
+        u32 first_y = origin_y + (out_y > 0 ? cluster_width - 1 : 0);
+        if ((out_x < 0 && !origin_x) || (out_y < 0 && !origin_y) || (out_x > 0 && first_x + 1 >= width) ||
+            (out_y > 0 && first_y + 1 >= width)) {
+            continue;
+        }
+        u32 run_start = 0;
+        bool in_run = false;
+        for (u32 i = 0; i <= cluster_width; i++) {
+            u32 inside = first_x + step_x * i + (first_y + step_y * i) * width;
+            u32 outside = inside + out_x + out_y * (i32) width;
+            bool crossable = i < cluster_width && path_step_cost(planner, inside, outside) != PATH_NONE;
+            bool continues = crossable && in_run && path_can_climb(planner, inside - step_x - step_y * width, inside) &&
+                             path_can_climb(planner, outside - step_x - step_y * width, outside);
+            if (in_run && !continues) {
+                u32 middle = (run_start + i - 1) / 2;
+                u32 column = first_x + step_x * middle + (first_y + step_y * middle) * width;
+                path_push_entrance(cluster, &capacity, column, column + out_x + out_y * (i32) width);
+            }
+            if (crossable && !continues) run_start = i;
+            in_run = crossable;
+        }
+    }
+
+    u32 count = cluster->entrance_count;
+    cluster->costs = (u32 *) malloc(((size_t) count * count + 1) * sizeof(u32));
+    if (!cluster->costs) FATAL("Out of memory.");
+    for (u32 i = 0; i < count; i++) {
+        path_search_cluster(planner, cluster->entrances[i], PATH_NONE);
+        for (u32 j = 0; j < count; j++) {
+            cluster->costs[i * count + j] = path_searched_cost(planner, cluster->entrances[j]);
+        }
+    }
+    cluster->built = true;
+    planner->clusters_built++;
+    return cluster;
+}
+
+static void path_drop_cluster(TerrainPathCluster *cluster) {
+    free(cluster->entrances);
+    free(cluster->across);
+    free(cluster->costs);
+    *cluster = (TerrainPathCluster) {0};
+}
+
+void terrain_planner_init(TerrainPlanner *planner, const Terrain *terrain, u32 level) {
+    if (level > terrain->depth) level = terrain->depth;
+    planner->terrain = terrain;
+    planner->cluster_width = CHUNK_WIDTH << level;
+    planner->width_clusters = terrain->width / planner->cluster_width;
+    planner->clusters = (TerrainPathCluster *) calloc((size_t) planner->width_clusters * planner->width_clusters,
+                                                      sizeof(TerrainPathCluster));
+    size_t cells = (size_t) planner->cluster_width * planner->cluster_width;
+    planner->costs = (u32 *) malloc(cells * sizeof(u32));
+    planner->parents = (u32 *) malloc(cells * sizeof(u32));
+    planner->stamps = (u32 *) calloc(cells, sizeof(u32));
+    planner->heap = (u64 *) malloc((8 * cells + 1) * sizeof(u64)); // each cell is pushed once per neighbour at most
+    if (!planner->clusters || !planner->costs || !planner->parents || !planner->stamps || !planner->heap) {
+        FATAL("Out of memory.");
+    }
+    planner->stamp = 0;
+    planner->clusters_built = 0;
+}
+
+void terrain_planner_destroy(TerrainPlanner *planner) {
+    for (u32 i = 0; i < planner->width_clusters * planner->width_clusters; i++) {
+        path_drop_cluster(&planner->clusters[i]);
+    }
+    free(planner->clusters);
+    free(planner->costs);
+    free(planner->parents);
+    free(planner->stamps);
+    free(planner->heap);
+}
+
+// the columns right next to the rectangle are in it too, since the borders they are on may have changed
+void terrain_planner_invalidate(TerrainPlanner *planner, u32 x, u32 y, u32 width, u32 height) {
+    if (!width || !height) return;
+    u32 last_x = min(x + width, planner->terrain->width - 1), last_y = min(y + height, planner->terrain->width - 1);
+    x = x ? x - 1 : 0;
+    y = y ? y - 1 : 0;
+    for (u32 cy = y / planner->cluster_width; cy <= last_y / planner->cluster_width; cy++) {
+        for (u32 cx = x / planner->cluster_width; cx <= last_x / planner->cluster_width; cx++) {
+            path_drop_cluster(&planner->clusters[cx + cy * planner->width_clusters]);
+        }
+    }
+}
+
+void terrain_planner_apply_deltas(TerrainPlanner *planner, const TerrainDelta *deltas, u32 count) {
+    u32 width = planner->terrain->width;
+    for (u32 i = 0; i < count; i++) {
+        if (deltas[i].kind == TERRAIN_DELTA_ALL) {
+            terrain_planner_invalidate(planner, 0, 0, width, width);
+        } else if (deltas[i].kind == TERRAIN_DELTA_SKYLIGHT && deltas[i].count) {
+            u32 first = deltas[i].first, last = deltas[i].first + deltas[i].count - 1;
+            if (first / width == last / width) {
+                terrain_planner_invalidate(planner, first % width, first / width, last - first + 1, 1);
+            } else {
+                terrain_planner_invalidate(planner, 0, first / width, width, last / width - first / width + 1);
+            }
+        }
+    }
+}
+
+static u32 path_graph_node(PathGraph *graph, u32 column) {
+    if (2 * (graph->node_count + 1) > graph->table_capacity) {
+        free(graph->table);
+        graph->table_capacity = graph->table_capacity ? graph->table_capacity * 2 : 1024;
+        graph->table = (u32 *) malloc(graph->table_capacity * sizeof(u32));
+        if (!graph->table) FATAL("Out of memory.");
+        memset(graph->table, 0xff, graph->table_capacity * sizeof(u32));
+        for (u32 i = 0; i < graph->node_count; i++) {
+            u32 slot = graph->nodes[i].column * 2654435761u & (graph->table_capacity - 1);
+            while (graph->table[slot] != PATH_NONE) slot = (slot + 1) & (graph->table_capacity - 1);
+            graph->table[slot] = i;
+        }
+    }
+    u32 slot = column * 2654435761u & (graph->table_capacity - 1);
+    while (graph->table[slot] != PATH_NONE) {
+        if (graph->nodes[graph->table[slot]].column == column) return graph->table[slot];
+        slot = (slot + 1) & (graph->table_capacity - 1);
+    }
+    if (graph->node_count == graph->node_capacity) {
+        graph->node_capacity = graph->node_capacity ? graph->node_capacity * 2 : 512;
+        graph->nodes = (PathNode *) realloc(graph->nodes, graph->node_capacity * sizeof(PathNode));
+        if (!graph->nodes) FATAL("Out of memory.");
+    }
+    graph->table[slot] = graph->node_count;
+    graph->nodes[graph->node_count] = (PathNode) {.column=column, .cost=PATH_NONE, .parent=PATH_NONE};
+    return graph->node_count++;
+}
+
+static void path_graph_push(PathGraph *graph, u32 priority, u32 node) {
+    if (graph->heap_size == graph->heap_capacity) {
+        graph->heap_capacity = graph->heap_capacity ? graph->heap_capacity * 2 : 1024;
+        graph->heap = (u64 *) realloc(graph->heap, graph->heap_capacity * sizeof(u64));
+        if (!graph->heap) FATAL("Out of memory.");
+    }
+    path_heap_push(graph->heap, &graph->heap_size, priority, node);
+}
+
+static void path_graph_reach(PathGraph *graph, const TerrainPlanner *planner, u32 from, u32 column, u32 step,
+                             u32 goal) {
+    if (step == PATH_NONE) return;
+    u32 cost = graph->nodes[from].cost + step, node = path_graph_node(graph, column);
+    if (graph->nodes[node].closed || graph->nodes[node].cost <= cost) return;
+    graph->nodes[node].cost = cost;
+    graph->nodes[node].parent = from;
+    path_graph_push(graph, cost + path_estimate(planner, column, goal), node);
+}
+
+/**
+ * A* over the entrances, from the start to the goal column. The start is linked to the entrances of its cluster and
+ * the goal to those of its own by searches within them, whose costs are passed in the same order as the entrances.
+ * Returns the node of the goal, or PATH_NONE.
+ */
+static u32 path_search_graph(TerrainPlanner *planner, PathGraph *graph, u32 start, u32 goal, const u32 *start_costs,
+                             const u32 *goal_costs) {
+    u32 goal_cluster = path_cluster_of(planner, goal);
+    u32 first = path_graph_node(graph, start);
+    graph->nodes[first].cost = 0;
+    path_graph_push(graph, path_estimate(planner, start, goal), first);
+    while (graph->heap_size) {
+        u32 node = (u32) path_heap_pop(graph->heap, &graph->heap_size);
+        if (graph->nodes[node].closed) continue;
+        graph->nodes[node].closed = true;
+        u32 column = graph->nodes[node].column;
+        if (column == goal) return node;
+
+        u32 index = path_cluster_of(planner, column);
+        const TerrainPathCluster *cluster = path_cluster(planner, index);
+        if (node == first) {
+            for (u32 i = 0; i < cluster->entrance_count; i++) {
+                path_graph_reach(graph, planner, node, cluster->entrances[i], start_costs[i], goal);
+            }
+        }
+        u32 count = cluster->entrance_count, entrance = 0;
+        while (entrance < count && cluster->entrances[entrance] != column) entrance++;
+        if (entrance == count) continue;
+        path_graph_reach(graph, planner, node, cluster->across[entrance],
+                         path_step_cost(planner, column, cluster->across[entrance]), goal);
+        for (u32 i = 0; i < count; i++) {
+            if (i != entrance) {
+                path_graph_reach(graph, planner, node, cluster->entrances[i], cluster->costs[entrance * count + i],
+                                 goal);
+            }
+        }
+        if (index == goal_cluster) path_graph_reach(graph, planner, node, goal, goal_costs[entrance], goal);
+    }
+    return PATH_NONE;
+}
+
+static void path_append(uvec3 **path, u32 *count, u32 *capacity, const TerrainPlanner *planner, u32 column) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 256;
+        *path = (uvec3 *) realloc(*path, *capacity * sizeof(uvec3));
+        if (!*path) FATAL("Out of memory.");
+    }
+    u32 width = planner->terrain->width;
+    (*path)[(*count)++] = (uvec3) {{column % width, column / width, path_height(planner, column)}};
+}
+
+// the steps of the last search within a cluster up to a column, the one it started from left out
+static void path_append_searched(uvec3 **path, u32 *count, u32 *capacity, const TerrainPlanner *planner, u32 column) {
+    u32 width = planner->terrain->width, cluster_width = planner->cluster_width;
+    u32 origin_x = column % width / cluster_width * cluster_width;
+    u32 origin_y = column / width / cluster_width * cluster_width;
+    u32 first = *count;
+    for (u32 cell = column % width - origin_x + (column / width - origin_y) * cluster_width;
+         planner->parents[cell] != PATH_NONE; cell = planner->parents[cell]) {
+        u32 step = origin_x + cell % cluster_width + (origin_y + cell / cluster_width) * width;
+        path_append(path, count, capacity, planner, step);
+    }
+    for (u32 i = first, j = *count - 1; i < j; i++, j--) {
+        uvec3 swap = (*path)[i];
+        (*path)[i] = (*path)[j];
+        (*path)[j] = swap;
+    }
+}
+
+u32 terrain_find_path(TerrainPlanner *planner, u32 from_x, u32 from_y, u32 to_x, u32 to_y, uvec3 **path) {
+    u32 width = planner->terrain->width, count = 0, capacity = 0;
+    *path = NULL;
+    if (from_x >= width || from_y >= width || to_x >= width || to_y >= width) return 0;
+    u32 start = from_x + from_y * width, goal = to_x + to_y * width;
+    if (!path_height(planner, start) || !path_height(planner, goal)) return 0;
+    path_append(path, &count, &capacity, planner, start);
+
+    // within a single cluster, the abstract graph is only needed when the way out of it is through another one
+    u32 start_cluster = path_cluster_of(planner, start), goal_cluster = path_cluster_of(planner, goal);
+    if (start_cluster == goal_cluster && path_search_cluster(planner, start, goal) != PATH_NONE) {
+        path_append_searched(path, &count, &capacity, planner, goal);
+        return count;
+    }
+
+    const TerrainPathCluster *from = path_cluster(planner, start_cluster), *to = path_cluster(planner, goal_cluster);
+    u32 *start_costs = (u32 *) malloc((from->entrance_count + to->entrance_count + 1) * sizeof(u32));
+    if (!start_costs) FATAL("Out of memory.");
+    u32 *goal_costs = start_costs + from->entrance_count;
+    path_search_cluster(planner, start, PATH_NONE);
+    for (u32 i = 0; i < from->entrance_count; i++) start_costs[i] = path_searched_cost(planner, from->entrances[i]);
+    path_search_cluster(planner, goal, PATH_NONE);
+    for (u32 i = 0; i < to->entrance_count; i++) goal_costs[i] = path_searched_cost(planner, to->entrances[i]);
+
+    PathGraph graph = {0};
+    u32 node = path_search_graph(planner, &graph, start, goal, start_costs, goal_costs);
+    if (node == PATH_NONE) {
+        free(*path);
+        *path = NULL;
+        count = 0;
+    } else {
+        // the coarse path, goal first, then refined hop by hop
+        u32 hops = 0;
+        for (u32 i = node; i != PATH_NONE; i = graph.nodes[i].parent) hops++;
+        u32 *columns = (u32 *) malloc(hops * sizeof(u32));
+        if (!columns) FATAL("Out of memory.");
+        hops = 0;
+        for (u32 i = node; i != PATH_NONE; i = graph.nodes[i].parent) columns[hops++] = graph.nodes[i].column;
+        for (u32 i = hops - 1; i > 0; i--) {
+            u32 hop_from = columns[i], hop_to = columns[i - 1];
+            if (path_cluster_of(planner, hop_from) != path_cluster_of(planner, hop_to)) {
+                path_append(path, &count, &capacity, planner, hop_to);
+            } else if (hop_from != hop_to) {
+                path_search_cluster(planner, hop_from, hop_to);
+                path_append_searched(path, &count, &capacity, planner, hop_to);
+            }
+        }
+        free(columns);
+    }
+    free(start_costs);
+    free(graph.nodes);
+    free(graph.table);
+    free(graph.heap);
+    return count;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include "terrain.h"
+
+/**
+ * Long-range paths for agents walking on top of the terrain, planned hierarchically (HPA*). Agents stand on the
+ * skylight map, the top-most opaque voxel of each column, and step to any of the 8 neighbouring columns that is at
+ * most TERRAIN_PATH_MAX_CLIMB voxels higher or lower, without cutting corners. Empty columns can't be walked on.
+ * Columns are grouped in clusters, the cells of one level of the height pyramid (see approx_heightmaps). Where a border
+ * between two clusters can be crossed, each run of crossings gets an entrance in its middle, and the cost of walking
+ * between each pair of entrances of a cluster without leaving it is cached with the cluster. Plans search this graph
+ * of entrances first, then find the actual steps only within the clusters the coarse path goes through.
+ * Clusters are built the first time a plan needs them. Edits only throw away the clusters whose columns changed and
+ * the neighbours of those on their borders, which planners find out from the skylight deltas of the terrain. Planners
+ * read the skylight map, so they must not run concurrently with anything writing to it, and each of them is used by
+ * one thread at a time.
+ */
+#define TERRAIN_PATH_MAX_CLIMB (1)
+
+// costs are in tenths of a voxel: straight and diagonal steps, and each voxel climbed or descended on top of that
+#define TERRAIN_PATH_STEP_COST (10)
+#define TERRAIN_PATH_DIAGONAL_COST (14)
+#define TERRAIN_PATH_CLIMB_COST (5)
+
+// level of the height pyramid whose cells are the clusters, 2 meaning clusters of 32x32 columns
+#define TERRAIN_PATH_CLUSTER_LEVEL (2)
+
+typedef struct TerrainPathCluster TerrainPathCluster;
+
+typedef struct TerrainPlanner {
+    const Terrain *terrain;
+    u32 cluster_width, width_clusters;
+    TerrainPathCluster *clusters;
+
+    // scratch of the searches within a cluster, whose cells are only valid where stamps hold the current stamp
+    u32 *costs, *parents, *stamps, stamp;
+    u64 *heap;
+
+    // how many clusters were built, first ones and rebuilt ones alike
+    u32 clusters_built;
+} TerrainPlanner;
+
+void terrain_planner_init(TerrainPlanner *planner, const Terrain *terrain, u32 level);
+void terrain_planner_destroy(TerrainPlanner *planner);
+
+/**
+ * Throws away what is cached about the columns of the deltas, taken from the terrain before it clears them. Skylight
+ * ranges over several rows throw away the clusters of every column in between, and any TERRAIN_DELTA_ALL throws
+ * everything away. Other kinds of deltas are left alone.
+ */
+void terrain_planner_apply_deltas(TerrainPlanner *planner, const TerrainDelta *deltas, u32 count);
+
+// the same for a rectangle of columns
+void terrain_planner_invalidate(TerrainPlanner *planner, u32 x, u32 y, u32 width, u32 height);
+
+/**
+ * Plans a walk from one column to another. Returns how many steps there are in *path, from the start to the goal
+ * both included, each one being a column and the height an agent stands at on top of it. *path is malloc'd and up to
+ * the caller to free. Returns 0 with *path left NULL if there is no way there.
+ */
+u32 terrain_find_path(TerrainPlanner *planner, u32 from_x, u32 from_y, u32 to_x, u32 to_y, uvec3 **path);
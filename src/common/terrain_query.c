@@ -0,0 +1,374 @@
+#include <math.h>
+#include "terrain_query.h"
+#include "materials.h"
+#include "epoch.h"
+#include "parallel.h"
+
+// a ray with a normalized direction, that stops at a distance of end
+typedef struct QueryRay {
+    double origin[3], direction[3];
+    double end;
+} QueryRay;
+
+typedef struct SightJob {
+    const Terrain *terrain;
+    const TerrainSightLine *lines;
+    bool *visible;
+    u32 begin, end;
+} SightJob;
+
+static i64 query_clamp(i64 value, i64 low, i64 high) {
+    return value < low ? low : value > high ? high : value;
+}
+
+static bool query_ray_init(QueryRay *ray, vec3 origin, vec3 direction, double end) {
+    double length = sqrt((double) direction.x * direction.x + (double) direction.y * direction.y +
+                         (double) direction.z * direction.z);
+    if (!(length > 0)) return false;
+    for (u32 axis = 0; axis < 3; axis++) {
+        ray->origin[axis] = origin.arr[axis];
+        ray->direction[axis] = direction.arr[axis] / length;
+    }
+    ray->end = end;
+    return true;
+}
+
+/**
+ * Walks the tree along the ray from where it enters the world. Each step finds the largest cell holding the current
+ * voxel that is either uniform, of air for nodes whose bounds are empty, or a single voxel of a chunk, and leaves it
+ * through the face the ray reaches first. With skip_first, whatever the voxel the ray starts in is made of, it's air.
+ * Must be called pinned.
+ */
+static bool query_ray(const Terrain *terrain, const QueryRay *ray, bool skip_first, TerrainRayHit *hit) {
+    const double *origin = ray->origin, *direction = ray->direction;
+    i64 width = terrain->width, voxel[3];
+    i32 normal[3] = {0, 0, 0}, entered = -1;
+    double t = 0, end = ray->end;
+    for (u32 axis = 0; axis < 3; axis++) {
+        if (direction[axis] == 0) {
+            if (!(origin[axis] >= 0 && origin[axis] < (double) width)) return false;
+            continue;
+        }
+        double near = -origin[axis] / direction[axis], far = ((double) width - origin[axis]) / direction[axis];
+        if (near > far) {
+            double swap = near;
+            near = far;
+            far = swap;
+        }
+        if (near >= t) {
+            t = near;
+            entered = (i32) axis;
+        }
+        if (far < end) end = far;
+    }
+    if (!(t <= end)) return false;
+    for (u32 axis = 0; axis < 3; axis++) {
+        if ((i32) axis == entered) {
+            voxel[axis] = direction[axis] > 0 ? 0 : width - 1;
+            normal[axis] = direction[axis] > 0 ? -1 : 1;
+        } else {
+            voxel[axis] = query_clamp((i64) floor(origin[axis] + direction[axis] * t), 0, width - 1);
+        }
+    }
+
+    u32 root = __atomic_load_n(&terrain->root_node_address, __ATOMIC_ACQUIRE);
+    for (;;) {
+        u32 node_address = root;
+        i64 cell = width;
+        Voxel material = AIR;
+        for (u32 depth = terrain->depth; depth > 0; depth--) {
+            cell /= NODE_WIDTH;
+            u32 slot = NODE_SLOT(voxel[0] / cell % NODE_WIDTH, voxel[1] / cell % NODE_WIDTH,
+                                 voxel[2] / cell % NODE_WIDTH);
+            u32 entry = terrain_node_entry(terrain, node_address, slot);
+            u32 child = terrain_entry_child(terrain, node_address, slot, entry);
+            material = terrain_entry_material(entry);
+            if (!child) break;
+            if (depth == 1) {
+                Chunk *chunk = poolAllocatorGet(&terrain->chunkPool, child);
+                material = __atomic_load_n(&(*chunk)[CHUNK_SLOT(voxel[0] % CHUNK_WIDTH, voxel[1] % CHUNK_WIDTH,
+                                                                voxel[2] % CHUNK_WIDTH)], __ATOMIC_RELAXED);
+                cell = 1;
+                break;
+            }
+            if (terrain_node_bounds(terrain, child) & TERRAIN_BOUNDS_EMPTY) {
+                material = AIR;
+                break;
+            }
+            node_address = child;
+        }
+        if (skip_first) {
+            if (material != AIR) cell = 1;
+            material = AIR;
+            skip_first = false;
+        }
+        if (material != AIR) {
+            for (u32 axis = 0; axis < 3; axis++) {
+                hit->voxel.arr[axis] = (u32) voxel[axis];
+                hit->normal.arr[axis] = normal[axis];
+            }
+            hit->distance = (float) t;
+            hit->material = material;
+            return true;
+        }
+
+        double exit = INFINITY;
+        u32 exit_axis = 0;
+        for (u32 axis = 0; axis < 3; axis++) {
+            if (direction[axis] == 0) continue;
+            i64 base = voxel[axis] - voxel[axis] % cell;
+            double face = (double) (direction[axis] > 0 ? base + cell : base);
+            double distance = (face - origin[axis]) / direction[axis];
+            if (distance < exit) {
+                exit = distance;
+                exit_axis = axis;
+            }
+        }
+        if (exit > end) return false;
+        if (exit > t) t = exit;
+        for (u32 axis = 0; axis < 3; axis++) {
+            i64 base = voxel[axis] - voxel[axis] % cell;
+            if (axis == exit_axis) {
+                voxel[axis] = direction[axis] > 0 ? base + cell : base - 1;
+                normal[axis] = direction[axis] > 0 ? -1 : 1;
+            } else {
+                // the rounding of t must not move the ray out of the face it goes through
+                voxel[axis] = query_clamp((i64) floor(origin[axis] + direction[axis] * t), base, base + cell - 1);
+                normal[axis] = 0;
+            }
+        }
+        if (voxel[exit_axis] < 0 || voxel[exit_axis] >= width) return false;
+    }
+}
+
+bool terrain_raycast(const Terrain *terrain, vec3 origin, vec3 direction, float max_distance, TerrainRayHit *hit) {
+    QueryRay ray;
+    if (!query_ray_init(&ray, origin, direction, max_distance)) return false;
+    epoch_pin();
+    bool found = query_ray(terrain, &ray, false, hit);
+    epoch_unpin();
+    return found;
+}
+
+Voxel terrain_material_at(const Terrain *terrain, vec3 point) {
+    double width = terrain->width;
+    for (u32 axis = 0; axis < 3; axis++) {
+        if (!(point.arr[axis] >= 0 && point.arr[axis] < width)) return AIR;
+    }
+    epoch_pin();
+    Voxel voxel = terrain_get_voxel(terrain, (u32) point.x, (u32) point.y, (u32) point.z);
+    epoch_unpin();
+    return voxel;
+}
+
+/**
+ * Voxels that aren't air in the part of the subnodes of a node that is within [lo, hi). Uniform subnodes count for
+ * their whole overlap at once, and nodes whose bounds are empty are skipped.
+ */
+static u64 query_box_node(const Terrain *terrain, u32 node_address, u32 depth, const u32 node_origin[3], u32 width,
+                          const u32 lo[3], const u32 hi[3], bool any) {
+    u32 subnode_width = width / NODE_WIDTH;
+    u64 count = 0;
+    for (u32 slot = 0; slot < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; slot++) {
+        u32 origin[3], from[3], to[3];
+        bool overlaps = true;
+        for (u32 axis = 0; axis < 3; axis++) {
+            origin[axis] = node_origin[axis] + (slot >> axis & 1) * subnode_width;
+            from[axis] = max(origin[axis], lo[axis]);
+            to[axis] = min(origin[axis] + subnode_width, hi[axis]);
+            overlaps &= from[axis] < to[axis];
+        }
+        if (!overlaps) continue;
+
+        u32 entry = terrain_node_entry(terrain, node_address, slot);
+        u32 child = terrain_entry_child(terrain, node_address, slot, entry);
+        if (!child) {
+            if (terrain_entry_material(entry) != AIR) {
+                count += (u64) (to[0] - from[0]) * (to[1] - from[1]) * (to[2] - from[2]);
+            }
+        } else if (depth == 1) {
+            Chunk *chunk = poolAllocatorGet(&terrain->chunkPool, child);
+            for (u32 z = from[2]; z < to[2]; z++) {
+                for (u32 y = from[1]; y < to[1]; y++) {
+                    for (u32 x = from[0]; x < to[0]; x++) {
+                        count += __atomic_load_n(&(*chunk)[CHUNK_SLOT(x % CHUNK_WIDTH, y % CHUNK_WIDTH,
+                                                                      z % CHUNK_WIDTH)], __ATOMIC_RELAXED) != AIR;
+                    }
+                }
+            }
+        } else if (!(terrain_node_bounds(terrain, child) & TERRAIN_BOUNDS_EMPTY)) {
+            count += query_box_node(terrain, child, depth - 1, origin, subnode_width, lo, hi, any);
+        }
+        if (any && count) return 1;
+    }
+    return count;
+}
+
+u64 terrain_box_occupancy(const Terrain *terrain, vec3 min, vec3 max, bool any) {
+    u32 lo[3], hi[3];
+    for (u32 axis = 0; axis < 3; axis++) {
+        double from = floor(min.arr[axis]), to = ceil(max.arr[axis]);
+        if (!(from < to) || to <= 0 || from >= terrain->width) return 0;
+        lo[axis] = from < 0 ? 0 : (u32) from;
+        hi[axis] = to > terrain->width ? terrain->width : (u32) to;
+    }
+    static const u32 world_origin[3] = {0, 0, 0};
+    epoch_pin();
+    u64 count = query_box_node(terrain, __atomic_load_n(&terrain->root_node_address, __ATOMIC_ACQUIRE),
+                               terrain->depth, world_origin, terrain->width, lo, hi, any);
+    epoch_unpin();
+    return count;
+}
+
+/**
+ * The first layer along axis of the part of a node within [lo, hi) that holds a voxel that isn't air, lowest one
+ * first when positive and highest one first otherwise, if it's nearer than *nearest. Subnodes are visited near half
+ * first, skipping those that can't hold a nearer layer: uniform ones answer at once, nodes whose bounds are empty are
+ * air, and only chunks are looked at voxel by voxel.
+ */
+static void query_nearest_node(const Terrain *terrain, u32 node_address, u32 depth, const u32 node_origin[3],
+                               u32 width, const u32 lo[3], const u32 hi[3], u32 axis, bool positive, i64 *nearest) {
+    u32 subnode_width = width / NODE_WIDTH;
+    for (u32 half = 0; half < NODE_WIDTH; half++) {
+        for (u32 slot = 0; slot < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; slot++) {
+            if ((slot >> axis & 1) != (positive ? half : 1 - half)) continue;
+            u32 origin[3], from[3], to[3];
+            bool overlaps = true;
+            for (u32 i = 0; i < 3; i++) {
+                origin[i] = node_origin[i] + (slot >> i & 1) * subnode_width;
+                from[i] = max(origin[i], lo[i]);
+                to[i] = min(origin[i] + subnode_width, hi[i]);
+                overlaps &= from[i] < to[i];
+            }
+            if (!overlaps || (positive ? (i64) from[axis] >= *nearest : (i64) to[axis] - 1 <= *nearest)) continue;
+
+            u32 entry = terrain_node_entry(terrain, node_address, slot);
+            u32 child = terrain_entry_child(terrain, node_address, slot, entry);
+            if (!child) {
+                if (terrain_entry_material(entry) != AIR) *nearest = positive ? from[axis] : to[axis] - 1;
+            } else if (depth == 1) {
+                Chunk *chunk = poolAllocatorGet(&terrain->chunkPool, child);
+                u32 a = (axis + 1) % 3, b = (axis + 2) % 3, layers = to[axis] - from[axis];
+                for (u32 layer = 0; layer < layers; layer++) {
+                    u32 voxel[3];
+                    voxel[axis] = positive ? from[axis] + layer : to[axis] - 1 - layer;
+                    if (positive ? (i64) voxel[axis] >= *nearest : (i64) voxel[axis] <= *nearest) break;
+                    bool found = false;
+                    for (voxel[b] = from[b]; voxel[b] < to[b] && !found; voxel[b]++) {
+                        for (voxel[a] = from[a]; voxel[a] < to[a] && !found; voxel[a]++) {
+                            found = __atomic_load_n(&(*chunk)[CHUNK_SLOT(voxel[0] % CHUNK_WIDTH,
+                                    voxel[1] % CHUNK_WIDTH, voxel[2] % CHUNK_WIDTH)], __ATOMIC_RELAXED) != AIR;
+                        }
+                    }
+                    if (found) {
+                        *nearest = voxel[axis];
+                        break;
+                    }
+                }
+            } else if (!(terrain_node_bounds(terrain, child) & TERRAIN_BOUNDS_EMPTY)) {
+                query_nearest_node(terrain, child, depth - 1, origin, subnode_width, lo, hi, axis, positive, nearest);
+            }
+        }
+    }
+}
+
+/**
+ * How far the box [min, max] can move by distance along axis, voxels it already overlaps along that axis left out.
+ * Must be called pinned.
+ */
+static double query_sweep_axis(const Terrain *terrain, const double min[3], const double max[3], u32 axis,
+                               double distance) {
+    double width = terrain->width;
+    u32 lo[3], hi[3];
+    for (u32 i = 0; i < 3; i++) {
+        double from, to;
+        if (i != axis) {
+            from = floor(min[i]);
+            to = ceil(max[i]);
+        } else if (distance > 0) {
+            from = ceil(max[i]);
+            to = ceil(max[i] + distance);
+        } else {
+            from = floor(min[i] + distance);
+            to = floor(min[i]);
+        }
+        from = fmax(from, 0);
+        to = fmin(to, width);
+        if (!(from < to)) return distance;
+        lo[i] = (u32) from;
+        hi[i] = (u32) to;
+    }
+
+    static const u32 world_origin[3] = {0, 0, 0};
+    i64 nearest = distance > 0 ? (i64) hi[axis] : (i64) lo[axis] - 1;
+    query_nearest_node(terrain, __atomic_load_n(&terrain->root_node_address, __ATOMIC_ACQUIRE), terrain->depth,
+                       world_origin, terrain->width, lo, hi, axis, distance > 0, &nearest);
+    if (distance > 0) {
+        if (nearest == (i64) hi[axis]) return distance;
+        return fmin(distance, fmax((double) nearest - max[axis] - TERRAIN_SWEEP_SKIN, 0));
+    }
+    if (nearest == (i64) lo[axis] - 1) return distance;
+    return fmax(distance, -fmax(min[axis] - (double) (nearest + 1) - TERRAIN_SWEEP_SKIN, 0));
+}
+
+vec3 terrain_move_box(const Terrain *terrain, vec3 min, vec3 max, vec3 motion) {
+    double low[3], high[3];
+    u32 order[3] = {0, 1, 2};
+    for (u32 i = 0; i < 3; i++) {
+        low[i] = min.arr[i];
+        high[i] = max.arr[i];
+        for (u32 j = i; j > 0 && fabsf(motion.arr[order[j]]) > fabsf(motion.arr[order[j - 1]]); j--) {
+            u32 swap = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = swap;
+        }
+    }
+    vec3 moved = {{0, 0, 0}};
+    epoch_pin();
+    for (u32 i = 0; i < 3; i++) {
+        u32 axis = order[i];
+        if (motion.arr[axis] == 0) continue;
+        double distance = query_sweep_axis(terrain, low, high, axis, motion.arr[axis]);
+        low[axis] += distance;
+        high[axis] += distance;
+        moved.arr[axis] = (float) distance;
+    }
+    epoch_unpin();
+    return moved;
+}
+
+// the voxels at both ends don't block, so the ray skips the first one and a hit on the last one doesn't count
+static bool query_sight_line(const Terrain *terrain, const TerrainSightLine *line) {
+    vec3 direction;
+    double length = 0;
+    for (u32 axis = 0; axis < 3; axis++) {
+        direction.arr[axis] = line->to.arr[axis] - line->from.arr[axis];
+        length += (double) direction.arr[axis] * direction.arr[axis];
+    }
+    length = sqrt(length);
+    QueryRay ray;
+    TerrainRayHit hit;
+    if (!query_ray_init(&ray, line->from, direction, length)) return true;
+    if (!query_ray(terrain, &ray, true, &hit)) return true;
+    return hit.voxel.x == (u32) floor(line->to.x) && hit.voxel.y == (u32) floor(line->to.y) &&
+           hit.voxel.z == (u32) floor(line->to.z);
+}
+
+// every thread pins its own epoch
+static void query_sight_job(void *data, u32 worker) {
+    SightJob *job = (SightJob *) data + worker;
+    epoch_pin();
+    for (u32 i = job->begin; i < job->end; i++) job->visible[i] = query_sight_line(job->terrain, &job->lines[i]);
+    epoch_unpin();
+}
+
+void terrain_line_of_sight(const Terrain *terrain, const TerrainSightLine *lines, u32 count, bool *visible) {
+    u32 thread_count = parallel_thread_count(count, TERRAIN_QUERY_BATCH_GRAIN, TERRAIN_QUERY_MAX_THREADS);
+    SightJob jobs[TERRAIN_QUERY_MAX_THREADS];
+    for (u32 i = 0; i < thread_count; i++) {
+        jobs[i] = (SightJob) {.terrain=terrain, .lines=lines, .visible=visible,
+                              .begin=(u32) ((u64) count * i / thread_count),
+                              .end=(u32) ((u64) count * (i + 1) / thread_count)};
+    }
+    parallel_run(query_sight_job, jobs, thread_count);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include "terrain.h"
+
+/**
+ * Read-only queries of the live tree, for picking, collisions and gameplay. Positions are in voxels, in the terrain's
+ * axes (z up), and everything out of the world is air. Queries can run on any thread while the terrain is written
+ * to, as long as the writer frees slots through retire_slot and pool memory through retireMemory: every query pins
+ * the epoch (see epoch.h) for as long as it reads the tree.
+ * Rays walk the tree rather than every voxel: uniform subnodes and nodes whose bounds are empty are crossed at once,
+ * chunks voxel by voxel.
+ */
+#define TERRAIN_QUERY_MAX_THREADS (16) // no more than PARALLEL_MAX_THREADS, each of them takes an epoch slot for good
+#define TERRAIN_QUERY_BATCH_GRAIN (256) // batched queries per thread, at least
+
+// how far from what stops them moved boxes are left, so that rounding never makes them touch it
+#define TERRAIN_SWEEP_SKIN (1.f / 64)
+
+typedef struct TerrainRayHit {
+    uvec3 voxel;    // the first voxel that isn't air
+    ivec3 normal;   // outwards normal of the face the ray went in through, all 0 if it started in the voxel
+    float distance; // along the ray, from its origin to that face
+    Voxel material;
+} TerrainRayHit;
+
+// the two ends of a line of sight, whose own voxels never block it
+typedef struct TerrainSightLine {
+    vec3 from, to;
+} TerrainSightLine;
+
+/**
+ * First voxel that isn't air along a ray, up to max_distance. The direction doesn't have to be normalized, distances
+ * are in voxels. Returns false if there is none.
+ */
+bool terrain_raycast(const Terrain *terrain, vec3 origin, vec3 direction, float max_distance, TerrainRayHit *hit);
+
+// material of the voxel holding a point
+Voxel terrain_material_at(const Terrain *terrain, vec3 point);
+
+/**
+ * How many voxels that aren't air overlap a box, the voxels it only touches being left out. With any set, stops at
+ * the first one, so that it returns 0 or 1.
+ */
+u64 terrain_box_occupancy(const Terrain *terrain, vec3 min, vec3 max, bool any);
+
+/**
+ * Moves a box by motion, one axis at a time from the largest move to the smallest, stopping each move
+ * TERRAIN_SWEEP_SKIN short of the first voxel that isn't air on the way, so that what is left of the other moves slides
+ * along it. Voxels the box already overlaps never stop it, so that it can always get out of them. Returns the motion
+ * that was actually done, which never goes through anything.
+ */
+vec3 terrain_move_box(const Terrain *terrain, vec3 min, vec3 max, vec3 motion);
+
+/**
+ * Whether each line of sight is clear of anything but air. Lines are split across the threads of parallel.h, up to
+ * TERRAIN_QUERY_MAX_THREADS of them and no fewer than TERRAIN_QUERY_BATCH_GRAIN lines each, the calling thread taking
+ * its share, and it returns once every line is answered.
+ */
+void terrain_line_of_sight(const Terrain *terrain, const TerrainSightLine *lines, u32 count, bool *visible);
@@ -0,0 +1,393 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "terrain_sync.h"
+#include "materials.h"
+#include "log.h"
+
+typedef enum SyncDecision {
+    SYNC_SAME,
+    SYNC_DESCEND,
+    SYNC_DATA
+} SyncDecision;
+
+// a subtree being compared, parent is UINT32_MAX for the root
+typedef struct SyncRegion {
+    u32 parent, slot;
+    u32 x, y, z;
+} SyncRegion;
+
+typedef struct SyncRegionList {
+    SyncRegion *regions;
+    u32 count, capacity;
+} SyncRegionList;
+
+typedef struct SyncBuffer {
+    u8 *data;
+    size_t size, capacity, cursor;
+} SyncBuffer;
+
+/**
+ * What a region holds: either a node or chunk at address, with its LOD color as material, or a uniform material. The
+ * root is always a node, even at address 0 which would otherwise mean uniform, and has no LOD color.
+ */
+typedef struct SyncSubnode {
+    u32 address;
+    Voxel material;
+    bool mixed, root;
+} SyncSubnode;
+
+static SyncSubnode sync_entry_subnode(const Terrain *terrain, u32 parent, u32 slot) {
+    u32 entry = terrain_node_entry(terrain, parent, slot);
+    u32 address = terrain_entry_child(terrain, parent, slot, entry);
+    return (SyncSubnode) {.address=address, .material=terrain_entry_material(entry), .mixed=address != 0};
+}
+
+static SyncSubnode sync_subnode(const Terrain *terrain, const SyncRegion *region) {
+    if (region->parent == UINT32_MAX) {
+        return (SyncSubnode) {.address=terrain->root_node_address, .mixed=true, .root=true};
+    }
+    return sync_entry_subnode(terrain, region->parent, region->slot);
+}
+
+static u64 sync_hash(const Terrain *terrain, SyncSubnode subnode, u32 level) {
+    if (subnode.root) return terrain_get_hash(terrain, subnode.address, level);
+    return terrain_subnode_hash(terrain, subnode.material, subnode.address, level);
+}
+
+static void sync_push_region(SyncRegionList *list, SyncRegion region) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->regions = (SyncRegion *) realloc(list->regions, list->capacity * sizeof(SyncRegion));
+        if (!list->regions) FATAL("Out of memory.");
+    }
+    list->regions[list->count++] = region;
+}
+
+// the 8 subregions of a node of the given level, in slot order
+static void sync_push_children(SyncRegionList *list, const SyncRegion *region, u32 address, u32 level) {
+    u32 width = CHUNK_WIDTH << (level - 1);
+    for (u32 dz = 0; dz < NODE_WIDTH; dz++) {
+        for (u32 dy = 0; dy < NODE_WIDTH; dy++) {
+            for (u32 dx = 0; dx < NODE_WIDTH; dx++) {
+                sync_push_region(list, (SyncRegion) {.parent=address, .slot=NODE_SLOT(dx, dy, dz),
+                        .x=region->x + dx * width, .y=region->y + dy * width, .z=region->z + dz * width});
+            }
+        }
+    }
+}
+
+static void sync_append(SyncBuffer *buffer, const void *data, size_t size) {
+    if (buffer->size + size > buffer->capacity) {
+        while (buffer->size + size > buffer->capacity) buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        buffer->data = (u8 *) realloc(buffer->data, buffer->capacity);
+        if (!buffer->data) FATAL("Out of memory.");
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+static bool sync_consume(SyncBuffer *buffer, void *data, size_t size) {
+    if (buffer->cursor + size > buffer->size) return false;
+    memcpy(data, buffer->data + buffer->cursor, size);
+    buffer->cursor += size;
+    return true;
+}
+
+static bool sync_write(int fd, const void *data, size_t size, u64 *bytes) {
+    for (size_t done = 0; done < size;) {
+        ssize_t written = write(fd, (const u8 *) data + done, size - done);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        done += (size_t) written;
+    }
+    *bytes += size;
+    return true;
+}
+
+static bool sync_read(int fd, void *data, size_t size, u64 *bytes) {
+    for (size_t done = 0; done < size;) {
+        ssize_t received = read(fd, (u8 *) data + done, size - done);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        done += (size_t) received;
+    }
+    *bytes += size;
+    return true;
+}
+
+/**
+ * Subtrees are sent depth-first: a header with the material in the top 8 bits and whether it's mixed in the lowest
+ * one, then for a mixed chunk its voxels, and for a mixed node its 8 subtrees.
+ */
+static void sync_write_subtree(const Terrain *terrain, SyncBuffer *buffer, SyncSubnode subnode, u32 level) {
+    u32 header = (u32) subnode.material << 24 | subnode.mixed;
+    sync_append(buffer, &header, sizeof(header));
+    if (!subnode.mixed) return;
+    if (!level) {
+        sync_append(buffer, poolAllocatorGet(&terrain->chunkPool, subnode.address), sizeof(Chunk));
+        return;
+    }
+    for (u32 i = 0; i < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; i++) {
+        sync_write_subtree(terrain, buffer, sync_entry_subnode(terrain, subnode.address, i), level - 1);
+    }
+}
+
+// builds a received subtree bottom-up, hashed, and returns what to point to it. Mixed ones may hold air or not.
+static bool sync_read_subtree(Terrain *terrain, SyncBuffer *buffer, u32 level, SyncSubnode *subnode, bool *solid,
+                              bool *air) {
+    u32 header;
+    if (!sync_consume(buffer, &header, sizeof(header))) return false;
+    Voxel material = header >> 24;
+    if (!(header & 1)) {
+        *subnode = (SyncSubnode) {.material=material};
+        *solid |= material != AIR;
+        *air |= material == AIR;
+        return true;
+    }
+
+    u32 address;
+    if (!level) {
+        address = poolAllocatorAlloc(&terrain->chunkPool);
+        if (!sync_consume(buffer, poolAllocatorGet(&terrain->chunkPool, address), sizeof(Chunk))) {
+            terrain_release(terrain, address, 0);
+            return false;
+        }
+        terrain_rehash_chunk(terrain, address);
+        terrain_record_delta(terrain, TERRAIN_DELTA_CHUNKS, address, 1);
+        *solid = *air = true;
+    } else {
+        address = poolAllocatorAlloc(&terrain->nodePool);
+        for (u32 i = 0; i < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; i++) terrain_node_set(terrain, address, i, AIR, 0);
+        for (u32 i = 0; i < NODE_WIDTH * NODE_WIDTH * NODE_WIDTH; i++) {
+            SyncSubnode child;
+            if (!sync_read_subtree(terrain, buffer, level - 1, &child, solid, air)) {
+                terrain_release(terrain, address, level);
+                return false;
+            }
+            terrain_node_set(terrain, address, i, child.material, child.address);
+        }
+        terrain_rehash_node(terrain, address, level);
+        terrain_rebound_node(terrain, address, level);
+        terrain_record_delta(terrain, TERRAIN_DELTA_NODES, address, 1);
+    }
+    *subnode = (SyncSubnode) {.address=address, .material=material, .mixed=true};
+    return true;
+}
+
+bool terrain_sync_serve(const Terrain *terrain, int fd, TerrainSyncStats *stats) {
+    *stats = (TerrainSyncStats) {0};
+    SyncRegionList frontier = {0}, next = {0};
+    SyncBuffer data = {0};
+    u64 *hashes = NULL;
+    u8 *mixed = NULL, *decisions = NULL;
+    bool ok = false;
+
+    sync_push_region(&frontier, (SyncRegion) {.parent=UINT32_MAX});
+    for (u32 level = terrain->depth;; level--) {
+        u32 count;
+        if (!sync_read(fd, &count, sizeof(count), &stats->bytes_received)) break;
+        if (!count) {
+            ok = true;
+            break;
+        }
+        if (count != frontier.count) {
+            WARN("Terrain sync out of step: %u hashes received for %u subtrees.", count, frontier.count);
+            break;
+        }
+        hashes = (u64 *) realloc(hashes, count * sizeof(u64));
+        mixed = (u8 *) realloc(mixed, count);
+        decisions = (u8 *) realloc(decisions, count);
+        if (!hashes || !mixed || !decisions) FATAL("Out of memory.");
+        if (!sync_read(fd, hashes, count * sizeof(u64), &stats->bytes_received) ||
+            !sync_read(fd, mixed, count, &stats->bytes_received)) {
+            break;
+        }
+
+        data.size = 0;
+        next.count = 0;
+        for (u32 i = 0; i < count; i++) {
+            SyncSubnode subnode = sync_subnode(terrain, &frontier.regions[i]);
+            if (sync_hash(terrain, subnode, level) == hashes[i]) {
+                decisions[i] = SYNC_SAME;
+            } else if (subnode.mixed && level && mixed[i]) {
+                // the LOD color goes along, in case it's the only thing that differs
+                u32 header = (u32) subnode.material << 24;
+                decisions[i] = SYNC_DESCEND;
+                sync_append(&data, &header, sizeof(header));
+                sync_push_children(&next, &frontier.regions[i], subnode.address, level);
+            } else {
+                decisions[i] = SYNC_DATA;
+                sync_write_subtree(terrain, &data, subnode, level);
+                stats->sent++;
+            }
+        }
+        stats->compared += count;
+        stats->rounds++;
+        u64 size = data.size;
+        if (!sync_write(fd, decisions, count, &stats->bytes_sent) ||
+            !sync_write(fd, &size, sizeof(size), &stats->bytes_sent) ||
+            !sync_write(fd, data.data, data.size, &stats->bytes_sent)) {
+            break;
+        }
+
+        SyncRegionList swap = frontier;
+        frontier = next;
+        next = swap;
+    }
+    if (!ok) WARN("Terrain sync failed after %u rounds.", stats->rounds);
+    free(frontier.regions);
+    free(next.regions);
+    free(data.data);
+    free(hashes);
+    free(mixed);
+    free(decisions);
+    return ok;
+}
+
+/**
+ * The replica makes every node it descends into private before anything below it is replaced, and rehashes them all
+ * once the descent is over, deepest first. Since subtrees only ever come whole, the skylight map is rebuilt from
+ * scratch, and the height pyramid is widened over the footprint of each of them.
+ */
+bool terrain_sync_pull(Terrain *terrain, int fd, TerrainSyncStats *stats) {
+    *stats = (TerrainSyncStats) {0};
+    SyncRegionList frontier = {0}, next = {0}, descended = {0};
+    SyncBuffer data = {0};
+    u64 *hashes = NULL;
+    u8 *mixed = NULL, *decisions = NULL;
+    bool ok = false, changed = false;
+
+    sync_push_region(&frontier, (SyncRegion) {.parent=UINT32_MAX});
+    for (u32 level = terrain->depth;; level--) {
+        u32 count = frontier.count;
+        if (!sync_write(fd, &count, sizeof(count), &stats->bytes_sent)) break;
+        if (!count) {
+            ok = true;
+            break;
+        }
+        hashes = (u64 *) realloc(hashes, count * sizeof(u64));
+        mixed = (u8 *) realloc(mixed, count);
+        decisions = (u8 *) realloc(decisions, count);
+        if (!hashes || !mixed || !decisions) FATAL("Out of memory.");
+        for (u32 i = 0; i < count; i++) {
+            SyncSubnode subnode = sync_subnode(terrain, &frontier.regions[i]);
+            hashes[i] = sync_hash(terrain, subnode, level);
+            mixed[i] = subnode.mixed;
+        }
+        u64 size;
+        if (!sync_write(fd, hashes, count * sizeof(u64), &stats->bytes_sent) ||
+            !sync_write(fd, mixed, count, &stats->bytes_sent) ||
+            !sync_read(fd, decisions, count, &stats->bytes_received) ||
+            !sync_read(fd, &size, sizeof(size), &stats->bytes_received)) {
+            break;
+        }
+        data.size = data.cursor = 0;
+        if (size > data.capacity) {
+            data.capacity = size;
+            data.data = (u8 *) realloc(data.data, data.capacity);
+            if (!data.data) FATAL("Out of memory.");
+        }
+        if (!sync_read(fd, data.data, size, &stats->bytes_received)) break;
+        data.size = size;
+
+        next.count = 0;
+        bool valid = true;
+        for (u32 i = 0; i < count && valid; i++) {
+            SyncRegion *region = &frontier.regions[i];
+            SyncSubnode subnode = sync_subnode(terrain, region);
+            if (decisions[i] == SYNC_DESCEND) {
+                u32 header;
+                valid = subnode.mixed && level && sync_consume(&data, &header, sizeof(header));
+                if (!valid) break;
+                u32 address = terrain_unshare(terrain, subnode.address, level);
+                if (address != subnode.address && subnode.root) {
+                    __atomic_store_n(&terrain->root_node_address, address, __ATOMIC_RELEASE);
+                    terrain_record_delta(terrain, TERRAIN_DELTA_ROOT, address, 1);
+                } else if (!subnode.root && (address != subnode.address || header >> 24 != subnode.material)) {
+                    terrain_node_set(terrain, region->parent, region->slot, header >> 24, address);
+                    terrain_record_delta(terrain, TERRAIN_DELTA_NODES, region->parent, 1);
+                }
+                sync_push_region(&descended, (SyncRegion) {.parent=address, .slot=level});
+                sync_push_children(&next, region, address, level);
+            } else if (decisions[i] == SYNC_DATA && !subnode.root) {
+                SyncSubnode received;
+                bool solid = false, air = false;
+                valid = sync_read_subtree(terrain, &data, level, &received, &solid, &air);
+                if (!valid) break;
+                terrain_node_set(terrain, region->parent, region->slot, received.material, received.address);
+                terrain_record_delta(terrain, TERRAIN_DELTA_NODES, region->parent, 1);
+                if (subnode.mixed) terrain_release(terrain, subnode.address, level);
+                stats->sent++;
+                terrain_widen_pyramid(terrain, region->x, region->y, region->z, CHUNK_WIDTH << level, solid, air);
+                changed = true;
+            } else if (decisions[i] != SYNC_SAME) {
+                valid = false;
+            }
+        }
+        stats->compared += count;
+        stats->rounds++;
+        if (!valid) {
+            WARN("Terrain sync received a malformed answer.");
+            break;
+        }
+
+        SyncRegionList swap = frontier;
+        frontier = next;
+        next = swap;
+    }
+
+    // the descended regions hold the address and level of every node above what was replaced
+    for (u32 i = descended.count; i > 0; i--) {
+        if (terrain->node_hashes) {
+            terrain_rehash_node(terrain, descended.regions[i - 1].parent, descended.regions[i - 1].slot);
+        }
+        terrain_rebound_node(terrain, descended.regions[i - 1].parent, descended.regions[i - 1].slot);
+    }
+    if (changed) terrain_rebuild_skylight(terrain);
+    if (!ok) WARN("Terrain sync failed after %u rounds.", stats->rounds);
+    free(frontier.regions);
+    free(next.regions);
+    free(descended.regions);
+    free(data.data);
+    free(hashes);
+    free(mixed);
+    free(decisions);
+    return ok;
+}
+
+static u32 terrain_diff_recursive(const Terrain *source, const Terrain *target, SyncSubnode a, SyncSubnode b,
+                                  u32 level, u32 x, u32 y, u32 z, TerrainDiffCallback emit, void *context) {
+    if (sync_hash(source, a, level) == sync_hash(target, b, level)) return 0;
+    if (!level || !a.mixed || !b.mixed) {
+        if (emit) emit(context, x, y, z, level);
+        return 1;
+    }
+    SyncRegion region_a = {.parent=a.address}, region_b = {.parent=b.address};
+    u32 width = CHUNK_WIDTH << (level - 1), count = 0;
+    for (u32 dz = 0; dz < NODE_WIDTH; dz++) {
+        for (u32 dy = 0; dy < NODE_WIDTH; dy++) {
+            for (u32 dx = 0; dx < NODE_WIDTH; dx++) {
+                region_a.slot = region_b.slot = NODE_SLOT(dx, dy, dz);
+                count += terrain_diff_recursive(source, target, sync_subnode(source, &region_a),
+                                                sync_subnode(target, &region_b), level - 1, x + dx * width,
+                                                y + dy * width, z + dz * width, emit, context);
+            }
+        }
+    }
+
+    // only the LOD color differs
+    if (!count) {
+        if (emit) emit(context, x, y, z, level);
+        count = 1;
+    }
+    return count;
+}
+
+u32 terrain_diff(const Terrain *source, const Terrain *target, TerrainDiffCallback emit, void *context) {
+    if (source->depth != target->depth) FATAL("Can't diff terrains of different depths.");
+    SyncRegion root = {.parent=UINT32_MAX};
+    return terrain_diff_recursive(source, target, sync_subnode(source, &root), sync_subnode(target, &root),
+                                  source->depth, 0, 0, 0, emit, context);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include "terrain.h"
+
+/**
+ * Replicating a terrain into another one of the same depth, both with their Merkle hashes built (see terrain.h).
+ * The replica drives a descent of both trees, one level per round trip: it sends the hashes of the subtrees it isn't
+ * sure about yet, and the source answers which of them are the same, which are to be looked into, and the contents of
+ * the ones that differ and can't be looked into any further. Only differing subtrees are ever sent.
+ * Both ends only need a stream socket, e.g. a Unix socket for a local viewer or backup. The source must not change
+ * for the time of the sync, the replica records deltas for what it received like any other edit.
+ */
+typedef struct TerrainSyncStats {
+    u32 rounds;
+    u32 compared; // subtrees whose hashes were compared
+    u32 sent;     // subtrees whose contents were sent
+    u64 bytes_sent, bytes_received;
+} TerrainSyncStats;
+
+bool terrain_sync_serve(const Terrain *terrain, int fd, TerrainSyncStats *stats);
+bool terrain_sync_pull(Terrain *terrain, int fd, TerrainSyncStats *stats);
+
+/**
+ * Same descent, locally: calls emit for every largest subtree of source that differs from target, with the position of
+ * its lower corner and its level (0 for a chunk). Returns how many there were.
+ */
+typedef void (*TerrainDiffCallback)(void *context, u32 x, u32 y, u32 z, u32 level);
+
+u32 terrain_diff(const Terrain *source, const Terrain *target, TerrainDiffCallback emit, void *context);
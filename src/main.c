@@ -2,11 +2,18 @@
 // Created by silver on 03/10/23.
 //
 
+#include <string.h>
 #include "server/server.h"
 #include "client/client.h"
+#include "bench/bench.h"
 
 int main(int argc, char** argv) {
 
+    /**
+     * Running a CPU benchmark instead of the game
+     */
+    if (argc == 3 && !strcmp(argv[1], "--bench")) return bench_run(argv[2]);
+
     /**
      * Starting the server. Not blocking.
      */
@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include "jobs.h"
+#include "common/log.h"
+
+#define JOBS_MAX_WORKERS (64)
+#define JOB_DEQUE_CAPACITY (4096)
+#define JOB_DEQUE_MASK (JOB_DEQUE_CAPACITY - 1)
+#define CACHE_LINE (64)
+
+typedef struct Job {
+    JobFunction function;
+    void *data;
+    u64 submit_time;
+    struct Job *next;
+} Job;
+
+/**
+ * The owner pushes and pops at the bottom, thieves take from the top. Top and bottom are kept on their own cache lines
+ * so that thieves hammering top don't slow down the owner. Jobs that don't fit go to the injection queue instead.
+ */
+typedef struct JobDeque {
+    _Alignas(CACHE_LINE) _Atomic(i64) top;
+    _Alignas(CACHE_LINE) _Atomic(i64) bottom;
+    _Alignas(CACHE_LINE) _Atomic(Job *) buffer[JOB_DEQUE_CAPACITY];
+} JobDeque;
+
+typedef struct Worker {
+    pthread_t thread;
+    u32 index;
+    u32 random;
+    JobDeque deque;
+} Worker;
+
+static Worker *workers = NULL;
+static u32 worker_count = 0;
+static _Thread_local i32 current_worker = -1;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static Job *injection_head = NULL, *injection_tail = NULL;
+static atomic_bool stopping = false;
+
+// metrics
+static _Atomic(u32) queued = 0, running = 0;
+static _Atomic(u64) completed = 0;
+static _Atomic(u32) started = 0;
+static _Atomic(u64) latency_sum = 0, latency_max = 0;
+
+static void *jobs_worker_main(void *arg);
+
+// cptime clocks are relative to the first call on each thread, so they can't measure across threads
+u64 jobs_clock(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (u64) time.tv_sec * 1000000ull + (u64) time.tv_nsec / 1000ull;
+}
+
+static bool jobs_deque_push(JobDeque *deque, Job *job) {
+    i64 bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    i64 top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= JOB_DEQUE_CAPACITY) return false;
+    atomic_store_explicit(&deque->buffer[bottom & JOB_DEQUE_MASK], job, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return true;
+}
+
+static Job *jobs_deque_pop(JobDeque *deque) {
+    i64 bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    i64 top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) { // empty
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    Job *job = atomic_load_explicit(&deque->buffer[bottom & JOB_DEQUE_MASK], memory_order_relaxed);
+    if (top == bottom) { // last job, we race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                     memory_order_relaxed)) {
+            job = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return job;
+}
+
+static Job *jobs_deque_steal(JobDeque *deque) {
+    i64 top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    i64 bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) return NULL;
+    Job *job = atomic_load_explicit(&deque->buffer[top & JOB_DEQUE_MASK], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+    return job;
+}
+
+void jobs_start(u32 count) {
+    if (workers) FATAL("Job system is already started!");
+    if (count == 0) count = 1;
+    if (count > JOBS_MAX_WORKERS) count = JOBS_MAX_WORKERS;
+    workers = (Worker *) aligned_alloc(CACHE_LINE, count * sizeof(Worker));
+    if (!workers) FATAL("Out of memory.");
+    atomic_store(&stopping, false);
+    worker_count = count;
+    for (u32 i = 0; i < count; i++) {
+        workers[i].index = i;
+        workers[i].random = 0x9e3779b9u * (i + 1);
+        atomic_init(&workers[i].deque.top, 0);
+        atomic_init(&workers[i].deque.bottom, 0);
+        if (pthread_create(&workers[i].thread, NULL, jobs_worker_main, &workers[i])) FATAL("Could not create thread.");
+    }
+    INFO("Job system started with %u workers.", count);
+}
+
+void jobs_stop(void) {
+    pthread_mutex_lock(&mutex);
+    atomic_store(&stopping, true);
+    pthread_cond_broadcast(&wakeup);
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Waits for the workers to finish their current job. Jobs that were never started are dropped, it's up to their
+ * submitter not to rely on them running once the server is stopping.
+ */
+void jobs_join(void) {
+    if (!workers) return;
+    for (u32 i = 0; i < worker_count; i++) pthread_join(workers[i].thread, NULL);
+    for (u32 i = 0; i < worker_count; i++) {
+        Job *job;
+        while ((job = jobs_deque_pop(&workers[i].deque))) free(job);
+    }
+    while (injection_head) {
+        Job *job = injection_head;
+        injection_head = job->next;
+        free(job);
+    }
+    injection_tail = NULL;
+    atomic_store(&queued, 0);
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+}
+
+void jobs_submit(JobFunction function, void *data) {
+    Job *job = (Job *) malloc(sizeof(Job));
+    if (!job) FATAL("Out of memory.");
+    *job = (Job) {.function=function, .data=data, .submit_time=jobs_clock(), .next=NULL};
+
+    // counted before it is visible, so that a worker never sees more jobs than queued
+    atomic_fetch_add(&queued, 1);
+    if (current_worker < 0 || !jobs_deque_push(&workers[current_worker].deque, job)) {
+        pthread_mutex_lock(&mutex);
+        if (injection_tail) injection_tail->next = job;
+        else injection_head = job;
+        injection_tail = job;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    // sleeping workers check queued with the mutex held, so taking it here means none of them can miss this job
+    pthread_mutex_lock(&mutex);
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&mutex);
+}
+
+void jobs_get_metrics(JobMetrics *metrics) {
+    u32 count = atomic_exchange(&started, 0);
+    u64 sum = atomic_exchange(&latency_sum, 0);
+    u64 max = atomic_exchange(&latency_max, 0);
+    *metrics = (JobMetrics) {.queued=atomic_load(&queued), .running=atomic_load(&running),
+            .completed=atomic_load(&completed), .started=count,
+            .average_latency_ms=count ? sum / 1e3f / count : 0, .max_latency_ms=max / 1e3f};
+}
+
+// own deque first, then the injection queue, then the other workers starting from a random one
+static Job *jobs_find(Worker *worker) {
+    Job *job = jobs_deque_pop(&worker->deque);
+    if (job) return job;
+
+    pthread_mutex_lock(&mutex);
+    job = injection_head;
+    if (job) {
+        injection_head = job->next;
+        if (!injection_head) injection_tail = NULL;
+    }
+    pthread_mutex_unlock(&mutex);
+    if (job) return job;
+
+    // xorshift, rand() would make every thief contend on the libc lock
+    worker->random ^= worker->random << 13;
+    worker->random ^= worker->random >> 17;
+    worker->random ^= worker->random << 5;
+    u32 first = worker->random % worker_count;
+    for (u32 i = 0; i < worker_count; i++) {
+        u32 victim = (first + i) % worker_count;
+        if (victim == worker->index) continue;
+        if ((job = jobs_deque_steal(&workers[victim].deque))) return job;
+    }
+    return NULL;
+}
+
+static void *jobs_worker_main(void *arg) {
+    Worker *worker = arg;
+    current_worker = (i32) worker->index;
+    while (!atomic_load(&stopping)) {
+        Job *job = jobs_find(worker);
+        if (!job) {
+            pthread_mutex_lock(&mutex);
+            while (!atomic_load(&queued) && !atomic_load(&stopping)) pthread_cond_wait(&wakeup, &mutex);
+            pthread_mutex_unlock(&mutex);
+            continue;
+        }
+
+        atomic_fetch_sub(&queued, 1);
+        atomic_fetch_add(&running, 1);
+        u64 latency = jobs_clock() - job->submit_time;
+        atomic_fetch_add(&started, 1);
+        atomic_fetch_add(&latency_sum, latency);
+        u64 max = atomic_load(&latency_max);
+        while (latency > max && !atomic_compare_exchange_weak(&latency_max, &max, latency));
+
+        job->function(job->data);
+        free(job);
+        atomic_fetch_sub(&running, 1);
+        atomic_fetch_add(&completed, 1);
+    }
+    return NULL;
+}
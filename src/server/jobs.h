@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include "cpmath.h"
+
+/**
+ * Server job system. Every worker owns a Chase-Lev work-stealing deque: jobs submitted from a worker go to the bottom
+ * of its own deque, that it pops LIFO, while idle workers steal the oldest jobs from the top of the others. Jobs
+ * submitted from any other thread go through a shared injection queue.
+ */
+typedef void (*JobFunction)(void *data);
+
+typedef struct JobMetrics {
+    // jobs submitted but not started yet, and jobs being run
+    u32 queued;
+    u32 running;
+    u64 completed;
+
+    // time between the submission of a job and its start, over the jobs started since the previous call
+    u32 started;
+    float average_latency_ms;
+    float max_latency_ms;
+} JobMetrics;
+
+void jobs_start(u32 worker_count);
+void jobs_stop(void);
+void jobs_join(void);
+
+void jobs_submit(JobFunction function, void *data);
+void jobs_get_metrics(JobMetrics *metrics);
+
+// microseconds, on a clock that is the same for every thread
+u64 jobs_clock(void);
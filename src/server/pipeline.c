@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include "pipeline.h"
+#include "jobs.h"
+#include "common/terrain_decoration.h"
+#include "common/log.h"
+#include "cptime.h"
+
+// level of the subnodes collapsed regions are cut at, 0 keeping every node and making every chunk a uniform leaf
+#define PIPELINE_COLLAPSE_LEVEL (0)
+
+/**
+ * Everything but the coordinates, slabs and collapsed flag is only touched with the mutex held. A region has at most
+ * one job at a time, that runs stage done. Collapsed is set with the mutex held while the region has no job, and
+ * cleared by its decoration job.
+ */
+typedef struct Region {
+    u32 x, y;
+    u32 first_slab, slab_count;
+    u32 done, target; // how many stages are done, and how many were requested
+    u32 last_seen;    // frame, see pipeline_mark_seen
+    bool running;
+    bool collapsed, edited;
+} Region;
+
+typedef void (*RegionStageFunction)(Region *region);
+
+static void pipeline_generate_heightmap(Region *region);
+
+static void pipeline_generate_terrain(Region *region);
+
+static void pipeline_decorate(Region *region);
+
+static void pipeline_light(Region *region);
+
+static const RegionStageFunction stage_functions[REGION_STAGE_COUNT] = {
+        [REGION_HEIGHTMAP]=pipeline_generate_heightmap,
+        [REGION_TERRAIN]=pipeline_generate_terrain,
+        [REGION_DECORATION]=pipeline_decorate,
+        [REGION_LIGHT]=pipeline_light,
+};
+
+static const char *stage_names[REGION_STAGE_COUNT] = {
+        [REGION_HEIGHTMAP]="heightmap",
+        [REGION_TERRAIN]="terrain",
+        [REGION_DECORATION]="decoration",
+        [REGION_LIGHT]="light",
+};
+
+// how many stages the neighbours of a region must be done with before it can run a stage
+static const u32 neighbour_stages[REGION_STAGE_COUNT] = {
+        [REGION_HEIGHTMAP]=0,
+        [REGION_TERRAIN]=0,
+        [REGION_DECORATION]=REGION_TERRAIN + 1,
+        [REGION_LIGHT]=REGION_DECORATION + 1,
+};
+
+static Terrain *terrain = NULL;
+static PipelineHooks hooks;
+static Region *regions = NULL;
+static TerrainSlab *slabs = NULL;
+static u32 width_regions = 0, region_width = 0;
+
+// the column pipeline_trim keeps regions around, for pipeline_compare_residency
+static u32 trim_x, trim_y;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static u32 pending = 0;
+static PipelineStageStats stage_stats[REGION_STAGE_COUNT];
+
+static void pipeline_run(void *data);
+
+static void pipeline_raise(Region *region, u32 target);
+
+static void pipeline_try_schedule(Region *region);
+
+static void pipeline_log_stats(void);
+
+/**
+ * Slabs are handed out by region, each region keeping them in the order terrain_init_progressive listed them, higher
+ * ones first.
+ */
+void pipeline_start(Terrain *world, u32 depth, u32 slab_depth, const PipelineHooks *pipeline_hooks) {
+    terrain = world;
+    hooks = *pipeline_hooks;
+    if (slab_depth >= depth) slab_depth = depth - 1;
+    TerrainSlab *list;
+    u32 slab_count = terrain_init_progressive(terrain, depth, slab_depth, &list);
+
+    region_width = CHUNK_WIDTH << slab_depth;
+    width_regions = terrain->width / region_width;
+    regions = (Region *) calloc((size_t) width_regions * width_regions, sizeof(Region));
+    slabs = (TerrainSlab *) malloc(max(slab_count, 1) * sizeof(TerrainSlab));
+    if (!regions || !slabs) FATAL("Out of memory.");
+    for (u32 i = 0; i < width_regions * width_regions; i++) {
+        regions[i].x = i % width_regions * region_width;
+        regions[i].y = i / width_regions * region_width;
+        regions[i].done = regions[i].target = slab_depth ? 0 : REGION_STAGE_COUNT; // else already fully generated
+    }
+    for (u32 i = 0; i < slab_count; i++) {
+        regions[list[i].x / region_width + list[i].y / region_width * width_regions].slab_count++;
+    }
+    for (u32 i = 1; i < width_regions * width_regions; i++) {
+        regions[i].first_slab = regions[i - 1].first_slab + regions[i - 1].slab_count;
+    }
+    for (u32 i = 0; i < width_regions * width_regions; i++) regions[i].slab_count = 0;
+    for (u32 i = 0; i < slab_count; i++) {
+        Region *region = &regions[list[i].x / region_width + list[i].y / region_width * width_regions];
+        slabs[region->first_slab + region->slab_count++] = list[i];
+    }
+    free(list);
+
+    pending = 0;
+    for (u32 i = 0; i < REGION_STAGE_COUNT; i++) stage_stats[i] = (PipelineStageStats) {0};
+    INFO("Generation pipeline has %ux%u regions of %ux%u columns", width_regions, width_regions, region_width,
+         region_width);
+}
+
+void pipeline_destroy(void) {
+    free(regions);
+    free(slabs);
+    regions = NULL;
+    slabs = NULL;
+    pending = 0; // jobs dropped by a stopping job system never got to finish
+}
+
+void pipeline_request(u32 x, u32 y, u32 width, RegionStage stage) {
+    pthread_mutex_lock(&mutex);
+    u32 first_x = x / region_width, first_y = y / region_width;
+    u32 last_x = min((x + width - 1) / region_width, width_regions - 1);
+    u32 last_y = min((y + width - 1) / region_width, width_regions - 1);
+    for (u32 ry = first_y; ry <= last_y; ry++) {
+        for (u32 rx = first_x; rx <= last_x; rx++) pipeline_raise(&regions[rx + ry * width_regions], stage + 1);
+    }
+    for (u32 i = 0; i < width_regions * width_regions; i++) pipeline_try_schedule(&regions[i]);
+    bool idle = !pending;
+    pthread_mutex_unlock(&mutex);
+    if (idle && hooks.idle) hooks.idle(); // everything was already there
+}
+
+bool pipeline_is_done(u32 x, u32 y, u32 width, RegionStage stage) {
+    pthread_mutex_lock(&mutex);
+    u32 last_x = min((x + width - 1) / region_width, width_regions - 1);
+    u32 last_y = min((y + width - 1) / region_width, width_regions - 1);
+    bool done = true;
+    for (u32 ry = y / region_width; ry <= last_y; ry++) {
+        for (u32 rx = x / region_width; rx <= last_x; rx++) done &= regions[rx + ry * width_regions].done > stage;
+    }
+    pthread_mutex_unlock(&mutex);
+    return done;
+}
+
+bool pipeline_is_idle(void) {
+    pthread_mutex_lock(&mutex);
+    bool idle = !pending;
+    pthread_mutex_unlock(&mutex);
+    return idle;
+}
+
+void pipeline_get_stats(PipelineStats *stats) {
+    pthread_mutex_lock(&mutex);
+    *stats = (PipelineStats) {.regions=width_regions * width_regions, .width_regions=width_regions, .pending=pending};
+    for (u32 i = 0; i < REGION_STAGE_COUNT; i++) stats->stages[i] = stage_stats[i];
+    pthread_mutex_unlock(&mutex);
+}
+
+// the block of regions around a region, itself included, clamped to the world
+static void pipeline_neighbourhood(const Region *region, u32 *first_x, u32 *first_y, u32 *last_x, u32 *last_y) {
+    u32 rx = region->x / region_width, ry = region->y / region_width;
+    *first_x = rx ? rx - 1 : 0;
+    *first_y = ry ? ry - 1 : 0;
+    *last_x = min(rx + 1, width_regions - 1);
+    *last_y = min(ry + 1, width_regions - 1);
+}
+
+static void pipeline_raise(Region *region, u32 target) {
+    if (region->target >= target) return;
+    if (region->target == region->done) pending++;
+    region->target = target;
+
+    // neighbour requirements only grow with the stage, the last one requested covers every stage before it
+    u32 first_x, first_y, last_x, last_y;
+    pipeline_neighbourhood(region, &first_x, &first_y, &last_x, &last_y);
+    for (u32 ny = first_y; ny <= last_y; ny++) {
+        for (u32 nx = first_x; nx <= last_x; nx++) {
+            Region *neighbour = &regions[nx + ny * width_regions];
+            if (neighbour != region) pipeline_raise(neighbour, neighbour_stages[target - 1]);
+        }
+    }
+}
+
+static void pipeline_try_schedule(Region *region) {
+    if (region->running || region->done >= region->target) return;
+    u32 first_x, first_y, last_x, last_y;
+    pipeline_neighbourhood(region, &first_x, &first_y, &last_x, &last_y);
+    for (u32 ny = first_y; ny <= last_y; ny++) {
+        for (u32 nx = first_x; nx <= last_x; nx++) {
+            if (regions[nx + ny * width_regions].done < neighbour_stages[region->done]) return;
+        }
+    }
+    region->running = true;
+    jobs_submit(pipeline_run, region);
+}
+
+static void pipeline_run(void *data) {
+    Region *region = data;
+    u32 stage = region->done;
+    u64 start = jobs_clock();
+    stage_functions[stage](region);
+    u64 time = jobs_clock() - start;
+
+    pthread_mutex_lock(&mutex);
+    region->done++;
+    region->running = false;
+    stage_stats[stage].regions++;
+    stage_stats[stage].total_time += time;
+    if (time > stage_stats[stage].max_time) stage_stats[stage].max_time = time;
+    if (region->done == region->target) pending--;
+
+    // this region and the ones waiting on it may be able to go on
+    u32 first_x, first_y, last_x, last_y;
+    pipeline_neighbourhood(region, &first_x, &first_y, &last_x, &last_y);
+    for (u32 ny = first_y; ny <= last_y; ny++) {
+        for (u32 nx = first_x; nx <= last_x; nx++) pipeline_try_schedule(&regions[nx + ny * width_regions]);
+    }
+    bool idle = !pending;
+    if (idle) pipeline_log_stats();
+    pthread_mutex_unlock(&mutex);
+    if (idle && hooks.idle) hooks.idle();
+}
+
+// stage times include waiting for the terrain lock
+static void pipeline_log_stats(void) {
+    for (u32 i = 0; i < REGION_STAGE_COUNT; i++) {
+        const PipelineStageStats *stats = &stage_stats[i];
+        if (!stats->regions) continue;
+        INFO("Stage %s: %u regions in %.2fms, %.2fms on average, %.2fms at most", stage_names[i], stats->regions,
+             stats->total_time / 1e3, stats->total_time / 1e3 / stats->regions, stats->max_time / 1e3);
+    }
+}
+
+void pipeline_mark_seen(const u32 *frames) {
+    pthread_mutex_lock(&mutex);
+    for (u32 i = 0; i < width_regions * width_regions; i++) regions[i].last_seen = frames[i];
+    pthread_mutex_unlock(&mutex);
+}
+
+bool pipeline_claim_edit(u32 x, u32 y) {
+    if (x >= terrain->width || y >= terrain->width) return false;
+    pthread_mutex_lock(&mutex);
+    Region *region = &regions[x / region_width + y / region_width * width_regions];
+    bool claimed = region->done == REGION_STAGE_COUNT && !region->running;
+    region->edited |= claimed;
+    pthread_mutex_unlock(&mutex);
+    return claimed;
+}
+
+// how many regions away from the trimmed column a region is, in either direction
+static u32 pipeline_region_distance(const Region *region) {
+    u32 rx = region->x / region_width, ry = region->y / region_width;
+    u32 tx = trim_x / region_width, ty = trim_y / region_width;
+    return max(rx > tx ? rx - tx : tx - rx, ry > ty ? ry - ty : ty - ry);
+}
+
+// a region can be collapsed once neither it nor its neighbours have any stage to run, since their stages read it
+static bool pipeline_can_collapse(const Region *region, u32 keep_radius) {
+    if (region->done <= REGION_TERRAIN || region->edited || pipeline_region_distance(region) < keep_radius) {
+        return false;
+    }
+    u32 first_x, first_y, last_x, last_y;
+    pipeline_neighbourhood(region, &first_x, &first_y, &last_x, &last_y);
+    for (u32 ny = first_y; ny <= last_y; ny++) {
+        for (u32 nx = first_x; nx <= last_x; nx++) {
+            const Region *neighbour = &regions[nx + ny * width_regions];
+            if (neighbour->running || neighbour->done != neighbour->target) return false;
+        }
+    }
+    return true;
+}
+
+// least recently seen first, then furthest from the trimmed column
+static int pipeline_compare_residency(const void *a, const void *b) {
+    const Region *first = *(Region *const *) a, *second = *(Region *const *) b;
+    if (first->last_seen != second->last_seen) return first->last_seen < second->last_seen ? -1 : 1;
+    u32 first_distance = pipeline_region_distance(first), second_distance = pipeline_region_distance(second);
+    return first_distance > second_distance ? -1 : first_distance < second_distance;
+}
+
+/**
+ * Slots freed by earlier collapses may still be retired, waiting for readers to move on: publishing first gives them a
+ * chance to be reclaimed before the terrain is measured.
+ */
+size_t pipeline_trim(size_t budget, u32 x, u32 y, u32 keep_radius) {
+    pthread_mutex_lock(hooks.lock);
+    hooks.publish();
+    size_t resident = (size_t) terrain->nodePool.size * sizeof(Node) + (size_t) terrain->chunkPool.size * sizeof(Chunk);
+    if (resident <= budget) {
+        pthread_mutex_unlock(hooks.lock);
+        return 0;
+    }
+
+    u32 time = uclock();
+    pthread_mutex_lock(&mutex);
+    trim_x = x;
+    trim_y = y;
+    Region **candidates = (Region **) malloc((size_t) width_regions * width_regions * sizeof(Region *));
+    if (!candidates) FATAL("Out of memory.");
+    u32 candidate_count = 0, collapsed = 0;
+    for (u32 i = 0; i < width_regions * width_regions; i++) {
+        if (pipeline_can_collapse(&regions[i], keep_radius)) candidates[candidate_count++] = &regions[i];
+    }
+    qsort(candidates, candidate_count, sizeof(Region *), pipeline_compare_residency);
+
+    size_t dropped = 0;
+    for (; collapsed < candidate_count && resident - dropped > budget; collapsed++) {
+        Region *region = candidates[collapsed];
+        for (u32 i = 0; i < region->slab_count; i++) {
+            dropped += terrain_collapse_slab(terrain, &slabs[region->first_slab + i], PIPELINE_COLLAPSE_LEVEL);
+        }
+        region->done = region->target = REGION_TERRAIN;
+        region->collapsed = true;
+    }
+    pthread_mutex_unlock(&mutex);
+    free(candidates);
+    hooks.publish();
+    pthread_mutex_unlock(hooks.lock);
+
+    INFO("Collapsed %u of %u candidate regions in %.2fms, %.1f MB dropped to fit %.1f MB in a %.1f MB budget", collapsed,
+         candidate_count, (uclock() - time) / 1e3, dropped / 1e6, resident / 1e6, budget / 1e6);
+    return dropped;
+}
+
+// only this region ever writes its columns, and nothing reads them before it's done. Its pyramid cells are uploaded.
+static void pipeline_generate_heightmap(Region *region) {
+    terrain_generate_heightmap_columns(terrain, region->x, region->y, region_width);
+    pthread_mutex_lock(hooks.lock);
+    terrain_refine_pyramid(terrain, region->x, region->y, region_width);
+    hooks.publish();
+    pthread_mutex_unlock(hooks.lock);
+}
+
+// slabs are generated without holding the terrain lock, which is only taken for the time of the graft
+static void pipeline_generate_terrain(Region *region) {
+    for (u32 i = 0; i < region->slab_count; i++) {
+        const TerrainSlab *slab = &slabs[region->first_slab + i];
+        Terrain scratch;
+        terrain_generate_slab(terrain, slab, &scratch);
+        pthread_mutex_lock(hooks.lock);
+        terrain_graft_slab(terrain, slab, &scratch);
+        hooks.publish();
+        pthread_mutex_unlock(hooks.lock);
+    }
+}
+
+/**
+ * Structures reach out of their column by less than a chunk, so the only ones a collapse dropped parts of, besides the
+ * region's own, stand on the ring of chunk columns around it. Stamping them again is a no-op wherever they still are.
+ */
+static void pipeline_decorate(Region *region) {
+    pthread_mutex_lock(hooks.lock);
+    terrain_decorate(terrain, region->x, region->y, region_width);
+    if (region->collapsed) {
+        TerrainStructureStats stats = {0};
+        i32 first_x = (i32) (region->x / CHUNK_WIDTH) - 1, first_y = (i32) (region->y / CHUNK_WIDTH) - 1;
+        i32 last_x = (i32) ((region->x + region_width) / CHUNK_WIDTH), last_y = (i32) ((region->y + region_width) / CHUNK_WIDTH);
+        for (i32 cy = max(first_y, 0); cy <= min(last_y, (i32) terrain->width_chunks - 1); cy++) {
+            for (i32 cx = max(first_x, 0); cx <= min(last_x, (i32) terrain->width_chunks - 1); cx++) {
+                if (cx != first_x && cx != last_x && cy != first_y && cy != last_y) continue;
+                terrain_place_structures(terrain, cx * CHUNK_WIDTH, cy * CHUNK_WIDTH, CHUNK_WIDTH, &stats);
+            }
+        }
+        region->collapsed = false;
+    }
+    hooks.publish();
+    pthread_mutex_unlock(hooks.lock);
+}
+
+static void pipeline_light(Region *region) {
+    pthread_mutex_lock(hooks.lock);
+    terrain_build_skylight(terrain, region->x, region->y, region_width);
+    hooks.publish();
+    pthread_mutex_unlock(hooks.lock);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <pthread.h>
+#include "common/terrain.h"
+
+/**
+ * Staged generation of a progressive terrain (see terrain.h). The world is cut into square regions, one slab wide and
+ * as high as the world, that each go through the stages below in order, as jobs. A stage only starts once the region
+ * is done with the previous one, and its 8 neighbours are done with the one it reads from them: decoration may reach
+ * into neighbours, so it waits for their terrain, and light waits for their decoration.
+ * Regions are only generated as far as they are requested, along with whatever their neighbours need for it.
+ */
+typedef enum RegionStage {
+    REGION_HEIGHTMAP,
+    REGION_TERRAIN,
+    REGION_DECORATION,
+    REGION_LIGHT,
+    REGION_STAGE_COUNT
+} RegionStage;
+
+typedef struct PipelineHooks {
+    pthread_mutex_t *lock; // held whenever a stage changes the tree, with anything else writing to it
+    void (*publish)(void); // called with the lock held after each of these changes
+    void (*idle)(void);    // called once everything requested so far is done, may be NULL
+} PipelineHooks;
+
+typedef struct PipelineStageStats {
+    u32 regions; // how many regions are done with it
+    u64 total_time, max_time; // microseconds spent running it, summed over regions, and the longest run
+} PipelineStageStats;
+
+typedef struct PipelineStats {
+    u32 regions, width_regions;
+    u32 pending; // regions not done with what was requested of them yet
+    PipelineStageStats stages[REGION_STAGE_COUNT];
+} PipelineStats;
+
+/**
+ * Initializes the terrain with terrain_init_progressive, nothing else is generated until requested. The job system
+ * has to be running.
+ */
+void pipeline_start(Terrain *terrain, u32 depth, u32 slab_depth, const PipelineHooks *hooks);
+void pipeline_destroy(void);
+
+// every region that the footprint overlaps, up to and including stage. Can be called from any thread.
+void pipeline_request(u32 x, u32 y, u32 width, RegionStage stage);
+bool pipeline_is_idle(void);
+void pipeline_get_stats(PipelineStats *stats);
+
+// whether every region that the footprint overlaps is done with stage
+bool pipeline_is_done(u32 x, u32 y, u32 width, RegionStage stage);
+
+/**
+ * Residency: what regions hold can be collapsed to bound the memory of the terrain (see terrain_collapse_slab), their
+ * heightmap being kept. A collapsed region goes back through every stage after it with the next request that covers
+ * it, and while it's regenerated, the structures of its neighbours that reached into it are stamped again.
+ * - pipeline_mark_seen takes, for each region in row order, the last frame it was seen in, 0 if never.
+ * - pipeline_claim_edit is called before editing a voxel, with the lock held. It returns false if its region isn't
+ * done with every stage, in which case the edit must be dropped, and otherwise pins the region: edits would be lost if
+ * it were collapsed and generated again.
+ * - pipeline_trim collapses regions until the terrain's node and chunk slots fit in budget bytes, or no region can be
+ * collapsed anymore. Regions closer than keep_radius regions to column (x, y) are kept, as are regions that still
+ * have, or whose neighbours still have, a stage to go through. The least recently seen go first, then the furthest.
+ * It takes the lock itself, and returns how many bytes were dropped.
+ */
+void pipeline_mark_seen(const u32 *frames);
+bool pipeline_claim_edit(u32 x, u32 y);
+size_t pipeline_trim(size_t budget, u32 x, u32 y, u32 keep_radius);
@@ -1,14 +1,232 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
 #include "server.h"
+#include "jobs.h"
+#include "pipeline.h"
+#include "common/epoch.h"
 #include "common/log.h"
+#include "common/ring.h"
+
+/**
+ * Assuming a node width of 2 and a chunk size of 8, a depth 8 means a 2048x2048x2048 world. Slabs of depth 3 are
+ * 64x64x64 voxels subtrees, small enough to show up one after the other while the world fills in. Generation regions
+ * are columns of them.
+ */
+#define SERVER_TERRAIN_DEPTH (6)
+#define SERVER_SLAB_DEPTH (3)
+
+#define SERVER_EDIT_QUEUE_SIZE (4096)
+#define SERVER_DELTA_QUEUE_SIZE (4096)
+#define SERVER_EDIT_BATCH (256)
+
+/**
+ * Bytes of node and chunk slots the terrain may hold, 0 for no limit. Past that, regions at least SERVER_KEEP_RADIUS
+ * regions away from the camera are collapsed, least recently seen first. Regions within SERVER_VIEW_RADIUS of it are
+ * generated again if they were, which reaches 2 regions further for their neighbours' stages: the keep radius covers
+ * those too, so that the neighbours are never left half generated next to the camera.
+ */
+#define SERVER_MEMORY_BUDGET ((size_t) 32 << 20)
+#define SERVER_VIEW_RADIUS (2)
+#define SERVER_KEEP_RADIUS (SERVER_VIEW_RADIUS + 3)
+
+/**
+ * Readers never lock the terrain, they pin an epoch instead (see epoch.h). Writers are serialized by terrain_lock, and
+ * publish every change with atomic stores in place. Slots and pool buffers that readers may still be walking are
+ * retired, and only reclaimed once every reader pinned at the time has moved on.
+ */
+static Terrain terrain;
+static pthread_mutex_t terrain_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool generating = false;
+static u64 generation_start;
+
+/**
+ * Edits are pushed by any client thread and consumed by the edit job. Deltas are only ever pushed with the terrain
+ * lock held, which is enough to make them single producer, and consumed by the client.
+ */
+static Ring edit_queue, delta_queue;
+static atomic_bool edits_scheduled = false;
+
+// the column the camera was last reported over, and whether the job fitting the terrain around it is pending
+static _Atomic u32 view_x, view_y;
+static atomic_bool residency_scheduled = false;
+
+static void server_generation_done(void);
+
+static void server_apply_edits(void *data);
+
+static void server_schedule_edits(void);
+
+static void server_update_residency(void *data);
+
+static void server_publish_deltas(void);
+
+static void server_retire_memory(void *memory);
+
+static void server_retire_slot(PoolAllocator *pool, u32 index);
 
 void server_start(void){
- INFO("Server starting.");
+    INFO("Server starting.");
+
+    // one core is left to the client
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    jobs_start(cores > 1 ? (u32) cores - 1 : 1);
+
+    /**
+     * Only the top of the tree is generated right away, every region below it goes through the generation pipeline
+     */
+    ring_create(&edit_queue, SERVER_EDIT_QUEUE_SIZE, sizeof(EditCommand), true);
+    ring_create(&delta_queue, SERVER_DELTA_QUEUE_SIZE, sizeof(TerrainDelta), false);
+
+    INFO("Generating terrain.");
+    generation_start = jobs_clock();
+    atomic_store(&generating, true);
+    PipelineHooks hooks = {.lock=&terrain_lock, .publish=server_publish_deltas, .idle=server_generation_done};
+    pipeline_start(&terrain, SERVER_TERRAIN_DEPTH, SERVER_SLAB_DEPTH, &hooks);
+    terrain.chunkPool.retireMemory = terrain.nodePool.retireMemory = terrain.farPool.retireMemory =
+            terrain.boundsPool.retireMemory = server_retire_memory;
+    terrain.retire_slot = server_retire_slot;
+    pthread_mutex_lock(&terrain_lock);
+    server_publish_deltas();
+    pthread_mutex_unlock(&terrain_lock);
+    pipeline_request(0, 0, terrain.width, REGION_LIGHT);
 }
 
 void server_stop(void){
     INFO("Server stopping.");
+    jobs_stop();
 }
 
 void server_join(void){
-    // lol
-}
\ No newline at end of file
+    jobs_join();
+    epoch_reclaim_all();
+    terrain_destroy(&terrain);
+    pipeline_destroy();
+    ring_destroy(&edit_queue);
+    ring_destroy(&delta_queue);
+}
+
+Terrain *server_acquire_terrain(void) {
+    epoch_pin();
+    return &terrain;
+}
+
+void server_release_terrain(void) {
+    epoch_unpin();
+}
+
+static void server_free_memory(void *context, uintptr_t memory) {
+    _mm_free((void *) memory);
+}
+
+static void server_retire_memory(void *memory) {
+    epoch_retire(server_free_memory, NULL, (uintptr_t) memory);
+}
+
+// reclaimed slots go back to the free list, which is only ever touched with the terrain lock held
+static void server_free_slot(void *pool, uintptr_t index) {
+    poolAllocatorDealloc(pool, (u32) index);
+}
+
+static void server_retire_slot(PoolAllocator *pool, u32 index) {
+    epoch_retire(server_free_slot, pool, index);
+}
+
+static void server_generation_done(void) {
+    if (!atomic_load(&generating)) return;
+    pthread_mutex_lock(&terrain_lock);
+    INFO("Terrain generation done in %.2fms, %u nodes and %u chunks.", (jobs_clock() - generation_start) / 1e3,
+         terrain.nodePool.size, terrain.chunkPool.size);
+    pthread_mutex_unlock(&terrain_lock);
+
+    // edits that came in during generation were left waiting for it
+    atomic_store(&generating, false);
+    server_schedule_edits();
+}
+
+u32 server_submit_edits(const EditCommand *edits, u32 count) {
+    u32 submitted = ring_push(&edit_queue, edits, count);
+    if (submitted) server_schedule_edits();
+    return submitted;
+}
+
+u32 server_poll_deltas(TerrainDelta *deltas, u32 max) {
+    return ring_pop(&delta_queue, deltas, max);
+}
+
+u32 server_region_width(void) {
+    return CHUNK_WIDTH << SERVER_SLAB_DEPTH;
+}
+
+void server_report_view(u32 x, u32 y, const u32 *region_frames) {
+    pipeline_mark_seen(region_frames);
+    atomic_store(&view_x, x);
+    atomic_store(&view_y, y);
+    if (!atomic_exchange(&residency_scheduled, true)) jobs_submit(server_update_residency, NULL);
+}
+
+/**
+ * Regions around the camera come first: collapsed ones are requested again, edits waiting for them like they wait for
+ * the initial generation. The terrain is only trimmed once nothing is being generated, so that what was just requested
+ * is counted, and nothing is collapsed while its neighbours still read it.
+ */
+static void server_update_residency(void *data) {
+    atomic_store(&residency_scheduled, false);
+    u32 x = atomic_load(&view_x), y = atomic_load(&view_y), region_width = server_region_width();
+    u32 radius = SERVER_VIEW_RADIUS * region_width;
+    u32 first_x = x / region_width * region_width, first_y = y / region_width * region_width;
+    first_x = first_x > radius ? first_x - radius : 0;
+    first_y = first_y > radius ? first_y - radius : 0;
+    u32 width = 2 * radius + region_width;
+    if (!pipeline_is_done(first_x, first_y, width, REGION_LIGHT)) {
+        if (!atomic_exchange(&generating, true)) generation_start = jobs_clock();
+        pipeline_request(first_x, first_y, width, REGION_LIGHT);
+    } else if (SERVER_MEMORY_BUDGET && pipeline_is_idle()) {
+        pipeline_trim(SERVER_MEMORY_BUDGET, x, y, SERVER_KEEP_RADIUS);
+    }
+}
+
+static void server_schedule_edits(void) {
+    if (!atomic_exchange(&edits_scheduled, true)) jobs_submit(server_apply_edits, NULL);
+}
+
+/**
+ * Drains the edit queue in batches. Regions being generated must not be edited since their next stages would
+ * overwrite the edits, so edits wait for the generation to finish, and those that still land in a region that isn't
+ * fully generated are dropped. The flag is cleared before anything else, so that edits submitted from
+ * now on schedule another job rather than being missed. Every batch is published on its own, so that a steady stream
+ * of edits still reaches the client, and what it retired gets reclaimed as it goes.
+ */
+static void server_apply_edits(void *data) {
+    atomic_store(&edits_scheduled, false);
+    if (atomic_load(&generating)) return;
+
+    EditCommand edits[SERVER_EDIT_BATCH];
+    pthread_mutex_lock(&terrain_lock);
+    u32 count, dropped = 0;
+    while ((count = ring_pop(&edit_queue, edits, SERVER_EDIT_BATCH))) {
+        for (u32 i = 0; i < count; i++) {
+            if (!pipeline_claim_edit(edits[i].x, edits[i].y)) {
+                dropped++;
+                continue;
+            }
+            terrain_set_voxel(&terrain, edits[i].x, edits[i].y, edits[i].z, edits[i].material);
+        }
+        server_publish_deltas();
+    }
+    pthread_mutex_unlock(&terrain_lock);
+    if (dropped) WARN("Dropping %u edits outside of the generated terrain.", dropped);
+}
+
+/**
+ * Hands the pending terrain deltas to the client, with the terrain lock held. Whatever doesn't fit in the queue
+ * stays in the terrain and goes with the next publish, or is folded into a full upload if too many pile up.
+ * It's also when what was retired by the previous writes gets a chance to be reclaimed.
+ */
+static void server_publish_deltas(void) {
+    u32 published = ring_push(&delta_queue, terrain.deltas, terrain.delta_count);
+    terrain_clear_deltas(&terrain, published);
+    epoch_collect();
+}
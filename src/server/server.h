@@ -4,6 +4,44 @@
 
 #pragma once
 
+#include "common/terrain.h"
+
+/**
+ * A single voxel change requested by the client
+ */
+typedef struct EditCommand {
+    u32 x, y, z;
+    Voxel material;
+} EditCommand;
+
 void server_start(void);
 void server_stop(void);
 void server_join(void);
+
+/**
+ * The terrain is owned by the server and filled progressively by its jobs. Anything reading it from another thread,
+ * like the client uploading it to the GPU, has to hold it between acquire and release. Neither blocks: acquiring
+ * pins the current epoch, so that nothing the reader may see is freed under it, and should be held for a frame at most
+ * since memory retired in the meantime piles up.
+ */
+Terrain *server_acquire_terrain(void);
+void server_release_terrain(void);
+
+/**
+ * Client to server: edits are queued without blocking, from any thread, and applied in order by a server job.
+ * Returns how many of them fit in the queue, what's left is up to the caller to retry or drop.
+ */
+u32 server_submit_edits(const EditCommand *edits, u32 count);
+
+/**
+ * Server to client: ranges of the terrain that changed since the last poll. Only one thread may poll.
+ */
+u32 server_poll_deltas(TerrainDelta *deltas, u32 max);
+
+/**
+ * Client to server: the column the camera is over, and for each generation region of server_region_width columns, in
+ * row order, the last frame it was seen in. Regions around the camera are generated again if they were collapsed,
+ * and the terrain is kept within its memory budget by collapsing far regions, least recently seen first.
+ */
+u32 server_region_width(void);
+void server_report_view(u32 x, u32 y, const u32 *region_frames);